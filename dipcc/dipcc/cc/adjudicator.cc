@@ -4,9 +4,13 @@ Copyright (c) Meta Platforms, Inc. and affiliates.
 This source code is licensed under the MIT license found in the
 LICENSE file in the root directory of this source tree.
 */
+#include <array>
+#include <bitset>
+#include <cstdint>
 #include <glog/logging.h>
-#include <map>
+#include <iterator>
 #include <set>
+#include <stdexcept>
 #include <unordered_map>
 #include <utility>
 #include <vector>
@@ -15,6 +19,7 @@ LICENSE file in the root directory of this source tree.
 #include "checks.h"
 #include "exceptions.h"
 #include "game_state.h"
+#include "loc_map.h"
 #include "power.h"
 #include "unit.h"
 #include "util.h"
@@ -42,14 +47,14 @@ const LocCandidate NONE_LOC_CANDIDATE = {
 
 // Output of resolve()
 struct Resolution {
-  map<Loc, LocCandidate> winners;
-  set<Loc> dislodged;
-  set<Loc> contested;
+  LocMap<LocCandidate> winners;
+  LocSet dislodged;
+  LocSet contested;
 };
 
 struct MoveCycle {
   bool convoy_swap;
-  set<Loc> locs;
+  LocSet locs;
 };
 
 struct UnresolvedSupport {
@@ -58,6 +63,221 @@ struct UnresolvedSupport {
   bool pending_dislodge;
 };
 
+// Fixed-capacity table of LocCandidates organized by (root) dest loc, then by
+// (root) src loc, e.g. table[BOT][STP].
+//
+// Candidates live in a flat pool and each dest keeps a linked list of its
+// candidates sorted by src, so iteration order is the same as for
+// map<Loc, map<Loc, LocCandidate>>, and nothing is heap-allocated.
+class CandidateTable {
+public:
+  using value_type = pair<Loc, LocCandidate>;
+
+  // View of the candidates for one dest loc, with the subset of the
+  // map<Loc, LocCandidate> interface used by LocCandidates
+  class DestCands {
+  public:
+    class iterator {
+    public:
+      using iterator_category = std::forward_iterator_tag;
+      using value_type = CandidateTable::value_type;
+      using difference_type = std::ptrdiff_t;
+      using pointer = value_type *;
+      using reference = value_type &;
+
+      iterator() {}
+      iterator(CandidateTable *t, int i) : t_(t), i_(i) {}
+
+      reference operator*() const { return t_->nodes_[i_].kv; }
+      pointer operator->() const { return &t_->nodes_[i_].kv; }
+      iterator &operator++() {
+        i_ = t_->nodes_[i_].next;
+        return *this;
+      }
+      bool operator==(const iterator &o) const { return i_ == o.i_; }
+      bool operator!=(const iterator &o) const { return i_ != o.i_; }
+
+    private:
+      CandidateTable *t_ = nullptr;
+      int i_ = -1;
+    };
+
+    DestCands(CandidateTable *t, Loc dest) : t_(t), dest_(dest) {}
+
+    iterator begin() const { return iterator(t_, t_->head_[idx(dest_)]); }
+    iterator end() const { return iterator(t_, -1); }
+    size_t size() const { return t_->size_[idx(dest_)]; }
+
+    iterator find(Loc src) const {
+      for (int i = t_->head_[idx(dest_)]; i != -1; i = t_->nodes_[i].next) {
+        if (t_->nodes_[i].kv.first == src) {
+          return iterator(t_, i);
+        }
+      }
+      return end();
+    }
+
+    LocCandidate &at(Loc src) const {
+      iterator it = find(src);
+      if (it == end()) {
+        throw std::out_of_range("CandidateTable::at " + loc_str(dest_) +
+                                " " + loc_str(src));
+      }
+      return it->second;
+    }
+
+    // Inserts a value-initialized candidate if src is not present
+    LocCandidate &operator[](Loc src) const {
+      return t_->nodes_[t_->find_or_insert(dest_, src)].kv.second;
+    }
+
+  private:
+    CandidateTable *t_;
+    Loc dest_;
+  };
+
+  CandidateTable() {
+    head_.fill(-1);
+    src_head_.fill(-1);
+  }
+
+  // Dest locs with an entry, in Loc order. Reflects later insertions, like
+  // iterating a std::map.
+  const LocSet &dests() const { return dests_; }
+
+  // Marks dest as present (like map::operator[]) and returns its candidates
+  DestCands operator[](Loc dest) {
+    dests_.insert(dest);
+    return DestCands(this, dest);
+  }
+
+  // Throws if dest is not present
+  DestCands at(Loc dest) {
+    if (!dests_.contains(dest)) {
+      throw std::out_of_range("CandidateTable::at " + loc_str(dest));
+    }
+    return DestCands(this, dest);
+  }
+
+  // Returns the (possibly empty) candidates for dest without inserting it
+  DestCands find(Loc dest) { return DestCands(this, dest); }
+
+  // Zeroes the min and max strength of src's candidates at every dest
+  void zero_src(Loc src) {
+    for (int i = src_head_[idx(src)]; i != -1; i = nodes_[i].next_src) {
+      nodes_[i].kv.second.min = 0;
+      nodes_[i].kv.second.max = 0;
+    }
+  }
+
+private:
+  static constexpr size_t SIZE = NUM_LOCS + 1; // includes Loc::NONE
+
+  // Each unit has at most one hold and one move candidate, plus at most one
+  // default-inserted hold candidate per dest
+  static constexpr size_t MAX_NODES = 3 * SIZE;
+
+  struct Node {
+    value_type kv;
+    int next;     // next node for the same dest, ordered by src, or -1
+    int next_src; // next node for the same src, unordered, or -1
+  };
+
+  static size_t idx(Loc loc) { return static_cast<size_t>(loc); }
+
+  int find_or_insert(Loc dest, Loc src) {
+    dests_.insert(dest);
+    int prev = -1;
+    int i = head_[idx(dest)];
+    for (; i != -1 && nodes_[i].kv.first < src; i = nodes_[i].next) {
+      prev = i;
+    }
+    if (i != -1 && nodes_[i].kv.first == src) {
+      return i;
+    }
+    if (n_nodes_ >= MAX_NODES) {
+      JFAIL("CandidateTable is full");
+    }
+    int n = n_nodes_++;
+    nodes_[n].kv = {src, LocCandidate{}};
+    nodes_[n].next = i;
+    nodes_[n].next_src = src_head_[idx(src)];
+    src_head_[idx(src)] = n;
+    if (prev == -1) {
+      head_[idx(dest)] = n;
+    } else {
+      nodes_[prev].next = n;
+    }
+    ++size_[idx(dest)];
+    return n;
+  }
+
+  std::array<Node, MAX_NODES> nodes_;
+  size_t n_nodes_ = 0;
+  std::array<int, SIZE> head_;
+  std::array<int, SIZE> src_head_;
+  std::array<uint8_t, SIZE> size_{};
+  LocSet dests_;
+};
+
+// Fixed-size set of (Loc, Loc) pairs, backed by a bitset. Iteration is in
+// lexicographic order, i.e. the same order as std::set<pair<Loc, Loc>>.
+class LocPairSet {
+public:
+  using value_type = pair<Loc, Loc>;
+
+  class const_iterator {
+  public:
+    const_iterator(const LocPairSet *s, size_t i) : s_(s), i_(i) {
+      skip_empty();
+    }
+
+    value_type operator*() const {
+      return {static_cast<Loc>(i_ / SIZE), static_cast<Loc>(i_ % SIZE)};
+    }
+    const_iterator &operator++() {
+      ++i_;
+      skip_empty();
+      return *this;
+    }
+    bool operator==(const const_iterator &o) const { return i_ == o.i_; }
+    bool operator!=(const const_iterator &o) const { return i_ != o.i_; }
+
+  private:
+    void skip_empty() {
+      while (i_ < SIZE * SIZE && !s_->bits_[i_]) {
+        ++i_;
+      }
+    }
+
+    const LocPairSet *s_;
+    size_t i_;
+  };
+
+  const_iterator begin() const { return const_iterator(this, 0); }
+  const_iterator end() const { return const_iterator(this, SIZE * SIZE); }
+
+  size_t size() const { return bits_.count(); }
+  bool empty() const { return bits_.none(); }
+  void insert(const value_type &p) { bits_.set(idx(p)); }
+  void erase(const value_type &p) { bits_.reset(idx(p)); }
+  void clear() { bits_.reset(); }
+
+  LocPairSet &operator|=(const LocPairSet &other) {
+    bits_ |= other.bits_;
+    return *this;
+  }
+
+private:
+  static constexpr size_t SIZE = NUM_LOCS + 1; // includes Loc::NONE
+
+  static size_t idx(const value_type &p) {
+    return static_cast<size_t>(p.first) * SIZE + static_cast<size_t>(p.second);
+  }
+
+  std::bitset<SIZE * SIZE> bits_;
+};
+
 class LocCandidates {
 public:
   void add_candidate(Loc dest, OwnedUnit unit, bool via, bool via_adj) {
@@ -66,7 +286,7 @@ public:
 
     // check for head to head battle: unit @ dest is trying to move to src,
     // both not via convoy
-    auto &inbound_cands = cands_[src_root];
+    auto inbound_cands = cands_[src_root];
     auto h2h_cand_it = inbound_cands.find(dest_root);
     bool is_h2h =
         h2h_cand_it != inbound_cands.end() && !via && !h2h_cand_it->second.via;
@@ -106,13 +326,13 @@ public:
     }
   }
 
-  void add_support(Order &order, Power supporter_power) {
+  void add_support(const Order &order, Power supporter_power) {
     Loc src_root = root_loc(order.get_target().loc);
     Loc dest_root = order.get_type() == OrderType::SM
                         ? root_loc(order.get_dest())
                         : root_loc(order.get_target().loc);
     DLOG(INFO) << "ADD SUPPORT " << src_root << " - " << dest_root;
-    map<Loc, LocCandidate> &dest_cands = cands_.at(dest_root);
+    auto dest_cands = cands_.at(dest_root);
     LocCandidate &supportee = dest_cands.at(root_loc(src_root));
 
     if (supportee.min_pending_convoy > 0) {
@@ -135,14 +355,13 @@ public:
     }
   }
 
-  void add_unresolved_support(Order &order, Power supporter_power,
+  void add_unresolved_support(const Order &order, Power supporter_power,
                               bool pending_dislodge) {
     if (order.get_type() == OrderType::SM) {
       // unresolved support-move
       Loc dest_root = root_loc(order.get_dest());
       Loc src_root = root_loc(order.get_target().loc);
-      map<Loc, LocCandidate> &dest_cands = cands_.at(dest_root);
-      LocCandidate &supportee = dest_cands.at(src_root);
+      LocCandidate &supportee = cands_.at(dest_root).at(src_root);
       supportee.max += 1;
     } else {
       // unresolved support-hold
@@ -184,7 +403,7 @@ public:
       // no support: nothing to do
       return false;
     }
-    auto &order = it->second.order;
+    const Order &order = it->second.order;
     if (order.get_type() == OrderType::SH) {
       // support-hold is broken
       remove_unresolved_support(order);
@@ -215,13 +434,12 @@ public:
     return false;
   }
 
-  void remove_unresolved_support(Order &support_order) {
+  void remove_unresolved_support(const Order &support_order) {
     if (support_order.get_type() == OrderType::SM) {
       // support-move
       Loc dest_root = root_loc(support_order.get_dest());
       Loc src_root = root_loc(support_order.get_target().loc);
-      map<Loc, LocCandidate> &dest_cands = cands_.at(dest_root);
-      LocCandidate &supportee = dest_cands.at(src_root);
+      LocCandidate &supportee = cands_.at(dest_root).at(src_root);
       supportee.max -= 1;
     } else {
       // support-hold
@@ -235,37 +453,26 @@ public:
 
   void add_convoy_order(const Order &order) {
     maybe_convoy_orders_by_fleet_[order.get_unit().loc] = order;
-    maybe_convoy_orders_by_dest_[root_loc(order.get_dest())].insert(order);
   }
 
-  vector<LocCandidate> get_move_candidates(Loc dest) {
-    dest = root_loc(dest);
-    vector<LocCandidate> r;
-    auto it = cands_.find(dest);
-    if (it == cands_.end()) {
-      return r;
-    }
-    for (auto &jt : it->second) {
-      Loc src = jt.first;
-      if (src != dest) {
-        // include only move candidates, not hold
-        r.push_back(jt.second);
-      }
-    }
-    return r;
+  // Returns all candidates for dest, including the hold candidate keyed by
+  // dest itself
+  CandidateTable::DestCands get_candidates(Loc dest) {
+    return cands_.find(root_loc(dest));
   }
 
   void log() {
+#ifndef NDEBUG
     DLOG(INFO) << "Adjudicator State:";
-    for (auto &it : cands_) {
-      if (loc_prev_str_[root_loc(it.first)] > 0) {
-        DLOG(INFO) << " Dest: " << loc_str(it.first)
-                   << ", prev=" << loc_prev_str_[root_loc(it.first)];
+    for (Loc dest : cands_.dests()) {
+      if (loc_prev_str_[static_cast<size_t>(root_loc(dest))] > 0) {
+        DLOG(INFO) << " Dest: " << loc_str(dest) << ", prev="
+                   << loc_prev_str_[static_cast<size_t>(root_loc(dest))];
       } else {
-        DLOG(INFO) << " Dest: " << loc_str(it.first);
+        DLOG(INFO) << " Dest: " << loc_str(dest);
       }
 
-      for (auto &jt : it.second) {
+      for (auto &jt : cands_[dest]) {
         DLOG(INFO) << "   " << loc_str(jt.first) << " " << jt.second.min << " "
                    << jt.second.max << " / " << jt.second.min_pending_convoy
                    << " " << jt.second.min_pending_h2h << " "
@@ -289,6 +496,7 @@ public:
         DLOG(INFO) << " " << fleet_loc << ": " << it.first;
       }
     }
+#endif
   }
 
   Resolution resolve() {
@@ -297,16 +505,12 @@ public:
     for (int i = 1; i < 100; i++) {
       bool change_this_iter = false;
 
-      for (auto &it : cands_) {
-        Loc dest = it.first;
-        map<Loc, LocCandidate> &loc_cands = it.second;
-
-        change_this_iter |= _try_resolve_loc(r, dest, loc_cands);
+      for (Loc dest : cands_.dests()) {
+        change_this_iter |= _try_resolve_loc(r, dest, cands_[dest]);
       }
 
-      if (!change_this_iter &&
-          (unresolved_self_dislodges_.size() > 0 ||
-           unresolved_self_support_dislodges_.size() > 0)) {
+      if (!change_this_iter && (!unresolved_self_dislodges_.empty() ||
+                                !unresolved_self_support_dislodges_.empty())) {
         DLOG(INFO) << "process() converged after " << i << " iterations with "
                    << unresolved_self_dislodges_.size()
                    << " unresolved self-dislodges and "
@@ -317,7 +521,7 @@ public:
         continue; // keep iterating with cleared self dislodges
       }
 
-      if (!change_this_iter && maybe_convoy_orders_by_fleet_.size() > 0) {
+      if (!change_this_iter && !maybe_convoy_orders_by_fleet_.empty()) {
         DLOG(INFO) << "process() converged after " << i << " iterations with "
                    << maybe_convoy_orders_by_fleet_.size()
                    << " unresolved convoys. Checking for paradox.";
@@ -345,7 +549,7 @@ public:
   //
   // Returns true if a change was made
   bool _try_resolve_loc(Resolution &r, Loc dest,
-                        map<Loc, LocCandidate> &loc_cands) {
+                        CandidateTable::DestCands loc_cands) {
     if (map_contains(r.winners, dest)) {
       // dest is already resolved
       return false;
@@ -371,11 +575,11 @@ public:
       // Loop through all candidate for dest, gathering data e.g.  the
       // largest min, largest max, and whether there is a unit engaging in
       // a h2h
-      map<Loc, LocCandidate>::iterator largest_min_cand;
+      CandidateTable::DestCands::iterator largest_min_cand;
       int largest_min = -1;
       int largest_max = -1;
       for (auto loc_cand_it = loc_cands.begin(); loc_cand_it != loc_cands.end();
-           loc_cand_it++) {
+           ++loc_cand_it) {
         int min = loc_cand_it->second.min;
         int max = loc_cand_it->second.max;
         if (min > largest_min) {
@@ -398,7 +602,7 @@ public:
       }
 
       // check largest min/max against loc's prevent strength
-      if (largest_max <= loc_prev_str_[dest]) {
+      if (largest_max <= loc_prev_str_[static_cast<size_t>(dest)]) {
         // no unit can beat the prev strength: either units holds, or we bounce
         if (cands_[dest][dest].min > 0) {
           _resolve_winner(r, dest, cands_[dest][dest]);
@@ -407,7 +611,7 @@ public:
         }
         return true;
       }
-      if (largest_min < loc_prev_str_[dest]) {
+      if (largest_min < loc_prev_str_[static_cast<size_t>(dest)]) {
         // no unit's min beats prev strength, but >=1 units' max beats prev
         // strength: we are undecided
         return false;
@@ -471,8 +675,7 @@ public:
 
           _resolve_winner(r, dest, largest_min_cand->second);
 
-          if (other_units_max == 0 &&
-              maybe_convoy_orders_by_dest_[dest].size() == 0) {
+          if (other_units_max == 0 && !_has_maybe_convoy_orders_to(dest)) {
             // no other unit managed to attack this loc: if the unit had an
             // unresolved support, resolve it
             _resolve_support_if_exists(r, dest);
@@ -550,11 +753,10 @@ public:
     // successful)
     auto it = maybe_convoy_orders_by_fleet_.find(winner.src);
     if (it != maybe_convoy_orders_by_fleet_.end()) {
-      Order &order = it->second;
+      const Order &order = it->second;
       Loc army_src = root_loc(order.get_target().loc);
       Loc army_dest = root_loc(order.get_dest());
-      maybe_convoy_orders_by_dest_[army_dest].erase(order);
-      maybe_convoy_orders_by_fleet_.erase(it);
+      maybe_convoy_orders_by_fleet_.erase(winner.src);
       LocCandidate &army_cand = cands_[army_dest][army_src];
       confirmed_convoy_fleets_[army_src].insert(winner.src);
       if (is_convoy_possible(army_src, army_dest, true)) {
@@ -563,15 +765,7 @@ public:
     }
 
     // Zero winner everywhere else
-    // TODO: remove loop, check move_reqs_
-    for (auto &it : cands_) {
-      auto cand_elsewhere_it = it.second.find(winner_root);
-      if (cand_elsewhere_it != it.second.end()) {
-        // zero min and max elsewhere
-        cand_elsewhere_it->second.min = 0;
-        cand_elsewhere_it->second.max = 0;
-      }
-    }
+    cands_.zero_src(winner_root);
 
     // Loser hold candidates are dislodged. Loser move candidates attempt to
     // hold their current position with strength 1.
@@ -672,16 +866,6 @@ public:
     remove_self_dislodges_at_dest(unresolved_self_dislodges_, dest);
     remove_self_dislodges_at_dest(unresolved_self_support_dislodges_, dest);
 
-    // Remove any unresolved self-dislodges at this location
-    for (auto it = unresolved_self_dislodges_.begin();
-         it != unresolved_self_dislodges_.end();) {
-      if (root_loc(it->second) == root_loc(dest)) {
-        it = unresolved_self_dislodges_.erase(it);
-      } else {
-        ++it;
-      }
-    }
-
     this->log();
   }
 
@@ -700,7 +884,7 @@ public:
     // and if so zero it (see DATC 6.E.1-5)
     auto move_it = move_reqs_.find(loc);
     if (move_it != move_reqs_.end()) {
-      LocCandidate &dislodger_cand = r.winners.at(loc); // broke
+      const LocCandidate &dislodger_cand = r.winners.at(loc); // broke
       Loc dislodger_src = root_loc(dislodger_cand.src);
       LocCandidate &move_cand = cands_.at(move_it->second).at(loc);
       if (move_it->second == dislodger_src) {
@@ -836,8 +1020,8 @@ public:
 
   void _set_prev_str_to_max(Loc loc, int val) {
     loc = root_loc(loc);
-    int old_val = loc_prev_str_[loc];
-    loc_prev_str_[loc] = val > old_val ? val : old_val;
+    int &prev_str = loc_prev_str_[static_cast<size_t>(loc)];
+    prev_str = val > prev_str ? val : prev_str;
   }
 
   void _move_pending_h2h_str_to_prev(LocCandidate &cand) {
@@ -867,8 +1051,8 @@ public:
 
     Loc a_dest = root_loc(a.dest);
     Loc b_dest = root_loc(b.dest);
-    auto &a_dest_cands = cands_.at(a_dest);
-    auto &b_dest_cands = cands_.at(b_dest);
+    auto a_dest_cands = cands_.at(a_dest);
+    auto b_dest_cands = cands_.at(b_dest);
     LocCandidate &a_dest_hold_cand = a_dest_cands.at(a_dest);
     LocCandidate &b_dest_hold_cand = b_dest_cands.at(b_dest);
 
@@ -908,8 +1092,7 @@ public:
     Order order = it->second;
     Loc src = root_loc(order.get_target().loc);
     Loc dest = root_loc(order.get_dest());
-    maybe_convoy_orders_by_dest_[dest].erase(order);
-    maybe_convoy_orders_by_fleet_.erase(it);
+    maybe_convoy_orders_by_fleet_.erase(loc);
     if (!is_convoy_possible(order.get_target().loc, order.get_dest())) {
       bool via_adj = cands_[dest][src].via_adj;
       DLOG(INFO) << "BROKEN CONVOY " << src << " -> " << dest
@@ -942,35 +1125,42 @@ public:
   }
 
   void erase_all_pending_convoys(Loc src, Loc dest) {
-    set<Order> &maybe_dest_convoys = maybe_convoy_orders_by_dest_[dest];
-    for (auto it = maybe_dest_convoys.begin();
-         it != maybe_dest_convoys.end();) {
-      if (it->get_target().loc == src) {
-        Loc fleet_loc = it->get_unit().loc;
+    for (auto &it : maybe_convoy_orders_by_fleet_) {
+      const Order &order = it.second;
+      if (root_loc(order.get_dest()) == dest && order.get_target().loc == src) {
+        Loc fleet_loc = it.first;
         DLOG(INFO) << "Disabling fleet for broken convoy: " << fleet_loc;
-        it = maybe_dest_convoys.erase(it);
-        JCHECK(maybe_convoy_orders_by_fleet_.erase(fleet_loc),
-               "Disabled fleet missing in maybe_convoy_orders_by_fleet_");
-      } else {
-        ++it;
+        maybe_convoy_orders_by_fleet_.erase(fleet_loc);
+      }
+    }
+  }
+
+  // Returns true if any unresolved convoy order has dest as its destination
+  bool _has_maybe_convoy_orders_to(Loc dest) {
+    for (auto &it : maybe_convoy_orders_by_fleet_) {
+      if (root_loc(it.second.get_dest()) == dest) {
+        return true;
       }
     }
+    return false;
   }
 
   bool is_convoy_possible(Loc src, Loc dest, bool only_confirmed = false) {
     src = root_loc(src);
 
     // Compile fleets that are attempting to convoy this route
-    const set<Loc> &confirmed_convoy_fleets = confirmed_convoy_fleets_[src];
-    set<Loc> maybe_convoy_fleets;
-    for (const Order &order : maybe_convoy_orders_by_dest_[dest]) {
-      if (root_loc(order.get_target().loc) == src) {
+    const LocSet &confirmed_convoy_fleets = confirmed_convoy_fleets_[src];
+    LocSet maybe_convoy_fleets;
+    for (auto &it : maybe_convoy_orders_by_fleet_) {
+      const Order &order = it.second;
+      if (root_loc(order.get_dest()) == dest &&
+          root_loc(order.get_target().loc) == src) {
         maybe_convoy_fleets.insert(order.get_unit().loc);
       }
     }
 
-    set<Loc> todo;
-    set<Loc> visited;
+    LocSet todo;
+    LocSet visited;
 
     // Initialize carefully: start with adjacent convoy fleets, not with src
     // directly, to ensure that VIA move goes through at least one fleet
@@ -983,10 +1173,9 @@ public:
       }
     }
 
-    while (todo.size() > 0) {
-      auto it = todo.begin();
-      Loc loc = *it;
-      todo.erase(it);
+    while (!todo.empty()) {
+      Loc loc = *todo.begin();
+      todo.erase(loc);
       visited.insert(loc);
 
       for (Loc current : ADJ_F_ALL_COASTS[static_cast<size_t>(loc)]) {
@@ -1017,20 +1206,23 @@ public:
 
   // Unit @ loc is not dislodged: maybe confirm unresolved support
   void _confirm_supporter_not_dislodged(Resolution &r, Loc loc) {
-    auto unresolved_support_it = unresolved_supports_.find(loc);
-    if (unresolved_support_it == unresolved_supports_.end()) {
+    if (!map_contains(unresolved_supports_, loc)) {
       return;
     }
     if (_is_unresolved_supporter_and_all_remaining_convoys_do_not_cut(loc)) {
       _resolve_support_if_exists(r, loc);
     } else {
-      unresolved_support_it->second.pending_dislodge = false;
+      unresolved_supports_[loc].pending_dislodge = false;
     }
   }
 
-  // Return true if all convoy orders' src loc == loc
-  bool _all_convoys_src_eq(const set<Order> &convoy_orders, Loc loc) {
-    for (const Order &order : convoy_orders) {
+  // Return true if all unresolved convoy orders to dest have src loc == loc
+  bool _all_convoys_src_eq(Loc dest, Loc loc) {
+    for (auto &it : maybe_convoy_orders_by_fleet_) {
+      const Order &order = it.second;
+      if (root_loc(order.get_dest()) != dest) {
+        continue;
+      }
       JCHECK(order.get_type() == OrderType::C,
              "_all_convoys_src_eq called with non-convoy");
       if (order.get_target().loc != loc) {
@@ -1048,19 +1240,17 @@ public:
     if (unresolved_support_it == unresolved_supports_.end()) {
       return false;
     }
-    set<Order> &maybe_inbound_convoys = maybe_convoy_orders_by_dest_[loc];
     // Vacuously true if there are no convoys at all coming in
-    if (maybe_inbound_convoys.size() == 0) {
+    if (!_has_maybe_convoy_orders_to(loc)) {
       return true;
     }
     // Support may still be cut by convoyed army.
     // The only exception is if all inbound convoys are
     // ferrying an army on which we are supporting an attack. Check for this
     // case.
-    Order &support_order = unresolved_support_it->second.order;
+    const Order &support_order = unresolved_support_it->second.order;
     if (support_order.get_type() == OrderType::SM &&
-        _all_convoys_src_eq(maybe_inbound_convoys,
-                            root_loc(support_order.get_dest()))) {
+        _all_convoys_src_eq(loc, root_loc(support_order.get_dest()))) {
       return true;
     }
 
@@ -1120,23 +1310,20 @@ public:
   void _clear_unresolved_self_dislodges(Resolution &r) {
 
     // Combine both unresolved self dislodge sets
-    set<pair<Loc, Loc>> unresolved_self_dislodges(unresolved_self_dislodges_);
-    for (auto &p : unresolved_self_support_dislodges_) {
-      unresolved_self_dislodges.insert(p);
-    }
+    LocPairSet unresolved_self_dislodges(unresolved_self_dislodges_);
+    unresolved_self_dislodges |= unresolved_self_support_dislodges_;
     unresolved_self_dislodges_.clear();
     unresolved_self_support_dislodges_.clear();
 
-    set<Loc> resolved_cycle_locs;
-    vector<set<Loc>> maybe_valid_cycles;
-    while (unresolved_self_dislodges.size() > 0) {
-      auto it = unresolved_self_dislodges.begin();
-      pair<Loc, Loc> p = *it;
+    LocSet resolved_cycle_locs;
+    vector<LocSet> maybe_valid_cycles;
+    while (!unresolved_self_dislodges.empty()) {
+      pair<Loc, Loc> p = *unresolved_self_dislodges.begin();
       Loc src = p.first;
       Loc dest = p.second;
       DLOG(INFO) << "Consider resolving " << src << " -> " << dest;
       if (set_contains(resolved_cycle_locs, src)) {
-        unresolved_self_dislodges.erase(it);
+        unresolved_self_dislodges.erase(p);
         continue;
       }
       MoveCycle cycle = _detect_unresolved_move_cycle(dest);
@@ -1167,7 +1354,7 @@ public:
     }
 
     // Resolve valid move cycles if they were not later resolved by a bounce
-    for (set<Loc> &cycle : maybe_valid_cycles) {
+    for (LocSet &cycle : maybe_valid_cycles) {
       Loc loc = *cycle.begin();
       if (!set_contains(resolved_cycle_locs, loc)) {
         Loc dest = move_reqs_.at(loc);
@@ -1179,14 +1366,14 @@ public:
     }
   }
 
-  void remove_self_dislodges_at_dest(set<pair<Loc, Loc>> &unresolved_dislodges,
+  void remove_self_dislodges_at_dest(LocPairSet &unresolved_dislodges,
                                      Loc dest) {
-    for (auto it = unresolved_dislodges.begin();
-         it != unresolved_dislodges.end();) {
-      if (root_loc(it->second) == root_loc(dest)) {
-        it = unresolved_dislodges.erase(it);
-      } else {
-        ++it;
+    if (unresolved_dislodges.empty()) {
+      return;
+    }
+    for (pair<Loc, Loc> p : unresolved_dislodges) {
+      if (root_loc(p.second) == root_loc(dest)) {
+        unresolved_dislodges.erase(p);
       }
     }
   }
@@ -1198,10 +1385,10 @@ public:
   //
   // See http://web.inter.nl.net/users/L.B.Kruijswijk/#4.A.2
   void _clear_convoy_paradoxes(Resolution &r) {
-    while (maybe_convoy_orders_by_fleet_.size() > 0) {
+    while (!maybe_convoy_orders_by_fleet_.empty()) {
       auto it = maybe_convoy_orders_by_fleet_.begin();
       Loc convoy_fleet = it->first;
-      Order &convoy_order = it->second;
+      const Order &convoy_order = it->second;
       DLOG(INFO) << "CONVOY PARADOX: " << convoy_order.to_string();
       if (exception_on_convoy_paradox_) {
         throw ConvoyParadoxException();
@@ -1234,46 +1421,83 @@ public:
   // e.g. for the order "F STP/SC - BOT"
   // cands_[BOT][STP] = move candidate
   // cands_[STP][STP] = hold candidate (in case move fails)
-  map<Loc, map<Loc, LocCandidate>> cands_;
+  CandidateTable cands_;
 
   // Move candidates organized src -> dest
-  map<Loc, Loc> move_reqs_;
+  LocMap<Loc> move_reqs_;
 
   // Key is supporter loc
-  map<Loc, UnresolvedSupport> unresolved_supports_;
+  LocMap<UnresolvedSupport> unresolved_supports_;
 
   // Units who do not yet have a resolved destination
-  set<Loc> unresolved_units_;
+  LocSet unresolved_units_;
 
   // bidirectional map of unresolved h2h battles
-  map<Loc, Loc> unresolved_h2h_;
+  LocMap<Loc> unresolved_h2h_;
 
   // unresolved self-support dislodge moves, src -> dest,
   // i.e. dislodges that succeed only with self-support
-  set<pair<Loc, Loc>> unresolved_self_support_dislodges_;
+  LocPairSet unresolved_self_support_dislodges_;
 
   // unresolved self-dislodge moves, src -> dest,
   // i.e. dislodges of same-power unit
-  set<pair<Loc, Loc>> unresolved_self_dislodges_;
-
-  // Unresolved convoy orders organized by *fleet loc*
-  map<Loc, Order> maybe_convoy_orders_by_fleet_;
+  LocPairSet unresolved_self_dislodges_;
 
-  // Unresolved convoy orders organized by *dest loc*
-  map<Loc, set<Order>> maybe_convoy_orders_by_dest_;
+  // Unresolved convoy orders organized by *fleet loc*. There are at most a
+  // handful, so lookups by dest loc scan this map.
+  LocMap<Order> maybe_convoy_orders_by_fleet_;
 
   // Non-dislodged fleets organized by *army loc*
   // Map of army loc -> set of fleet locs
-  map<Loc, set<Loc>> confirmed_convoy_fleets_;
+  LocMap<LocSet> confirmed_convoy_fleets_;
 
-  // Minimum strength necessary to move to a loc.
-  map<Loc, int> loc_prev_str_;
+  // Minimum strength necessary to move to a loc, indexed by root loc
+  std::array<int, NUM_LOCS + 1> loc_prev_str_{};
 
   // For debugging: if true, raise a custom exception when a convoy paradox is
   // encountered
   bool exception_on_convoy_paradox_ = false;
 };
 
+void GameState::collect_m_orders(
+    const std::unordered_map<Power, std::vector<Order>> &orders,
+    LocMap<Order> &orders_by_src, LocSet &illegal_orderers) {
+  const PossibleOrders &all_possible_orders(this->get_all_possible_orders());
+
+  // Organize orders by src loc
+  for (auto &[power, porders] : orders) {
+    for (const Order order : porders) {
+      Loc loc = order.get_unit().loc;
+      // check if correct power ordering unit
+      if (this->get_unit(loc).power != power) {
+        DLOG(WARNING) << power_str(power)
+                      << " tried wrong-power order: " << order.to_string();
+        continue;
+      }
+      orders_by_src[root_loc(loc)] = order;
+    }
+  }
+
+  // check if each order is possible
+  for (auto &[rloc, order] : orders_by_src) {
+    auto loc_possible_orders_it =
+        all_possible_orders.find(order.get_unit().loc);
+    if (loc_possible_orders_it != all_possible_orders.end() &&
+        set_contains(loc_possible_orders_it->second, order)) {
+      continue;
+    }
+    if (is_implicit_via(order, all_possible_orders)) {
+      // set via to explicitly true and move on
+      DLOG(WARNING) << "Accepting implicit via for order: "
+                    << order.to_string();
+      orders_by_src[rloc] = order.with_via(true);
+    } else {
+      DLOG(WARNING) << "Order not possible: " << order.to_string();
+      illegal_orderers.insert(rloc);
+    }
+  }
+}
+
 GameState GameState::process_m(
     const std::unordered_map<Power, std::vector<Order>> &orders,
     bool exception_on_convoy_paradox) {
@@ -1281,15 +1505,16 @@ GameState GameState::process_m(
          "Bad phase_type: " + this->get_phase().phase_type);
   DLOG(INFO) << "Process phase: " << this->get_phase().to_string();
 
-  const unordered_map<Loc, set<Order>> &all_possible_orders(
-      this->get_all_possible_orders());
+  const PossibleOrders &all_possible_orders(this->get_all_possible_orders());
 
-  // Build up candidate data
+  // Build up candidate data. Everything here is keyed by (root) unit loc and
+  // stored in fixed-size per-loc containers, so no allocation is needed.
   LocCandidates loc_candidates;
-  vector<pair<Order, bool>> move_via_orders;
-  vector<Order> support_orders;
-  set<Loc> illegal_orderers;
-  set<Loc> unconvoyed_movers;
+  LocMap<Order> orders_by_src;
+  LocMap<bool> move_via_orders; // value is via_adj
+  LocSet support_orders;
+  LocSet illegal_orderers;
+  LocSet unconvoyed_movers;
 
   // Set debugging flags
   loc_candidates.exception_on_convoy_paradox_ = exception_on_convoy_paradox;
@@ -1302,47 +1527,26 @@ GameState GameState::process_m(
     loc_candidates.add_candidate(loc, unit, false, false);
   }
 
-  // Organize orders by src loc
-  unordered_map<Loc, Order> orders_by_src;
-  for (auto &[power, porders] : orders) {
-    for (const Order order : porders) {
-      Loc loc = order.get_unit().loc;
-      // check if correct power ordering unit
-      if (this->get_unit(loc).power != power) {
-        DLOG(WARNING) << power_str(power)
-                      << " tried wrong-power order: " << order.to_string();
-        continue;
-      }
-      orders_by_src[root_loc(loc)] = order;
-    }
-  }
+  collect_m_orders(orders, orders_by_src, illegal_orderers);
 
-  // Loop through all orders and build up data structures
-  for (auto &[rloc, order] : orders_by_src) {
-    // check if order is possible
-    auto loc_possible_orders_it =
-        all_possible_orders.find(order.get_unit().loc);
-    if (loc_possible_orders_it == all_possible_orders.end() ||
-        !set_contains(loc_possible_orders_it->second, order)) {
-      if (is_implicit_via(order, all_possible_orders)) {
-        // set via to explicitly true and move on
-        DLOG(WARNING) << "Accepting implicit via for order: "
-                      << order.to_string();
-        order = order.with_via(true);
-        orders_by_src[root_loc(order.get_unit().loc)] = order;
-      } else {
-        DLOG(WARNING) << "Order not possible: " << order.to_string();
-        illegal_orderers.insert(root_loc(order.get_unit().loc));
-        continue;
-      }
+  // Loop through all legal orders and build up data structures
+  for (auto &it : orders_by_src) {
+    Loc rloc = it.first;
+    const Order &order = it.second;
+    if (set_contains(illegal_orderers, rloc)) {
+      continue;
     }
 
     // check if via move is to adjacent loc (i.e. non-via move also
     // allowed)
-    bool via_adj =
-        (order.get_via() &&
-         loc_possible_orders_it != all_possible_orders.end() &&
-         set_contains(loc_possible_orders_it->second, order.with_via(false)));
+    bool via_adj = false;
+    if (order.get_via()) {
+      auto loc_possible_orders_it =
+          all_possible_orders.find(order.get_unit().loc);
+      via_adj = loc_possible_orders_it != all_possible_orders.end() &&
+                set_contains(loc_possible_orders_it->second,
+                             order.with_via(false));
+    }
 
     // add all loc candidates and set aside supports
     if (order.get_type() == OrderType::H) {
@@ -1350,7 +1554,7 @@ GameState GameState::process_m(
     } else if (order.get_type() == OrderType::M) {
       if (order.get_via()) {
         // Handle via moves after gathering convoy orders.
-        move_via_orders.push_back(make_pair(order, via_adj));
+        move_via_orders[rloc] = via_adj;
       } else {
         // move to dest with max=1
         loc_candidates.add_candidate(order.get_dest(),
@@ -1360,7 +1564,7 @@ GameState GameState::process_m(
     } else if (order.get_type() == OrderType::SM ||
                order.get_type() == OrderType::SH) {
       // handle supports after determining which moves are legal
-      support_orders.push_back(order);
+      support_orders.insert(rloc);
     } else if (order.get_type() == OrderType::C) {
       auto target = orders_by_src.find(root_loc(order.get_target().loc));
       if (target != orders_by_src.end() &&
@@ -1379,7 +1583,8 @@ GameState GameState::process_m(
 
   // Check for valid convoy path before adding move via order. Move may still
   // fail if a convoying fleet is dislodged
-  for (auto &[order, via_adj] : move_via_orders) {
+  for (auto &[rloc, via_adj] : move_via_orders) {
+    const Order &order = orders_by_src.at(rloc);
     if (loc_candidates.is_convoy_possible(root_loc(order.get_unit().loc),
                                           root_loc(order.get_dest()))) {
       loc_candidates.add_candidate(order.get_dest(),
@@ -1403,7 +1608,8 @@ GameState GameState::process_m(
   }
 
   // Resolve supports
-  for (Order &order : support_orders) {
+  for (Loc rloc : support_orders) {
+    const Order &order = orders_by_src.at(rloc);
     // Check for support coordination, e.g. that we are not support-holding a
     // unit that is moving, or support-moving a unit to the wrong destination
     auto target = orders_by_src.find(root_loc(order.get_target().loc));
@@ -1433,10 +1639,14 @@ GameState GameState::process_m(
     // Check for support cuts.  Anyone (of a different power) trying to move
     // to any coastal variant is a cut candidate
     Power supporter_power = this->get_unit(order.get_unit().loc).power;
-    set<Loc> cut_candidates;
-    set<Loc> convoy_cut_candidates;
+    LocSet cut_candidates;
+    LocSet convoy_cut_candidates;
     for (Loc loc : expand_coasts(order.get_unit().loc)) {
-      for (LocCandidate move_cand : loc_candidates.get_move_candidates(loc)) {
+      for (auto &[src, move_cand] : loc_candidates.get_candidates(loc)) {
+        if (src == root_loc(loc)) {
+          // include only move candidates, not hold
+          continue;
+        }
         if (move_cand.power == supporter_power) {
           // can't cut own support
           continue;
@@ -1494,21 +1704,103 @@ GameState GameState::process_m(
   return build_next_state(resolved);
 }
 
+std::vector<bool> GameState::process_m_uncontested_batch(
+    const std::vector<GameState *> &states,
+    const std::vector<const std::unordered_map<Power, std::vector<Order>> *>
+        &orders,
+    std::vector<GameState> &next) {
+  JCHECK(states.size() == orders.size(),
+         "process_m_uncontested_batch: states/orders size mismatch");
+  constexpr size_t S = NUM_LOCS + 1;
+  size_t n = states.size();
+
+  vector<bool> uncontested(n, false);
+  vector<LocMap<Order>> orders_by_src(n);
+  vector<LocSet> illegal_orderers(n);
+
+  // Structure-of-arrays tables, indexed by (game * S + root loc):
+  // - n_claims: the number of units holding at or moving to a loc
+  // - unit_dest: where the unit at a loc ends up if its board is uncontested
+  vector<uint8_t> n_claims(n * S, 0);
+  vector<Loc> unit_dest(n * S, Loc::NONE);
+
+  // Pass 1: validate the orders of every movement phase
+  for (size_t i = 0; i < n; ++i) {
+    if (states[i]->get_phase().phase_type != 'M') {
+      continue;
+    }
+    states[i]->collect_m_orders(*orders[i], orders_by_src[i],
+                                illegal_orderers[i]);
+    uncontested[i] = true;
+  }
+
+  // Pass 2: every unit claims its own loc, and movers also claim their dest.
+  // A board is uncontested if no loc is claimed twice and no unit moves via
+  // convoy, in which case supports and convoys cannot affect the outcome.
+  for (size_t i = 0; i < n; ++i) {
+    if (!uncontested[i]) {
+      continue;
+    }
+    uint8_t *claims = &n_claims[i * S];
+    Loc *dests = &unit_dest[i * S];
+    for (auto &[loc, unit] : states[i]->units_) {
+      Loc rloc = root_loc(loc);
+      Loc dest = loc;
+      auto order_it = orders_by_src[i].find(rloc);
+      if (order_it != orders_by_src[i].end() &&
+          !set_contains(illegal_orderers[i], rloc) &&
+          order_it->second.get_type() == OrderType::M) {
+        if (order_it->second.get_via()) {
+          uncontested[i] = false;
+          break;
+        }
+        dest = order_it->second.get_dest();
+        ++claims[static_cast<size_t>(root_loc(dest))];
+      }
+      dests[static_cast<size_t>(rloc)] = dest;
+      ++claims[static_cast<size_t>(rloc)];
+    }
+    for (size_t loc = 0; uncontested[i] && loc < S; ++loc) {
+      uncontested[i] = claims[loc] <= 1;
+    }
+  }
+
+  // Pass 3: every unit on an uncontested board wins its dest
+  next.resize(n);
+  for (size_t i = 0; i < n; ++i) {
+    if (!uncontested[i]) {
+      continue;
+    }
+    const Loc *dests = &unit_dest[i * S];
+    Resolution r;
+    for (auto &[loc, unit] : states[i]->units_) {
+      Loc dest = dests[static_cast<size_t>(root_loc(loc))];
+      r.winners[root_loc(dest)] = {
+          loc, dest, unit.power, 1, 1, 0, 0, 0, 0, false, false};
+    }
+    next[i] = states[i]->build_next_state(r);
+  }
+
+  return uncontested;
+}
+
 GameState GameState::build_next_state(const Resolution &r) const {
 
   GameState next;
   next.set_centers(this->get_centers());
   next.set_influence(this->get_influence());
+  next.possible_orders_cache_m_ = possible_orders_cache_m_;
 
   // Set units
   for (auto &it : r.winners) {
-    LocCandidate cand = it.second;
+    const LocCandidate &cand = it.second;
     if (cand.src == Loc::NONE) {
       continue;
     }
     auto unit = this->get_unit(cand.src);
-    JCHECK(unit.type != UnitType::NONE,
-           "Bad: dest=" + loc_str(cand.dest) + " src=" + loc_str(cand.src));
+    if (unit.type == UnitType::NONE) {
+      JFAIL("Bad: dest=" + loc_str(cand.dest) + " src=" + loc_str(cand.src));
+    }
     next.set_unit(unit.power, unit.type, cand.dest);
   }
 
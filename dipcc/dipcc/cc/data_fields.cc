@@ -10,33 +10,131 @@ LICENSE file in the root directory of this source tree.
 
 namespace dipcc {
 
-TensorDict new_data_fields_state_only(long B, int input_version) {
+namespace {
+
+// Uninitialized fields of new_data_fields_state_only, or of new_data_fields
+// if max_seq_len > 0
+TensorDict empty_data_fields(long B, int input_version, long max_seq_len,
+                             bool include_power, bool pin_memory) {
+  auto options = [pin_memory](torch::ScalarType dtype) {
+    return torch::TensorOptions().dtype(dtype).pinned_memory(pin_memory);
+  };
   int bWidth = board_state_enc_width(input_version);
-  return {
-      {"x_board_state", torch::empty({B, NUM_LOCS, bWidth}, torch::kFloat32)},
-      {"x_prev_state", torch::empty({B, NUM_LOCS, bWidth}, torch::kFloat32)},
-      {"x_prev_orders", torch::empty({B, 2, 100}, torch::kLong)},
-      {"x_season", torch::empty({B, 3}, torch::kFloat32)},
-      {"x_year_encoded", torch::empty({B, 1}, torch::kFloat32)},
-      {"x_in_adj_phase", torch::empty({B}, torch::kFloat32)},
-      {"x_build_numbers", torch::empty({B, 7}, torch::kFloat32)},
+  TensorDict fields{
+      {"x_board_state",
+       torch::empty({B, NUM_LOCS, bWidth}, options(torch::kFloat32))},
+      {"x_prev_state",
+       torch::empty({B, NUM_LOCS, bWidth}, options(torch::kFloat32))},
+      {"x_prev_orders", torch::empty({B, 2, 100}, options(torch::kLong))},
+      {"x_season", torch::empty({B, 3}, options(torch::kFloat32))},
+      {"x_year_encoded", torch::empty({B, 1}, options(torch::kFloat32))},
+      {"x_in_adj_phase", torch::empty({B}, options(torch::kFloat32))},
+      {"x_build_numbers", torch::empty({B, 7}, options(torch::kFloat32))},
       {"x_scoring_system",
-       torch::empty({B, NUM_SCORING_SYSTEMS}, torch::kFloat32)},
+       torch::empty({B, NUM_SCORING_SYSTEMS}, options(torch::kFloat32))},
   };
+  if (max_seq_len > 0) {
+    fields["x_loc_idxs"] =
+        torch::empty({B, 7, NUM_LOCS}, options(torch::kInt8));
+    fields["x_possible_actions"] =
+        torch::empty({B, 7, max_seq_len, 469}, options(torch::kInt32));
+    if (include_power) {
+      fields["x_power"] =
+          torch::empty({B, 7, max_seq_len}, options(torch::kLong));
+    }
+  }
+  return fields;
+}
+
+// True if nothing but fields references its tensors' storage
+bool is_unreferenced(const TensorDict &fields) {
+  for (auto &kv : fields) {
+    if (kv.second.use_count() > 1 || kv.second.storage().use_count() > 1) {
+      return false;
+    }
+  }
+  return true;
+}
+
+} // namespace
+
+TensorDict new_data_fields_state_only(long B, int input_version) {
+  return empty_data_fields(B, input_version, 0, false, false);
 }
 
 TensorDict new_data_fields(long B, int input_version, long max_seq_len,
                            bool include_power) {
-  TensorDict fields(new_data_fields_state_only(B, input_version));
-  fields["x_loc_idxs"] = torch::full({B, 7, NUM_LOCS}, -1, torch::kInt8);
-  fields["x_possible_actions"] =
-      torch::full({B, 7, max_seq_len, 469}, -1, torch::kInt32);
-
+  TensorDict fields(
+      empty_data_fields(B, input_version, max_seq_len, include_power, false));
+  fields["x_loc_idxs"].fill_(-1);
+  fields["x_possible_actions"].fill_(-1);
   if (include_power) {
-    fields["x_power"] = torch::full({B, 7, max_seq_len}, -1, torch::kLong);
+    fields["x_power"].fill_(-1);
   }
 
   return fields;
 }
 
+TensorDict DataFieldsPool::get_state_only(long B, int input_version) {
+  return get_or_allocate(Key(B, input_version, 0, false));
+}
+
+TensorDict DataFieldsPool::get(long B, int input_version, long max_seq_len,
+                               bool include_power) {
+  return get_or_allocate(Key(B, input_version, max_seq_len, include_power));
+}
+
+void DataFieldsPool::clear() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  entries_.clear();
+  cached_bytes_ = 0;
+}
+
+TensorDict DataFieldsPool::get_or_allocate(const Key &key) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (Entry &entry : entries_[key]) {
+    if (is_unreferenced(entry.fields)) {
+      entry.last_used = ++clock_;
+      return entry.fields;
+    }
+  }
+
+  auto [B, input_version, max_seq_len, include_power] = key;
+  TensorDict fields = empty_data_fields(B, input_version, max_seq_len,
+                                        include_power, pin_memory_);
+  size_t bytes = 0;
+  for (auto &kv : fields) {
+    bytes += kv.second.numel() * kv.second.element_size();
+  }
+  if (make_room(bytes)) {
+    entries_[key].push_back(Entry{fields, bytes, ++clock_});
+    cached_bytes_ += bytes;
+  }
+  return fields;
+}
+
+bool DataFieldsPool::make_room(size_t bytes) {
+  while (cached_bytes_ + bytes > max_cached_bytes_) {
+    // Find the least recently used unreferenced dict
+    std::vector<Entry> *lru_entries = nullptr;
+    size_t lru_i = 0;
+    for (auto &[key, entries] : entries_) {
+      for (size_t i = 0; i < entries.size(); ++i) {
+        if ((lru_entries == nullptr ||
+             entries[i].last_used < (*lru_entries)[lru_i].last_used) &&
+            is_unreferenced(entries[i].fields)) {
+          lru_entries = &entries;
+          lru_i = i;
+        }
+      }
+    }
+    if (lru_entries == nullptr) {
+      return false;
+    }
+    cached_bytes_ -= (*lru_entries)[lru_i].bytes;
+    lru_entries->erase(lru_entries->begin() + lru_i);
+  }
+  return true;
+}
+
 } // namespace dipcc
@@ -6,7 +6,12 @@ LICENSE file in the root directory of this source tree.
 */
 #pragma once
 
+#include <cstdint>
+#include <map>
+#include <mutex>
 #include <torch/torch.h>
+#include <tuple>
+#include <vector>
 
 namespace dipcc {
 
@@ -17,4 +22,58 @@ TensorDict new_data_fields_state_only(long B, int input_version);
 TensorDict new_data_fields(long B, int input_version, long max_seq_len = 17,
                            bool include_power = false);
 
+// Recycles the TensorDicts used as encoder outputs, so that steady-state
+// encoding of same-sized batches neither allocates nor initializes memory.
+//
+// Dicts are keyed by the arguments of new_data_fields (or
+// new_data_fields_state_only), and their tensors are left uninitialized: the
+// ThreadPool encoders overwrite every element of each row they encode. A dict
+// is handed out again once nothing outside the pool references any of its
+// tensors' storage, i.e. once the caller has dropped the dict and all views of
+// it. The pool keeps at most max_cached_bytes of dicts, evicting the least
+// recently used unreferenced ones first.
+//
+// If pin_memory, tensors are allocated in pinned memory for faster
+// host-to-device copies. Asynchronous copies out of a dict must then complete
+// before the dict is dropped, since it may be reused as soon as it is.
+class DataFieldsPool {
+public:
+  static constexpr size_t DEFAULT_MAX_CACHED_BYTES = size_t(1) << 30;
+
+  explicit DataFieldsPool(bool pin_memory = false,
+                          size_t max_cached_bytes = DEFAULT_MAX_CACHED_BYTES)
+      : pin_memory_(pin_memory), max_cached_bytes_(max_cached_bytes) {}
+
+  TensorDict get_state_only(long B, int input_version);
+  TensorDict get(long B, int input_version, long max_seq_len = 17,
+                 bool include_power = false);
+
+  // Drops all dicts held by the pool
+  void clear();
+
+private:
+  // (B, input_version, max_seq_len, include_power), with max_seq_len = 0 for
+  // state-only dicts
+  using Key = std::tuple<long, int, long, bool>;
+
+  struct Entry {
+    TensorDict fields;
+    size_t bytes;
+    uint64_t last_used;
+  };
+
+  TensorDict get_or_allocate(const Key &key);
+
+  // Evicts least recently used unreferenced dicts until bytes more fit in
+  // max_cached_bytes_. Returns false if they can't be made to fit.
+  bool make_room(size_t bytes);
+
+  bool pin_memory_;
+  size_t max_cached_bytes_;
+  std::mutex mutex_;
+  std::map<Key, std::vector<Entry>> entries_;
+  size_t cached_bytes_ = 0;
+  uint64_t clock_ = 0;
+};
+
 } // namespace dipcc
@@ -49,6 +49,20 @@ void encode_board_state(GameState &state, int input_version, float *r);
 void encode_board_state_pperm_matrix(const int *pperm, int input_version,
                                      float *r);
 
+// Same as encode_board_state followed by the multiplication by the
+// encode_board_state_pperm_matrix of each of the n_pperms permutations
+// pperms[7 * k : 7 * k + 7], without the matmul. Writes the n_pperms permuted
+// encodings [n_pperms, 81, enc_width] to r, computing the state's features
+// only once.
+void encode_board_state_pperms(GameState &state, int input_version,
+                               const int *pperms, int n_pperms, float *r);
+
+// Channel idxs equivalent to encode_board_state_pperm_matrix: channel j of the
+// permuted encoding is channel r[j] of the original one, i.e. gathering the
+// channels of an encoding at r permutes its powers.
+void encode_board_state_pperm_channel_idxs(const int *pperm, int input_version,
+                                           int64_t *r);
+
 // Return the list of feature encoding indices c_i such that if the encoding
 // tensor is one-hot at [batch_elt, location, c_i], then power i has a unit at
 // location.
@@ -60,6 +74,9 @@ std::vector<int> encoding_sc_ownership_idxs(int input_version);
 void encode_board_state_v1(GameState &state, float *r);
 void encode_board_state_v2(GameState &state, float *r);
 void encode_board_state_pperm_matrix_v2(const int *pperm, float *r);
+void encode_board_state_pperms_v2(GameState &state, const int *pperms,
+                                  int n_pperms, float *r);
+void encode_board_state_pperm_channel_idxs_v2(const int *pperm, int64_t *r);
 
 std::vector<int> encoding_unit_ownership_idxs_v1();
 std::vector<int> encoding_unit_ownership_idxs_v2();
@@ -0,0 +1,120 @@
+/*
+Copyright (c) Meta Platforms, Inc. and affiliates.
+
+This source code is licensed under the MIT license found in the
+LICENSE file in the root directory of this source tree.
+*/
+#include "encoding_cache.h"
+#include <algorithm>
+#include <cstring>
+
+#include "encoding.h"
+#include "hash.h"
+#include "loc.h"
+#include "orders_encoder.h"
+
+using namespace std;
+
+namespace dipcc {
+
+namespace {
+
+uint64_t cache_key(size_t board_hash, int input_version, bool all_powers) {
+  size_t key = board_hash;
+  hash_combine(key, input_version);
+  hash_combine(key, all_powers);
+  return key;
+}
+
+size_t n_rows(bool all_powers) {
+  return 7 * (all_powers ? N_SCS : OrdersEncoder::MAX_SEQ_LEN);
+}
+
+} // namespace
+
+EncodingCache::EncodingCache(size_t max_entries, int max_cands)
+    : max_cands_(max_cands), board_states_(max_entries),
+      valid_orders_(max_entries) {}
+
+bool EncodingCache::get_board_state(size_t board_hash, int input_version,
+                                    float *r) {
+  auto entry = board_states_.get(cache_key(board_hash, input_version, false));
+  if (entry == nullptr) {
+    return false;
+  }
+  memcpy(r, entry->data(), entry->size() * sizeof(float));
+  return true;
+}
+
+void EncodingCache::put_board_state(size_t board_hash, int input_version,
+                                    const float *r) {
+  board_states_.put(
+      cache_key(board_hash, input_version, false),
+      make_shared<const vector<float>>(
+          r, r + 81 * board_state_enc_width(input_version)));
+}
+
+bool EncodingCache::get_valid_orders(size_t board_hash, int input_version,
+                                     bool all_powers, int32_t *r_order_idxs,
+                                     int8_t *r_loc_idxs, int64_t *r_powers) {
+  auto entry =
+      valid_orders_.get(cache_key(board_hash, input_version, all_powers));
+  if (entry == nullptr) {
+    return false;
+  }
+  size_t rows = n_rows(all_powers);
+  memset(r_order_idxs, OrdersEncoder::EOS_IDX,
+         rows * max_cands_ * sizeof(int32_t));
+  const int32_t *src = entry->order_idxs.data();
+  for (size_t row = 0; row < rows; ++row) {
+    memcpy(r_order_idxs + row * max_cands_, src,
+           entry->row_lengths[row] * sizeof(int32_t));
+    src += entry->row_lengths[row];
+  }
+  memcpy(r_loc_idxs, entry->loc_idxs.data(), 7 * 81 * sizeof(int8_t));
+  if (all_powers) {
+    memcpy(r_powers, entry->powers.data(), rows * sizeof(int64_t));
+  }
+  return true;
+}
+
+void EncodingCache::put_valid_orders(size_t board_hash, int input_version,
+                                     bool all_powers,
+                                     const int32_t *r_order_idxs,
+                                     const int8_t *r_loc_idxs,
+                                     const int64_t *r_powers) {
+  auto entry = make_shared<ValidOrders>();
+  size_t rows = n_rows(all_powers);
+  entry->row_lengths.reserve(rows);
+  for (size_t row = 0; row < rows; ++row) {
+    const int32_t *begin = r_order_idxs + row * max_cands_;
+    const int32_t *end =
+        find(begin, begin + max_cands_, OrdersEncoder::EOS_IDX);
+    entry->order_idxs.insert(entry->order_idxs.end(), begin, end);
+    entry->row_lengths.push_back(end - begin);
+  }
+  entry->loc_idxs.assign(r_loc_idxs, r_loc_idxs + 7 * 81);
+  if (all_powers) {
+    entry->powers.assign(r_powers, r_powers + rows);
+  }
+  valid_orders_.put(cache_key(board_hash, input_version, all_powers),
+                    std::move(entry));
+}
+
+map<string, int64_t> EncodingCache::get_stats() {
+  return {
+      {"board_state_hits", board_states_.hits()},
+      {"board_state_misses", board_states_.misses()},
+      {"board_state_size", board_states_.size()},
+      {"valid_orders_hits", valid_orders_.hits()},
+      {"valid_orders_misses", valid_orders_.misses()},
+      {"valid_orders_size", valid_orders_.size()},
+  };
+}
+
+void EncodingCache::clear() {
+  board_states_.clear();
+  valid_orders_.clear();
+}
+
+} // namespace dipcc
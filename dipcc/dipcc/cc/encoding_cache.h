@@ -0,0 +1,149 @@
+/*
+Copyright (c) Meta Platforms, Inc. and affiliates.
+
+This source code is licensed under the MIT license found in the
+LICENSE file in the root directory of this source tree.
+*/
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace dipcc {
+
+// Bounded map from keys to immutable values, evicting the least recently used
+// entries. Split into independently locked shards so that concurrent lookups
+// of different keys rarely contend.
+template <typename V> class ShardedLruCache {
+public:
+  static constexpr size_t N_SHARDS = 16;
+
+  explicit ShardedLruCache(size_t max_entries)
+      : shard_capacity_(std::max((max_entries + N_SHARDS - 1) / N_SHARDS,
+                                 size_t(1))) {}
+
+  // Returns nullptr on miss
+  std::shared_ptr<const V> get(uint64_t key) {
+    Shard &shard = shards_[key % N_SHARDS];
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto it = shard.map.find(key);
+    if (it == shard.map.end()) {
+      ++misses_;
+      return nullptr;
+    }
+    ++hits_;
+    shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+    return it->second->second;
+  }
+
+  void put(uint64_t key, std::shared_ptr<const V> value) {
+    Shard &shard = shards_[key % N_SHARDS];
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto it = shard.map.find(key);
+    if (it != shard.map.end()) {
+      // Another worker encoded the same state concurrently
+      shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+      return;
+    }
+    if (shard.map.size() >= shard_capacity_) {
+      shard.map.erase(shard.lru.back().first);
+      shard.lru.pop_back();
+    }
+    shard.lru.emplace_front(key, std::move(value));
+    shard.map[key] = shard.lru.begin();
+  }
+
+  void clear() {
+    for (Shard &shard : shards_) {
+      std::lock_guard<std::mutex> lock(shard.mutex);
+      shard.map.clear();
+      shard.lru.clear();
+    }
+    hits_ = 0;
+    misses_ = 0;
+  }
+
+  size_t size() {
+    size_t r = 0;
+    for (Shard &shard : shards_) {
+      std::lock_guard<std::mutex> lock(shard.mutex);
+      r += shard.map.size();
+    }
+    return r;
+  }
+
+  uint64_t hits() const { return hits_; }
+  uint64_t misses() const { return misses_; }
+
+private:
+  using Entries = std::list<std::pair<uint64_t, std::shared_ptr<const V>>>;
+
+  struct Shard {
+    std::mutex mutex;
+    Entries lru; // most recently used first
+    std::unordered_map<uint64_t, typename Entries::iterator> map;
+  };
+
+  size_t shard_capacity_;
+  std::array<Shard, N_SHARDS> shards_;
+  std::atomic<uint64_t> hits_{0};
+  std::atomic<uint64_t> misses_{0};
+};
+
+// Memoizes the outputs of encode_board_state and of the OrdersEncoder
+// encode_valid_orders* methods, which only depend on the board, keyed by
+// GameState::compute_board_hash and the input version. Used by ThreadPool to
+// skip re-encoding positions that recur across games and rollouts, e.g. the
+// shared start of a batch of rollouts or the prev_state of sibling games.
+//
+// Each of the two caches keeps at most max_entries entries. Entries are only
+// told apart by their 64-bit key, so a hash collision would return another
+// board's encoding; this is assumed not to happen in practice.
+class EncodingCache {
+public:
+  EncodingCache(size_t max_entries, int max_cands);
+
+  // Copies the cached encode_board_state output into r. Returns false on miss.
+  bool get_board_state(size_t board_hash, int input_version, float *r);
+  void put_board_state(size_t board_hash, int input_version, const float *r);
+
+  // Copies the cached encode_valid_orders output of each of the 7 powers (or
+  // encode_valid_orders_all_powers output, with r_powers, if all_powers) into
+  // the [7, S, max_cands] r_order_idxs and [7, 81] r_loc_idxs. Returns false
+  // on miss.
+  bool get_valid_orders(size_t board_hash, int input_version, bool all_powers,
+                        int32_t *r_order_idxs, int8_t *r_loc_idxs,
+                        int64_t *r_powers);
+  void put_valid_orders(size_t board_hash, int input_version, bool all_powers,
+                        const int32_t *r_order_idxs, const int8_t *r_loc_idxs,
+                        const int64_t *r_powers);
+
+  // Hit and miss counts of each cache, and their sizes
+  std::map<std::string, int64_t> get_stats();
+
+  void clear();
+
+private:
+  // The valid orders of a board with the EOS_IDX padding of each row stripped
+  struct ValidOrders {
+    std::vector<int32_t> order_idxs;   // candidates of each row, in order
+    std::vector<uint16_t> row_lengths; // [7, S]
+    std::vector<int8_t> loc_idxs;      // [7, 81]
+    std::vector<int64_t> powers;       // [7, S], all_powers only
+  };
+
+  int max_cands_;
+  ShardedLruCache<std::vector<float>> board_states_;
+  ShardedLruCache<ValidOrders> valid_orders_;
+};
+
+} // namespace dipcc
@@ -38,6 +38,34 @@ void encode_board_state_pperm_matrix(const int *pperm, int input_version,
   }
 }
 
+void encode_board_state_pperms(GameState &state, int input_version,
+                               const int *pperms, int n_pperms, float *r) {
+  static_assert(MAX_INPUT_VERSION <= 3,
+                "Don't forget to update code here if necessary when changing "
+                "MAX_INPUT_VERSION");
+  if (input_version == 1) {
+    JFAIL("PowerPermutation not supported for input_version 1");
+  } else if (input_version == 2 || input_version == 3) {
+    encode_board_state_pperms_v2(state, pperms, n_pperms, r);
+  } else {
+    JFAIL("Unknown input version in encode_board_state_pperms");
+  }
+}
+
+void encode_board_state_pperm_channel_idxs(const int *pperm, int input_version,
+                                           int64_t *r) {
+  static_assert(MAX_INPUT_VERSION <= 3,
+                "Don't forget to update code here if necessary when changing "
+                "MAX_INPUT_VERSION");
+  if (input_version == 1) {
+    JFAIL("PowerPermutation not supported for input_version 1");
+  } else if (input_version == 2 || input_version == 3) {
+    encode_board_state_pperm_channel_idxs_v2(pperm, r);
+  } else {
+    JFAIL("Unknown input version in encode_board_state_pperm_channel_idxs");
+  }
+}
+
 std::vector<int> encoding_unit_ownership_idxs(int input_version) {
   static_assert(MAX_INPUT_VERSION <= 3,
                 "Don't forget to update code here if necessary when changing "
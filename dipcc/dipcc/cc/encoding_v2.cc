@@ -6,6 +6,8 @@ LICENSE file in the root directory of this source tree.
 */
 #include "encoding.h"
 
+#include <array>
+#include <cstring>
 #include <glog/logging.h>
 #include <pybind11/numpy.h>
 #include <pybind11/pybind11.h>
@@ -105,45 +107,119 @@ std::vector<int> encoding_sc_ownership_idxs_v2() {
           SV2_SC_GER, SV2_SC_RUS, SV2_SC_TUR};
 }
 
-void encode_board_state_v2(GameState &state, float *r) {
-  constexpr int input_version = 2;
-  int _enc_width = board_state_enc_width(input_version);
-  memset(r, 0, 81 * _enc_width * sizeof(float));
+namespace {
+
+// The channels of a location are encoded as a bitmask, bit j set if channel j
+// is 1, and expanded into floats a byte at a time
+constexpr uint64_t channel_bit(int channel) { return uint64_t(1) << channel; }
+
+// BYTE_FLOATS[b][k] is bit k of b, as a float
+const std::array<std::array<float, 8>, 256> BYTE_FLOATS = [] {
+  std::array<std::array<float, 8>, 256> r{};
+  for (int b = 0; b < 256; ++b) {
+    for (int k = 0; k < 8; ++k) {
+      r[b][k] = (b >> k) & 1;
+    }
+  }
+  return r;
+}();
+
+// Expands the 81 location channel masks into the [81, enc_width] encoding.
+// Specialized on the input version so that the width, and hence the number
+// of 8-float copies per location, is known at compile time.
+template <int input_version>
+void expand_channel_masks(const uint64_t *loc_masks, float *r) {
+  constexpr int _enc_width = board_state_enc_width(input_version);
+  static_assert(_enc_width <= 64, "Channel masks are 64 bits");
+  for (int i = 0; i < 81; ++i, r += _enc_width) {
+    uint64_t mask = loc_masks[i];
+    int j = 0;
+    for (; j + 8 <= _enc_width; j += 8) {
+      memcpy(r + j, BYTE_FLOATS[(mask >> j) & 0xff].data(), 8 * sizeof(float));
+    }
+    if (j < _enc_width) {
+      memcpy(r + j, BYTE_FLOATS[(mask >> j) & 0xff].data(),
+             (_enc_width - j) * sizeof(float));
+    }
+  }
+}
+
+// Channel masks of the channels that don't depend on the state: area type
+// and home centers
+const std::array<uint64_t, 81> &static_loc_masks_v2() {
+  static const std::array<uint64_t, 81> masks = [] {
+    std::array<uint64_t, 81> r{};
+    for (int i = 0; i < 81; ++i) {
+      Loc loc = LOCS[i];
+      r[i] = channel_bit(is_water(loc)   ? SV2_WATER
+                         : is_coast(loc) ? SV2_COAST
+                                         : SV2_LAND);
+    }
+    for (int p = 0; p < 7; ++p) {
+      for (Loc loc : home_centers(POWERS[p])) {
+        r[static_cast<int>(loc) - 1] |= channel_bit(SV2_HOME_AUS + p);
+      }
+    }
+    return r;
+  }();
+  return masks;
+}
+
+// Root locs of the supply centers
+const std::vector<Loc> &center_root_locs() {
+  static const std::vector<Loc> locs = [] {
+    std::vector<Loc> r;
+    for (Loc loc : LOCS) {
+      if (is_center(loc) && loc == root_loc(loc)) {
+        r.push_back(loc);
+      }
+    }
+    return r;
+  }();
+  return locs;
+}
+
+// Sets bits on the masks of loc and, if it's a coast, of its parent
+void set_loc_and_root(uint64_t *loc_masks, Loc loc, uint64_t bits) {
+  loc_masks[static_cast<int>(loc) - 1] |= bits;
+  Loc rloc = root_loc(loc);
+  if (loc != rloc) {
+    loc_masks[static_cast<int>(rloc) - 1] |= bits;
+  }
+}
+
+// First channels of the blocks of 7 per-power channels, which power
+// permutations act on
+constexpr std::array<int, 4> POWER_CHANNEL_BLOCKS_V2 = {
+    SV2_AUS, SV2_DIS_AUS, SV2_SC_AUS, SV2_HOME_AUS};
+
+// Channel masks of each location of state
+std::array<uint64_t, 81> encode_loc_masks_v2(GameState &state) {
+  std::array<uint64_t, 81> loc_masks = static_loc_masks_v2();
 
   //////////////////////////////////////
   // unit type, unit power, removable //
   //////////////////////////////////////
 
-  std::vector<bool> filled(81, false);
+  std::array<bool, 7> removable{};
+  if (state.get_phase().season == 'W') {
+    for (int p = 0; p < 7; ++p) {
+      removable[p] = state.get_n_builds(POWERS[p]) < 0;
+    }
+  }
 
-  for (auto p : state.get_units()) {
-    OwnedUnit unit = p.second;
+  for (auto &p : state.get_units()) {
+    const OwnedUnit &unit = p.second;
     JCHECK(unit.type != UnitType::NONE, "UnitType::NONE");
     JCHECK(unit.loc != Loc::NONE, "Loc::NONE");
     JCHECK(unit.power != Power::NONE, "Power::NONE");
 
-    bool removable =
-        state.get_phase().season == 'W' && state.get_n_builds(unit.power) < 0;
-
     int power_i = static_cast<int>(unit.power) - 1;
-
-    size_t loc_i = static_cast<int>(unit.loc) - 1;
-    P_BOARD_STATE(r, loc_i,
-                  unit.type == UnitType::ARMY ? SV2_ARMY : SV2_FLEET) = 1;
-    P_BOARD_STATE(r, loc_i, SV2_AUS + power_i) = 1;
-    P_BOARD_STATE(r, loc_i, SV2_REMOVABLE) = static_cast<float>(removable);
-    filled[loc_i] = true;
-
-    // Mark parent if it's a coast
-    Loc rloc = root_loc(unit.loc);
-    if (unit.loc != rloc) {
-      size_t rloc_i = static_cast<int>(rloc) - 1;
-      P_BOARD_STATE(r, rloc_i,
-                    unit.type == UnitType::ARMY ? SV2_ARMY : SV2_FLEET) = 1;
-      P_BOARD_STATE(r, rloc_i, SV2_AUS + power_i) = 1;
-      P_BOARD_STATE(r, rloc_i, SV2_REMOVABLE) = static_cast<float>(removable);
-      filled[rloc_i] = true;
-    }
+    uint64_t bits =
+        channel_bit(unit.type == UnitType::ARMY ? SV2_ARMY : SV2_FLEET) |
+        channel_bit(SV2_AUS + power_i) |
+        (removable[power_i] ? channel_bit(SV2_REMOVABLE) : 0);
+    set_loc_and_root(loc_masks.data(), unit.loc, bits);
   }
 
   ///////////////
@@ -155,8 +231,7 @@ void encode_board_state_v2(GameState &state, float *r) {
       auto order = p.second.begin();
       if (order->get_type() == OrderType::B) {
         Loc loc = order->get_unit().loc;
-        size_t loc_i = static_cast<int>(loc) - 1;
-        P_BOARD_STATE(r, loc_i, SV2_BUILDABLE) = 1;
+        loc_masks[static_cast<int>(loc) - 1] |= channel_bit(SV2_BUILDABLE);
       }
     }
   }
@@ -165,77 +240,88 @@ void encode_board_state_v2(GameState &state, float *r) {
   // dislodged units //
   /////////////////////
 
-  std::fill(filled.begin(), filled.end(), false);
   for (OwnedUnit unit : state.get_dislodged_units()) {
-    size_t loc_i = static_cast<int>(unit.loc) - 1;
     int power_i = static_cast<int>(unit.power) - 1;
-    P_BOARD_STATE(r, loc_i,
-                  unit.type == UnitType::ARMY ? SV2_DIS_ARMY : SV2_DIS_FLEET) =
-        1;
-    P_BOARD_STATE(r, loc_i, SV2_DIS_AUS + power_i) = 1;
-    filled[loc_i] = true;
-
-    // Mark parent if it's a coast
-    Loc rloc = root_loc(unit.loc);
-    if (unit.loc != rloc) {
-      size_t rloc_i = static_cast<int>(rloc) - 1;
-      P_BOARD_STATE(r, rloc_i,
-                    unit.type == UnitType::ARMY ? SV2_DIS_ARMY
-                                                : SV2_DIS_FLEET) = 1;
-      P_BOARD_STATE(r, rloc_i, SV2_DIS_AUS + power_i) = 1;
-      filled[rloc_i] = true;
-    }
-  }
-
-  ///////////////
-  // Area type //
-  ///////////////
-
-  for (int i = 0; i < 81; ++i) {
-    Loc loc = LOCS[i];
-    if (is_water(loc)) {
-      P_BOARD_STATE(r, i, SV2_WATER) = 1;
-    } else if (is_coast(loc)) {
-      P_BOARD_STATE(r, i, SV2_COAST) = 1;
-    } else {
-      P_BOARD_STATE(r, i, SV2_LAND) = 1;
-    }
+    uint64_t bits =
+        channel_bit(unit.type == UnitType::ARMY ? SV2_DIS_ARMY
+                                                : SV2_DIS_FLEET) |
+        channel_bit(SV2_DIS_AUS + power_i);
+    set_loc_and_root(loc_masks.data(), unit.loc, bits);
   }
 
   ///////////////////
   // supply center //
   ///////////////////
 
-  auto centers = state.get_centers();
-  for (int i = 0; i < 81; ++i) {
-    Loc loc = LOCS[i];
-    if (!is_center(loc) || loc != root_loc(loc)) {
-      continue;
-    }
-
+  const auto &centers = state.get_centers();
+  for (Loc loc : center_root_locs()) {
     auto it = centers.find(loc);
     Power power = it == centers.end() ? Power::NONE : it->second;
     int power_i = power == Power::NONE ? 7 : (static_cast<int>(power) - 1);
 
     for (Loc cloc : expand_coasts(loc)) {
-      int cloc_i = static_cast<int>(cloc) - 1;
-      P_BOARD_STATE(r, cloc_i, SV2_SC_AUS + power_i) = 1;
+      loc_masks[static_cast<int>(cloc) - 1] |=
+          channel_bit(SV2_SC_AUS + power_i);
     }
   }
 
-  /////////////////
-  // home center //
-  /////////////////
+  return loc_masks;
+}
+
+// Moves the bits of the per-power channels of each location mask as
+// multiplying by the encode_board_state_pperm_matrix_v2 of pperm would: power
+// p's channels become power pperm[p]'s
+void permute_loc_masks_v2(const uint64_t *loc_masks, const int *pperm,
+                          uint64_t *r) {
+  // permuted_bits[b] is the 7 bits of a block b with the powers permuted
+  std::array<uint64_t, 128> permuted_bits;
+  permuted_bits[0] = 0;
   for (int p = 0; p < 7; ++p) {
-    Power power = POWERS[p];
-    const std::vector<Loc> &hcs = home_centers(power);
-    for (Loc loc : hcs) {
-      int loc_i = static_cast<int>(loc) - 1;
-      int power_i = static_cast<int>(power) - 1;
-      P_BOARD_STATE(r, loc_i, SV2_HOME_AUS + power_i) = 1;
+    for (int b = 0; b < (1 << p); ++b) {
+      permuted_bits[b | (1 << p)] = permuted_bits[b] | channel_bit(pperm[p]);
     }
   }
+  uint64_t power_bits = 0;
+  for (int block : POWER_CHANNEL_BLOCKS_V2) {
+    power_bits |= uint64_t(0x7f) << block;
+  }
+  for (int i = 0; i < 81; ++i) {
+    uint64_t mask = loc_masks[i];
+    uint64_t permuted = mask & ~power_bits;
+    for (int block : POWER_CHANNEL_BLOCKS_V2) {
+      permuted |= permuted_bits[(mask >> block) & 0x7f] << block;
+    }
+    r[i] = permuted;
+  }
+}
+
+} // namespace
+
+void encode_board_state_v2(GameState &state, float *r) {
+  expand_channel_masks<2>(encode_loc_masks_v2(state).data(), r);
+}
 
-} // encode_board_state_v2
+void encode_board_state_pperms_v2(GameState &state, const int *pperms,
+                                  int n_pperms, float *r) {
+  constexpr int _enc_width = board_state_enc_width(2);
+  std::array<uint64_t, 81> loc_masks = encode_loc_masks_v2(state);
+  std::array<uint64_t, 81> permuted;
+  for (int k = 0; k < n_pperms; ++k) {
+    permute_loc_masks_v2(loc_masks.data(), pperms + 7 * k, permuted.data());
+    expand_channel_masks<2>(permuted.data(), r + k * 81 * _enc_width);
+  }
+}
+
+void encode_board_state_pperm_channel_idxs_v2(const int *pperm, int64_t *r) {
+  constexpr int _enc_width = board_state_enc_width(2);
+  for (int j = 0; j < _enc_width; ++j) {
+    r[j] = j;
+  }
+  for (int block : POWER_CHANNEL_BLOCKS_V2) {
+    for (int p = 0; p < 7; ++p) {
+      r[block + pperm[p]] = block + p;
+    }
+  }
+}
 
 } // namespace dipcc
@@ -26,14 +26,21 @@ namespace dipcc {
 void Game::set_orders(const std::string &power_str,
                       const std::vector<std::string> &order_strs) {
   Power power = power_from_str(power_str);
-  auto &staged_orders = staged_orders_[power];
-
+  std::vector<Order> orders;
+  orders.reserve(order_strs.size());
   for (const std::string &order_str : order_strs) {
     if (order_str == "WAIVE") {
       continue;
     }
-    Order order(order_str);
+    orders.emplace_back(order_str);
+  }
+  set_orders(power, orders);
+}
+
+void Game::set_orders(Power power, const std::vector<Order> &orders) {
+  auto &staged_orders = staged_orders_[power];
 
+  for (const Order &order : orders) {
     // Check that order is legal for this power
     if (!safe_contains(state_->get_orderable_locations(), power,
                        root_loc(order.get_unit().loc))) {
@@ -64,15 +71,18 @@ void Game::set_all_orders(
   }
 }
 
-void Game::process() {
-  state_history_[state_->get_phase()] = state_;
-  order_history_[state_->get_phase()] =
+void Game::record_current_phase() {
+  state_history_.set(state_->get_phase(), state_);
+  order_history_.set(
+      state_->get_phase(),
       std::make_shared<const std::unordered_map<Power, std::vector<Order>>>(
-          staged_orders_);
+          staged_orders_));
+}
 
+template <typename MakeNextState>
+void Game::advance_state(MakeNextState make_next_state) {
   try {
-    state_ = std::make_shared<GameState>(
-        state_->process(staged_orders_, exception_on_convoy_paradox_));
+    state_ = std::make_shared<GameState>(make_next_state());
     maybe_early_exit();
   } catch (const ConvoyParadoxException &e) {
     throw e;
@@ -88,6 +98,45 @@ void Game::process() {
   staged_orders_.clear();
 }
 
+void Game::process() {
+  record_current_phase();
+  advance_state([this] {
+    return state_->process(staged_orders_, exception_on_convoy_paradox_);
+  });
+}
+
+void Game::process_batch(const std::vector<Game *> &games) {
+  std::vector<GameState *> states;
+  std::vector<const std::unordered_map<Power, std::vector<Order>> *> orders;
+  states.reserve(games.size());
+  orders.reserve(games.size());
+  for (Game *game : games) {
+    states.push_back(game->state_.get());
+    orders.push_back(&game->staged_orders_);
+  }
+
+  // If batch adjudication fails, each game is processed on its own instead,
+  // so that the failing one gets dumped
+  std::vector<GameState> next;
+  std::vector<bool> done;
+  try {
+    done = GameState::process_m_uncontested_batch(states, orders, next);
+  } catch (const std::exception &e) {
+    LOG(ERROR) << "Batch adjudication exception: " << e.what();
+    done.assign(games.size(), false);
+  }
+
+  for (int i = 0; i < games.size(); ++i) {
+    Game *game = games[i];
+    if (!done[i]) {
+      game->process();
+      continue;
+    }
+    game->record_current_phase();
+    game->advance_state([&] { return std::move(next[i]); });
+  }
+}
+
 GameState &Game::get_state() { return *state_; }
 const GameState &Game::get_state() const { return *state_; }
 
@@ -95,8 +144,7 @@ std::unordered_map<Power, std::vector<Loc>> Game::get_orderable_locations() {
   return state_->get_orderable_locations();
 }
 
-const std::unordered_map<Loc, std::set<Order>> &
-Game::get_all_possible_orders() {
+const PossibleOrders &Game::get_all_possible_orders() {
   return state_->get_all_possible_orders();
 }
 
@@ -193,7 +241,7 @@ string Game::to_json() {
   j["scoring_system"] = SCORING_STRINGS[static_cast<int>(scoring_system_)];
   j["is_full_press"] = is_full_press_;
 
-  for (auto &q : state_history_) {
+  for (auto &q : state_history_.in_order()) {
     GameState &state = *q.second;
 
     json phase;
@@ -202,7 +250,7 @@ string Game::to_json() {
     for (auto &p : POWERS) {
       phase["orders"][power_str(p)] = vector<string>();
     }
-    for (auto &p : *order_history_[state.get_phase()]) {
+    for (auto &p : *order_history_.at(state.get_phase())) {
       string power = power_str(p.first);
       vector<Order> action(p.second);
       std::sort(action.begin(), action.end(), loc_order_cmp);
@@ -211,15 +259,19 @@ string Game::to_json() {
       }
     }
     phase["messages"] = json::value_type::array(); // mila compat
-    for (auto &[time_sent, msg] : message_history_[state.get_phase()]) {
-      phase["messages"].push_back(msg);
+    if (auto messages = message_history_.find(state.get_phase())) {
+      for (auto &[time_sent, msg] : *messages) {
+        phase["messages"].push_back(msg);
+      }
     }
 
     phase["results"] = json::value_type::object(); // mila compat
 
     phase["logs"] = json::value_type::array();
-    for (auto &data : logs_[state.get_phase()]) {
-      phase["logs"].push_back(*data);
+    if (auto logs = logs_.find(state.get_phase())) {
+      for (auto &data : *logs) {
+        phase["logs"].push_back(*data);
+      }
     }
 
     j["phases"].push_back(phase);
@@ -232,12 +284,16 @@ string Game::to_json() {
   current["orders"] = json::value_type::object();  // mila compat
   current["results"] = json::value_type::object(); // mila compat
   current["messages"] = json::value_type::array(); // mila compat
-  for (auto &[time_sent, msg] : message_history_[state_->get_phase()]) {
-    current["messages"].push_back(msg);
+  if (auto messages = message_history_.find(state_->get_phase())) {
+    for (auto &[time_sent, msg] : *messages) {
+      current["messages"].push_back(msg);
+    }
   }
   current["logs"] = json::value_type::array();
-  for (auto &data : logs_[state_->get_phase()]) {
-    current["logs"].push_back(*data);
+  if (auto logs = logs_.find(state_->get_phase())) {
+    for (auto &data : *logs) {
+      current["logs"].push_back(*data);
+    }
   }
   for (auto &[power, orders] : staged_orders_) {
     for (auto &order : orders) {
@@ -300,7 +356,8 @@ Game::Game(const string &json_str) {
     string phase_str;
     for (auto &j_phase : j["phases"]) {
       phase_str = j_phase["name"];
-      state_history_[phase_str] = std::make_shared<GameState>(j_phase["state"]);
+      state_history_.set(phase_str,
+                         std::make_shared<GameState>(j_phase["state"]));
 
       std::unordered_map<Power, std::vector<Order>> orders_this_phase;
       for (auto &it : j_phase["orders"].items()) {
@@ -309,21 +366,24 @@ Game::Game(const string &json_str) {
           orders_this_phase[power].push_back(Order(j_order));
         }
       }
-      order_history_[phase_str] =
+      order_history_.set(
+          phase_str,
           std::make_shared<const std::unordered_map<Power, std::vector<Order>>>(
-              orders_this_phase);
+              orders_this_phase));
 
       if (j_phase.find("messages") != j_phase.end()) {
         for (auto &j_msg : j_phase["messages"]) {
-          JCHECK(message_history_[phase_str].find(j_msg["time_sent"]) ==
-                     message_history_[phase_str].end(),
+          auto &phase_messages = message_history_.mutable_at(phase_str);
+          JCHECK(phase_messages.find(j_msg["time_sent"]) ==
+                     phase_messages.end(),
                  "from_json duplicate message timestamps not allowed");
-          message_history_[phase_str][j_msg["time_sent"]] = j_msg;
+          phase_messages[j_msg["time_sent"]] = j_msg;
         }
       }
       if (j_phase.find("logs") != j_phase.end()) {
         for (auto &data : j_phase["logs"]) {
-          logs_[phase_str].push_back(std::make_shared<const std::string>(data));
+          logs_.mutable_at(phase_str).push_back(
+              std::make_shared<const std::string>(data));
         }
       }
     }
@@ -331,7 +391,8 @@ Game::Game(const string &json_str) {
     string phase_str;
     for (auto &j_state : j["state_history"].items()) {
       phase_str = j_state.key();
-      state_history_[phase_str] = std::make_shared<GameState>(j_state.value());
+      state_history_.set(phase_str,
+                         std::make_shared<GameState>(j_state.value()));
 
       std::unordered_map<Power, std::vector<Order>> orders_this_phase;
       if (j["order_history"].find(phase_str) != j["order_history"].end()) {
@@ -342,31 +403,31 @@ Game::Game(const string &json_str) {
           }
         }
       }
-      order_history_[phase_str] =
+      order_history_.set(
+          phase_str,
           std::make_shared<const std::unordered_map<Power, std::vector<Order>>>(
-              orders_this_phase);
+              orders_this_phase));
 
       if (j.find("message_history") == j.end() ||
           j["message_history"].find(phase_str) == j["message_history"].end()) {
         continue;
       }
       for (auto &j_msg : j["message_history"][phase_str]) {
-        JCHECK(message_history_[phase_str].find(j_msg["time_sent"]) ==
-                   message_history_[phase_str].end(),
+        auto &phase_messages = message_history_.mutable_at(phase_str);
+        JCHECK(phase_messages.find(j_msg["time_sent"]) == phase_messages.end(),
                "from_json duplicate message timestamps not allowed");
-        message_history_[phase_str][j_msg["time_sent"]] = j_msg;
+        phase_messages[j_msg["time_sent"]] = j_msg;
       }
     }
   }
 
   // Pop last state as current state
-  auto it = state_history_.rbegin();
-  Phase current_phase = it->first;
-  state_ = it->second;
-  state_history_.erase(current_phase);
-  if (order_history_.find(current_phase) != order_history_.end()) {
-    staged_orders_ = *order_history_[current_phase];
-    order_history_.erase(current_phase);
+  Phase current_phase = state_history_.last().first;
+  state_ = state_history_.last().second;
+  state_history_.erase_from(current_phase);
+  if (auto orders = order_history_.find(current_phase)) {
+    staged_orders_ = **orders;
+    order_history_.erase_from(current_phase);
   }
 
   // metadata
@@ -415,7 +476,7 @@ Phase Game::phase_of_last_message_at_or_before(const uint64_t timestamp) const {
       return it->first;
   }
   if (state_history_.size() > 0)
-    return state_history_.begin()->first;
+    return state_history_.first().first;
   return state_->get_phase();
 }
 
@@ -444,21 +505,17 @@ void Game::rollback_to_phase(Phase phase, bool preserve_phase_messages,
                              bool preserve_phase_orders,
                              bool preserve_phase_logs) {
   // delete message_history_ including (?) and after phase
-  auto m_it = message_history_.find(phase);
-  if (preserve_phase_messages && m_it != message_history_.end()) {
-    ++m_it;
-  }
-  while (m_it != message_history_.end()) {
-    m_it = message_history_.erase(m_it);
+  if (preserve_phase_messages) {
+    message_history_.erase_after(phase);
+  } else {
+    message_history_.erase_from(phase);
   }
 
   // delete logs_ including (?) and after phase
-  auto l_it = logs_.find(phase);
-  if (preserve_phase_logs && l_it != logs_.end()) {
-    ++l_it;
-  }
-  while (l_it != logs_.end()) {
-    l_it = logs_.erase(l_it);
+  if (preserve_phase_logs) {
+    logs_.erase_after(phase);
+  } else {
+    logs_.erase_from(phase);
   }
 
   // set current state
@@ -468,23 +525,18 @@ void Game::rollback_to_phase(Phase phase, bool preserve_phase_messages,
   if (state_->get_phase() == phase) {
     return;
   }
-  auto s_it = state_history_.find(phase);
-  JCHECK(s_it != state_history_.end(), "rollback_to_phase phase not found");
-  state_ = s_it->second;
+  auto state = state_history_.find(phase);
+  JCHECK(state != nullptr, "rollback_to_phase phase not found");
+  state_ = *state;
 
   // delete state_history_ including and after phase
-  while (s_it != state_history_.end()) {
-    s_it = state_history_.erase(s_it);
-  }
+  state_history_.erase_from(phase);
 
   // delete order_history_ including and after phase
-  auto o_it = order_history_.find(phase);
   if (preserve_phase_orders) {
-    staged_orders_ = *(o_it->second);
-  }
-  while (o_it != order_history_.end()) {
-    o_it = order_history_.erase(o_it);
+    staged_orders_ = *order_history_.at(phase);
   }
+  order_history_.erase_from(phase);
 }
 
 void Game::rollback_messages_to_timestamp_end(const uint64_t timestamp) {
@@ -492,27 +544,32 @@ void Game::rollback_messages_to_timestamp_end(const uint64_t timestamp) {
 }
 
 void Game::rollback_messages_to_timestamp_start(const uint64_t timestamp) {
-  for (auto &[phase, messages] : message_history_) {
-    (void)phase;
-    for (auto it = messages.begin(); it != messages.end(); ++it) {
-      if (it->first >= timestamp) {
-        messages.erase(it, messages.end());
-        break;
-      }
+  // Find the affected phases first so that only those are copied out of the
+  // shared history
+  vector<Phase> phases;
+  for (auto it = message_history_.rbegin(); it != message_history_.rend();
+       ++it) {
+    if (it->second.lower_bound(timestamp) != it->second.end()) {
+      phases.push_back(it->first);
     }
   }
+  for (Phase phase : phases) {
+    auto &messages = message_history_.mutable_at(phase);
+    messages.erase(messages.lower_bound(timestamp), messages.end());
+  }
 }
 
 void Game::delete_message_at_timestamp(const uint64_t timestamp) {
-  for (auto &[phase, messages] : message_history_) {
-    (void)phase;
-    for (auto it = messages.begin(); it != messages.end(); ++it) {
-      if (it->first == timestamp) {
-        messages.erase(it);
-        break;
-      }
+  vector<Phase> phases;
+  for (auto it = message_history_.rbegin(); it != message_history_.rend();
+       ++it) {
+    if (it->second.find(timestamp) != it->second.end()) {
+      phases.push_back(it->first);
     }
   }
+  for (Phase phase : phases) {
+    message_history_.mutable_at(phase).erase(timestamp);
+  }
 }
 
 uint64_t Game::get_last_message_timestamp() const {
@@ -529,7 +586,7 @@ uint64_t Game::get_last_message_timestamp() const {
 GameState *Game::get_last_movement_phase() {
   for (auto it = state_history_.rbegin(); it != state_history_.rend(); ++it) {
     if (it->first.phase_type == 'M') {
-      return state_history_[it->first].get();
+      return it->second.get();
     }
   }
 
@@ -538,8 +595,8 @@ GameState *Game::get_last_movement_phase() {
 }
 
 void Game::clear_old_all_possible_orders() {
-  for (auto &p : state_history_) {
-    p.second->clear_all_possible_orders();
+  for (auto it = state_history_.rbegin(); it != state_history_.rend(); ++it) {
+    it->second->clear_all_possible_orders();
   }
 }
 
@@ -549,9 +606,8 @@ int Game::get_consecutive_years_without_sc_change() const {
   // If it's not spring, check against the current year (i.e. handle us being
   // on a winter where an SC change did happen)
   {
-    auto it = state_history_.find(Phase('S', phase.year, 'M'));
-    if (it != state_history_.end() &&
-        state_->get_centers() != it->second->get_centers()) {
+    auto state = state_history_.find(Phase('S', phase.year, 'M'));
+    if (state != nullptr && state_->get_centers() != (*state)->get_centers()) {
       return 0;
     }
   }
@@ -559,9 +615,8 @@ int Game::get_consecutive_years_without_sc_change() const {
   int years_without_change = 0;
   int next_year_to_check = phase.year - 1;
   while (true) {
-    auto it = state_history_.find(Phase('S', next_year_to_check, 'M'));
-    if (it == state_history_.end() ||
-        state_->get_centers() != it->second->get_centers()) {
+    auto state = state_history_.find(Phase('S', next_year_to_check, 'M'));
+    if (state == nullptr || state_->get_centers() != (*state)->get_centers()) {
       return years_without_change;
     }
     years_without_change += 1;
@@ -591,7 +646,7 @@ void Game::maybe_early_exit() {
 void Game::add_message(Power sender, PowerOrAll recipient,
                        const std::string &body, uint64_t time_sent,
                        bool increment_on_collision) {
-  auto &phase_messages = message_history_[state_->get_phase()];
+  auto &phase_messages = message_history_.mutable_at(state_->get_phase());
   if (phase_messages.find(time_sent) != phase_messages.end()) {
     if (increment_on_collision) {
       while (phase_messages.find(++time_sent) !=
@@ -606,8 +661,8 @@ void Game::add_message(Power sender, PowerOrAll recipient,
 }
 
 void Game::add_log(const std::string &data) {
-  logs_[state_->get_phase()].push_back(
-      std::make_shared<const std::string>(data));
+  logs_.mutable_at(state_->get_phase())
+      .push_back(std::make_shared<const std::string>(data));
 }
 
 Scoring Game::get_scoring_system() const { return scoring_system_; }
@@ -618,15 +673,14 @@ std::optional<Phase> Game::get_next_phase(Phase from) {
   if (from == state_->get_phase()) {
     return {};
   }
-  auto it = state_history_.find(from);
-  if (it == state_history_.end()) {
-    JFAIL("get_next_phase phase not found");
-  }
-  if (from == state_history_.rbegin()->first) {
-    return state_->get_phase();
+  Phase next = state_->get_phase();
+  for (auto it = state_history_.rbegin(); it != state_history_.rend(); ++it) {
+    if (it->first == from) {
+      return next;
+    }
+    next = it->first;
   }
-  ++it;
-  return it->first;
+  JFAIL("get_next_phase phase not found");
 }
 
 std::optional<Phase> Game::get_prev_phase(Phase from) {
@@ -634,18 +688,21 @@ std::optional<Phase> Game::get_prev_phase(Phase from) {
     return {};
   }
   if (from == state_->get_phase()) {
-    return state_history_.rbegin()->first;
+    return state_history_.last().first;
   }
-  auto it = state_history_.find(from);
-  if (it == state_history_.end()) {
-    JFAIL("get_prev_phase phase not found");
+  for (auto it = state_history_.rbegin(); it != state_history_.rend(); ++it) {
+    if (it->first == from) {
+      ++it;
+      JCHECK(it != state_history_.rend(), "get_prev_phase no previous phase");
+      return it->first;
+    }
   }
-  return std::prev(it, 1)->first;
+  JFAIL("get_prev_phase phase not found");
 }
 
 size_t Game::compute_order_history_hash() const {
   std::set<size_t> order_hashes;
-  for (const auto [phase, phase_orders] : order_history_) {
+  for (const auto [phase, phase_orders] : order_history_.in_order()) {
     if (phase.phase_type != 'M')
       continue;
     const auto state = state_history_.at(phase);
@@ -719,7 +776,7 @@ Game::get_supply_center_power(const std::string &loc_str) {
   loc = root_loc(loc);
   if (!is_center(loc))
     return std::nullopt;
-  const std::map<Loc, Power> &centers = state_->get_centers();
+  const LocMap<Power> &centers = state_->get_centers();
   auto it = centers.find(loc);
   if (it == centers.end())
     return std::nullopt;
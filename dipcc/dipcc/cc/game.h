@@ -25,6 +25,7 @@ LICENSE file in the root directory of this source tree.
 #include "message.h"
 #include "order.h"
 #include "phase.h"
+#include "phase_history.h"
 #include "power.h"
 #include "scoring.h"
 #include "thirdparty/nlohmann/json.hpp"
@@ -42,6 +43,9 @@ public:
   void set_orders(const std::string &power,
                   const std::vector<std::string> &orders);
 
+  // Same, for already parsed orders
+  void set_orders(Power power, const std::vector<Order> &orders);
+
   void set_all_orders(
       const std::map<std::string, std::vector<std::string>> &orders_by_power);
 
@@ -49,12 +53,17 @@ public:
 
   void process();
 
+  // Equivalent to calling process() on each game, but movement phases that
+  // have no contested locs are adjudicated together in one batch (see
+  // GameState::process_m_uncontested_batch).
+  static void process_batch(const std::vector<Game *> &games);
+
   GameState &get_state();
   const GameState &get_state() const;
 
   std::unordered_map<Power, std::vector<Loc>> get_orderable_locations();
 
-  const std::unordered_map<Loc, std::set<Order>> &get_all_possible_orders();
+  const PossibleOrders &get_all_possible_orders();
 
   bool is_game_done() const;
 
@@ -89,19 +98,10 @@ public:
 
   uint64_t get_last_message_timestamp() const;
 
-  std::map<Phase, std::shared_ptr<GameState>> &get_state_history() {
+  const PhaseHistory<std::shared_ptr<GameState>> &get_state_history() const {
     return state_history_;
   }
-  std::map<Phase,
-           std::shared_ptr<const std::unordered_map<Power, std::vector<Order>>>>
-      &get_order_history() {
-    return order_history_;
-  }
-  const std::map<Phase, std::shared_ptr<GameState>> &get_state_history() const {
-    return state_history_;
-  }
-  const std::map<
-      Phase,
+  const PhaseHistory<
       std::shared_ptr<const std::unordered_map<Power, std::vector<Order>>>> &
   get_order_history() const {
     return order_history_;
@@ -135,7 +135,7 @@ public:
 
   bool is_full_press() const { return is_full_press_; }
 
-  std::map<Phase, std::map<uint64_t, Message>> &get_message_history() {
+  const PhaseHistory<std::map<uint64_t, Message>> &get_message_history() const {
     return message_history_;
   }
 
@@ -214,20 +214,28 @@ public:
 
 private:
   void crash_dump();
+  void record_current_phase();
   void maybe_early_exit();
 
+  // Sets the state to make_next_state() and clears the staged orders. If
+  // that throws, dumps the game before rethrowing.
+  template <typename MakeNextState>
+  void advance_state(MakeNextState make_next_state);
+
   void rollback_to_phase(Phase phase, bool preserve_phase_messages,
                          bool preserve_phase_orders, bool preserve_phase_logs);
 
   // Members
   std::shared_ptr<GameState> state_;
   std::unordered_map<Power, std::vector<Order>> staged_orders_;
-  std::map<Phase, std::shared_ptr<GameState>> state_history_;
-  std::map<Phase,
-           std::shared_ptr<const std::unordered_map<Power, std::vector<Order>>>>
+  // Past phases are immutable, so the histories are persistent chains that
+  // are shared between copies of a Game rather than copied with it.
+  PhaseHistory<std::shared_ptr<GameState>> state_history_;
+  PhaseHistory<
+      std::shared_ptr<const std::unordered_map<Power, std::vector<Order>>>>
       order_history_;
-  std::map<Phase, std::vector<std::shared_ptr<const std::string>>> logs_;
-  std::map<Phase, std::map<uint64_t, Message>> message_history_;
+  PhaseHistory<std::vector<std::shared_ptr<const std::string>>> logs_;
+  PhaseHistory<std::map<uint64_t, Message>> message_history_;
   int draw_on_stalemate_years_ = -1;
   bool exception_on_convoy_paradox_ = false;
   std::unordered_map<std::string, std::string> metadata_;
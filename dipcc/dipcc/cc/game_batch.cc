@@ -0,0 +1,156 @@
+/*
+Copyright (c) Meta Platforms, Inc. and affiliates.
+
+This source code is licensed under the MIT license found in the
+LICENSE file in the root directory of this source tree.
+*/
+#include "game_batch.h"
+#include "checks.h"
+#include "power.h"
+
+using namespace std;
+
+namespace dipcc {
+
+int64_t phase_sort_key(const Phase &phase) {
+  if (phase.phase_type == 'C') {
+    return 100000 * 9;
+  }
+  int64_t season = phase.season == 'S' ? 0 : phase.season == 'F' ? 1 : 2;
+  int64_t type = phase.phase_type == 'M' ? 0 : phase.phase_type == 'R' ? 1 : 2;
+  return (static_cast<int64_t>(phase.year) - 1900) * 9 + season * 3 + type;
+}
+
+GameBatch::GameBatch(const Game &game, int n_repeats) {
+  games_.reserve(n_repeats);
+  for (int i = 0; i < n_repeats; ++i) {
+    games_.emplace_back(game);
+    games_.back().game_id += "_" + std::to_string(i);
+  }
+}
+
+vector<Game *> GameBatch::get_games() {
+  vector<Game *> r;
+  r.reserve(games_.size());
+  for (Game &game : games_) {
+    r.push_back(&game);
+  }
+  return r;
+}
+
+vector<Game *> GameBatch::get_games(const vector<int64_t> &game_idxs) {
+  vector<Game *> r;
+  r.reserve(game_idxs.size());
+  for (int64_t i : game_idxs) {
+    r.push_back(&games_.at(i));
+  }
+  return r;
+}
+
+torch::Tensor GameBatch::is_done() const {
+  torch::Tensor r = torch::empty({static_cast<long>(games_.size())},
+                                 torch::kBool);
+  bool *p = r.data_ptr<bool>();
+  for (size_t i = 0; i < games_.size(); ++i) {
+    p[i] = games_[i].is_game_done();
+  }
+  return r;
+}
+
+torch::Tensor GameBatch::phase_keys() const {
+  torch::Tensor r = torch::empty({static_cast<long>(games_.size())},
+                                 torch::kLong);
+  int64_t *p = r.data_ptr<int64_t>();
+  for (size_t i = 0; i < games_.size(); ++i) {
+    p[i] = phase_sort_key(games_[i].get_state().get_phase());
+  }
+  return r;
+}
+
+vector<string> GameBatch::phases() const {
+  vector<string> r;
+  r.reserve(games_.size());
+  for (const Game &game : games_) {
+    r.push_back(game.get_state().get_phase().to_string());
+  }
+  return r;
+}
+
+torch::Tensor GameBatch::get_scores() const {
+  torch::Tensor r = torch::empty(
+      {static_cast<long>(games_.size()), NUM_POWERS}, torch::kFloat32);
+  float *p = r.data_ptr<float>();
+  for (size_t i = 0; i < games_.size(); ++i) {
+    vector<float> scores = games_[i].get_scores();
+    std::copy(scores.begin(), scores.end(), p + i * NUM_POWERS);
+  }
+  return r;
+}
+
+torch::Tensor GameBatch::get_scores(Scoring scoring_system) const {
+  torch::Tensor r = torch::empty(
+      {static_cast<long>(games_.size()), NUM_POWERS}, torch::kFloat32);
+  float *p = r.data_ptr<float>();
+  for (size_t i = 0; i < games_.size(); ++i) {
+    vector<float> scores = games_[i].get_scores(scoring_system);
+    std::copy(scores.begin(), scores.end(), p + i * NUM_POWERS);
+  }
+  return r;
+}
+
+string GameBatch::min_ongoing_phase() const {
+  const Game *min_game = nullptr;
+  for (const Game &game : games_) {
+    if (!game.is_game_done() &&
+        (min_game == nullptr || game.get_state().get_phase() <
+                                    min_game->get_state().get_phase())) {
+      min_game = &game;
+    }
+  }
+  return min_game == nullptr ? ""
+                             : min_game->get_state().get_phase().to_string();
+}
+
+vector<int64_t>
+GameBatch::ongoing_game_idxs_at_phase(const std::string &phase_str) {
+  Phase phase(phase_str);
+  vector<int64_t> r;
+  for (size_t i = 0; i < games_.size(); ++i) {
+    if (!games_[i].is_game_done() &&
+        games_[i].get_state().get_phase() == phase) {
+      r.push_back(i);
+    }
+  }
+  return r;
+}
+
+void GameBatch::set_orders(const vector<int64_t> &game_idxs,
+                           const vector<vector<vector<string>>> &orders) {
+  JCHECK(game_idxs.size() == orders.size(),
+         "GameBatch::set_orders got " + std::to_string(orders.size()) +
+             " orders for " + std::to_string(game_idxs.size()) + " games");
+  for (size_t i = 0; i < game_idxs.size(); ++i) {
+    JCHECK(orders[i].size() == NUM_POWERS,
+           "GameBatch::set_orders expects orders for each of the powers");
+    Game &game = games_.at(game_idxs[i]);
+    for (int p = 0; p < NUM_POWERS; ++p) {
+      game.set_orders(power_str(POWERS[p]), orders[i][p]);
+    }
+  }
+}
+
+void GameBatch::process(const vector<int64_t> &game_idxs) {
+  Game::process_batch(get_games(game_idxs));
+}
+
+void GameBatch::process() {
+  vector<Game *> games;
+  for (Game &game : games_) {
+    if (!game.is_game_done()) {
+      games.push_back(&game);
+    }
+  }
+  Game::process_batch(games);
+}
+
+} // namespace dipcc
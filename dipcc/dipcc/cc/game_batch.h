@@ -0,0 +1,78 @@
+/*
+Copyright (c) Meta Platforms, Inc. and affiliates.
+
+This source code is licensed under the MIT license found in the
+LICENSE file in the root directory of this source tree.
+*/
+#pragma once
+
+#include <string>
+#include <torch/torch.h>
+#include <vector>
+
+#include "game.h"
+#include "phase.h"
+#include "scoring.h"
+
+namespace dipcc {
+
+// Integer key with the same ordering as Phase::operator<. Matches
+// fairdiplomacy.game.sort_phase_key, flattened to a single int.
+int64_t phase_sort_key(const Phase &phase);
+
+// A batch of games that are queried, given orders and processed together, so
+// that a rollout step costs a few calls instead of a few calls per game.
+//
+// Per-game queries return one tensor row per game, in batch order. Methods
+// that take game_idxs only act on those games.
+class GameBatch {
+public:
+  GameBatch() {}
+  explicit GameBatch(const std::vector<Game> &games) : games_(games) {}
+
+  // n_repeats copies of game, with game_ids suffixed as clone_n_times does
+  GameBatch(const Game &game, int n_repeats);
+
+  size_t size() const { return games_.size(); }
+  Game &get_game(size_t i) { return games_.at(i); }
+  std::vector<Game *> get_games();
+  std::vector<Game *> get_games(const std::vector<int64_t> &game_idxs);
+
+  // Bool tensor [N]
+  torch::Tensor is_done() const;
+
+  // Long tensor [N] of phase_sort_key of each game's current phase
+  torch::Tensor phase_keys() const;
+
+  // Short names of each game's current phase
+  std::vector<std::string> phases() const;
+
+  // Float tensor [N, 7] of each game's scores, using the game's own scoring
+  // system, or scoring_system if given
+  torch::Tensor get_scores() const;
+  torch::Tensor get_scores(Scoring scoring_system) const;
+
+  // Earliest current phase of any game that is not done, or "" if all games
+  // are done
+  std::string min_ongoing_phase() const;
+
+  // Indices of the games that are not done and whose current phase is phase
+  std::vector<int64_t> ongoing_game_idxs_at_phase(const std::string &phase);
+
+  // Sets orders for each power of each game in game_idxs. orders[i][p] are
+  // the orders of POWERS[p] in game game_idxs[i].
+  void set_orders(
+      const std::vector<int64_t> &game_idxs,
+      const std::vector<std::vector<std::vector<std::string>>> &orders);
+
+  // Processes the games in game_idxs (see Game::process_batch)
+  void process(const std::vector<int64_t> &game_idxs);
+
+  // Processes all games that are not done
+  void process();
+
+private:
+  std::vector<Game> games_;
+};
+
+} // namespace dipcc
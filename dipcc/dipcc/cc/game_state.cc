@@ -4,6 +4,9 @@ Copyright (c) Meta Platforms, Inc. and affiliates.
 This source code is licensed under the MIT license found in the
 LICENSE file in the root directory of this source tree.
 */
+#include <algorithm>
+#include <array>
+#include <memory>
 #include <optional>
 #include <set>
 #include <unordered_set>
@@ -47,19 +50,26 @@ void GameState::set_unit(Power power, UnitType type, Loc loc) {
 
 void GameState::add_dislodged_unit(OwnedUnit unit, Loc dislodged_by) {
   JCHECK(unit.type != UnitType::NONE, "add_dislodged_unit NONE unit");
-  dislodged_units_[unit] = dislodged_by;
+  dislodged_units_[unit.loc] = unit;
+  dislodged_by_[unit.loc] = dislodged_by;
 }
 
 void GameState::remove_dislodged_unit(OwnedUnit unit) {
-  dislodged_units_.erase(unit);
+  auto it = dislodged_units_.find(unit.loc);
+  if (it != dislodged_units_.end() && it->second == unit) {
+    dislodged_units_.erase(unit.loc);
+    dislodged_by_.erase(unit.loc);
+  }
 }
 
+// Returned in OwnedUnit order (power, type, loc), not in loc order
 vector<OwnedUnit> GameState::get_dislodged_units() const {
   vector<OwnedUnit> r;
   r.reserve(dislodged_units_.size());
   for (auto &it : dislodged_units_) {
-    r.push_back(it.first);
+    r.push_back(it.second);
   }
+  sort(r.begin(), r.end());
   return r;
 }
 
@@ -123,7 +133,7 @@ const unordered_map<Power, vector<Loc>> &GameState::get_orderable_locations() {
   return orderable_locations_;
 }
 
-const unordered_map<Loc, set<Order>> &GameState::get_all_possible_orders() {
+const PossibleOrders &GameState::get_all_possible_orders() {
   if (!orders_loaded_) {
     if (phase_.phase_type == 'M') {
       load_all_possible_orders_m();
@@ -135,145 +145,296 @@ const unordered_map<Loc, set<Order>> &GameState::get_all_possible_orders() {
     orders_loaded_ = true;
   }
 
-  return all_possible_orders_;
+  if (all_possible_orders_ == nullptr) {
+    static const PossibleOrders empty;
+    return empty;
+  }
+  return *all_possible_orders_;
 }
 
-void GameState::load_all_possible_orders_m() {
-  JCHECK(phase_.phase_type == 'M', "load_all_possible_orders_m non-m phase");
-  clear_all_possible_orders();
+// A connected group of fleets on water, any of which can be part of a convoy
+// of any adjacent army to any coast adjacent to the group
+struct ConvoyGroup {
+  LocSet fleets;
+  LocSet armies;
+  LocSet coasts; // root locs
+};
+
+struct PossibleOrdersCacheM {
+  LocSet armies;
+  LocSet fleets;
+  vector<ConvoyGroup> convoy_groups; // in order of their first fleet's loc
+  shared_ptr<const PossibleOrders> orders;
+};
 
-  vector<vector<Order>> move_orders_by_dest;
-  std::set<Loc> global_fleets_visited;
+namespace {
 
-  all_possible_orders_.reserve(LOCS.size() + 1);
-  move_orders_by_dest.resize(LOCS.size() + 1);
+// Static per-loc tables for M phase order generation. Tables indexed by
+// [is_fleet][loc] are for a unit of that type at loc.
+struct PossibleOrdersTables {
+  // Locs which the unit could support-hold or support-move into
+  array<array<LocSet, NUM_LOCS + 1>, 2> adj_coasts;
 
-  unordered_map<Power, set<Loc>> orderable_locations;
+  // Locs whose occupants determine the unit's support-holds and non-via
+  // support-moves: adj_coasts, plus the locs from which any unit could move
+  // into one of them
+  array<array<LocSet, NUM_LOCS + 1>, 2> neighborhood;
 
-  // Determine all orders except support-moves
-  for (const auto &it : units_) {
-    Unit unit = it.second.unowned();
-    JCHECK(unit.type != UnitType::NONE, "load_all_possible_orders_m NONE unit");
-    orderable_locations[it.second.power].insert(unit.loc);
-    auto &adj = unit.type == UnitType::ARMY ? ADJ_A : ADJ_F;
-    auto &adj_coasts =
-        unit.type == UnitType::ARMY ? ADJ_A_ALL_COASTS : ADJ_F_ALL_COASTS;
-    set<Order> &unit_orders = all_possible_orders_[unit.loc];
-
-    // Hold
-    unit_orders.insert(Order(unit, OrderType::H));
-
-    // Non-via moves
-    for (auto adj_loc : adj[static_cast<size_t>(unit.loc)]) {
-      move_orders_by_dest[static_cast<int>(adj_loc)].push_back(
-          Order(unit, OrderType::M, adj_loc));
-    }
-
-    // Support-holds
-    for (auto adj_loc : adj_coasts[static_cast<size_t>(unit.loc)]) {
-      const Unit &adj_unit = get_unit(adj_loc).unowned();
-      if (adj_unit.type != UnitType::NONE) {
-        unit_orders.insert(Order(unit, OrderType::SH, adj_unit));
-
-        // Accept e.g. "F BLA S F BUL" instead of "F BUL/SC"
-        Loc adj_root = root_loc(adj_unit.loc);
-        if (adj_root != adj_unit.loc) {
-          unit_orders.insert(
-              Order(unit, OrderType::SH, {adj_unit.type, adj_root}));
+  // Units which could move (not via convoy) to each loc
+  array<vector<Unit>, NUM_LOCS + 1> movers_to;
+
+  PossibleOrdersTables() {
+    for (Loc src : LOCS) {
+      for (Loc dest : ADJ_A[static_cast<size_t>(src)]) {
+        movers_to[static_cast<size_t>(dest)].push_back({UnitType::ARMY, src});
+      }
+      for (Loc dest : ADJ_F[static_cast<size_t>(src)]) {
+        movers_to[static_cast<size_t>(dest)].push_back({UnitType::FLEET, src});
+      }
+    }
+    for (size_t is_fleet = 0; is_fleet < 2; ++is_fleet) {
+      auto &adj = is_fleet ? ADJ_F_ALL_COASTS : ADJ_A_ALL_COASTS;
+      for (Loc loc : LOCS) {
+        size_t i = static_cast<size_t>(loc);
+        for (Loc dest : adj[i]) {
+          adj_coasts[is_fleet][i].insert(dest);
+          neighborhood[is_fleet][i].insert(dest);
+          for (const Unit &mover : movers_to[static_cast<size_t>(dest)]) {
+            neighborhood[is_fleet][i].insert(mover.loc);
+          }
         }
       }
     }
+  }
+};
 
-    // Convoys + moves via
-    if (unit.type == UnitType::FLEET && is_water(unit.loc)) {
-      std::set<Unit> adj_armies;
-      std::set<Unit> adj_fleets_todo{unit};
-      std::set<Unit> local_fleets_visited;
-      std::set<Loc> adj_coast_locs;
-      while (adj_fleets_todo.size() > 0) {
-
-        // Pop fleet to consider
-        auto fleet_it = adj_fleets_todo.begin();
-        Unit fleet = *fleet_it;
-        adj_fleets_todo.erase(fleet_it);
-        local_fleets_visited.insert(fleet);
-        global_fleets_visited.insert(fleet.loc);
-
-        for (Loc adj_loc : ADJ_F_ALL_COASTS[static_cast<size_t>(fleet.loc)]) {
+const PossibleOrdersTables &possible_orders_tables() {
+  static const PossibleOrdersTables tables;
+  return tables;
+}
 
-          if (!is_water(adj_loc)) {
-            // Possible destination loc
-            adj_coast_locs.insert(root_loc(adj_loc));
-          }
+vector<ConvoyGroup> find_convoy_groups(const GameState &state) {
+  vector<ConvoyGroup> groups;
+  LocSet visited;
+  vector<Loc> todo;
+  for (const auto &it : state.get_units()) {
+    Loc loc = it.first;
+    if (it.second.type != UnitType::FLEET || !is_water(loc) ||
+        visited.contains(loc)) {
+      continue;
+    }
+    ConvoyGroup &group = groups.emplace_back();
+    visited.insert(loc);
+    todo.push_back(loc);
+    while (!todo.empty()) {
+      Loc fleet = todo.back();
+      todo.pop_back();
+      group.fleets.insert(fleet);
+
+      for (Loc adj_loc : ADJ_F_ALL_COASTS[static_cast<size_t>(fleet)]) {
+        if (!is_water(adj_loc)) {
+          // Possible destination loc
+          group.coasts.insert(root_loc(adj_loc));
+        }
 
-          Unit adj_unit = this->get_unit(adj_loc).unowned();
-          if (adj_unit.type == UnitType::FLEET && is_water(adj_loc) &&
-              global_fleets_visited.find(adj_loc) ==
-                  global_fleets_visited.end()) {
-            // Adjacent fleet that can chain convoy
-            adj_fleets_todo.insert(adj_unit);
-          } else if (adj_unit.type == UnitType::ARMY) {
-            // Possible source army to convoy
-            adj_armies.insert(adj_unit);
+        UnitType adj_type = state.get_unit(adj_loc).type;
+        if (adj_type == UnitType::FLEET && is_water(adj_loc)) {
+          // Adjacent fleet that can chain convoy
+          if (!visited.contains(adj_loc)) {
+            visited.insert(adj_loc);
+            todo.push_back(adj_loc);
           }
+        } else if (adj_type == UnitType::ARMY) {
+          // Possible source army to convoy
+          group.armies.insert(adj_loc);
         }
       }
+    }
+  }
+  return groups;
+}
 
-      // Each adj_army can be convoyed to each adj_coast_loc via each
-      // local_fleets_visited
-      for (const Unit &army : adj_armies) {
-        for (Loc dest : adj_coast_locs) {
-          if (dest == army.loc) {
-            continue;
-          }
-          move_orders_by_dest[static_cast<int>(dest)].push_back(
-              Order(army, OrderType::M, dest, true));
-          for (const Unit &convoy_fleet : local_fleets_visited) {
-            all_possible_orders_[convoy_fleet.loc].insert(
-                Order(convoy_fleet, OrderType::C, army, dest));
+// Inserts all of unit's possible orders during an M phase into possible
+void add_unit_possible_orders_m(const GameState &state, Unit unit,
+                                const vector<ConvoyGroup> &convoy_groups,
+                                PossibleOrders &possible) {
+  const PossibleOrdersTables &tables = possible_orders_tables();
+  size_t i = static_cast<size_t>(unit.loc);
+  auto &adj = unit.type == UnitType::ARMY ? ADJ_A : ADJ_F;
+  auto &adj_coasts =
+      unit.type == UnitType::ARMY ? ADJ_A_ALL_COASTS : ADJ_F_ALL_COASTS;
+
+  auto insert = [&](const Order &order) { possible.insert(unit.loc, order); };
+
+  // Hold
+  insert(Order(unit, OrderType::H));
+
+  // Non-via moves
+  for (auto adj_loc : adj[i]) {
+    insert(Order(unit, OrderType::M, adj_loc));
+  }
+
+  // Support-holds
+  for (auto adj_loc : adj_coasts[i]) {
+    const Unit &adj_unit = state.get_unit(adj_loc).unowned();
+    if (adj_unit.type != UnitType::NONE) {
+      insert(Order(unit, OrderType::SH, adj_unit));
+
+      // Accept e.g. "F BLA S F BUL" instead of "F BUL/SC"
+      Loc adj_root = root_loc(adj_unit.loc);
+      if (adj_root != adj_unit.loc) {
+        insert(
+            Order(unit, OrderType::SH, {adj_unit.type, adj_root}));
+      }
+    }
+  }
+
+  // Support non-via moves
+  for (Loc dest : adj_coasts[i]) {
+    if (dest == unit.loc) {
+      continue; // can't support self-dislodge
+    }
+    Loc dest_root = root_loc(dest);
+    for (const Unit &mover : tables.movers_to[static_cast<size_t>(dest)]) {
+      if (mover.loc == unit.loc) {
+        continue; // can't support own move
+      }
+      if (state.get_unit(mover.loc).type != mover.type) {
+        continue;
+      }
+      insert(Order(unit, OrderType::SM, mover, dest));
+
+      // Accept e.g. "F BLA S F CON - BUL" instead of "BUL/SC"
+      if (dest_root != dest) {
+        insert(Order(unit, OrderType::SM, mover, dest_root));
+      }
+    }
+  }
+
+  // Convoys, moves via and support via moves: each army adjacent to a group
+  // can be convoyed to each of its coasts via each of its fleets
+  for (const ConvoyGroup &group : convoy_groups) {
+    if (group.fleets.contains(unit.loc)) {
+      for (Loc army : group.armies) {
+        for (Loc dest : group.coasts) {
+          if (dest != army) {
+            insert(
+                Order(unit, OrderType::C, {UnitType::ARMY, army}, dest));
           }
         }
       }
     }
+    if (group.armies.contains(unit.loc)) {
+      for (Loc dest : group.coasts) {
+        if (dest != unit.loc) {
+          insert(Order(unit, OrderType::M, dest, true));
+        }
+      }
+    }
+    for (Loc dest : adj_coasts[i]) {
+      if (dest == unit.loc || !group.coasts.contains(dest)) {
+        continue;
+      }
+      for (Loc army : group.armies) {
+        if (army != unit.loc && army != dest) {
+          insert(
+              Order(unit, OrderType::SM, {UnitType::ARMY, army}, dest));
+        }
+      }
+    }
+  }
+}
+
+// Returns true if unit's orders in prev are also its orders in cur: the same
+// unit was at the same loc, no occupant of its neighborhood has changed, and
+// neither has any of the convoy groups it could be part of or support
+bool can_reuse_possible_orders(const PossibleOrdersCacheM &prev,
+                               const PossibleOrdersCacheM &cur,
+                               const LocSet &changed, Unit unit) {
+  const PossibleOrdersTables &tables = possible_orders_tables();
+  size_t is_fleet = unit.type == UnitType::FLEET;
+  size_t i = static_cast<size_t>(unit.loc);
+  if (!prev.orders->contains(unit.loc) || changed.contains(unit.loc) ||
+      changed.intersects(tables.neighborhood[is_fleet][i])) {
+    return false;
   }
 
-  // Move move_orders to all_possible_orders_
-  for (const auto &move_orders : move_orders_by_dest) {
-    for (const Order &order : move_orders) {
-      all_possible_orders_[order.get_unit().loc].insert(order);
+  // Groups are in the same relative order in both snapshots, so it is enough
+  // to compare the groups touching unit pairwise
+  auto touches = [&](const ConvoyGroup &group) {
+    return group.fleets.contains(unit.loc) || group.armies.contains(unit.loc) ||
+           group.coasts.intersects(tables.adj_coasts[is_fleet][i]);
+  };
+  auto prev_it = prev.convoy_groups.begin();
+  auto prev_end = prev.convoy_groups.end();
+  for (const ConvoyGroup &group : cur.convoy_groups) {
+    if (!touches(group)) {
+      continue;
     }
+    while (prev_it != prev_end && !touches(*prev_it)) {
+      ++prev_it;
+    }
+    if (prev_it == prev_end || prev_it->fleets != group.fleets ||
+        prev_it->armies != group.armies) {
+      return false;
+    }
+    ++prev_it;
+  }
+  while (prev_it != prev_end && !touches(*prev_it)) {
+    ++prev_it;
   }
+  return prev_it == prev_end;
+}
+
+} // namespace
+
+void GameState::load_all_possible_orders_m() {
+  JCHECK(phase_.phase_type == 'M', "load_all_possible_orders_m non-m phase");
+  clear_all_possible_orders();
 
-  // Determine support moves
+  auto cache = make_shared<PossibleOrdersCacheM>();
   for (const auto &it : units_) {
-    auto &unit = it.second;
-    auto &adj_coasts =
-        unit.type == UnitType::ARMY ? ADJ_A_ALL_COASTS : ADJ_F_ALL_COASTS;
-    set<Order> &unit_orders = all_possible_orders_[unit.loc];
-
-    for (Loc dest : adj_coasts[static_cast<size_t>(unit.loc)]) {
-      if (dest == unit.loc) {
-        continue; // can't support self-dislodge
-      }
-      for (const Order &move_order :
-           move_orders_by_dest[static_cast<int>(dest)]) {
-        if (move_order.get_unit().loc == unit.loc) {
-          continue; // can't support own move
-        }
+    if (it.second.type == UnitType::ARMY) {
+      cache->armies.insert(it.first);
+    } else {
+      cache->fleets.insert(it.first);
+    }
+  }
+  cache->convoy_groups = find_convoy_groups(*this);
+
+  // Locs whose unit differs from the previous snapshot's
+  const PossibleOrdersCacheM *prev = possible_orders_cache_m_.get();
+  LocSet changed;
+  if (prev != nullptr) {
+    LocSet changed_fleets = cache->fleets;
+    changed_fleets ^= prev->fleets;
+    changed = cache->armies;
+    changed ^= prev->armies;
+    changed |= changed_fleets;
+  }
 
-        unit_orders.insert(
-            Order(unit, OrderType::SM, move_order.get_unit(), dest));
+  auto possible = make_shared<PossibleOrders>();
+  unordered_map<Power, set<Loc>> orderable_locations;
 
-        // Accept e.g. "F BLA S F CON - BUL" instead of "BUL/SC"
-        Loc dest_root = root_loc(dest);
-        if (dest_root != dest) {
-          unit_orders.insert(
-              Order(unit, OrderType::SM, move_order.get_unit(), dest_root));
-        }
+  for (const auto &it : units_) {
+    Unit unit = it.second.unowned();
+    JCHECK(unit.type != UnitType::NONE, "load_all_possible_orders_m NONE unit");
+    orderable_locations[it.second.power].insert(unit.loc);
+
+    if (prev != nullptr &&
+        can_reuse_possible_orders(*prev, *cache, changed, unit)) {
+      for (const Order &order : prev->orders->at(unit.loc)) {
+        possible->insert(unit.loc, order);
       }
+    } else {
+      add_unit_possible_orders_m(*this, unit, cache->convoy_groups, *possible);
     }
   }
+  possible->finalize();
 
+  all_possible_orders_ = possible;
+  cache->orders = move(possible);
+  possible_orders_cache_m_ = move(cache);
   copy_sorted_root_locs(orderable_locations, orderable_locations_);
 }
 
@@ -281,13 +442,13 @@ void GameState::load_all_possible_orders_r() {
   JCHECK(this->phase_.phase_type == 'R', "load_all_possible_orders_r non-r");
   clear_all_possible_orders();
 
+  auto possible = make_shared<PossibleOrders>();
   unordered_map<Power, set<Loc>> orderable_locations;
 
   for (auto &p : dislodged_units_) {
-    OwnedUnit unit = p.first;
-    Loc dislodger_root = root_loc(p.second);
-    set<Order> &retreats = all_possible_orders_[unit.loc];
-    retreats.insert(Order(unit.unowned(), OrderType::D));
+    OwnedUnit unit = p.second;
+    Loc dislodger_root = root_loc(dislodged_by_.at(p.first));
+    possible->insert(unit.loc, Order(unit.unowned(), OrderType::D));
     orderable_locations[unit.power].insert(unit.loc);
     const auto &adj_locs =
         (unit.type == UnitType::ARMY ? ADJ_A
@@ -306,15 +467,18 @@ void GameState::load_all_possible_orders_r() {
         continue;
       }
 
-      retreats.insert(Order(unit.unowned(), OrderType::R, adj));
+      possible->insert(unit.loc, Order(unit.unowned(), OrderType::R, adj));
     }
   }
+  possible->finalize();
+  all_possible_orders_ = move(possible);
 
   copy_sorted_root_locs(orderable_locations, orderable_locations_);
 }
 
 void GameState::load_all_possible_orders_a() {
   clear_all_possible_orders();
+  auto possible = make_shared<PossibleOrders>();
   unordered_map<Power, set<Loc>> orderable_locations;
 
   vector<int> n_units(7, 0);
@@ -344,8 +508,8 @@ void GameState::load_all_possible_orders_a() {
       for (Loc center : home_centers_army(power)) {
         if (centers_.at(center) == power &&
             get_unit_rooted(center).type == UnitType::NONE) {
-          all_possible_orders_[center].insert(
-              Order({UnitType::ARMY, center}, OrderType::B));
+          possible->insert(center,
+                           Order({UnitType::ARMY, center}, OrderType::B));
           orderable_locations[power].insert(root_loc(center));
         }
       }
@@ -354,8 +518,8 @@ void GameState::load_all_possible_orders_a() {
       for (Loc center : home_centers_fleet(power)) {
         if (centers_.at(root_loc(center)) == power &&
             get_unit_rooted(center).type == UnitType::NONE) {
-          all_possible_orders_[center].insert(
-              Order({UnitType::FLEET, center}, OrderType::B));
+          possible->insert(center,
+                           Order({UnitType::FLEET, center}, OrderType::B));
           orderable_locations[power].insert(root_loc(center));
         }
       }
@@ -370,19 +534,21 @@ void GameState::load_all_possible_orders_a() {
   // add disbands
   for (auto &p : units_) {
     if (can_disband[static_cast<int>(p.second.power) - 1]) {
-      all_possible_orders_[p.first].insert(
-          Order(p.second.unowned(), OrderType::D));
+      possible->insert(p.first, Order(p.second.unowned(), OrderType::D));
       orderable_locations[p.second.power].insert(root_loc(p.first));
     }
   }
 
+  possible->finalize();
+  all_possible_orders_ = move(possible);
+
   // sort doesn't matter/apply in A-phase, but we use this function
   // just to do the set->vector copy
   copy_sorted_root_locs(orderable_locations, orderable_locations_);
 }
 
 void GameState::clear_all_possible_orders() {
-  all_possible_orders_.clear();
+  all_possible_orders_.reset();
   orderable_locations_.clear();
   orders_loaded_ = false;
 }
@@ -436,17 +602,19 @@ GameState::process_r(const unordered_map<Power, vector<Order>> &orders) {
   next_state.set_phase(this->get_phase().next(false));
   next_state.set_units(this->get_units());
   next_state.set_centers(this->get_centers());
+  next_state.possible_orders_cache_m_ = possible_orders_cache_m_;
 
-  map<OwnedUnit, Loc> dislodged_units(this->dislodged_units_);
+  LocMap<OwnedUnit> dislodged_units(this->dislodged_units_);
   const auto &all_possible_orders(this->get_all_possible_orders());
-  set<Loc> multiple_retreater_locs;
+  LocSet multiple_retreater_locs;
 
   for (const auto &p : orders) {
     Power power = p.first;
     for (const Order &order : p.second) {
       OwnedUnit unit = order.get_unit().owned_by(power);
-      auto dislodged_it = dislodged_units.find(unit);
-      if (dislodged_it == dislodged_units.end()) {
+      auto dislodged_it = dislodged_units.find(unit.loc);
+      if (dislodged_it == dislodged_units.end() ||
+          dislodged_it->second != unit) {
         LOG(WARNING) << "Unit not dislodged [" << power_str(power)
                      << "]: " << order.to_string();
         continue;
@@ -458,7 +626,7 @@ GameState::process_r(const unordered_map<Power, vector<Order>> &orders) {
       }
 
       // retreat order is valid: mark so another valid order is not accepted
-      dislodged_units.erase(dislodged_it);
+      dislodged_units.erase(unit.loc);
 
       if (order.get_type() == OrderType::D ||
           set_contains(multiple_retreater_locs, root_loc(order.get_dest()))) {
@@ -488,6 +656,7 @@ GameState::process_a(const unordered_map<Power, vector<Order>> &orders) {
   next_state.set_phase(this->get_phase().next(false));
   next_state.set_units(this->get_units());
   next_state.set_centers(this->get_centers());
+  next_state.possible_orders_cache_m_ = possible_orders_cache_m_;
 
   auto &all_possible_orders(this->get_all_possible_orders());
   vector<int> n_builds(n_builds_);
@@ -717,9 +886,9 @@ json GameState::to_json() {
     j["units"][power_str(p.second.power)].push_back(
         p.second.unowned().to_string());
   }
-  for (const auto &p : dislodged_units_) {
-    j["units"][power_str(p.first.power)].push_back(
-        "*" + p.first.unowned().to_string());
+  for (const OwnedUnit &unit : get_dislodged_units()) {
+    j["units"][power_str(unit.power)].push_back("*" +
+                                                unit.unowned().to_string());
   }
 
   return j;
@@ -748,6 +917,7 @@ GameState::GameState(const json &j) {
 
   // retreats
   if (phase_.phase_type == 'R') {
+    auto possible = make_shared<PossibleOrders>();
     unordered_map<Power, set<Loc>> orderable_locations;
     for (Power power : POWERS) {
       auto power_s = power_str(power);
@@ -756,16 +926,18 @@ GameState::GameState(const json &j) {
       }
       for (auto &it : j["retreats"][power_s].items()) {
         Unit unit = Unit(it.key());
-        dislodged_units_[unit.owned_by(power)] = Loc::NONE;
+        dislodged_units_[unit.loc] = unit.owned_by(power);
+        dislodged_by_[unit.loc] = Loc::NONE;
         orderable_locations[power].insert(unit.loc);
-        all_possible_orders_[unit.loc].insert(Order(unit, OrderType::D));
+        possible->insert(unit.loc, Order(unit, OrderType::D));
         for (const string &s : it.value()) {
           Loc dest = loc_from_str(s);
-          all_possible_orders_[unit.loc].insert(
-              Order(unit, OrderType::R, dest));
+          possible->insert(unit.loc, Order(unit, OrderType::R, dest));
         }
       }
     }
+    possible->finalize();
+    all_possible_orders_ = move(possible);
     copy_sorted_root_locs(orderable_locations, orderable_locations_);
     orders_loaded_ = true;
   }
@@ -842,10 +1014,10 @@ std::vector<float> GameState::get_scores(Scoring scoring_system) const {
 }
 
 namespace {
-// Using a separate function for std::map to make code die if anyone will change
-// underlying objects to std::unordered_set in the future.
-template <typename K, typename V>
-inline void hash_combine_map(std::size_t &seed, const std::map<K, V> &map) {
+// Using a separate function for LocMap to make code die if anyone will change
+// underlying objects to an unordered container in the future.
+template <typename V>
+inline void hash_combine_map(std::size_t &seed, const LocMap<V> &map) {
   for (const auto &[k, v] : map) {
     hash_combine(seed, k);
     hash_combine(seed, v);
@@ -862,7 +1034,10 @@ size_t GameState::compute_board_hash() const {
   hash_combine_map(ret, centers_);
   if (phase_.phase_type == 'R') {
     hash_combine(ret, dislodged_units_.size());
-    hash_combine_map(ret, dislodged_units_);
+    for (const OwnedUnit &unit : get_dislodged_units()) {
+      hash_combine(ret, unit);
+      hash_combine(ret, dislodged_by_.at(unit.loc));
+    }
     hash_combine(ret, contested_locs_.size());
     for (const auto loc : contested_locs_)
       hash_combine(ret, loc);
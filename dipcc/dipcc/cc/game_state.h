@@ -7,6 +7,7 @@ LICENSE file in the root directory of this source tree.
 #pragma once
 
 #include <map>
+#include <memory>
 #include <set>
 #include <unordered_map>
 #include <unordered_set>
@@ -14,9 +15,11 @@ LICENSE file in the root directory of this source tree.
 
 #include "enums.h"
 #include "hash.h"
+#include "loc_map.h"
 #include "order.h"
 #include "owned_unit.h"
 #include "phase.h"
+#include "possible_orders.h"
 #include "power.h"
 #include "scoring.h"
 #include "thirdparty/nlohmann/json.hpp"
@@ -25,6 +28,11 @@ namespace dipcc {
 
 struct Resolution; // defined in process.cc
 
+// Snapshot of the possible orders of an M phase, from which the next M phase
+// reuses the order sets of units whose surroundings have not changed. Defined
+// in game_state.cc.
+struct PossibleOrdersCacheM;
+
 class GameState {
 public:
   GameState(){};
@@ -33,22 +41,20 @@ public:
   OwnedUnit get_unit(Loc loc) const;
   OwnedUnit get_unit_rooted(Loc loc) const;
   void set_unit(Power power, UnitType type, Loc loc);
-  void set_units(const std::map<Loc, OwnedUnit> units) {
+  void set_units(const LocMap<OwnedUnit> &units) {
     units_ = units;
     influence_.clear();
     for (const auto &[loc, unit] : units_)
       influence_[loc] = unit.power;
   }
-  void set_influence(const std::map<Loc, Power> &influence) {
-    influence_ = influence;
-  }
+  void set_influence(const LocMap<Power> &influence) { influence_ = influence; }
   void remove_unit_rooted(Loc);
-  const std::map<Loc, OwnedUnit> &get_units() const { return units_; }
-  const std::map<Loc, Power> &get_influence() const { return influence_; }
+  const LocMap<OwnedUnit> &get_units() const { return units_; }
+  const LocMap<Power> &get_influence() const { return influence_; }
 
   void set_center(Loc loc, Power power);
-  void set_centers(const std::map<Loc, Power> &centers) { centers_ = centers; }
-  const std::map<Loc, Power> &get_centers() const { return centers_; }
+  void set_centers(const LocMap<Power> &centers) { centers_ = centers; }
+  const LocMap<Power> &get_centers() const { return centers_; }
 
   Phase get_phase() const { return phase_; }
   void set_phase(Phase phase) { phase_ = phase; }
@@ -60,7 +66,7 @@ public:
   int get_n_builds(Power power);
 
   const std::unordered_map<Power, std::vector<Loc>> &get_orderable_locations();
-  const std::unordered_map<Loc, std::set<Order>> &get_all_possible_orders();
+  const PossibleOrders &get_all_possible_orders();
   void clear_all_possible_orders();
 
   void do_civil_disorder(Power power, int n);
@@ -73,6 +79,20 @@ public:
   GameState process(const std::unordered_map<Power, std::vector<Order>> &orders,
                     bool exception_on_convoy_paradox = false);
 
+  // Adjudicates a batch of independent movement phases together, handling
+  // only the boards on which no loc is claimed by more than one unit and no
+  // unit moves via convoy: there, every legal move succeeds regardless of
+  // supports, so no strength resolution is needed.
+  //
+  // Returns for each i whether states[i] was adjudicated, in which case
+  // next[i] is the same as states[i]->process(*orders[i]). All other boards
+  // (including non-movement phases) are left for the caller to process().
+  static std::vector<bool> process_m_uncontested_batch(
+      const std::vector<GameState *> &states,
+      const std::vector<const std::unordered_map<Power, std::vector<Order>> *>
+          &orders,
+      std::vector<GameState> &next);
+
   nlohmann::json to_json();
 
   size_t compute_board_hash() const;
@@ -86,6 +106,12 @@ private:
   copy_sorted_root_locs(const std::unordered_map<Power, std::set<Loc>> &from,
                         std::unordered_map<Power, std::vector<Loc>> &to);
 
+  // Organizes movement orders by root unit loc, dropping orders for units of
+  // another power and making implicit via moves explicit. Root locs of units
+  // whose order is not possible are added to illegal_orderers.
+  void
+  collect_m_orders(const std::unordered_map<Power, std::vector<Order>> &orders,
+                   LocMap<Order> &orders_by_src, LocSet &illegal_orderers);
   GameState
   process_m(const std::unordered_map<Power, std::vector<Order>> &orders,
             bool exception_on_convoy_paradox = false);
@@ -103,18 +129,29 @@ private:
   void debug_log_all_possible_orders();
 
   // Members
+  //
+  // Board contents are kept in flat per-loc arrays (see loc_map.h) so that
+  // copying a GameState does not allocate.
   Phase phase_ = {'S', 1901, 'M'};
-  std::map<Loc, OwnedUnit> units_;
-  std::map<Loc, Power> centers_;
-  std::map<Loc, Power> influence_;           // only for vizualization purposes.
-  std::map<OwnedUnit, Loc> dislodged_units_; // only valid during R phase
-  std::set<Loc> contested_locs_;             // only valid during R phase
+  LocMap<OwnedUnit> units_;
+  LocMap<Power> centers_;
+  LocMap<Power> influence_;           // only for vizualization purposes.
+  LocMap<OwnedUnit> dislodged_units_; // only valid during R phase
+  LocMap<Loc> dislodged_by_;          // only valid during R phase
+  LocSet contested_locs_;             // only valid during R phase
   std::vector<int> n_builds_; // 7-len vector only valid during A phase
 
-  std::unordered_map<Loc, std::set<Order>> all_possible_orders_;
+  // Immutable once loaded, so copies of a GameState share it
+  std::shared_ptr<const PossibleOrders> all_possible_orders_;
   std::unordered_map<Power, std::vector<Loc>> orderable_locations_;
   bool orders_loaded_ = false;
 
+  // Set by load_all_possible_orders_m and passed on to the next states, so
+  // that the next M phase only regenerates the orders of units whose
+  // neighborhood differs from this snapshot. Immutable once set, so it may be
+  // shared between threads.
+  std::shared_ptr<const PossibleOrdersCacheM> possible_orders_cache_m_;
+
   const static int MAX_YEAR = 1935;
 };
 
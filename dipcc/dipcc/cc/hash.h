@@ -57,13 +57,7 @@ template <> inline void hash_combine(std::size_t &seed, const Phase &phase) {
 
 struct HashOrder {
   std::size_t operator()(const Order &x) const {
-    std::size_t r = 0;
-    hash_combine(r, x.get_unit());
-    hash_combine(r, x.get_type());
-    hash_combine(r, x.get_target());
-    hash_combine(r, x.get_dest());
-    hash_combine(r, x.get_via());
-    return r;
+    return std::hash<uint32_t>()(x.get_id());
   }
 };
 
@@ -0,0 +1,234 @@
+/*
+Copyright (c) Meta Platforms, Inc. and affiliates.
+
+This source code is licensed under the MIT license found in the
+LICENSE file in the root directory of this source tree.
+*/
+#pragma once
+
+#include <array>
+#include <bitset>
+#include <cstddef>
+#include <iterator>
+#include <stdexcept>
+#include <utility>
+
+#include "loc.h"
+
+namespace dipcc {
+
+// Fixed-size map keyed by Loc, backed by a flat array with one slot per loc.
+//
+// Drop-in replacement for the subset of the std::map<Loc, V> interface used by
+// GameState. Iteration is in Loc order, i.e. the same order as std::map<Loc,
+// V>, and copying is a flat copy with no per-element allocation.
+template <typename V> class LocMap {
+public:
+  using key_type = Loc;
+  using mapped_type = V;
+  using value_type = std::pair<Loc, V>;
+  using size_type = size_t;
+
+  class const_iterator {
+  public:
+    using iterator_category = std::forward_iterator_tag;
+    using value_type = LocMap::value_type;
+    using difference_type = std::ptrdiff_t;
+    using pointer = const value_type *;
+    using reference = const value_type &;
+
+    const_iterator() {}
+    const_iterator(const LocMap *m, size_t i) : m_(m), i_(i) { skip_empty(); }
+
+    reference operator*() const { return m_->slots_[i_]; }
+    pointer operator->() const { return &m_->slots_[i_]; }
+    const_iterator &operator++() {
+      ++i_;
+      skip_empty();
+      return *this;
+    }
+    const_iterator operator++(int) {
+      const_iterator r(*this);
+      ++(*this);
+      return r;
+    }
+    bool operator==(const const_iterator &o) const { return i_ == o.i_; }
+    bool operator!=(const const_iterator &o) const { return i_ != o.i_; }
+
+  private:
+    void skip_empty() {
+      while (i_ < SIZE && !m_->present_[i_]) {
+        ++i_;
+      }
+    }
+
+    const LocMap *m_ = nullptr;
+    size_t i_ = SIZE;
+  };
+  using iterator = const_iterator;
+
+  LocMap() {
+    for (size_t i = 0; i < SIZE; ++i) {
+      slots_[i] = {static_cast<Loc>(i), V{}};
+    }
+  }
+
+  const_iterator begin() const { return const_iterator(this, 0); }
+  const_iterator end() const { return const_iterator(this, SIZE); }
+
+  size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+
+  size_t count(Loc loc) const { return present_[idx(loc)] ? 1 : 0; }
+  bool contains(Loc loc) const { return present_[idx(loc)]; }
+
+  const_iterator find(Loc loc) const {
+    return present_[idx(loc)] ? const_iterator(this, idx(loc)) : end();
+  }
+
+  const V &at(Loc loc) const {
+    if (!present_[idx(loc)]) {
+      throw std::out_of_range("LocMap::at " + loc_str(loc));
+    }
+    return slots_[idx(loc)].second;
+  }
+
+  // Inserts a default-constructed value if loc is not present
+  V &operator[](Loc loc) {
+    size_t i = idx(loc);
+    if (!present_[i]) {
+      present_[i] = true;
+      slots_[i].second = V{};
+      ++size_;
+    }
+    return slots_[i].second;
+  }
+
+  // Returns the number of elements removed (0 or 1)
+  size_t erase(Loc loc) {
+    size_t i = idx(loc);
+    if (!present_[i]) {
+      return 0;
+    }
+    present_[i] = false;
+    --size_;
+    return 1;
+  }
+
+  void clear() {
+    present_.reset();
+    size_ = 0;
+  }
+
+  bool operator==(const LocMap &other) const {
+    if (size_ != other.size_ || present_ != other.present_) {
+      return false;
+    }
+    for (size_t i = 0; i < SIZE; ++i) {
+      if (present_[i] && !(slots_[i].second == other.slots_[i].second)) {
+        return false;
+      }
+    }
+    return true;
+  }
+  bool operator!=(const LocMap &other) const { return !operator==(other); }
+
+private:
+  static constexpr size_t SIZE = NUM_LOCS + 1; // includes Loc::NONE
+
+  static size_t idx(Loc loc) { return static_cast<size_t>(loc); }
+
+  std::array<value_type, SIZE> slots_;
+  std::bitset<SIZE> present_;
+  size_t size_ = 0;
+};
+
+// Fixed-size set of Locs, backed by a bitset. Iteration is in Loc order, i.e.
+// the same order as std::set<Loc>.
+class LocSet {
+public:
+  using key_type = Loc;
+  using value_type = Loc;
+  using size_type = size_t;
+
+  class const_iterator {
+  public:
+    using iterator_category = std::forward_iterator_tag;
+    using value_type = Loc;
+    using difference_type = std::ptrdiff_t;
+    using pointer = const Loc *;
+    using reference = Loc;
+
+    const_iterator() {}
+    const_iterator(const LocSet *s, size_t i) : s_(s), i_(i) { skip_empty(); }
+
+    Loc operator*() const { return static_cast<Loc>(i_); }
+    const_iterator &operator++() {
+      ++i_;
+      skip_empty();
+      return *this;
+    }
+    const_iterator operator++(int) {
+      const_iterator r(*this);
+      ++(*this);
+      return r;
+    }
+    bool operator==(const const_iterator &o) const { return i_ == o.i_; }
+    bool operator!=(const const_iterator &o) const { return i_ != o.i_; }
+
+  private:
+    void skip_empty() {
+      while (i_ < SIZE && !s_->bits_[i_]) {
+        ++i_;
+      }
+    }
+
+    const LocSet *s_ = nullptr;
+    size_t i_ = SIZE;
+  };
+  using iterator = const_iterator;
+
+  const_iterator begin() const { return const_iterator(this, 0); }
+  const_iterator end() const { return const_iterator(this, SIZE); }
+
+  size_t size() const { return bits_.count(); }
+  bool empty() const { return bits_.none(); }
+  size_t count(Loc loc) const { return bits_[idx(loc)] ? 1 : 0; }
+  bool contains(Loc loc) const { return bits_[idx(loc)]; }
+
+  const_iterator find(Loc loc) const {
+    return bits_[idx(loc)] ? const_iterator(this, idx(loc)) : end();
+  }
+
+  void insert(Loc loc) { bits_.set(idx(loc)); }
+  size_t erase(Loc loc) {
+    size_t r = count(loc);
+    bits_.reset(idx(loc));
+    return r;
+  }
+  void clear() { bits_.reset(); }
+
+  bool intersects(const LocSet &other) const {
+    return (bits_ & other.bits_).any();
+  }
+  LocSet &operator|=(const LocSet &other) {
+    bits_ |= other.bits_;
+    return *this;
+  }
+  LocSet &operator^=(const LocSet &other) {
+    bits_ ^= other.bits_;
+    return *this;
+  }
+
+  bool operator==(const LocSet &other) const { return bits_ == other.bits_; }
+  bool operator!=(const LocSet &other) const { return bits_ != other.bits_; }
+
+private:
+  static constexpr size_t SIZE = NUM_LOCS + 1; // includes Loc::NONE
+
+  static size_t idx(Loc loc) { return static_cast<size_t>(loc); }
+
+  std::bitset<SIZE> bits_;
+};
+
+} // namespace dipcc
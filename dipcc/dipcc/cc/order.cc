@@ -13,22 +13,31 @@ LICENSE file in the root directory of this source tree.
 
 namespace dipcc {
 
+uint32_t Order::pack(Unit unit, OrderType type, Unit target, Loc dest,
+                     bool via) {
+  return static_cast<uint32_t>(unit.type) << UNIT_TYPE_SHIFT |
+         static_cast<uint32_t>(unit.loc) << UNIT_LOC_SHIFT |
+         static_cast<uint32_t>(type) << TYPE_SHIFT |
+         static_cast<uint32_t>(target.type) << TARGET_TYPE_SHIFT |
+         static_cast<uint32_t>(target.loc) << TARGET_LOC_SHIFT |
+         static_cast<uint32_t>(dest) << DEST_SHIFT |
+         static_cast<uint32_t>(via) << VIA_SHIFT;
+}
+
 Order::Order(Unit unit, OrderType type, Unit target, Loc dest, bool via)
-    : unit_(unit), type_(type), target_(target), dest_(dest), via_(via) {}
+    : bits_(pack(unit, type, target, dest, via)) {}
 
 Order::Order(OwnedUnit unit, OrderType type, OwnedUnit target, Loc dest,
              bool via)
-    : unit_(unit.unowned()), type_(type), target_(target.unowned()),
-      dest_(dest), via_(via) {}
+    : bits_(pack(unit.unowned(), type, target.unowned(), dest, via)) {}
 
 Order::Order(OwnedUnit unit, OrderType type, Unit target, Loc dest, bool via)
-    : unit_(unit.unowned()), type_(type), target_(target), dest_(dest),
-      via_(via) {}
+    : bits_(pack(unit.unowned(), type, target, dest, via)) {}
 
 Order::Order(Unit unit, OrderType type, Loc dest)
-    : unit_(unit), type_(type), dest_(dest) {}
+    : bits_(pack(unit, type, {}, dest, false)) {}
 Order::Order(Unit unit, OrderType type, Loc dest, bool via)
-    : unit_(unit), type_(type), dest_(dest), via_(via) {}
+    : bits_(pack(unit, type, {}, dest, via)) {}
 
 Loc loc_from_str_throws(const std::string &s) {
   Loc loc = loc_from_str(s);
@@ -44,21 +53,29 @@ void check_throws(bool b, const std::string &msg) {
   }
 }
 
-Order::Order(const std::string &s) {
+namespace {
+
+Order parse_order(const std::string &s) {
+  Unit unit;
+  OrderType type = OrderType::NONE;
+  Unit target;
+  Loc dest = Loc::NONE;
+  bool via = false;
+
   check_throws(s.size() >= 7, "Can't parse order: " + s);
   size_t i = 0;
 
   // Unit type
   check_throws(s[i] == 'A' || s[i] == 'F', "Can't parse order: " + s);
-  unit_.type = s[i++] == 'A' ? UnitType::ARMY : UnitType::FLEET;
+  unit.type = s[i++] == 'A' ? UnitType::ARMY : UnitType::FLEET;
   check_throws(s[i++] == ' ', "Can't parse order: " + s);
 
   // Unit loc
   if (s[i + 3] == '/') {
-    unit_.loc = loc_from_str_throws(s.substr(i, 6));
+    unit.loc = loc_from_str_throws(s.substr(i, 6));
     i += 6;
   } else {
-    unit_.loc = loc_from_str_throws(s.substr(i, 3));
+    unit.loc = loc_from_str_throws(s.substr(i, 3));
     i += 3;
   }
   check_throws(s[i++] == ' ', "Can't parse order: " + s);
@@ -68,35 +85,35 @@ Order::Order(const std::string &s) {
 
   if (order_type == 'H' || order_type == 'B' || order_type == 'D') {
     if (order_type == 'H') {
-      type_ = OrderType::H;
+      type = OrderType::H;
     } else if (order_type == 'B') {
-      type_ = OrderType::B;
+      type = OrderType::B;
     } else {
-      type_ = OrderType::D;
+      type = OrderType::D;
     }
     check_throws(i == s.size(), "Can't parse order: " + s);
-    return;
+    return Order(unit, type, target, dest, via);
   }
 
   if (order_type == 'D') {
     // Disband
-    type_ = OrderType::D;
+    type = OrderType::D;
     check_throws(i == s.size(), "Can't parse order: " + s);
-    return;
+    return Order(unit, type, target, dest, via);
   }
 
   check_throws(s[i++] == ' ', "Can't parse order: " + s);
 
   if (order_type == '-' || order_type == 'R') {
     // Move
-    type_ = order_type == '-' ? OrderType::M : OrderType::R;
+    type = order_type == '-' ? OrderType::M : OrderType::R;
 
     // Move dest
     if (s[i + 3] == '/') {
-      dest_ = loc_from_str_throws(s.substr(i, 6));
+      dest = loc_from_str_throws(s.substr(i, 6));
       i += 6;
     } else {
-      dest_ = loc_from_str_throws(s.substr(i, 3));
+      dest = loc_from_str_throws(s.substr(i, 3));
       i += 3;
     }
 
@@ -104,32 +121,32 @@ Order::Order(const std::string &s) {
     if (order_type == '-' && i != s.size()) {
       check_throws(i + 4 == s.size(), "Can't parse order: " + s);
       check_throws(s.substr(i) == " VIA", "Can't parse order: " + s);
-      via_ = true;
+      via = true;
     }
-    return;
+    return Order(unit, type, target, dest, via);
   }
 
   // Could be SM, SH, or C
 
   // Target unit
   check_throws(s[i] == 'A' || s[i] == 'F', "Can't parse order: " + s);
-  target_.type = s[i++] == 'A' ? UnitType::ARMY : UnitType::FLEET;
+  target.type = s[i++] == 'A' ? UnitType::ARMY : UnitType::FLEET;
   check_throws(s[i++] == ' ', "Can't parse order: " + s);
 
   // Target loc
   if (s[i + 3] == '/') {
-    target_.loc = loc_from_str_throws(s.substr(i, 6));
+    target.loc = loc_from_str_throws(s.substr(i, 6));
     i += 6;
   } else {
-    target_.loc = loc_from_str_throws(s.substr(i, 3));
+    target.loc = loc_from_str_throws(s.substr(i, 3));
     i += 3;
   }
 
   // Support hold - done parsing
   if (i == s.size()) {
     check_throws(order_type == 'S', "Can't parse order: " + s);
-    type_ = OrderType::SH;
-    return;
+    type = OrderType::SH;
+    return Order(unit, type, target, dest, via);
   }
   check_throws(s[i++] == ' ', "Can't parse order: " + s);
   check_throws(s[i++] == '-', "Can't parse order: " + s);
@@ -137,35 +154,41 @@ Order::Order(const std::string &s) {
 
   // Could be SM or C - parse dest
   if (s[i + 3] == '/') {
-    dest_ = loc_from_str_throws(s.substr(i, 6));
+    dest = loc_from_str_throws(s.substr(i, 6));
     i += 6;
   } else {
-    dest_ = loc_from_str_throws(s.substr(i, 3));
+    dest = loc_from_str_throws(s.substr(i, 3));
     i += 3;
   }
 
   // We should be done now
   check_throws(i == s.size(), "Can't parse order: " + s);
   if (order_type == 'C') {
-    type_ = OrderType::C;
+    type = OrderType::C;
   } else if (order_type == 'S') {
-    type_ = OrderType::SM;
+    type = OrderType::SM;
   } else {
     check_throws(false, "Can't parse order: " + s);
   }
+  return Order(unit, type, target, dest, via);
 }
 
+} // namespace
+
+Order::Order(const std::string &s) : Order(parse_order(s)) {}
+
 std::tuple<UnitType, Loc, OrderType, UnitType, Loc, Loc, bool>
 Order::to_tuple() const {
-  return std::tie(unit_.type, unit_.loc, type_, target_.type, target_.loc,
-                  dest_, via_);
+  Unit unit = get_unit(), target = get_target();
+  return std::make_tuple(unit.type, unit.loc, get_type(), target.type,
+                         target.loc, get_dest(), get_via());
 }
 
 std::string Order::to_string() const {
   std::string s;
-  s += unit_.to_string();
+  s += get_unit().to_string();
 
-  switch (type_) {
+  switch (get_type()) {
   case OrderType::H: {
     s += " H";
     return s;
@@ -180,50 +203,42 @@ std::string Order::to_string() const {
   }
   case OrderType::M: {
     s += " - ";
-    s += loc_str(dest_);
-    if (via_) {
+    s += loc_str(get_dest());
+    if (get_via()) {
       s += " VIA";
     }
     return s;
   }
   case OrderType::R: {
     s += " R ";
-    s += loc_str(dest_);
+    s += loc_str(get_dest());
     return s;
   }
   case OrderType::SH: {
     s += " S ";
-    s += target_.to_string();
+    s += get_target().to_string();
     return s;
   }
   case OrderType::SM: {
     s += " S ";
-    s += target_.to_string();
+    s += get_target().to_string();
     s += " - ";
-    s += loc_str(dest_);
+    s += loc_str(get_dest());
     return s;
   }
   case OrderType::C: {
     s += " C ";
-    s += target_.to_string();
+    s += get_target().to_string();
     s += " - ";
-    s += loc_str(dest_);
+    s += loc_str(get_dest());
     return s;
   }
   default: {
-    JFAIL("Bad order type: " + std::to_string(static_cast<int>(type_)));
+    JFAIL("Bad order type: " + std::to_string(static_cast<int>(get_type())));
   }
   }
 }
 
-bool Order::operator==(const Order &other) const {
-  return this->get_unit() == other.get_unit() &&
-         this->get_type() == other.get_type() &&
-         this->get_target() == other.get_target() &&
-         this->get_dest() == other.get_dest() &&
-         this->get_via() == other.get_via();
-}
-
 std::ostream &operator<<(std::ostream &os, const Order &x) {
   return os << "Order(\"" << x.to_string() << "\")";
 }
@@ -243,9 +258,9 @@ bool loc_order_cmp(const Order &a, const Order &b) {
 }
 
 Order Order::as_normalized() const {
-  Order order(*this);
-  order.target_.loc = root_loc(order.target_.loc);
-  return order;
+  Unit target = get_target();
+  target.loc = root_loc(target.loc);
+  return Order(get_unit(), get_type(), target, get_dest(), get_via());
 }
 
 } // namespace dipcc
@@ -6,6 +6,7 @@ LICENSE file in the root directory of this source tree.
 */
 #pragma once
 
+#include <cstdint>
 #include <glog/logging.h>
 #include <tuple>
 
@@ -17,6 +18,12 @@ LICENSE file in the root directory of this source tree.
 
 namespace dipcc {
 
+// An order packed into a single 32-bit integer. The fields are laid out from
+// the most to the least significant bit in to_tuple() order, so that
+// comparing two packed orders is the same as comparing their tuples.
+//
+// The packed value doubles as the order's ID in a global order ID space of
+// size MAX_ID (see get_id / from_id).
 class Order {
 public:
   // Constructors
@@ -32,11 +39,26 @@ public:
   Order(const std::string &s);
 
   // Getters
-  Unit get_unit() const { return unit_; }
-  OrderType get_type() const { return type_; }
-  Unit get_target() const { return target_; }
-  Loc get_dest() const { return dest_; }
-  bool get_via() const { return via_; }
+  Unit get_unit() const {
+    return unit_of(field(UNIT_TYPE_SHIFT, 2), field(UNIT_LOC_SHIFT, 7));
+  }
+  OrderType get_type() const {
+    return static_cast<OrderType>(field(TYPE_SHIFT, 4));
+  }
+  Unit get_target() const {
+    return unit_of(field(TARGET_TYPE_SHIFT, 2), field(TARGET_LOC_SHIFT, 7));
+  }
+  Loc get_dest() const { return static_cast<Loc>(field(DEST_SHIFT, 7)); }
+  bool get_via() const { return field(VIA_SHIFT, 1); }
+
+  // Unique integer ID of the order, in [0, MAX_ID)
+  uint32_t get_id() const { return bits_; }
+  static Order from_id(uint32_t id) {
+    Order order;
+    order.bits_ = id;
+    return order;
+  }
+  static constexpr uint32_t MAX_ID = 1u << 30;
 
   // Convert to order string
   std::string to_string() const;
@@ -50,23 +72,41 @@ public:
   // Comparator (to enable use as set/map key)
   std::tuple<UnitType, Loc, OrderType, UnitType, Loc, Loc, bool>
   to_tuple() const;
-  bool operator<(const Order &other) const {
-    return this->to_tuple() < other.to_tuple();
-  }
+  bool operator<(const Order &other) const { return bits_ < other.bits_; }
 
   // Equality comparator
-  bool operator==(const Order &other) const;
+  bool operator==(const Order &other) const { return bits_ == other.bits_; }
+  bool operator!=(const Order &other) const { return bits_ != other.bits_; }
 
   // Print operator
   friend std::ostream &operator<<(std::ostream &os, const Order &);
 
 private:
+  // Bit offsets of the packed fields. target is used for SH, SM, C; dest for
+  // M, SM, C; via for M.
+  static constexpr int VIA_SHIFT = 0;
+  static constexpr int DEST_SHIFT = 1;
+  static constexpr int TARGET_LOC_SHIFT = 8;
+  static constexpr int TARGET_TYPE_SHIFT = 15;
+  static constexpr int TYPE_SHIFT = 17;
+  static constexpr int UNIT_LOC_SHIFT = 21;
+  static constexpr int UNIT_TYPE_SHIFT = 28;
+  static_assert(NUM_LOCS < (1 << 7), "Loc does not fit in 7 bits");
+
+  static uint32_t pack(Unit unit, OrderType type, Unit target, Loc dest,
+                       bool via);
+  uint32_t field(int shift, int width) const {
+    return (bits_ >> shift) & ((1u << width) - 1);
+  }
+  static Unit unit_of(uint32_t type, uint32_t loc) {
+    Unit unit;
+    unit.type = static_cast<UnitType>(type);
+    unit.loc = static_cast<Loc>(loc);
+    return unit;
+  }
+
   // Members
-  Unit unit_;
-  OrderType type_;
-  Unit target_ = {UnitType::NONE, Loc::NONE}; // Used for SH, SM, C
-  Loc dest_ = Loc::NONE;                      // Used for M, SM, C
-  bool via_ = false;                          // Used for M
+  uint32_t bits_ = 0;
 };
 
 // Comparator function implemening LOCS-ordering
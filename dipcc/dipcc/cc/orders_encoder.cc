@@ -7,6 +7,7 @@ LICENSE file in the root directory of this source tree.
 #include "orders_encoder.h"
 #include <algorithm>
 #include <glog/logging.h>
+#include <stdexcept>
 #include <string>
 #include <utility>
 #include <vector>
@@ -20,9 +21,44 @@ using namespace std;
 namespace dipcc {
 
 // forward declares
-vector<string> get_compound_build_orders(
-    const unordered_map<dipcc::Loc, set<dipcc::Order>> &all_possible_orders,
-    vector<Loc> orderable_locs, int n_builds);
+vector<uint64_t> get_compound_build_keys(
+    const PossibleOrders &all_possible_orders,
+    const vector<Loc> &orderable_locs, int n_builds);
+
+namespace {
+
+// Key of a compound build order: the (type, loc) codes of its built units,
+// sorted and packed 9 bits each. Codes are >= 1 << 7, so keys of different
+// numbers of builds never collide.
+constexpr int BUILD_UNIT_BITS = 9;
+constexpr size_t MAX_KEYED_BUILDS = 64 / BUILD_UNIT_BITS;
+
+uint32_t build_unit_code(const Order &order) {
+  Unit unit = order.get_unit();
+  return static_cast<uint32_t>(unit.type) << 7 |
+         static_cast<uint32_t>(unit.loc);
+}
+
+uint64_t build_units_key(vector<uint32_t> &codes) {
+  sort(codes.begin(), codes.end());
+  uint64_t key = 0;
+  for (uint32_t code : codes) {
+    key = key << BUILD_UNIT_BITS | code;
+  }
+  return key;
+}
+
+// Returns the Order whose to_string() is s, if there is one
+bool parse_vocab_order(const string &s, Order *order) {
+  try {
+    *order = Order(s);
+  } catch (const std::invalid_argument &) {
+    return false;
+  }
+  return order->to_string() == s;
+}
+
+} // namespace
 
 // Constructor
 OrdersDecoder::OrdersDecoder(
@@ -38,14 +74,59 @@ OrdersDecoder::OrdersDecoder(
   for (auto &p : order_vocabulary_to_idx) {
     order_vocabulary_[p.second] = p.first;
   }
+
+  // init vocab_orders_
+  vocab_orders_.resize(order_vocabulary_.size());
+  vocab_orders_ok_.resize(order_vocabulary_.size(), true);
+  for (size_t i = 0; i < order_vocabulary_.size(); ++i) {
+    const string &order = order_vocabulary_[i];
+    for (size_t start = 0, end = 0; end != string::npos; start = end + 1) {
+      end = order.find(';', start);
+      try {
+        vocab_orders_[i].emplace_back(order.substr(start, end - start));
+      } catch (const std::invalid_argument &) {
+        vocab_orders_[i].clear();
+        vocab_orders_ok_[i] = false;
+        break;
+      }
+    }
+  }
 }
 
 // Constructor
 OrdersEncoder::OrdersEncoder(
     const std::unordered_map<std::string, int> &order_vocabulary_to_idx,
     int max_cands, bool allow_buggy_duplicates)
-    : order_vocabulary_to_idx_(order_vocabulary_to_idx), max_cands_(max_cands),
-      allow_buggy_duplicates_(allow_buggy_duplicates) {}
+    : max_cands_(max_cands), allow_buggy_duplicates_(allow_buggy_duplicates) {
+  order_idx_by_id_.reserve(order_vocabulary_to_idx.size());
+  for (auto &[order_s, idx] : order_vocabulary_to_idx) {
+    Order order;
+    if (order_s.find(';') == string::npos) {
+      if (parse_vocab_order(order_s, &order)) {
+        order_idx_by_id_[order.get_id()] = idx;
+        if (order.get_type() == OrderType::B) {
+          vector<uint32_t> codes{build_unit_code(order)};
+          build_idx_by_units_[build_units_key(codes)] = idx;
+        }
+      }
+      continue;
+    }
+
+    // Compound build order, e.g. "A PAR B;F BRE B"
+    vector<uint32_t> codes;
+    bool ok = true;
+    for (size_t start = 0, end = 0; ok && end != string::npos;
+         start = end + 1) {
+      end = order_s.find(';', start);
+      ok = parse_vocab_order(order_s.substr(start, end - start), &order) &&
+           order.get_type() == OrderType::B;
+      codes.push_back(build_unit_code(order));
+    }
+    if (ok && codes.size() <= MAX_KEYED_BUILDS) {
+      build_idx_by_units_[build_units_key(codes)] = idx;
+    }
+  }
+}
 
 void OrdersEncoder::encode_prev_orders_deepmind(const Game *game,
                                                 long *r) const {
@@ -90,9 +171,8 @@ void OrdersEncoder::encode_orders_deepmind(
   for (size_t i = 0; i < orders.size(); ++i) {
     const Order &order = orders[i];
     const GameState *state = state_for_each_order[i];
-    auto x = order_vocabulary_to_idx_.find(order.to_string());
-    if (x != order_vocabulary_to_idx_.end()) {
-      int32_t order_idx = x->second;
+    int order_idx = order_index(order);
+    if (order_idx != -1) {
       int8_t loc_idx = static_cast<int>(order.get_unit().loc) - 1;
       orders_pairs.push_back(make_pair(order_idx, loc_idx));
     } else {
@@ -110,9 +190,8 @@ void OrdersEncoder::encode_orders_deepmind(
           Order alternative_order(order.get_unit(), order.get_type(),
                                   supportee.unowned(), order.get_dest(),
                                   order.get_via());
-          x = order_vocabulary_to_idx_.find(alternative_order.to_string());
-          if (x != order_vocabulary_to_idx_.end()) {
-            int32_t order_idx = x->second;
+          order_idx = order_index(alternative_order);
+          if (order_idx != -1) {
             int8_t loc_idx =
                 static_cast<int>(alternative_order.get_unit().loc) - 1;
             orders_pairs.push_back(make_pair(order_idx, loc_idx));
@@ -237,14 +316,14 @@ void OrdersEncoder::encode_adj_phase(Power power, GameState &state,
   if (n_builds > 0) {
     // builds phase
     n_builds = min(n_builds, static_cast<int>(orderable_locs.size()));
-    vector<string> orders(get_compound_build_orders(all_possible_orders,
-                                                    orderable_locs, n_builds));
-    vector<int> order_idxs(orders.size());
-    for (int j = 0; j < orders.size(); ++j) {
-      order_idxs[j] = order_vocabulary_to_idx_.at(orders[j]);
+    vector<uint64_t> keys(
+        get_compound_build_keys(all_possible_orders, orderable_locs, n_builds));
+    vector<int> order_idxs(keys.size());
+    for (int j = 0; j < keys.size(); ++j) {
+      order_idxs[j] = build_idx_by_units_.at(keys[j]);
     }
     sort(order_idxs.begin(), order_idxs.end());
-    for (int j = 0; j < orders.size(); ++j) {
+    for (int j = 0; j < order_idxs.size(); ++j) {
       P_IDX(r_order_idxs, max_cands_, 0, j) = order_idxs[j];
     }
     for (Loc loc : orderable_locs) {
@@ -399,8 +478,49 @@ vector<vector<vector<string>>> OrdersDecoder::decode_order_idxs_all_powers(
   return order_strings;
 } // decode_order_idxs_all_powers
 
+vector<vector<Order>>
+OrdersDecoder::decode_orders(const torch::Tensor &order_idxs, int64_t b,
+                             const torch::Tensor *x_in_adj_phase,
+                             const torch::Tensor *x_power) const {
+  auto accessor = order_idxs.accessor<long, 3>();
+  long max_seq_len = accessor.size(2);
+
+  vector<vector<Order>> r(7);
+  for (int p = 0; p < 7; ++p) {
+    auto &rp = r[p];
+    for (int i = 0; i < max_seq_len; ++i) {
+      long order_idx = accessor[b][p][i];
+      if (order_idx == OrdersEncoder::EOS_IDX) {
+        continue;
+      }
+      if (order_idx < 0 || order_idx >= (long)vocab_orders_ok_.size() ||
+          !vocab_orders_ok_[order_idx]) {
+        JFAIL("Can't decode order idx: " + std::to_string(order_idx));
+      }
+      const auto &orders = vocab_orders_[order_idx];
+      rp.insert(rp.end(), orders.begin(), orders.end());
+    }
+    std::sort(rp.begin(), rp.end(), loc_order_cmp);
+  }
+
+  if (x_power != nullptr && x_in_adj_phase->accessor<float, 1>()[b] <= 0.5) {
+    auto accessor_power = x_power->accessor<long, 3>();
+    vector<Order> joint_orders;
+    joint_orders.swap(r[0]);
+    for (int order_index = 0; order_index < joint_orders.size();
+         ++order_index) {
+      const long power = accessor_power[b][0][order_index];
+      if (power == -1)
+        break;
+      r[power].push_back(joint_orders[order_index]);
+    }
+  }
+
+  return r;
+} // decode_orders
+
 vector<int>
-OrdersEncoder::filter_orders_in_vocab(const set<Order> &orders) const {
+OrdersEncoder::filter_orders_in_vocab(const OrderSpan &orders) const {
   vector<int> idxs;
   idxs.reserve(orders.size());
   if (allow_buggy_duplicates_) {
@@ -425,39 +545,30 @@ OrdersEncoder::filter_orders_in_vocab(const set<Order> &orders) const {
   return idxs;
 }
 
+int OrdersEncoder::order_index(const Order &order) const {
+  auto it = order_idx_by_id_.find(order.get_id());
+  return it == order_idx_by_id_.end() ? -1 : it->second;
+}
+
 int OrdersEncoder::smarter_order_index(const Order &order) const {
-  string order_s(order.to_string());
-  auto it = order_vocabulary_to_idx_.find(order_s);
-  if (it != order_vocabulary_to_idx_.end()) {
-    return it->second;
+  int idx = order_index(order);
+  if (idx != -1) {
+    return idx;
   }
 
   // Try order with no coasts
-  string order_s_no_coasts;
-  order_s_no_coasts.reserve(order_s.size());
-  for (int i = 0; i < order_s.size();) {
-    char c = order_s[i];
-    if (c == '/') {
-      i += 3; // skip coast
-    } else {
-      order_s_no_coasts += c;
-      i += 1;
-    }
-  }
-
-  it = order_vocabulary_to_idx_.find(order_s_no_coasts);
-  if (it != order_vocabulary_to_idx_.end()) {
-    return it->second;
-  }
-
-  // Give up
-  return -1;
+  Unit unit = order.get_unit();
+  Unit target = order.get_target();
+  unit.loc = root_loc(unit.loc);
+  target.loc = root_loc(target.loc);
+  return order_index(Order(unit, order.get_type(), target,
+                           root_loc(order.get_dest()), order.get_via()));
 }
 
 template <typename T>
 vector<Loc> OrdersEncoder::get_sorted_actual_orderable_locs(
     const T &root_locs,
-    const unordered_map<dipcc::Loc, set<dipcc::Order>> &all_possible_orders)
+    const PossibleOrders &all_possible_orders)
     const {
   vector<Loc> locs;
   locs.reserve(root_locs.size());
@@ -503,55 +614,39 @@ void combinations(int n, int c, function<void(const vector<int> &)> foo) {
   combinations_impl(0, n, c, v, foo);
 }
 
-vector<string> get_compound_build_orders(
-    const unordered_map<dipcc::Loc, set<dipcc::Order>> &all_possible_orders,
-    vector<Loc> orderable_locs, int n_builds) {
-
-  vector<string> r;
+// Returns build_units_key() of each combination of n_builds builds at
+// distinct orderable_locs
+vector<uint64_t> get_compound_build_keys(
+    const PossibleOrders &all_possible_orders,
+    const vector<Loc> &orderable_locs, int n_builds) {
+  vector<uint64_t> r;
   r.reserve(64);
 
   combinations(orderable_locs.size(), n_builds,
                [&](const vector<int> &orderable_locs_idxs) {
-                 vector<vector<Order>> order_lists;
-                 order_lists.resize(n_builds);
+                 vector<vector<uint32_t>> code_lists(n_builds);
                  int product = 1;
-
                  for (int i = 0; i < n_builds; ++i) {
-
                    for (Loc loc :
                         expand_coasts(orderable_locs[orderable_locs_idxs[i]])) {
                      for (const Order &order : all_possible_orders.at(loc)) {
-                       order_lists[i].push_back(order);
+                       code_lists[i].push_back(build_unit_code(order));
                      }
                    }
-                   product *= order_lists[i].size();
+                   product *= code_lists[i].size();
                  }
 
                  vector<int> counter(n_builds, 0);
-
-                 vector<string> orders_to_cat;
-                 orders_to_cat.resize(n_builds);
-
+                 vector<uint32_t> codes(n_builds);
                  for (int i = 0; i < product; ++i) {
-
-                   // Gather orders to cat
                    for (int j = 0; j < n_builds; ++j) {
-                     orders_to_cat[j] =
-                         (order_lists[j][counter[j]].to_string());
-                   }
-                   sort(orders_to_cat.begin(), orders_to_cat.end());
-
-                   // Cat orders and add to final list
-                   string cat(orders_to_cat[0]);
-                   for (int k = 1; k < orders_to_cat.size(); ++k) {
-                     cat += ";";
-                     cat += orders_to_cat[k];
+                     codes[j] = code_lists[j][counter[j]];
                    }
-                   r.push_back(cat);
+                   r.push_back(build_units_key(codes));
 
                    // Increase counter
                    for (int j = n_builds - 1; j >= 0; --j) {
-                     if (counter[j] == order_lists[j].size() - 1) {
+                     if (counter[j] == code_lists[j].size() - 1) {
                        counter[j] = 0;
                      } else {
                        counter[j] += 1;
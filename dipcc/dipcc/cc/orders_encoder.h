@@ -54,18 +54,24 @@ public:
 
 private:
   // Methods
+  int order_index(const Order &) const;
   int smarter_order_index(const Order &) const;
-  std::vector<int> filter_orders_in_vocab(const std::set<Order> &) const;
+  std::vector<int> filter_orders_in_vocab(const OrderSpan &) const;
   template <typename T>
   std::vector<Loc> get_sorted_actual_orderable_locs(
       const T &root_locs,
-      const std::unordered_map<dipcc::Loc, std::set<dipcc::Order>>
-          &all_possible_orders) const;
+      const PossibleOrders &all_possible_orders) const;
   void encode_adj_phase(Power power, GameState &state, int32_t *r_order_idxs,
                         int8_t *r_loc_idxs) const;
 
   // Data
-  std::unordered_map<std::string, int> order_vocabulary_to_idx_;
+  //
+  // Vocab lookup tables, built once in the constructor so that encoding does
+  // no string formatting or hashing: packed Order id -> vocab idx for each
+  // single order in the vocab, and build_units_key() -> vocab idx for each
+  // single or compound build order.
+  std::unordered_map<uint32_t, int> order_idx_by_id_;
+  std::unordered_map<uint64_t, int> build_idx_by_units_;
   int max_cands_;
   // If true, behave in a buggy fashion that sometimes outputs duplicate coastal
   // orders, preserving old behavior pre-mid-November 2021.
@@ -88,9 +94,24 @@ public:
                                torch::Tensor *x_power,
                                int batch_repeat_interleave) const;
 
+  // Decode row b of a [B, 7, S]-shape tensor of EOS_IDX-padded order idxs
+  // straight to Order objects, with no string round trip. Returns the orders
+  // of each power, in the same order as decode_order_idxs. If x_power is not
+  // null, decodes all-power outputs as decode_order_idxs_all_powers does,
+  // using row b of x_in_adj_phase and x_power.
+  std::vector<std::vector<Order>>
+  decode_orders(const torch::Tensor &order_idxs, int64_t b,
+                const torch::Tensor *x_in_adj_phase = nullptr,
+                const torch::Tensor *x_power = nullptr) const;
+
 private:
   // Data
   std::vector<std::string> order_vocabulary_;
+
+  // order_vocabulary_ parsed once, compound build orders split into their
+  // single builds. vocab_orders_ok_[i] is false if entry i failed to parse.
+  std::vector<std::vector<Order>> vocab_orders_;
+  std::vector<bool> vocab_orders_ok_;
 };
 
 } // namespace dipcc
@@ -0,0 +1,235 @@
+/*
+Copyright (c) Meta Platforms, Inc. and affiliates.
+
+This source code is licensed under the MIT license found in the
+LICENSE file in the root directory of this source tree.
+*/
+#pragma once
+
+#include <cstddef>
+#include <iterator>
+#include <memory>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#include "phase.h"
+
+namespace dipcc {
+
+// Persistent map from Phase to V, stored as a singly-linked chain of nodes
+// ordered newest-first, with the tail of the chain shared between copies.
+//
+// Copying a PhaseHistory is O(1) (a single shared_ptr copy), and appending a
+// phase newer than every existing one is O(1) and never touches the shared
+// tail. Modifying an existing entry copies only the nodes from the head down
+// to that entry, and only if they are shared with another PhaseHistory.
+//
+// Lookups walk the chain from the newest phase, so they are cheapest for
+// recent phases, which is the common access pattern in Game.
+template <typename V> class PhaseHistory {
+public:
+  using key_type = Phase;
+  using mapped_type = V;
+  using value_type = std::pair<const Phase, V>;
+  using size_type = size_t;
+
+private:
+  struct Node {
+    Node(Phase phase, V value, std::shared_ptr<Node> prev)
+        : kv(phase, std::move(value)), prev(std::move(prev)),
+          size(this->prev ? this->prev->size + 1 : 1) {}
+
+    value_type kv;
+    std::shared_ptr<Node> prev; // next older phase, or nullptr
+    size_t size;                // number of nodes in the chain from here
+  };
+
+public:
+  // Iterates from the newest to the oldest phase
+  class const_reverse_iterator {
+  public:
+    using iterator_category = std::forward_iterator_tag;
+    using value_type = PhaseHistory::value_type;
+    using difference_type = std::ptrdiff_t;
+    using pointer = const value_type *;
+    using reference = const value_type &;
+
+    const_reverse_iterator() {}
+    explicit const_reverse_iterator(const Node *n) : n_(n) {}
+
+    reference operator*() const { return n_->kv; }
+    pointer operator->() const { return &n_->kv; }
+    const_reverse_iterator &operator++() {
+      n_ = n_->prev.get();
+      return *this;
+    }
+    const_reverse_iterator operator++(int) {
+      const_reverse_iterator r(*this);
+      ++(*this);
+      return r;
+    }
+    bool operator==(const const_reverse_iterator &o) const {
+      return n_ == o.n_;
+    }
+    bool operator!=(const const_reverse_iterator &o) const {
+      return n_ != o.n_;
+    }
+
+  private:
+    const Node *n_ = nullptr;
+  };
+
+  // Snapshot of the entries in oldest-to-newest order, for range-for loops.
+  // Holds raw pointers into the chain, so it must not outlive the history it
+  // was taken from or any modification of it.
+  class InOrder {
+  public:
+    class const_iterator {
+    public:
+      using iterator_category = std::forward_iterator_tag;
+      using value_type = PhaseHistory::value_type;
+      using difference_type = std::ptrdiff_t;
+      using pointer = const value_type *;
+      using reference = const value_type &;
+
+      explicit const_iterator(
+          typename std::vector<const value_type *>::const_iterator it)
+          : it_(it) {}
+
+      reference operator*() const { return **it_; }
+      pointer operator->() const { return *it_; }
+      const_iterator &operator++() {
+        ++it_;
+        return *this;
+      }
+      bool operator==(const const_iterator &o) const { return it_ == o.it_; }
+      bool operator!=(const const_iterator &o) const { return it_ != o.it_; }
+
+    private:
+      typename std::vector<const value_type *>::const_iterator it_;
+    };
+
+    explicit InOrder(const Node *head) {
+      entries_.resize(head ? head->size : 0);
+      size_t i = entries_.size();
+      for (const Node *n = head; n != nullptr; n = n->prev.get()) {
+        entries_[--i] = &n->kv;
+      }
+    }
+
+    const_iterator begin() const { return const_iterator(entries_.begin()); }
+    const_iterator end() const { return const_iterator(entries_.end()); }
+
+  private:
+    std::vector<const value_type *> entries_;
+  };
+
+  size_t size() const { return head_ ? head_->size : 0; }
+  bool empty() const { return head_ == nullptr; }
+
+  const_reverse_iterator rbegin() const {
+    return const_reverse_iterator(head_.get());
+  }
+  const_reverse_iterator rend() const { return const_reverse_iterator(); }
+
+  InOrder in_order() const { return InOrder(head_.get()); }
+
+  // Newest / oldest entry. Must not be called on an empty history.
+  const value_type &last() const { return head_->kv; }
+  const value_type &first() const {
+    const Node *n = head_.get();
+    while (n->prev != nullptr) {
+      n = n->prev.get();
+    }
+    return n->kv;
+  }
+
+  // Returns nullptr if phase is not present
+  const V *find(Phase phase) const {
+    const Node *n = find_node(phase);
+    return n ? &n->kv.second : nullptr;
+  }
+
+  bool contains(Phase phase) const { return find_node(phase) != nullptr; }
+
+  const V &at(Phase phase) const {
+    const Node *n = find_node(phase);
+    if (n == nullptr) {
+      throw std::out_of_range("PhaseHistory::at " + phase.to_string());
+    }
+    return n->kv.second;
+  }
+
+  // Returns a mutable reference to the value for phase, inserting a
+  // default-constructed value if it is not present. Any nodes between the
+  // head and phase that are shared with another PhaseHistory are copied first,
+  // so the modification is never visible through a copy.
+  V &mutable_at(Phase phase) {
+    // Fast path: modify or append at the head
+    if (head_ != nullptr && head_->kv.first == phase &&
+        head_.use_count() == 1) {
+      return head_->kv.second;
+    }
+    if (head_ == nullptr || head_->kv.first < phase) {
+      head_ = std::make_shared<Node>(phase, V{}, std::move(head_));
+      return head_->kv.second;
+    }
+
+    // Slow path: unlink all newer nodes, then re-link copies of them on top
+    // of a fresh node for phase
+    std::vector<const Node *> newer;
+    std::shared_ptr<Node> rest = head_;
+    while (rest != nullptr && phase < rest->kv.first) {
+      newer.push_back(rest.get());
+      rest = rest->prev;
+    }
+    std::shared_ptr<Node> target;
+    if (rest != nullptr && rest->kv.first == phase) {
+      target = std::make_shared<Node>(phase, rest->kv.second, rest->prev);
+    } else {
+      target = std::make_shared<Node>(phase, V{}, rest);
+    }
+    std::shared_ptr<Node> head = target;
+    for (auto it = newer.rbegin(); it != newer.rend(); ++it) {
+      head = std::make_shared<Node>((*it)->kv.first, (*it)->kv.second, head);
+    }
+    head_ = std::move(head);
+    return target->kv.second;
+  }
+
+  void set(Phase phase, V value) { mutable_at(phase) = std::move(value); }
+
+  // Removes all entries >= phase
+  void erase_from(Phase phase) {
+    while (head_ != nullptr && phase <= head_->kv.first) {
+      head_ = head_->prev;
+    }
+  }
+
+  // Removes all entries > phase
+  void erase_after(Phase phase) {
+    while (head_ != nullptr && phase < head_->kv.first) {
+      head_ = head_->prev;
+    }
+  }
+
+  void clear() { head_.reset(); }
+
+private:
+  const Node *find_node(Phase phase) const {
+    for (const Node *n = head_.get(); n != nullptr; n = n->prev.get()) {
+      if (n->kv.first == phase) {
+        return n;
+      }
+      if (n->kv.first < phase) {
+        return nullptr;
+      }
+    }
+    return nullptr;
+  }
+
+  std::shared_ptr<Node> head_;
+};
+
+} // namespace dipcc
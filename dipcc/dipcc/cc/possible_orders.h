@@ -0,0 +1,149 @@
+/*
+Copyright (c) Meta Platforms, Inc. and affiliates.
+
+This source code is licensed under the MIT license found in the
+LICENSE file in the root directory of this source tree.
+*/
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#include "loc.h"
+#include "order.h"
+
+namespace dipcc {
+
+// Read-only view of a sorted run of distinct orders.
+//
+// Drop-in replacement for the subset of the const std::set<Order> interface
+// used with possible orders. Lookups are binary searches over packed orders.
+class OrderSpan {
+public:
+  using value_type = Order;
+  using size_type = size_t;
+  using const_iterator = const Order *;
+  using iterator = const_iterator;
+
+  OrderSpan() {}
+  OrderSpan(const Order *begin, const Order *end) : begin_(begin), end_(end) {}
+
+  const_iterator begin() const { return begin_; }
+  const_iterator end() const { return end_; }
+  size_t size() const { return end_ - begin_; }
+  bool empty() const { return begin_ == end_; }
+
+  const_iterator find(const Order &order) const {
+    const Order *it = std::lower_bound(begin_, end_, order);
+    return it != end_ && *it == order ? it : end_;
+  }
+  size_t count(const Order &order) const { return find(order) != end_; }
+  bool contains(const Order &order) const { return find(order) != end_; }
+
+private:
+  const Order *begin_ = nullptr;
+  const Order *end_ = nullptr;
+};
+
+// All possible orders of a GameState, keyed by the loc of the ordered unit.
+//
+// The orders of all locs are stored in a single flat array, sorted by loc and
+// then by order, and each loc maps to an OrderSpan over its part of the array.
+// Drop-in replacement for the subset of the const
+// std::unordered_map<Loc, std::set<Order>> interface used by callers, except
+// that iteration is in Loc order.
+//
+// Built by calling insert() for each order, in any order and with any
+// duplicates, and then finalize() once before any lookup.
+class PossibleOrders {
+public:
+  using key_type = Loc;
+  using mapped_type = OrderSpan;
+  using value_type = std::pair<Loc, OrderSpan>;
+  using size_type = size_t;
+  using const_iterator = std::vector<value_type>::const_iterator;
+  using iterator = const_iterator;
+
+  PossibleOrders() { entry_idx_.fill(-1); }
+  PossibleOrders(const PossibleOrders &other) { *this = other; }
+  PossibleOrders &operator=(const PossibleOrders &other) {
+    pending_ = other.pending_;
+    orders_ = other.orders_;
+    entries_ = other.entries_;
+    entry_idx_ = other.entry_idx_;
+    for (auto &entry : entries_) {
+      entry.second = OrderSpan(
+          orders_.data() + (entry.second.begin() - other.orders_.data()),
+          orders_.data() + (entry.second.end() - other.orders_.data()));
+    }
+    return *this;
+  }
+
+  void insert(Loc loc, Order order) { pending_.emplace_back(loc, order); }
+
+  void finalize() {
+    std::sort(pending_.begin(), pending_.end());
+    pending_.erase(std::unique(pending_.begin(), pending_.end()),
+                   pending_.end());
+    orders_.resize(pending_.size());
+    for (size_t i = 0; i < pending_.size(); ++i) {
+      orders_[i] = pending_[i].second;
+    }
+    size_t begin = 0;
+    while (begin < pending_.size()) {
+      Loc loc = pending_[begin].first;
+      size_t end = begin + 1;
+      while (end < pending_.size() && pending_[end].first == loc) {
+        ++end;
+      }
+      entry_idx_[static_cast<size_t>(loc)] = entries_.size();
+      entries_.emplace_back(
+          loc, OrderSpan(orders_.data() + begin, orders_.data() + end));
+      begin = end;
+    }
+    pending_.clear();
+    pending_.shrink_to_fit();
+  }
+
+  const_iterator begin() const { return entries_.begin(); }
+  const_iterator end() const { return entries_.end(); }
+  size_t size() const { return entries_.size(); }
+  bool empty() const { return entries_.empty(); }
+
+  // Total number of orders over all locs
+  size_t num_orders() const { return orders_.size(); }
+
+  const_iterator find(Loc loc) const {
+    int16_t i = entry_idx_[static_cast<size_t>(loc)];
+    return i < 0 ? end() : begin() + i;
+  }
+  size_t count(Loc loc) const { return find(loc) != end(); }
+  bool contains(Loc loc) const { return find(loc) != end(); }
+
+  const OrderSpan &at(Loc loc) const {
+    auto it = find(loc);
+    if (it == end()) {
+      throw std::out_of_range("PossibleOrders::at " + loc_str(loc));
+    }
+    return it->second;
+  }
+
+  // Unlike std::unordered_map, returns an empty span if loc is not present
+  OrderSpan operator[](Loc loc) const {
+    auto it = find(loc);
+    return it == end() ? OrderSpan() : it->second;
+  }
+
+private:
+  std::vector<std::pair<Loc, Order>> pending_; // inserted, not yet finalized
+  std::vector<Order> orders_;
+  std::vector<value_type> entries_;
+  std::array<int16_t, NUM_LOCS + 1> entry_idx_; // index into entries_, or -1
+};
+
+} // namespace dipcc
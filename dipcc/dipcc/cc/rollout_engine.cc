@@ -0,0 +1,230 @@
+/*
+Copyright (c) Meta Platforms, Inc. and affiliates.
+
+This source code is licensed under the MIT license found in the
+LICENSE file in the root directory of this source tree.
+*/
+#include "rollout_engine.h"
+#include "checks.h"
+
+using namespace std;
+
+namespace dipcc {
+
+namespace {
+
+// The movement phase n movement phases after from, matching
+// fairdiplomacy.agents.base_search_agent.n_move_phases_later
+Phase n_move_phases_later(const Phase &from, int n) {
+  if (n == 0) {
+    return from;
+  }
+  int from_idx = 2 * (static_cast<int>(from.year) - 1901) +
+                 (from.season == 'F' || from.season == 'W' ? 1 : 0);
+  int to_idx = from_idx + n;
+  return Phase(to_idx % 2 == 0 ? 'S' : 'F', to_idx / 2 + 1901, 'M');
+}
+
+} // namespace
+
+RolloutEngine::RolloutEngine(
+    const Game &game, int n_games, std::shared_ptr<ThreadPool> thread_pool,
+    int input_version, bool all_powers, int max_rollout_length,
+    const std::map<int, float> &year_spring_prob_of_ending)
+    : batch_(game, n_games), start_phase_(game.get_state().get_phase()),
+      thread_pool_(thread_pool), input_version_(input_version),
+      all_powers_(all_powers), max_rollout_length_(max_rollout_length),
+      year_spring_prob_of_ending_(year_spring_prob_of_ending),
+      start_orders_set_(n_games), spring_ending_ev_(n_games * NUM_POWERS),
+      cumulative_spring_prob_(n_games) {
+  JCHECK(thread_pool_ != nullptr, "RolloutEngine needs a thread pool");
+  JCHECK(max_rollout_length >= 0, "RolloutEngine max_rollout_length < 0");
+  for (auto &set : start_orders_set_) {
+    set.fill(false);
+  }
+}
+
+void RolloutEngine::set_start_orders(int64_t game_idx, const string &power,
+                                     const vector<string> &orders) {
+  batch_.get_game(game_idx).set_orders(power, orders);
+  start_orders_set_.at(game_idx)[static_cast<int>(power_from_str(power)) - 1] =
+      true;
+}
+
+void RolloutEngine::run(const RolloutPolicy &policy) {
+  const OrdersDecoder &decoder = thread_pool_->get_orders_decoder();
+  run_impl([&](vector<Game *> &games, const vector<int64_t> &game_idxs,
+               bool keep_start_orders) {
+    TensorDict fields =
+        all_powers_
+            ? thread_pool_->encode_inputs_all_powers_multi(games,
+                                                           input_version_)
+            : thread_pool_->encode_inputs_multi(games, input_version_);
+    torch::Tensor order_idxs = policy(fields, game_idxs);
+    JCHECK(order_idxs.dim() == 3 && order_idxs.size(0) == games.size(),
+           "RolloutEngine policy returned " +
+               std::to_string(order_idxs.size(0)) + " actions for " +
+               std::to_string(games.size()) + " games");
+    if (!keep_start_orders) {
+      if (all_powers_) {
+        thread_pool_->decode_and_set_orders_all_powers(
+            games, order_idxs, fields.at("x_in_adj_phase"),
+            fields.at("x_power"));
+      } else {
+        thread_pool_->decode_and_set_orders(games, order_idxs);
+      }
+      return;
+    }
+    const torch::Tensor *x_in_adj_phase =
+        all_powers_ ? &fields.at("x_in_adj_phase") : nullptr;
+    const torch::Tensor *x_power =
+        all_powers_ ? &fields.at("x_power") : nullptr;
+    for (size_t i = 0; i < games.size(); ++i) {
+      auto orders =
+          decoder.decode_orders(order_idxs, i, x_in_adj_phase, x_power);
+      for (int p = 0; p < NUM_POWERS; ++p) {
+        if (!start_orders_set_[game_idxs[i]][p]) {
+          games[i]->set_orders(POWERS[p], orders[p]);
+        }
+      }
+    }
+  });
+}
+
+void RolloutEngine::run(float temperature, float top_p) {
+  JCHECK(thread_pool_->has_policy_module(),
+         "RolloutEngine::run needs a policy module loaded in the thread pool");
+  run_impl([&](vector<Game *> &games, const vector<int64_t> &game_idxs,
+               bool keep_start_orders) {
+    if (!keep_start_orders) {
+      thread_pool_->forward_policy_and_set_orders_multi(
+          games, input_version_, all_powers_, temperature, top_p);
+      return;
+    }
+    auto orders = thread_pool_->forward_policy_multi(
+        games, input_version_, all_powers_, temperature, top_p);
+    for (size_t i = 0; i < games.size(); ++i) {
+      for (int p = 0; p < NUM_POWERS; ++p) {
+        if (!start_orders_set_[game_idxs[i]][p]) {
+          games[i]->set_orders(power_str(POWERS[p]), orders[i][p]);
+        }
+      }
+    }
+  });
+}
+
+void RolloutEngine::run_impl(const SetOrdersFn &set_policy_orders) {
+  Phase end_phase;
+  int max_steps;
+  if (max_rollout_length_ > 0) {
+    end_phase = n_move_phases_later(start_phase_, max_rollout_length_);
+    max_steps = 1000000;
+  } else {
+    // Really far ahead
+    end_phase = n_move_phases_later(start_phase_, 10);
+    max_steps = 1;
+  }
+
+  bool any_start_orders_set = false;
+  bool any_start_orders_missing = false;
+  for (const auto &set : start_orders_set_) {
+    for (bool b : set) {
+      any_start_orders_set |= b;
+      any_start_orders_missing |= !b;
+    }
+  }
+
+  for (int step = 0; step < max_steps; ++step) {
+    string min_phase_str = batch_.min_ongoing_phase();
+    if (min_phase_str.empty()) {
+      // all games are done
+      break;
+    }
+    Phase min_phase(min_phase_str);
+    if (min_phase >= end_phase) {
+      break;
+    }
+
+    // Processing the spring movement phase of a year. Games that are already
+    // done are scored again, which is fine since it just averages in the same
+    // score again.
+    if (step > 0 && min_phase.season == 'S' && min_phase.phase_type == 'M') {
+      float prob = get_prob_of_spring_ending(min_phase.year);
+      if (prob > 0) {
+        vector<int64_t> all_idxs(batch_.size());
+        for (size_t i = 0; i < all_idxs.size(); ++i) {
+          all_idxs[i] = i;
+        }
+        add_spring_ending_ev(all_idxs, vector<float>(all_idxs.size(), prob),
+                             true);
+      }
+    }
+
+    vector<int64_t> game_idxs =
+        batch_.ongoing_game_idxs_at_phase(min_phase_str);
+    vector<Game *> games = batch_.get_games(game_idxs);
+
+    if (step > 0 || any_start_orders_missing) {
+      set_policy_orders(games, game_idxs, step == 0 && any_start_orders_set);
+    }
+
+    thread_pool_->process_multi(games);
+  }
+
+  if (!year_spring_prob_of_ending_.empty()) {
+    // The final positions may be on different phases
+    vector<int64_t> game_idxs;
+    vector<float> probs;
+    for (size_t i = 0; i < batch_.size(); ++i) {
+      Phase phase = batch_.get_game(i).get_state().get_phase();
+      if (phase.season == 'S' && phase.phase_type == 'M') {
+        game_idxs.push_back(i);
+        probs.push_back(get_prob_of_spring_ending(phase.year));
+      }
+    }
+    add_spring_ending_ev(game_idxs, probs, false);
+  }
+}
+
+float RolloutEngine::get_prob_of_spring_ending(int year) const {
+  auto it = year_spring_prob_of_ending_.upper_bound(year);
+  if (it == year_spring_prob_of_ending_.begin()) {
+    return 0;
+  }
+  return std::prev(it)->second;
+}
+
+void RolloutEngine::add_spring_ending_ev(const vector<int64_t> &game_idxs,
+                                         const vector<float> &probs,
+                                         bool scale_by_not_ended) {
+  for (size_t k = 0; k < game_idxs.size(); ++k) {
+    int64_t i = game_idxs[k];
+    float prob = probs[k];
+    if (scale_by_not_ended) {
+      prob *= 1 - cumulative_spring_prob_[i];
+    }
+    vector<float> scores = batch_.get_game(i).get_scores();
+    for (int p = 0; p < NUM_POWERS; ++p) {
+      spring_ending_ev_[i * NUM_POWERS + p] += scores[p] * prob;
+    }
+    cumulative_spring_prob_[i] += prob;
+  }
+}
+
+torch::Tensor RolloutEngine::get_spring_ending_ev() const {
+  torch::Tensor r = torch::empty(
+      {static_cast<long>(batch_.size()), NUM_POWERS}, torch::kFloat32);
+  std::copy(spring_ending_ev_.begin(), spring_ending_ev_.end(),
+            r.data_ptr<float>());
+  return r;
+}
+
+torch::Tensor RolloutEngine::get_cumulative_spring_ending_prob() const {
+  torch::Tensor r =
+      torch::empty({static_cast<long>(batch_.size())}, torch::kFloat32);
+  std::copy(cumulative_spring_prob_.begin(), cumulative_spring_prob_.end(),
+            r.data_ptr<float>());
+  return r;
+}
+
+} // namespace dipcc
@@ -0,0 +1,115 @@
+/*
+Copyright (c) Meta Platforms, Inc. and affiliates.
+
+This source code is licensed under the MIT license found in the
+LICENSE file in the root directory of this source tree.
+*/
+#pragma once
+
+#include <array>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <torch/torch.h>
+#include <vector>
+
+#include "data_fields.h"
+#include "game.h"
+#include "game_batch.h"
+#include "phase.h"
+#include "power.h"
+#include "thread_pool.h"
+
+namespace dipcc {
+
+// Batched policy used by RolloutEngine.
+//
+// Called with the encoded inputs of the games to step, as returned by
+// ThreadPool::encode_inputs_multi (or encode_inputs_all_powers_multi for
+// all-powers models), and the indices of those games in the engine's batch.
+// Returns the sampled [B, 7, S] order idxs, in the format taken by
+// OrdersDecoder.
+using RolloutPolicy = std::function<torch::Tensor(
+    const TensorDict &fields, const std::vector<int64_t> &game_idxs)>;
+
+// Rolls out a batch of copies of a game, querying a batched policy once per
+// step.
+//
+// Games are stepped together at the pace of the slowest game, e.g. games in
+// retreat phases are processed alone before the others move on to the next
+// movement phase. Stepping stops once all games are done or have reached the
+// movement phase max_rollout_length movement phases after the start. If
+// max_rollout_length is 0, the games are only processed once.
+//
+// If year_spring_prob_of_ending is not empty, the games are assumed to end
+// and be scored at the start of each spring with probability
+// get_prob_of_spring_ending(year), and the expected value of that is
+// accumulated along the way, including for the final positions.
+class RolloutEngine {
+public:
+  RolloutEngine(const Game &game, int n_games,
+                std::shared_ptr<ThreadPool> thread_pool, int input_version,
+                bool all_powers, int max_rollout_length,
+                const std::map<int, float> &year_spring_prob_of_ending);
+
+  GameBatch &get_batch() { return batch_; }
+
+  // Sets the orders of power in game game_idx for the first step. On the first
+  // step the policy is only used for the powers whose orders were not set.
+  void set_start_orders(int64_t game_idx, const std::string &power,
+                        const std::vector<std::string> &orders);
+
+  // Steps the games until the end of the rollouts
+  void run(const RolloutPolicy &policy);
+
+  // Same, sampling orders with the thread pool's policy module (see
+  // ThreadPool::load_policy_module) without leaving C++
+  void run(float temperature, float top_p);
+
+  // Probability of the greatest year <= year in year_spring_prob_of_ending,
+  // or 0 if there is none
+  float get_prob_of_spring_ending(int year) const;
+
+  // Float tensor [N, 7]. Accumulated expected value of the game ending early
+  // in spring and being scored immediately, already multiplied by the
+  // probability of it happening.
+  torch::Tensor get_spring_ending_ev() const;
+
+  // Float tensor [N]. Accumulated probability of the game ending in spring.
+  torch::Tensor get_cumulative_spring_ending_prob() const;
+
+private:
+  // Samples orders for games, the games of the engine's batch at indices
+  // game_idxs, and sets them. If keep_start_orders, the orders of the powers
+  // whose start orders were set are left alone.
+  using SetOrdersFn = std::function<void(std::vector<Game *> &games,
+                                         const std::vector<int64_t> &game_idxs,
+                                         bool keep_start_orders)>;
+
+  void run_impl(const SetOrdersFn &set_policy_orders);
+
+  // Adds the spring ending EV of the current position of each game in
+  // game_idxs, with probability prob scaled by that of not having ended yet
+  // if scale_by_not_ended
+  void add_spring_ending_ev(const std::vector<int64_t> &game_idxs,
+                            const std::vector<float> &probs,
+                            bool scale_by_not_ended);
+
+  GameBatch batch_;
+  Phase start_phase_;
+  std::shared_ptr<ThreadPool> thread_pool_;
+  int input_version_;
+  bool all_powers_;
+  int max_rollout_length_;
+  std::map<int, float> year_spring_prob_of_ending_;
+
+  // start_orders_set_[i][p] is true if orders of POWERS[p] were set on game i
+  // with set_start_orders
+  std::vector<std::array<bool, NUM_POWERS>> start_orders_set_;
+
+  std::vector<float> spring_ending_ev_;       // [N, 7]
+  std::vector<float> cumulative_spring_prob_; // [N]
+};
+
+} // namespace dipcc
@@ -16,15 +16,15 @@ namespace dipcc {
 ThreadPool::ThreadPool(
     size_t n_threads,
     std::unordered_map<std::string, int> order_vocabulary_to_idx,
-    int max_order_cands)
-    : orders_encoder_nonbuggy_(order_vocabulary_to_idx, max_order_cands, false),
+    int max_order_cands, bool pin_memory)
+    : queues_(n_threads),
+      orders_encoder_nonbuggy_(order_vocabulary_to_idx, max_order_cands, false),
       orders_encoder_buggy_(order_vocabulary_to_idx, max_order_cands, true),
-      orders_decoder_(order_vocabulary_to_idx) {
+      orders_decoder_(order_vocabulary_to_idx), data_fields_pool_(pin_memory) {
 
-  jobs_.reserve(n_threads);
   threads_.reserve(n_threads);
-  for (int i = 0; i < n_threads; ++i) {
-    threads_.push_back(thread(&ThreadPool::thread_fn, this));
+  for (size_t i = 0; i < n_threads; ++i) {
+    threads_.push_back(thread(&ThreadPool::thread_fn, this, i));
   }
 }
 
@@ -39,49 +39,80 @@ ThreadPool::~ThreadPool() {
   }
 }
 
-void ThreadPool::boilerplate_job_prep(ThreadPoolJobType job_type,
-                                      vector<Game *> &games,
-                                      int input_version) {
-  JCHECK(jobs_.size() == 0, "ThreadPool called with non-empty jobs_");
+shared_ptr<ThreadPoolBatch>
+ThreadPool::boilerplate_job_prep(ThreadPoolJobType job_type,
+                                 vector<Game *> &games, int input_version,
+                                 size_t jobs_per_thread) {
+  auto batch = make_shared<ThreadPoolBatch>();
 
-  // Pack games into n_threads jobs
+  // Pack games into contiguous chunks, several per thread
   size_t n_threads = threads_.size() > 0 ? threads_.size() : 1;
-  for (int i = 0; i < n_threads; ++i) {
-    jobs_.push_back(ThreadPoolJob(job_type, input_version));
+  size_t n_jobs = n_threads * jobs_per_thread;
+  batch->games_per_job = max((games.size() + n_jobs - 1) / n_jobs, size_t(1));
+  n_jobs = (games.size() + batch->games_per_job - 1) / batch->games_per_job;
+  for (int i = 0; i < n_jobs; ++i) {
+    batch->jobs.push_back(ThreadPoolJob(job_type, input_version));
   }
   for (int i = 0; i < games.size(); ++i) {
-    jobs_[i % n_threads].games.push_back(games[i]);
+    batch->job_for_game(i).games.push_back(games[i]);
   }
   for (int i = 0; i < games.size(); ++i) {
     // Poor man's race condition elimination. Should not take so much time as
-    // stepping job calls get_all_possible_orders on all produced states.
+    // the STEP* jobs call get_all_possible_orders on all produced states.
     games[i]->get_all_possible_orders();
   }
+  return batch;
 }
 
-void ThreadPool::boilerplate_job_handle(unique_lock<mutex> &my_lock) {
+ThreadPoolFuture
+ThreadPool::boilerplate_job_submit(shared_ptr<ThreadPoolBatch> batch) {
+  ThreadPoolFuture future(batch);
+
   // maybe handle in-thread
   if (threads_.size() == 0) {
-    thread_fn_do_job_unsafe(jobs_[0]);
-    jobs_.clear();
-    return;
+    try {
+      for (ThreadPoolJob &job : batch->jobs) {
+        thread_fn_do_job_unsafe(job);
+      }
+      batch->promise.set_value();
+    } catch (...) {
+      batch->promise.set_exception(std::current_exception());
+    }
+    return future;
+  }
+  if (batch->jobs.size() == 0) {
+    batch->promise.set_value();
+    return future;
   }
 
-  // Notify and wait for worker threads
-  unfinished_jobs_ = jobs_.size();
-  cv_in_.notify_all();
-  while (unfinished_jobs_ != 0) {
-    cv_out_.wait(my_lock);
+  // Deal jobs round-robin to the worker queues. unfinished_jobs must be set
+  // first, since a busy worker may pick up a job as soon as it is queued.
+  batch->unfinished_jobs = batch->jobs.size();
+  size_t first_queue = next_queue_++;
+  for (size_t i = 0; i < batch->jobs.size(); ++i) {
+    WorkerQueue &queue = queues_[(first_queue + i) % queues_.size()];
+    lock_guard<mutex> queue_lock(queue.mutex);
+    queue.jobs.push_back(QueuedJob{batch, i});
   }
+
+  // Notify worker threads
+  {
+    unique_lock<mutex> my_lock(mutex_);
+    ++generation_;
+  }
+  cv_in_.notify_all();
+  return future;
 }
 
 void ThreadPool::process_multi(vector<Game *> &games) {
-  unique_lock<mutex> my_lock(mutex_);
+  process_multi_async(games).wait();
+}
 
+ThreadPoolFuture ThreadPool::process_multi_async(vector<Game *> &games) {
   int input_version = MAX_INPUT_VERSION; // unused, dummy value
 
-  boilerplate_job_prep(ThreadPoolJobType::STEP, games, input_version);
-  boilerplate_job_handle(my_lock);
+  return boilerplate_job_submit(
+      boilerplate_job_prep(ThreadPoolJobType::STEP, games, input_version));
 }
 
 torch::Tensor ThreadPool::encode_orders_tolerant(const Game &game,
@@ -118,128 +149,346 @@ torch::Tensor ThreadPool::encode_orders_strict(vector<std::string> &orders,
 
 TensorDict ThreadPool::encode_inputs_state_only_multi(vector<Game *> &games,
                                                       int input_version) {
-  unique_lock<mutex> my_lock(mutex_);
+  return encode_inputs_state_only_multi_async(games, input_version).wait();
+}
 
-  boilerplate_job_prep(ThreadPoolJobType::ENCODE_STATE_ONLY, games,
-                       input_version);
+ThreadPoolFuture
+ThreadPool::encode_inputs_state_only_multi_async(vector<Game *> &games,
+                                                 int input_version) {
+  auto batch = boilerplate_job_prep(ThreadPoolJobType::ENCODE_STATE_ONLY,
+                                    games, input_version);
 
   // Job-specific prep
-  TensorDict fields(new_data_fields_state_only(games.size(), input_version));
-  size_t n_threads = threads_.size() > 0 ? threads_.size() : 1;
-  for (int i = 0; i < games.size(); ++i) {
-    jobs_[i % n_threads].encoding_array_pointers.push_back(
-        EncodingArrayPointers{
-            fields["x_board_state"].index({i}).data_ptr<float>(),
-            fields["x_prev_state"].index({i}).data_ptr<float>(),
-            fields["x_prev_orders"].index({i}).data_ptr<long>(),
-            fields["x_season"].index({i}).data_ptr<float>(),
-            fields["x_year_encoded"].index({i}).data_ptr<float>(),
-            fields["x_in_adj_phase"].index({i}).data_ptr<float>(),
-            fields["x_build_numbers"].index({i}).data_ptr<float>(),
-            fields["x_scoring_system"].index({i}).data_ptr<float>(),
-            nullptr, // x_loc_idxs
-            nullptr, // x_possible_actions
-            nullptr, // x_max_seq_len
-        });
-  }
-
-  boilerplate_job_handle(my_lock);
+  batch->fields =
+      data_fields_pool_.get_state_only(games.size(), input_version);
+  set_encoding_array_pointers(*batch);
 
-  return fields;
+  return boilerplate_job_submit(batch);
 }
 
 TensorDict ThreadPool::encode_inputs_all_powers_multi(vector<Game *> &games,
                                                       int input_version) {
-  unique_lock<mutex> my_lock(mutex_);
+  return encode_inputs_all_powers_multi_async(games, input_version).wait();
+}
 
-  boilerplate_job_prep(ThreadPoolJobType::ENCODE_ALL_POWERS, games,
-                       input_version);
+ThreadPoolFuture
+ThreadPool::encode_inputs_all_powers_multi_async(vector<Game *> &games,
+                                                 int input_version) {
+  auto batch = boilerplate_job_prep(ThreadPoolJobType::ENCODE_ALL_POWERS,
+                                    games, input_version);
 
   // Job-specific prep
-  TensorDict fields(new_data_fields(games.size(), input_version, N_SCS, true));
-  size_t n_threads = threads_.size() > 0 ? threads_.size() : 1;
-  for (int i = 0; i < games.size(); ++i) {
-    jobs_[i % n_threads].encoding_array_pointers.push_back(
-        EncodingArrayPointers{
-            fields["x_board_state"].index({i}).data_ptr<float>(),
-            fields["x_prev_state"].index({i}).data_ptr<float>(),
-            fields["x_prev_orders"].index({i}).data_ptr<long>(),
-            fields["x_season"].index({i}).data_ptr<float>(),
-            fields["x_year_encoded"].index({i}).data_ptr<float>(),
-            fields["x_in_adj_phase"].index({i}).data_ptr<float>(),
-            fields["x_build_numbers"].index({i}).data_ptr<float>(),
-            fields["x_scoring_system"].index({i}).data_ptr<float>(),
-            fields["x_loc_idxs"].index({i}).data_ptr<int8_t>(),
-            fields["x_possible_actions"].index({i}).data_ptr<int32_t>(),
-            fields["x_power"].index({i}).data_ptr<int64_t>(),
-        });
-  }
-
-  boilerplate_job_handle(my_lock);
+  batch->fields =
+      data_fields_pool_.get(games.size(), input_version, N_SCS, true);
+  set_encoding_array_pointers(*batch);
 
-  return fields;
+  return boilerplate_job_submit(batch);
 }
 
 TensorDict ThreadPool::encode_inputs_multi(vector<Game *> &games,
                                            int input_version) {
-  unique_lock<mutex> my_lock(mutex_);
+  return encode_inputs_multi_async(games, input_version).wait();
+}
 
-  boilerplate_job_prep(ThreadPoolJobType::ENCODE, games, input_version);
+ThreadPoolFuture ThreadPool::encode_inputs_multi_async(vector<Game *> &games,
+                                                       int input_version) {
+  auto batch =
+      boilerplate_job_prep(ThreadPoolJobType::ENCODE, games, input_version);
 
   // Job-specific prep
-  TensorDict fields(new_data_fields(games.size(), input_version));
-  size_t n_threads = threads_.size() > 0 ? threads_.size() : 1;
-  for (int i = 0; i < games.size(); ++i) {
-    jobs_[i % n_threads].encoding_array_pointers.push_back(
-        EncodingArrayPointers{
-            fields["x_board_state"].index({i}).data_ptr<float>(),
-            fields["x_prev_state"].index({i}).data_ptr<float>(),
-            fields["x_prev_orders"].index({i}).data_ptr<long>(),
-            fields["x_season"].index({i}).data_ptr<float>(),
-            fields["x_year_encoded"].index({i}).data_ptr<float>(),
-            fields["x_in_adj_phase"].index({i}).data_ptr<float>(),
-            fields["x_build_numbers"].index({i}).data_ptr<float>(),
-            fields["x_scoring_system"].index({i}).data_ptr<float>(),
-            fields["x_loc_idxs"].index({i}).data_ptr<int8_t>(),
-            fields["x_possible_actions"].index({i}).data_ptr<int32_t>(),
-            nullptr, // x_max_seq_len
-        });
-  }
-
-  boilerplate_job_handle(my_lock);
+  batch->fields = data_fields_pool_.get(games.size(), input_version);
+  set_encoding_array_pointers(*batch);
+
+  return boilerplate_job_submit(batch);
+}
+
+TensorDict ThreadPool::process_and_encode_inputs_multi(vector<Game *> &games,
+                                                       int input_version) {
+  return process_and_encode_inputs_multi_async(games, input_version).wait();
+}
+
+ThreadPoolFuture
+ThreadPool::process_and_encode_inputs_multi_async(vector<Game *> &games,
+                                                  int input_version) {
+  auto batch = boilerplate_job_prep(ThreadPoolJobType::STEP_AND_ENCODE, games,
+                                    input_version);
+
+  // Job-specific prep
+  batch->fields = data_fields_pool_.get(games.size(), input_version);
+  set_encoding_array_pointers(*batch);
+
+  return boilerplate_job_submit(batch);
+}
+
+TensorDict
+ThreadPool::process_and_encode_inputs_all_powers_multi(vector<Game *> &games,
+                                                       int input_version) {
+  return process_and_encode_inputs_all_powers_multi_async(games, input_version)
+      .wait();
+}
+
+ThreadPoolFuture ThreadPool::process_and_encode_inputs_all_powers_multi_async(
+    vector<Game *> &games, int input_version) {
+  auto batch = boilerplate_job_prep(
+      ThreadPoolJobType::STEP_AND_ENCODE_ALL_POWERS, games, input_version);
+
+  // Job-specific prep
+  batch->fields =
+      data_fields_pool_.get(games.size(), input_version, N_SCS, true);
+  set_encoding_array_pointers(*batch);
+
+  return boilerplate_job_submit(batch);
+}
+
+void ThreadPool::load_policy_module(const string &path,
+                                    int intra_op_threads) {
+  JCHECK(intra_op_threads >= 1, "load_policy_module intra_op_threads < 1");
+  auto module = make_shared<torch::jit::script::Module>(torch::jit::load(path));
+  module->eval();
+  lock_guard<mutex> lock(policy_mutex_);
+  policy_module_ = module;
+  policy_intra_op_threads_ = intra_op_threads;
+}
 
+shared_ptr<ThreadPoolBatch>
+ThreadPool::run_policy_jobs(vector<Game *> &games, int input_version,
+                            bool all_powers, float temperature, float top_p,
+                            bool set_orders) {
+  JCHECK(has_policy_module(),
+         "forward_policy_multi called before load_policy_module");
+
+  // One job per thread, so that each forward runs on as large a batch as
+  // possible
+  auto batch = boilerplate_job_prep(
+      all_powers ? ThreadPoolJobType::ENCODE_ALL_POWERS_AND_POLICY
+                 : ThreadPoolJobType::ENCODE_AND_POLICY,
+      games, input_version, 1);
+  for (ThreadPoolJob &job : batch->jobs) {
+    job.temperature = temperature;
+    job.top_p = top_p;
+    job.set_orders = set_orders;
+  }
+  boilerplate_job_submit(batch).wait();
+  return batch;
+}
+
+vector<vector<vector<string>>>
+ThreadPool::forward_policy_multi(vector<Game *> &games, int input_version,
+                                 bool all_powers, float temperature,
+                                 float top_p) {
+  auto batch = run_policy_jobs(games, input_version, all_powers, temperature,
+                               top_p, false);
+
+  vector<vector<vector<string>>> r;
+  r.reserve(games.size());
+  for (ThreadPoolJob &job : batch->jobs) {
+    for (auto &game_orders : job.orders) {
+      r.push_back(std::move(game_orders));
+    }
+  }
+  return r;
+}
+
+void ThreadPool::forward_policy_and_set_orders_multi(vector<Game *> &games,
+                                                     int input_version,
+                                                     bool all_powers,
+                                                     float temperature,
+                                                     float top_p) {
+  run_policy_jobs(games, input_version, all_powers, temperature, top_p, true);
+}
+
+void ThreadPool::decode_and_set_orders(vector<Game *> &games,
+                                       torch::Tensor order_idxs) {
+  decode_and_set_orders_async(games, order_idxs).wait();
+}
+
+ThreadPoolFuture
+ThreadPool::decode_and_set_orders_async(vector<Game *> &games,
+                                        torch::Tensor order_idxs) {
+  JCHECK(order_idxs.dim() == 3 && order_idxs.size(0) == games.size(),
+         "decode_and_set_orders expects [B, 7, S] order_idxs for B games");
+  int input_version = MAX_INPUT_VERSION; // unused, dummy value
+  auto batch = boilerplate_job_prep(ThreadPoolJobType::DECODE_AND_SET_ORDERS,
+                                    games, input_version);
+  for (size_t i = 0; i < batch->jobs.size(); ++i) {
+    batch->jobs[i].order_idxs = order_idxs;
+    batch->jobs[i].first_game_i = i * batch->games_per_job;
+  }
+  return boilerplate_job_submit(batch);
+}
+
+void ThreadPool::decode_and_set_orders_all_powers(vector<Game *> &games,
+                                                  torch::Tensor order_idxs,
+                                                  torch::Tensor x_in_adj_phase,
+                                                  torch::Tensor x_power) {
+  JCHECK(order_idxs.dim() == 3 && order_idxs.size(0) == games.size(),
+         "decode_and_set_orders expects [B, 7, S] order_idxs for B games");
+  int input_version = MAX_INPUT_VERSION; // unused, dummy value
+  auto batch = boilerplate_job_prep(
+      ThreadPoolJobType::DECODE_ALL_POWERS_AND_SET_ORDERS, games,
+      input_version);
+  for (size_t i = 0; i < batch->jobs.size(); ++i) {
+    batch->jobs[i].order_idxs = order_idxs;
+    batch->jobs[i].x_in_adj_phase = x_in_adj_phase;
+    batch->jobs[i].x_power = x_power;
+    batch->jobs[i].first_game_i = i * batch->games_per_job;
+  }
+  boilerplate_job_submit(batch).wait();
+}
+
+TensorDict ThreadPool::encode_inputs_csr_multi(vector<Game *> &games,
+                                              int input_version,
+                                              bool all_powers) {
+  auto batch = boilerplate_job_prep(
+      all_powers ? ThreadPoolJobType::ENCODE_ALL_POWERS_CSR
+                 : ThreadPoolJobType::ENCODE_CSR,
+      games, input_version);
+
+  // Job-specific prep. x_possible_actions is encoded into per-worker scratch
+  // space and compacted into the jobs' csr_* vectors.
+  long B = games.size();
+  long max_seq_len = all_powers ? N_SCS : OrdersEncoder::MAX_SEQ_LEN;
+  batch->fields = data_fields_pool_.get_state_only(B, input_version);
+  batch->fields["x_loc_idxs"] = torch::empty({B, 7, NUM_LOCS}, torch::kInt8);
+  if (all_powers) {
+    batch->fields["x_power"] = torch::empty({B, 7, max_seq_len}, torch::kLong);
+  }
+  set_encoding_array_pointers(*batch);
+  TensorDict fields = boilerplate_job_submit(batch).wait();
+
+  // Gather the jobs' candidates
+  size_t nnz = 0;
+  for (ThreadPoolJob &job : batch->jobs) {
+    nnz += job.csr_values.size();
+  }
+  torch::Tensor values = torch::empty({static_cast<long>(nnz)}, torch::kInt32);
+  torch::Tensor offsets = torch::empty({B * 7 * max_seq_len + 1}, torch::kLong);
+  int32_t *values_ptr = values.data_ptr<int32_t>();
+  int64_t *offsets_ptr = offsets.data_ptr<int64_t>();
+  *offsets_ptr = 0;
+  for (ThreadPoolJob &job : batch->jobs) {
+    values_ptr = std::copy(job.csr_values.begin(), job.csr_values.end(),
+                           values_ptr);
+    for (int64_t length : job.csr_row_lengths) {
+      offsets_ptr[1] = offsets_ptr[0] + length;
+      ++offsets_ptr;
+    }
+  }
+  fields["x_possible_actions_values"] = values;
+  fields["x_possible_actions_offsets"] = offsets;
   return fields;
 }
 
-void ThreadPool::thread_fn() {
+void ThreadPool::set_orders_on_game(Game *game,
+                                    const vector<vector<Order>> &orders) {
+  for (int p = 0; p < 7; ++p) {
+    game->set_orders(POWERS[p], orders[p]);
+  }
+}
+
+namespace {
+
+// Returns a pointer to row i of fields[key], or nullptr if there is no such
+// field
+template <typename T> T *row_ptr(TensorDict &fields, const char *key, int i) {
+  auto it = fields.find(key);
+  return it == fields.end() ? nullptr : it->second.index({i}).data_ptr<T>();
+}
+
+} // namespace
+
+EncodingArrayPointers ThreadPool::encoding_array_pointers(TensorDict &fields,
+                                                          int i) {
+  return EncodingArrayPointers{
+      row_ptr<float>(fields, "x_board_state", i),
+      row_ptr<float>(fields, "x_prev_state", i),
+      row_ptr<long>(fields, "x_prev_orders", i),
+      row_ptr<float>(fields, "x_season", i),
+      row_ptr<float>(fields, "x_year_encoded", i),
+      row_ptr<float>(fields, "x_in_adj_phase", i),
+      row_ptr<float>(fields, "x_build_numbers", i),
+      row_ptr<float>(fields, "x_scoring_system", i),
+      row_ptr<int8_t>(fields, "x_loc_idxs", i),
+      row_ptr<int32_t>(fields, "x_possible_actions", i),
+      row_ptr<int64_t>(fields, "x_power", i),
+  };
+}
+
+void ThreadPool::set_encoding_array_pointers(ThreadPoolBatch &batch) {
+  for (int i = 0, game_i = 0; i < batch.jobs.size(); ++i) {
+    ThreadPoolJob &job = batch.jobs[i];
+    for (int j = 0; j < job.games.size(); ++j, ++game_i) {
+      job.encoding_array_pointers.push_back(
+          encoding_array_pointers(batch.fields, game_i));
+    }
+  }
+}
+
+void ThreadPool::thread_fn(size_t worker_i) {
+  uint64_t seen_generation = 0;
   while (true) {
-    ThreadPoolJob job;
+    bool dying;
     { // Locked critical section
       unique_lock<mutex> my_lock(mutex_);
-      while (!time_to_die_ && jobs_.size() == 0) {
+      while (!time_to_die_ && generation_ == seen_generation) {
         cv_in_.wait(my_lock);
       }
-      if (time_to_die_) {
-        return;
-      }
-      job = jobs_.back();
-      jobs_.pop_back();
+      seen_generation = generation_;
+      dying = time_to_die_;
     }
 
-    // Do the job
-    thread_fn_do_job_unsafe(job);
+    // Do jobs until there are none left to pop or steal. When dying, this
+    // drains any jobs still queued so that no batch is left unfinished.
+    QueuedJob job;
+    while (pop_or_steal_job(worker_i, &job)) {
+      try {
+        thread_fn_do_job_unsafe(job.batch->jobs[job.job_i]);
+      } catch (...) {
+        lock_guard<mutex> exception_lock(job.batch->exception_mutex);
+        if (!job.batch->exception) {
+          job.batch->exception = std::current_exception();
+        }
+      }
 
-    // Notify done (locked critical section)
-    {
-      unique_lock<mutex> my_lock(mutex_);
-      unfinished_jobs_--;
-      if (unfinished_jobs_ == 0) {
-        cv_out_.notify_all();
+      // Notify done, passing on the first exception thrown by a job
+      if (--job.batch->unfinished_jobs == 0) {
+        if (job.batch->exception) {
+          job.batch->promise.set_exception(job.batch->exception);
+        } else {
+          job.batch->promise.set_value();
+        }
       }
+      job.batch.reset();
+    }
+    if (dying) {
+      return;
     }
   }
 }
 
+bool ThreadPool::pop_or_steal_job(size_t worker_i, QueuedJob *job) {
+  { // Own queue: pop from the front
+    WorkerQueue &queue = queues_[worker_i];
+    lock_guard<mutex> queue_lock(queue.mutex);
+    if (!queue.jobs.empty()) {
+      *job = std::move(queue.jobs.front());
+      queue.jobs.pop_front();
+      return true;
+    }
+  }
+  for (size_t k = 1; k < queues_.size(); ++k) {
+    // Other queues: steal from the back
+    WorkerQueue &queue = queues_[(worker_i + k) % queues_.size()];
+    lock_guard<mutex> queue_lock(queue.mutex);
+    if (!queue.jobs.empty()) {
+      *job = std::move(queue.jobs.back());
+      queue.jobs.pop_back();
+      return true;
+    }
+  }
+  return false;
+}
+
 void ThreadPool::thread_fn_do_job_unsafe(ThreadPoolJob &job) {
   try {
     // Do the job
@@ -251,18 +500,32 @@ void ThreadPool::thread_fn_do_job_unsafe(ThreadPoolJob &job) {
       do_job_encode_state_only(job);
     } else if (job.job_type == ThreadPoolJobType::ENCODE_ALL_POWERS) {
       do_job_encode_all_powers(job);
+    } else if (job.job_type == ThreadPoolJobType::STEP_AND_ENCODE ||
+               job.job_type == ThreadPoolJobType::STEP_AND_ENCODE_ALL_POWERS) {
+      do_job_step_and_encode(job);
+    } else if (job.job_type == ThreadPoolJobType::ENCODE_AND_POLICY ||
+               job.job_type ==
+                   ThreadPoolJobType::ENCODE_ALL_POWERS_AND_POLICY) {
+      do_job_encode_and_policy(job);
+    } else if (job.job_type == ThreadPoolJobType::DECODE_AND_SET_ORDERS ||
+               job.job_type ==
+                   ThreadPoolJobType::DECODE_ALL_POWERS_AND_SET_ORDERS) {
+      do_job_decode_and_set_orders(job);
+    } else if (job.job_type == ThreadPoolJobType::ENCODE_CSR ||
+               job.job_type == ThreadPoolJobType::ENCODE_ALL_POWERS_CSR) {
+      do_job_encode_csr(job);
     } else {
       JCHECK(false, "ThreadPoolJobType Not Implemented");
     }
   } catch (const std::exception &e) {
     LOG(ERROR) << "Worker thread exception: " << e.what();
-    throw e;
+    throw;
   }
 }
 
 void ThreadPool::do_job_step(ThreadPoolJob &job) {
+  Game::process_batch(job.games);
   for (Game *game : job.games) {
-    game->process();
     game->get_all_possible_orders();
   }
 }
@@ -288,15 +551,8 @@ void ThreadPool::do_job_encode_all_powers(ThreadPoolJob &job) {
          "do_job_encode called with wrong input sizes");
 
   for (int i = 0; i < job.games.size(); ++i) {
-    Game *game = job.games[i];
-    int input_version = job.input_version;
-    EncodingArrayPointers &pointers = job.encoding_array_pointers[i];
-
-    encode_state_for_game(game, input_version, pointers);
-    const OrdersEncoder &orders_encoder_ = get_orders_encoder(input_version);
-    orders_encoder_.encode_valid_orders_all_powers(
-        game->get_state(), pointers.x_possible_actions, pointers.x_loc_idxs,
-        pointers.x_power);
+    encode_inputs_all_powers_for_game(job.games[i], job.input_version,
+                                      job.encoding_array_pointers[i]);
   }
 }
 
@@ -307,21 +563,147 @@ void ThreadPool::do_job_encode(ThreadPoolJob &job) {
          "do_job_encode called with wrong input sizes");
 
   for (int i = 0; i < job.games.size(); ++i) {
-    Game *game = job.games[i];
-    int input_version = job.input_version;
-    EncodingArrayPointers &pointers = job.encoding_array_pointers[i];
+    encode_inputs_for_game(job.games[i], job.input_version,
+                           job.encoding_array_pointers[i]);
+  }
+}
 
-    // encode all inputs except actions
-    encode_state_for_game(game, input_version, pointers);
+void ThreadPool::do_job_step_and_encode(ThreadPoolJob &job) {
+  JCHECK(job.games.size() == job.encoding_array_pointers.size(),
+         "do_job_step_and_encode called with wrong input sizes");
 
-    // encode x_possible_actions, x_loc_idxs
-    const OrdersEncoder &orders_encoder_ = get_orders_encoder(input_version);
-    for (int power_i = 0; power_i < 7; ++power_i) {
-      orders_encoder_.encode_valid_orders(
-          POWERS[power_i], game->get_state(),
-          pointers.x_possible_actions + (power_i * orders_encoder_.MAX_SEQ_LEN *
-                                         orders_encoder_.get_max_cands()),
-          pointers.x_loc_idxs + (power_i * 81));
+  Game::process_batch(job.games);
+  for (int i = 0; i < job.games.size(); ++i) {
+    // The processed state belongs to this game only, so its possible orders
+    // can be computed here while the game is still hot in cache
+    job.games[i]->get_all_possible_orders();
+    if (job.job_type == ThreadPoolJobType::STEP_AND_ENCODE_ALL_POWERS) {
+      encode_inputs_all_powers_for_game(job.games[i], job.input_version,
+                                        job.encoding_array_pointers[i]);
+    } else {
+      encode_inputs_for_game(job.games[i], job.input_version,
+                             job.encoding_array_pointers[i]);
+    }
+  }
+}
+
+void ThreadPool::do_job_encode_and_policy(ThreadPoolJob &job) {
+  bool all_powers =
+      job.job_type == ThreadPoolJobType::ENCODE_ALL_POWERS_AND_POLICY;
+  shared_ptr<torch::jit::script::Module> module;
+  int module_intra_op_threads;
+  {
+    lock_guard<mutex> lock(policy_mutex_);
+    module = policy_module_;
+    module_intra_op_threads = policy_intra_op_threads_;
+  }
+  JCHECK(module != nullptr, "do_job_encode_and_policy without policy module");
+
+  // Pin this worker's intra-op threads, once per worker and setting. With the
+  // OpenMP backend this only affects this worker; with the native backend,
+  // and for MKL, it sets the process-wide count (see load_policy_module).
+  thread_local int intra_op_threads = 0;
+  if (intra_op_threads != module_intra_op_threads) {
+    at::init_num_threads();
+    at::set_num_threads(module_intra_op_threads);
+    intra_op_threads = module_intra_op_threads;
+  }
+
+  // Encode
+  int n_games = job.games.size();
+  TensorDict fields =
+      all_powers
+          ? data_fields_pool_.get(n_games, job.input_version, N_SCS, true)
+          : data_fields_pool_.get(n_games, job.input_version);
+  for (int i = 0; i < n_games; ++i) {
+    EncodingArrayPointers pointers = encoding_array_pointers(fields, i);
+    if (all_powers) {
+      encode_inputs_all_powers_for_game(job.games[i], job.input_version,
+                                        pointers);
+    } else {
+      encode_inputs_for_game(job.games[i], job.input_version, pointers);
+    }
+  }
+
+  // Forward
+  torch::Tensor order_idxs;
+  {
+    torch::NoGradGuard no_grad;
+    c10::Dict<string, torch::Tensor> inputs;
+    for (auto &kv : fields) {
+      inputs.insert(kv.first, kv.second);
+    }
+    torch::jit::IValue output = module->forward(
+        {inputs, static_cast<double>(job.temperature),
+         static_cast<double>(job.top_p)});
+    if (output.isTuple()) {
+      output = output.toTuple()->elements().at(0);
+    }
+    order_idxs = output.toTensor().to(torch::kLong).contiguous();
+  }
+
+  // Decode
+  JCHECK(order_idxs.dim() == 3 && order_idxs.size(0) == n_games,
+         "Policy module returned " + std::to_string(order_idxs.size(0)) +
+             " actions for " + std::to_string(n_games) + " games");
+  torch::Tensor *x_in_adj_phase =
+      all_powers ? &fields.at("x_in_adj_phase") : nullptr;
+  torch::Tensor *x_power = all_powers ? &fields.at("x_power") : nullptr;
+  if (!job.set_orders) {
+    job.orders = all_powers ? orders_decoder_.decode_order_idxs_all_powers(
+                                  &order_idxs, x_in_adj_phase, x_power, 1)
+                            : orders_decoder_.decode_order_idxs(&order_idxs);
+    return;
+  }
+  for (int i = 0; i < n_games; ++i) {
+    set_orders_on_game(job.games[i],
+                       orders_decoder_.decode_orders(order_idxs, i,
+                                                     x_in_adj_phase, x_power));
+  }
+}
+
+void ThreadPool::do_job_decode_and_set_orders(ThreadPoolJob &job) {
+  bool all_powers =
+      job.job_type == ThreadPoolJobType::DECODE_ALL_POWERS_AND_SET_ORDERS;
+  for (size_t i = 0; i < job.games.size(); ++i) {
+    set_orders_on_game(
+        job.games[i],
+        orders_decoder_.decode_orders(
+            job.order_idxs, job.first_game_i + i,
+            all_powers ? &job.x_in_adj_phase : nullptr,
+            all_powers ? &job.x_power : nullptr));
+  }
+}
+
+void ThreadPool::do_job_encode_csr(ThreadPoolJob &job) {
+  JCHECK(job.games.size() == job.encoding_array_pointers.size(),
+         "do_job_encode_csr called with wrong input sizes");
+  bool all_powers = job.job_type == ThreadPoolJobType::ENCODE_ALL_POWERS_CSR;
+  size_t max_seq_len = all_powers ? N_SCS : OrdersEncoder::MAX_SEQ_LEN;
+  size_t max_cands = get_orders_encoder(job.input_version).get_max_cands();
+
+  // Dense x_possible_actions of one game. The candidates of each row are
+  // written first, followed by EOS_IDX padding.
+  thread_local vector<int32_t> scratch;
+  scratch.resize(7 * max_seq_len * max_cands);
+
+  job.csr_row_lengths.reserve(job.games.size() * 7 * max_seq_len);
+  for (int i = 0; i < job.games.size(); ++i) {
+    EncodingArrayPointers &pointers = job.encoding_array_pointers[i];
+    pointers.x_possible_actions = scratch.data();
+    if (all_powers) {
+      encode_inputs_all_powers_for_game(job.games[i], job.input_version,
+                                        pointers);
+    } else {
+      encode_inputs_for_game(job.games[i], job.input_version, pointers);
+    }
+
+    for (size_t row = 0; row < 7 * max_seq_len; ++row) {
+      const int32_t *begin = scratch.data() + row * max_cands;
+      const int32_t *end =
+          std::find(begin, begin + max_cands, OrdersEncoder::EOS_IDX);
+      job.csr_values.insert(job.csr_values.end(), begin, end);
+      job.csr_row_lengths.push_back(end - begin);
     }
   }
 }
@@ -336,15 +718,74 @@ const OrdersEncoder &ThreadPool::get_orders_encoder(int input_version) {
   return orders_encoder_buggy_;
 }
 
+void ThreadPool::encode_inputs_for_game(Game *game, int input_version,
+                                        EncodingArrayPointers &pointers) {
+  // encode all inputs except actions
+  encode_state_for_game(game, input_version, pointers);
+
+  // encode x_possible_actions, x_loc_idxs
+  size_t board_hash = 0;
+  if (encoding_cache_ != nullptr) {
+    board_hash = game->compute_board_hash();
+    if (encoding_cache_->get_valid_orders(
+            board_hash, input_version, false, pointers.x_possible_actions,
+            pointers.x_loc_idxs, nullptr)) {
+      return;
+    }
+  }
+  const OrdersEncoder &orders_encoder_ = get_orders_encoder(input_version);
+  for (int power_i = 0; power_i < 7; ++power_i) {
+    orders_encoder_.encode_valid_orders(
+        POWERS[power_i], game->get_state(),
+        pointers.x_possible_actions + (power_i * orders_encoder_.MAX_SEQ_LEN *
+                                       orders_encoder_.get_max_cands()),
+        pointers.x_loc_idxs + (power_i * 81));
+  }
+  if (encoding_cache_ != nullptr) {
+    encoding_cache_->put_valid_orders(board_hash, input_version, false,
+                                      pointers.x_possible_actions,
+                                      pointers.x_loc_idxs, nullptr);
+  }
+}
+
+void ThreadPool::encode_inputs_all_powers_for_game(
+    Game *game, int input_version, EncodingArrayPointers &pointers) {
+  encode_state_for_game(game, input_version, pointers);
+
+  size_t board_hash = 0;
+  if (encoding_cache_ != nullptr) {
+    board_hash = game->compute_board_hash();
+    if (encoding_cache_->get_valid_orders(
+            board_hash, input_version, true, pointers.x_possible_actions,
+            pointers.x_loc_idxs, pointers.x_power)) {
+      return;
+    }
+  }
+
+  // encode_valid_orders_all_powers only fills the first power's x_loc_idxs
+  memset(pointers.x_loc_idxs, -1, 7 * 81 * sizeof(int8_t));
+  const OrdersEncoder &orders_encoder_ = get_orders_encoder(input_version);
+  orders_encoder_.encode_valid_orders_all_powers(
+      game->get_state(), pointers.x_possible_actions, pointers.x_loc_idxs,
+      pointers.x_power);
+  if (encoding_cache_ != nullptr) {
+    encoding_cache_->put_valid_orders(board_hash, input_version, true,
+                                      pointers.x_possible_actions,
+                                      pointers.x_loc_idxs, pointers.x_power);
+  }
+}
+
 void ThreadPool::encode_state_for_game(Game *game, int input_version,
                                        EncodingArrayPointers &pointers) {
   // encode x_board_state
-  encode_board_state(game->get_state(), input_version, pointers.x_board_state);
+  encode_board_state_cached(game->get_state(), input_version,
+                            pointers.x_board_state);
 
   // encode x_prev_state, x_prev_orders
   GameState *prev_move_state = game->get_last_movement_phase();
   if (prev_move_state != nullptr) {
-    encode_board_state(*prev_move_state, input_version, pointers.x_prev_state);
+    encode_board_state_cached(*prev_move_state, input_version,
+                              pointers.x_prev_state);
     const OrdersEncoder &orders_encoder_ = get_orders_encoder(input_version);
     orders_encoder_.encode_prev_orders_deepmind(game, pointers.x_prev_orders);
   } else {
@@ -391,4 +832,39 @@ void ThreadPool::encode_state_for_game(Game *game, int input_version,
       (float)1.0;
 }
 
+void ThreadPool::encode_board_state_cached(GameState &state, int input_version,
+                                           float *r) {
+  if (encoding_cache_ == nullptr) {
+    encode_board_state(state, input_version, r);
+    return;
+  }
+  size_t board_hash = state.compute_board_hash();
+  if (!encoding_cache_->get_board_state(board_hash, input_version, r)) {
+    encode_board_state(state, input_version, r);
+    encoding_cache_->put_board_state(board_hash, input_version, r);
+  }
+}
+
+void ThreadPool::enable_encoding_cache(size_t max_entries) {
+  if (max_entries == 0) {
+    encoding_cache_.reset();
+    return;
+  }
+  encoding_cache_ = std::make_unique<EncodingCache>(
+      max_entries, orders_encoder_nonbuggy_.get_max_cands());
+}
+
+map<string, int64_t> ThreadPool::get_encoding_cache_stats() {
+  if (encoding_cache_ == nullptr) {
+    return {};
+  }
+  return encoding_cache_->get_stats();
+}
+
+void ThreadPool::clear_encoding_cache() {
+  if (encoding_cache_ != nullptr) {
+    encoding_cache_->clear();
+  }
+}
+
 } // namespace dipcc
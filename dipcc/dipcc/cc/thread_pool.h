@@ -6,13 +6,22 @@ LICENSE file in the root directory of this source tree.
 */
 #pragma once
 
+#include <atomic>
+#include <chrono>
 #include <condition_variable>
+#include <deque>
+#include <exception>
+#include <future>
+#include <map>
 #include <memory>
 #include <mutex>
+#include <string>
 #include <thread>
+#include <torch/script.h>
 #include <vector>
 
 #include "data_fields.h"
+#include "encoding_cache.h"
 #include "game.h"
 #include "orders_encoder.h"
 
@@ -21,11 +30,25 @@ namespace py = pybind11;
 namespace dipcc {
 
 // Job Types
-enum ThreadPoolJobType { STEP, ENCODE, ENCODE_STATE_ONLY, ENCODE_ALL_POWERS };
+enum ThreadPoolJobType {
+  STEP,
+  ENCODE,
+  ENCODE_STATE_ONLY,
+  ENCODE_ALL_POWERS,
+  STEP_AND_ENCODE,
+  STEP_AND_ENCODE_ALL_POWERS,
+  ENCODE_AND_POLICY,
+  ENCODE_ALL_POWERS_AND_POLICY,
+  DECODE_AND_SET_ORDERS,
+  DECODE_ALL_POWERS_AND_SET_ORDERS,
+  ENCODE_CSR,
+  ENCODE_ALL_POWERS_CSR
+};
 
 // Used for ENCODE* jobs
 //
-// Initialized in "new_data_fields" function
+// Point into rows of fields from DataFieldsPool, which encoders overwrite
+// entirely
 struct EncodingArrayPointers {
   float *x_board_state;
   float *x_prev_state;
@@ -47,24 +70,100 @@ struct ThreadPoolJob {
   std::vector<Game *> games;
   std::vector<EncodingArrayPointers> encoding_array_pointers;
 
+  // *_AND_POLICY jobs only: sampling parameters passed to the policy module,
+  // and the decoded orders of each game, orders[i][p] for POWERS[p], unless
+  // set_orders is true, in which case they are set on the games instead
+  float temperature = 1.0;
+  float top_p = 1.0;
+  bool set_orders = false;
+  std::vector<std::vector<std::vector<std::string>>> orders;
+
+  // DECODE*_AND_SET_ORDERS jobs only: the batch's order idxs and, for all-power
+  // outputs, its x_in_adj_phase and x_power. The job's games are the rows
+  // starting at first_game_i.
+  torch::Tensor order_idxs;
+  torch::Tensor x_in_adj_phase;
+  torch::Tensor x_power;
+  size_t first_game_i = 0;
+
+  // ENCODE*_CSR jobs only: the x_possible_actions candidates of the job's
+  // games, and the number of candidates of each of their [7, S] rows
+  std::vector<int32_t> csr_values;
+  std::vector<int64_t> csr_row_lengths;
+
   ThreadPoolJob() {}
   ThreadPoolJob(ThreadPoolJobType type, int iv)
       : job_type(type), input_version(iv) {}
 };
 
+// A set of jobs submitted to the pool together by one *_multi call. Games are
+// split into contiguous chunks of games_per_job, one chunk per job.
+struct ThreadPoolBatch {
+  std::vector<ThreadPoolJob> jobs;
+  size_t games_per_job = 1;
+  std::atomic<size_t> unfinished_jobs{0};
+  std::promise<void> promise; // set when the last job has finished
+  TensorDict fields;          // output of ENCODE* batches
+
+  // First exception thrown by a job, set on promise once the last job has
+  // finished
+  std::mutex exception_mutex;
+  std::exception_ptr exception;
+
+  ThreadPoolJob &job_for_game(size_t game_i) {
+    return jobs[game_i / games_per_job];
+  }
+};
+
+// Handle to a batch returned by one of the ThreadPool *_async methods.
+//
+// The games passed to the *_async call must stay alive and must not be
+// modified until the batch is done.
+class ThreadPoolFuture {
+public:
+  ThreadPoolFuture() {}
+  explicit ThreadPoolFuture(std::shared_ptr<ThreadPoolBatch> batch)
+      : batch_(batch), future_(batch->promise.get_future().share()) {}
+
+  // Returns true if all of the batch's jobs have finished
+  bool done() const {
+    return future_.wait_for(std::chrono::seconds(0)) ==
+           std::future_status::ready;
+  }
+
+  // Blocks until all of the batch's jobs have finished, and returns the
+  // filled fields for ENCODE* batches (empty for process_multi_async).
+  // Rethrows the first exception thrown by a job, if any.
+  TensorDict wait() const {
+    future_.get();
+    return batch_->fields;
+  }
+
+private:
+  std::shared_ptr<ThreadPoolBatch> batch_;
+  std::shared_future<void> future_;
+};
+
 class ThreadPool {
 public:
+  // If pin_memory, the encoded inputs are returned in pinned memory (see
+  // DataFieldsPool)
   ThreadPool(size_t n_threads,
              std::unordered_map<std::string, int> order_vocabulary_to_idx,
-             int max_order_cands);
+             int max_order_cands, bool pin_memory = false);
   ~ThreadPool();
 
   const OrdersDecoder &get_orders_decoder() const { return orders_decoder_; }
 
-  // Call game.process() on each of the games. Blocks until all process()
-  // functions have exited.
+  // Call game.process() on each of the games, batching the adjudication of
+  // each worker's games (see Game::process_batch). Blocks until all games
+  // have been processed.
   void process_multi(std::vector<Game *> &games);
 
+  // Same as process_multi, but returns immediately. The games are processed
+  // once the returned future is done.
+  ThreadPoolFuture process_multi_async(std::vector<Game *> &games);
+
   // Write a single sequence of orders as a feature tensor. The same format as
   // used from x_prev_orders features.
   // Any orders that fail to strictly match the exact strings in the
@@ -81,7 +180,8 @@ public:
                                        int input_version);
 
   // Fill a list of pre-allocated DataFields objects with the games' input
-  // encodings
+  // encodings. The outputs of the encode_inputs_* methods are recycled from a
+  // DataFieldsPool, so their buffers are reused once the caller drops them.
   TensorDict encode_inputs_multi(std::vector<Game *> &games, int input_version);
 
   // Fill a list of pre-allocated DataFields objects with the games' input
@@ -94,13 +194,134 @@ public:
   TensorDict encode_inputs_all_powers_multi(std::vector<Game *> &games,
                                             int input_version);
 
+  // Non-blocking versions of the encode_inputs_*multi methods. The fields are
+  // returned by wait() on the returned future.
+  ThreadPoolFuture encode_inputs_multi_async(std::vector<Game *> &games,
+                                             int input_version);
+  ThreadPoolFuture
+  encode_inputs_state_only_multi_async(std::vector<Game *> &games,
+                                       int input_version);
+  ThreadPoolFuture
+  encode_inputs_all_powers_multi_async(std::vector<Game *> &games,
+                                       int input_version);
+
+  // Same as encode_inputs_multi (or encode_inputs_all_powers_multi if
+  // all_powers), but with x_possible_actions in a compact CSR layout instead
+  // of the EOS_IDX-padded [B, 7, S, max_cands] tensor:
+  //
+  // - x_possible_actions_values: int32 [nnz], the candidates of each of the
+  //   B * 7 * S rows of x_possible_actions, in order
+  // - x_possible_actions_offsets: int64 [B * 7 * S + 1], row i's candidates
+  //   are values[offsets[i]:offsets[i + 1]]
+  TensorDict encode_inputs_csr_multi(std::vector<Game *> &games,
+                                     int input_version, bool all_powers);
+
+  // Process each of the games, then encode their new inputs as
+  // encode_inputs_multi does (or encode_inputs_all_powers_multi does). Each
+  // game is stepped, gets its possible orders computed and is encoded in a
+  // single pass on a worker thread.
+  TensorDict process_and_encode_inputs_multi(std::vector<Game *> &games,
+                                             int input_version);
+  TensorDict
+  process_and_encode_inputs_all_powers_multi(std::vector<Game *> &games,
+                                             int input_version);
+  ThreadPoolFuture
+  process_and_encode_inputs_multi_async(std::vector<Game *> &games,
+                                        int input_version);
+  ThreadPoolFuture
+  process_and_encode_inputs_all_powers_multi_async(std::vector<Game *> &games,
+                                                   int input_version);
+
+  // Loads a TorchScript policy module for forward_policy_multi, replacing any
+  // previously loaded one. Jobs already running keep using the module they
+  // started with.
+  //
+  // The module's forward must take (Dict[str, Tensor] fields, float
+  // temperature, float top_p), where fields are the inputs encoded by
+  // encode_inputs_multi (or encode_inputs_all_powers_multi), and return the
+  // sampled [B, 7, S] order idxs, or a tuple whose first element they are.
+  // Inputs that the encoder does not produce, e.g. x_has_press, must be
+  // filled in by the module itself.
+  //
+  // Each worker thread runs the module with intra_op_threads intra-op
+  // threads, so that workers do not oversubscribe the cores between them.
+  // This uses at::set_num_threads, which is per thread only with ATen's
+  // OpenMP backend. With the native backend, and for MKL, it is
+  // process-global, so intra_op_threads then applies to the whole process.
+  //
+  // fairdiplomacy.models.base_strategy_model.policy_module exports trained
+  // models in this form.
+  void load_policy_module(const std::string &path, int intra_op_threads);
+
+  bool has_policy_module() const {
+    std::lock_guard<std::mutex> lock(policy_mutex_);
+    return policy_module_ != nullptr;
+  }
+
+  // Encodes the games, samples their orders with the policy module and
+  // decodes them, each worker running encode -> forward -> decode on its own
+  // chunk of games with no round trip to the caller. Returns orders[i][p],
+  // the orders of POWERS[p] in games[i]. Requires load_policy_module.
+  std::vector<std::vector<std::vector<std::string>>>
+  forward_policy_multi(std::vector<Game *> &games, int input_version,
+                       bool all_powers, float temperature, float top_p);
+
+  // Same, but sets the sampled orders on the games instead of returning them
+  void forward_policy_and_set_orders_multi(std::vector<Game *> &games,
+                                           int input_version, bool all_powers,
+                                           float temperature, float top_p);
+
+  // Decode a [B, 7, S]-shape tensor of EOS_IDX-padded order idxs, as
+  // OrdersDecoder::decode_order_idxs does, and set the orders of each power on
+  // games[b]. Order idxs are mapped straight to Order objects, and each
+  // worker sets the orders of its own chunk of games. The games must be
+  // distinct.
+  void decode_and_set_orders(std::vector<Game *> &games,
+                             torch::Tensor order_idxs);
+
+  // Same as decode_and_set_orders, but returns immediately. The orders are
+  // set once the returned future is done.
+  ThreadPoolFuture decode_and_set_orders_async(std::vector<Game *> &games,
+                                               torch::Tensor order_idxs);
+
+  // Same for all-power outputs, as decode_order_idxs_all_powers decodes them
+  // with batch_repeat_interleave = 1
+  void decode_and_set_orders_all_powers(std::vector<Game *> &games,
+                                        torch::Tensor order_idxs,
+                                        torch::Tensor x_in_adj_phase,
+                                        torch::Tensor x_power);
+
+  // Enables an EncodingCache of at most max_entries board encodings and
+  // max_entries valid-orders encodings, shared by all workers, replacing any
+  // previous cache. Encodings of positions already seen are then copied from
+  // the cache instead of being recomputed. max_entries = 0 disables caching.
+  // Must not be called while jobs are running.
+  void enable_encoding_cache(size_t max_entries);
+
+  // Hit and miss counts of the encoding cache (see EncodingCache::get_stats),
+  // empty if it is disabled
+  std::map<std::string, int64_t> get_encoding_cache_stats();
+
+  // Drops all cached encodings and resets the counts
+  void clear_encoding_cache();
+
 private:
   /////////////
   // Methods //
   /////////////
 
   // Worker thread entrypoint function
-  void thread_fn();
+  void thread_fn(size_t worker_i);
+
+  // A job of a submitted batch, as held in the worker queues
+  struct QueuedJob {
+    std::shared_ptr<ThreadPoolBatch> batch;
+    size_t job_i;
+  };
+
+  // Pops a job from worker_i's own queue, or steals one from the back of
+  // another worker's queue. Returns false if all queues are empty.
+  bool pop_or_steal_job(size_t worker_i, QueuedJob *job);
 
   // Top-level job handler
   void thread_fn_do_job_unsafe(ThreadPoolJob &);
@@ -110,15 +331,46 @@ private:
   void do_job_encode(ThreadPoolJob &);
   void do_job_encode_state_only(ThreadPoolJob &);
   void do_job_encode_all_powers(ThreadPoolJob &);
+  void do_job_step_and_encode(ThreadPoolJob &);
+  void do_job_encode_and_policy(ThreadPoolJob &);
+  void do_job_decode_and_set_orders(ThreadPoolJob &);
+  void do_job_encode_csr(ThreadPoolJob &);
 
   // Job handler boilerplate
-  void boilerplate_job_prep(ThreadPoolJobType, std::vector<Game *> &,
-                            int input_version);
-  void boilerplate_job_handle(std::unique_lock<std::mutex> &);
+  std::shared_ptr<ThreadPoolBatch>
+  boilerplate_job_prep(ThreadPoolJobType, std::vector<Game *> &,
+                       int input_version,
+                       size_t jobs_per_thread = JOBS_PER_THREAD);
+  ThreadPoolFuture boilerplate_job_submit(std::shared_ptr<ThreadPoolBatch>);
+
+  // Points each job's encoding_array_pointers at its games' rows of
+  // batch.fields. Pointers to fields that were not allocated are nullptr.
+  void set_encoding_array_pointers(ThreadPoolBatch &batch);
+
+  // Runs *_AND_POLICY jobs for forward_policy*_multi and returns the batch
+  std::shared_ptr<ThreadPoolBatch>
+  run_policy_jobs(std::vector<Game *> &games, int input_version,
+                  bool all_powers, float temperature, float top_p,
+                  bool set_orders);
+
+  // Sets orders[p] on game for each power p
+  static void set_orders_on_game(Game *game,
+                                 const std::vector<std::vector<Order>> &orders);
+
+  // Pointers to row i of each of fields' tensors, nullptr for missing fields
+  static EncodingArrayPointers encoding_array_pointers(TensorDict &fields,
+                                                       int i);
 
   // Helpers
   void encode_state_for_game(Game *, int input_version,
                              EncodingArrayPointers &);
+  void encode_inputs_for_game(Game *, int input_version,
+                              EncodingArrayPointers &);
+  void encode_inputs_all_powers_for_game(Game *, int input_version,
+                                         EncodingArrayPointers &);
+
+  // encode_board_state, through the encoding cache if it is enabled
+  void encode_board_state_cached(GameState &, int input_version, float *r);
 
   const OrdersEncoder &get_orders_encoder(int input_version);
 
@@ -126,17 +378,45 @@ private:
   // Data //
   //////////
 
-  std::vector<ThreadPoolJob> jobs_;
+  // Each batch's games are split into about JOBS_PER_THREAD chunks per
+  // worker, so that workers that draw cheap chunks can steal the remaining
+  // ones from slower workers.
+  static constexpr size_t JOBS_PER_THREAD = 4;
+
+  // Per-worker job queues. A worker pops from the front of its own queue and
+  // steals from the back of the others. Jobs of several batches may be
+  // queued at once.
+  struct WorkerQueue {
+    std::mutex mutex;
+    std::deque<QueuedJob> jobs;
+  };
+  std::vector<WorkerQueue> queues_;
+  std::atomic<size_t> next_queue_{0};
+
+  // mutex_ guards generation_ and time_to_die_. Workers wake up whenever
+  // generation_ is bumped for a new batch of jobs.
   std::mutex mutex_;
   std::condition_variable cv_in_;
-  std::condition_variable cv_out_;
-  size_t unfinished_jobs_;
+  uint64_t generation_ = 0;
   bool time_to_die_ = false;
 
   std::vector<std::thread> threads_;
   const OrdersEncoder orders_encoder_nonbuggy_;
   const OrdersEncoder orders_encoder_buggy_;
   const OrdersDecoder orders_decoder_;
+
+  // Recycled output buffers of ENCODE* batches and *_AND_POLICY jobs
+  DataFieldsPool data_fields_pool_;
+
+  // Cache of board and valid-orders encodings, nullptr if disabled
+  std::unique_ptr<EncodingCache> encoding_cache_;
+
+  // Policy module run by *_AND_POLICY jobs, shared by all workers. Workers
+  // copy the pointer, so a module replaced by load_policy_module stays alive
+  // until the jobs using it are done.
+  mutable std::mutex policy_mutex_; // guards the two below
+  std::shared_ptr<torch::jit::script::Module> policy_module_;
+  int policy_intra_op_threads_ = 1;
 };
 
 } // namespace dipcc
@@ -17,17 +17,16 @@ LICENSE file in the root directory of this source tree.
 namespace dipcc {
 
 bool is_implicit_via(const Order &order,
-                     const std::set<Order> &loc_possible_orders) {
+                     const OrderSpan &loc_possible_orders) {
   return order.get_type() == OrderType::M && !order.get_via() &&
          // order not possible
-         !set_contains(loc_possible_orders, order) &&
+         !loc_possible_orders.contains(order) &&
          // order with via is possible
-         set_contains(loc_possible_orders, order.with_via(true));
+         loc_possible_orders.contains(order.with_via(true));
 }
 
-bool is_implicit_via(
-    const Order &order,
-    const std::unordered_map<Loc, std::set<Order>> &all_possible_orders) {
+bool is_implicit_via(const Order &order,
+                     const PossibleOrders &all_possible_orders) {
   auto it = all_possible_orders.find(order.get_unit().loc);
   return it != all_possible_orders.end() && is_implicit_via(order, it->second);
 }
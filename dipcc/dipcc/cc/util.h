@@ -14,18 +14,19 @@ LICENSE file in the root directory of this source tree.
 #include <vector>
 
 #include "loc.h"
+#include "loc_map.h"
 #include "order.h"
+#include "possible_orders.h"
 
 #include "thirdparty/nlohmann/json.hpp"
 
 namespace dipcc {
 
 bool is_implicit_via(const Order &order,
-                     const std::set<Order> &loc_possible_orders);
+                     const OrderSpan &loc_possible_orders);
 
-bool is_implicit_via(
-    const Order &order,
-    const std::unordered_map<Loc, std::set<Order>> &all_possible_orders);
+bool is_implicit_via(const Order &order,
+                     const PossibleOrders &all_possible_orders);
 
 template <typename T> bool set_contains(const std::set<T> &c, const T &x) {
   return c.find(x) != c.end();
@@ -51,6 +52,16 @@ bool map_contains(const std::unordered_map<T, Q> &c, const T &x) {
   return c.find(x) != c.end();
 }
 
+inline bool set_contains(const LocSet &c, Loc x) { return c.contains(x); }
+
+inline bool set_contains(const OrderSpan &c, const Order &x) {
+  return c.contains(x);
+}
+
+template <typename Q> bool map_contains(const LocMap<Q> &c, Loc x) {
+  return c.contains(x);
+}
+
 template <typename T> bool vec_contains(const std::vector<T> &c, const T &x) {
   return std::find(c.begin(), c.end(), x) != c.end();
 }
@@ -69,6 +80,11 @@ bool safe_contains(const std::unordered_map<K, std::set<V>> &c, const K &k,
   return it != c.end() && set_contains(it->second, v);
 }
 
+inline bool safe_contains(const PossibleOrders &c, Loc k, const Order &v) {
+  auto it = c.find(k);
+  return it != c.end() && it->second.contains(v);
+}
+
 template <typename... S, typename D>
 D json_deep_get(const json &j, D default_return, const std::string &key) {
   auto it = j.find(key);
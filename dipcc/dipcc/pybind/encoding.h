@@ -13,24 +13,39 @@ LICENSE file in the root directory of this source tree.
 
 #include "../cc/checks.h"
 #include "../cc/encoding.h"
+#include "../cc/game.h"
 #include "../cc/thirdparty/nlohmann/json.hpp"
 
 namespace py = pybind11;
 
 namespace dipcc {
 
+// The output arrays are allocated with the GIL held, and the encoding itself
+// runs with the GIL released.
+
 py::array_t<float> py_encode_board_state(GameState &state, int input_version) {
   int bwidth = board_state_enc_width(input_version);
   py::array_t<float> r({NUM_LOCS, bwidth});
-  encode_board_state(state, input_version, r.mutable_data(0, 0));
+  float *r_data = r.mutable_data(0, 0);
+  {
+    py::gil_scoped_release release;
+    encode_board_state(state, input_version, r_data);
+  }
   return r;
 }
 
 py::array_t<float> py_encode_board_state_from_json(const std::string &json_str,
                                                    int input_version) {
-  auto j = json::parse(json_str);
-  GameState state(j);
-  return py_encode_board_state(state, input_version);
+  int bwidth = board_state_enc_width(input_version);
+  py::array_t<float> r({NUM_LOCS, bwidth});
+  float *r_data = r.mutable_data(0, 0);
+  {
+    py::gil_scoped_release release;
+    auto j = json::parse(json_str);
+    GameState state(j);
+    encode_board_state(state, input_version, r_data);
+  }
+  return r;
 }
 
 py::array_t<float> py_encode_board_state_from_phase(PhaseData &phase,
@@ -50,9 +65,57 @@ py_encode_board_state_pperm_matrices(const py::array_t<int> &pperms,
   py::array_t<float> r({static_cast<py::ssize_t>(pperms.shape(0)),
                         static_cast<py::ssize_t>(bwidth),
                         static_cast<py::ssize_t>(bwidth)});
+  std::vector<const int *> pperm_ptrs(batch_size);
+  std::vector<float *> r_ptrs(batch_size);
+  for (size_t i = 0; i < batch_size; ++i) {
+    pperm_ptrs[i] = pperms.data(i, 0);
+    r_ptrs[i] = r.mutable_data(i, 0, 0);
+  }
+  {
+    py::gil_scoped_release release;
+    for (size_t i = 0; i < batch_size; ++i) {
+      encode_board_state_pperm_matrix(pperm_ptrs[i], input_version, r_ptrs[i]);
+    }
+  }
+  return r;
+}
+
+py::array_t<float> py_encode_board_state_pperms(Game &game,
+                                                const py::array_t<int> &pperms,
+                                                int input_version) {
+  JCHECK(pperms.ndim() == 2, "py_encode_board_state_pperms ndim must be 2");
+  JCHECK(pperms.shape(1) == 7,
+         "py_encode_board_state_pperms shape(1) must be 7");
+  auto pperms_c = py::array_t<int, py::array::c_style>::ensure(pperms);
+  int n_pperms = pperms.shape(0);
+  int bwidth = board_state_enc_width(input_version);
+  py::array_t<float> r({static_cast<py::ssize_t>(n_pperms),
+                        static_cast<py::ssize_t>(NUM_LOCS),
+                        static_cast<py::ssize_t>(bwidth)});
+  const int *pperms_data = pperms_c.data();
+  float *r_data = r.mutable_data();
+  {
+    py::gil_scoped_release release;
+    encode_board_state_pperms(game.get_state(), input_version, pperms_data,
+                              n_pperms, r_data);
+  }
+  return r;
+}
+
+py::array_t<int64_t>
+py_encode_board_state_pperm_channel_idxs(const py::array_t<int> &pperms,
+                                         int input_version) {
+  JCHECK(pperms.ndim() == 2,
+         "py_encode_board_state_pperm_channel_idxs ndim must be 2");
+  JCHECK(pperms.shape(1) == 7,
+         "py_encode_board_state_pperm_channel_idxs shape(1) must be 7");
+  size_t batch_size = pperms.shape(0);
+  int bwidth = board_state_enc_width(input_version);
+  py::array_t<int64_t> r({static_cast<py::ssize_t>(batch_size),
+                          static_cast<py::ssize_t>(bwidth)});
   for (size_t i = 0; i < batch_size; ++i) {
-    encode_board_state_pperm_matrix(pperms.data(i, 0), input_version,
-                                    r.mutable_data(i, 0, 0));
+    encode_board_state_pperm_channel_idxs(pperms.data(i, 0), input_version,
+                                          r.mutable_data(i, 0));
   }
   return r;
 }
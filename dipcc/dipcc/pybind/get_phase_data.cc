@@ -24,9 +24,8 @@ PhaseData Game::get_phase_data() const {
 
 PhaseData Game::get_staged_phase_data() const {
   std::map<uint64_t, Message> phase_messages;
-  auto iter = message_history_.find(state_->get_phase());
-  if (iter != message_history_.end()) {
-    phase_messages = iter->second;
+  if (auto messages = message_history_.find(state_->get_phase())) {
+    phase_messages = *messages;
   }
   return PhaseData(*state_, staged_orders_, phase_messages);
 }
@@ -18,10 +18,11 @@ vector<PhaseData> Game::get_phase_history() {
   vector<PhaseData> r;
   r.reserve(state_history_.size());
 
-  for (auto &it : state_history_) {
-    string name = it.first.to_string();
-    r.push_back(
-        PhaseData(*it.second, *order_history_[name], message_history_[name]));
+  for (auto &it : state_history_.in_order()) {
+    auto messages = message_history_.find(it.first);
+    r.push_back(PhaseData(*it.second, *order_history_.at(it.first),
+                          messages ? *messages
+                                   : std::map<uint64_t, Message>()));
   }
 
   return r;
@@ -30,8 +31,8 @@ vector<PhaseData> Game::get_phase_history() {
 vector<PhaseData> Game::get_all_phases() {
   vector<PhaseData> r = get_phase_history();
   std::map<uint64_t, Message> phase_messages;
-  if (message_history_.find(state_->get_phase()) != message_history_.end()) {
-    phase_messages = message_history_[state_->get_phase()];
+  if (auto messages = message_history_.find(state_->get_phase())) {
+    phase_messages = *messages;
   }
   r.push_back(PhaseData(*state_, staged_orders_, phase_messages));
 
@@ -41,7 +42,7 @@ vector<PhaseData> Game::get_all_phases() {
 vector<std::string> Game::get_all_phase_names() const {
   vector<std::string> r;
   r.reserve(state_history_.size() + 1);
-  for (auto &it : state_history_) {
+  for (auto &it : state_history_.in_order()) {
     string name = it.first.to_string();
     r.push_back(name);
   }
@@ -20,7 +20,7 @@ namespace dipcc {
 
 py::dict Game::py_get_logs() {
   py::dict d;
-  for (auto &[phase, datas] : logs_) {
+  for (auto &[phase, datas] : logs_.in_order()) {
     py::list l;
     for (const std::shared_ptr<const std::string> &data : datas) {
       l.append(*data);
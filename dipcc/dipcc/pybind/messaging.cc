@@ -22,7 +22,9 @@ py::dict Game::py_get_message_history() {
 }
 
 py::dict Game::py_get_messages() {
-  return py_messages_to_phase_dict(message_history_[state_->get_phase()]);
+  auto messages = message_history_.find(state_->get_phase());
+  return py_messages_to_phase_dict(messages ? *messages
+                                            : std::map<uint64_t, Message>());
 }
 
 // PRIVATE
@@ -55,11 +57,11 @@ py_messages_to_phase_dict(const std::map<uint64_t, Message> &messages) {
 }
 
 py::dict py_message_history_to_dict(
-    const std::map<Phase, std::map<uint64_t, Message>> &message_history,
+    const PhaseHistory<std::map<uint64_t, Message>> &message_history,
     Phase exclude_phase) {
 
   py::dict d;
-  for (auto &[phase, messages] : message_history) {
+  for (auto &[phase, messages] : message_history.in_order()) {
     if (phase == exclude_phase) {
       continue;
     }
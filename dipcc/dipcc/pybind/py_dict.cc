@@ -34,9 +34,16 @@ py::dict py_orders_to_dict(unordered_map<Power, vector<Order>> &orders) {
 }
 
 py::dict py_state_to_dict(GameState &state) {
-  py::dict d;
+  // Possible orders may need to be computed; do that without holding the GIL
+  // and only build the python objects below with it held.
+  const PossibleOrders *all_possible_orders_ptr;
+  {
+    py::gil_scoped_release release;
+    all_possible_orders_ptr = &state.get_all_possible_orders();
+  }
+  const auto &all_possible_orders(*all_possible_orders_ptr);
 
-  auto &all_possible_orders(state.get_all_possible_orders());
+  py::dict d;
 
   // builds
   d["builds"] = py::dict();
@@ -5,6 +5,7 @@ This source code is licensed under the MIT license found in the
 LICENSE file in the root directory of this source tree.
 */
 #include <memory>
+#include <pybind11/functional.h>
 #include <pybind11/pybind11.h>
 #include <pybind11/stl.h>
 #include <torch/extension.h>
@@ -12,7 +13,9 @@ LICENSE file in the root directory of this source tree.
 #include "../cc/cfrstats.h"
 #include "../cc/exceptions.h"
 #include "../cc/game.h"
+#include "../cc/game_batch.h"
 #include "../cc/loc.h"
+#include "../cc/rollout_engine.h"
 #include "../cc/thread_pool.h"
 #include "encoding.h"
 #include "py_game_get_units.h"
@@ -28,38 +31,50 @@ using namespace dipcc;
 // #################################################
 
 PYBIND11_MODULE(pydipcc, m) {
+  // Bindings that only run C++ code release the GIL for the duration of the
+  // call, so that other python threads can run meanwhile. Conversions of
+  // arguments and return values still happen with the GIL held. Python threads
+  // must not use a game while another thread has a call on it in flight.
+  const auto release_gil = py::call_guard<py::gil_scoped_release>();
+
   // class Game
   py::class_<Game>(m, "Game")
       .def(py::init<int, bool>(), py::arg("draw_on_stalemate_years") = -1,
            py::arg("is_full_press") = true)
       .def(py::init<const Game &>())
-      .def("process", &Game::process)
-      .def("set_orders", &Game::set_orders)
+      .def("process", &Game::process, release_gil)
+      .def("set_orders",
+           py::overload_cast<const std::string &,
+                             const std::vector<std::string> &>(
+               &Game::set_orders))
       .def("set_all_orders", &Game::set_all_orders,
            "NOTE: Clears and replaces any existing staged orders for any power")
       .def("clear_orders", &Game::clear_orders)
       .def("get_state", &Game::py_get_state, py::return_value_policy::move)
-      .def("get_all_possible_orders", &Game::py_get_all_possible_orders)
+      .def("get_all_possible_orders", &Game::py_get_all_possible_orders,
+           release_gil)
       // Returns a dict power -> list of orderable locations. The list will be
       // sorted in the same way as x_possible_actions.
       .def("get_orderable_locations", &Game::py_get_orderable_locations)
-      .def("to_json", &Game::to_json)
-      .def("from_json", &Game::from_json)
-      .def("from_json_inplace",
-           [](Game &this_game, const std::string &json_content) {
-             this_game = Game::from_json(json_content);
-           })
+      .def("to_json", &Game::to_json, release_gil)
+      .def("from_json", &Game::from_json, release_gil)
+      .def(
+          "from_json_inplace",
+          [](Game &this_game, const std::string &json_content) {
+            this_game = Game::from_json(json_content);
+          },
+          release_gil)
       .def("get_phase_history", &Game::get_phase_history,
-           py::return_value_policy::move,
+           py::return_value_policy::move, release_gil,
            "Gets the phase data for all past phases, not including the current "
            "staged phase.")
       .def("get_staged_phase_data", &Game::get_staged_phase_data,
-           py::return_value_policy::move,
+           py::return_value_policy::move, release_gil,
            "Gets the phase data for the current staged phase that is not "
            "processed yet.")
 
       .def("get_phase_data", &Game::get_phase_data,
-           py::return_value_policy::move,
+           py::return_value_policy::move, release_gil,
            "NOTE: get_phase_data, bizarrely, omits the staged orders and "
            "messages"
            "of the current phase. This can lead to unexpected bugs, for example"
@@ -70,7 +85,7 @@ PYBIND11_MODULE(pydipcc, m) {
            "Use get_all_phases or get_staged_phase_data, which do not have "
            "this behavior. ")
       .def("get_all_phases", &Game::get_all_phases,
-           py::return_value_policy::move,
+           py::return_value_policy::move, release_gil,
            "Gets the phase data for all past phases and the current staged "
            "phase.")
       .def("get_all_phase_names", &Game::get_all_phase_names,
@@ -88,11 +103,14 @@ PYBIND11_MODULE(pydipcc, m) {
            py::arg_v("increment_on_collision", false,
                      "If the timestamp is already used, increment until an "
                      "unused timestamp is found"))
-      .def("rolled_back_to_phase_start", &Game::rolled_back_to_phase_start)
-      .def("rolled_back_to_phase_end", &Game::rolled_back_to_phase_end)
+      .def("rolled_back_to_phase_start", &Game::rolled_back_to_phase_start,
+           release_gil)
+      .def("rolled_back_to_phase_end", &Game::rolled_back_to_phase_end,
+           release_gil)
       .def("rolled_back_to_timestamp_start",
-           &Game::rolled_back_to_timestamp_start)
-      .def("rolled_back_to_timestamp_end", &Game::rolled_back_to_timestamp_end)
+           &Game::rolled_back_to_timestamp_start, release_gil)
+      .def("rolled_back_to_timestamp_end", &Game::rolled_back_to_timestamp_end,
+           release_gil)
       .def("phase_of_last_message_at_or_before",
            &Game::py_phase_of_last_message_at_or_before)
       .def("rollback_messages_to_timestamp_start",
@@ -141,9 +159,10 @@ PYBIND11_MODULE(pydipcc, m) {
       .def("set_exception_on_convoy_paradox",
            &Game::set_exception_on_convoy_paradox)
       // Hash of the current state of the board, i.e., position of units.
-      .def("compute_board_hash", &Game::compute_board_hash)
+      .def("compute_board_hash", &Game::compute_board_hash, release_gil)
       // Hash of the whole history of valid orders.
-      .def("compute_order_history_hash", &Game::compute_order_history_hash)
+      .def("compute_order_history_hash", &Game::compute_order_history_hash,
+           release_gil)
       .def("set_draw_on_stalemate_years", &Game::set_draw_on_stalemate_years)
       .def("get_consecutive_years_without_sc_change",
            &Game::get_consecutive_years_without_sc_change)
@@ -182,16 +201,18 @@ PYBIND11_MODULE(pydipcc, m) {
              return x ? static_cast<py::object>(py::str(x->to_string()))
                       : py::none();
            })
-      .def("clone_n_times",
-           [](Game &game, const int &n_repeats) {
-             std::vector<Game> games;
-             games.reserve(n_repeats);
-             for (int i = 0; i < n_repeats; ++i) {
-               games.emplace_back(game);
-               games.back().game_id += "_" + std::to_string(i);
-             }
-             return games;
-           })
+      .def(
+          "clone_n_times",
+          [](Game &game, const int &n_repeats) {
+            std::vector<Game> games;
+            games.reserve(n_repeats);
+            for (int i = 0; i < n_repeats; ++i) {
+              games.emplace_back(game);
+              games.back().game_id += "_" + std::to_string(i);
+            }
+            return games;
+          },
+          release_gil)
       .def("set_metadata", &Game::set_metadata)
       .def("get_metadata", &Game::get_metadata)
       .def_property_readonly_static(
@@ -211,6 +232,45 @@ PYBIND11_MODULE(pydipcc, m) {
         return loc == Loc::NONE ? false : is_center(loc);
       });
 
+  // class GameBatch
+  py::class_<GameBatch>(m, "GameBatch")
+      .def(py::init<const std::vector<Game> &>(), py::arg("games"))
+      .def(py::init<const Game &, int>(), py::arg("game"),
+           py::arg("n_repeats"), release_gil,
+           "Copies of game, with game_ids suffixed as clone_n_times does")
+      .def("__len__", &GameBatch::size)
+      .def("__getitem__", &GameBatch::get_game,
+           py::return_value_policy::reference_internal)
+      .def("get_games", py::overload_cast<>(&GameBatch::get_games),
+           py::return_value_policy::reference_internal)
+      .def("get_games",
+           py::overload_cast<const std::vector<int64_t> &>(
+               &GameBatch::get_games),
+           py::return_value_policy::reference_internal)
+      .def("is_done", &GameBatch::is_done, release_gil)
+      .def("phase_keys", &GameBatch::phase_keys, release_gil)
+      .def("phases", &GameBatch::phases, release_gil)
+      .def("get_scores",
+           py::overload_cast<>(&GameBatch::get_scores, py::const_),
+           release_gil)
+      .def(
+          "get_scores",
+          [](GameBatch &batch, int scoring_system) {
+            return batch.get_scores(static_cast<Scoring>(scoring_system));
+          },
+          release_gil)
+      .def("min_ongoing_phase", &GameBatch::min_ongoing_phase, release_gil)
+      .def("ongoing_game_idxs_at_phase", &GameBatch::ongoing_game_idxs_at_phase,
+           release_gil)
+      .def("set_orders", &GameBatch::set_orders, py::arg("game_idxs"),
+           py::arg("orders"), release_gil)
+      .def("process",
+           py::overload_cast<const std::vector<int64_t> &>(&GameBatch::process),
+           py::arg("game_idxs"), release_gil)
+      .def("process", py::overload_cast<>(&GameBatch::process), release_gil);
+  m.def("phase_sort_key",
+        [](const std::string &phase) { return phase_sort_key(Phase(phase)); });
+
   // class PhaseData
   py::class_<PhaseData>(m, "PhaseData")
       .def_property_readonly("name", &PhaseData::get_name)
@@ -223,20 +283,108 @@ PYBIND11_MODULE(pydipcc, m) {
            })
       .def("to_dict", &PhaseData::to_dict);
 
+  // class ThreadPoolFuture
+  py::class_<ThreadPoolFuture>(m, "ThreadPoolFuture")
+      .def("done", &ThreadPoolFuture::done)
+      .def("wait", &ThreadPoolFuture::wait, release_gil);
+
   // class ThreadPool
+  //
+  // The *_async methods keep the pool and the list of games alive until the
+  // returned future is destroyed.
   py::class_<ThreadPool, std::shared_ptr<ThreadPool>>(m, "ThreadPool")
-      .def(py::init<size_t, std::unordered_map<std::string, int>, int>())
-      .def("process_multi", &ThreadPool::process_multi)
-      .def("encode_orders_single_strict", &py_thread_pool_encode_orders_strict)
+      .def(py::init<size_t, std::unordered_map<std::string, int>, int, bool>(),
+           py::arg("n_threads"), py::arg("order_vocabulary_to_idx"),
+           py::arg("max_order_cands"), py::arg("pin_memory") = false,
+           release_gil)
+      .def("process_multi", &ThreadPool::process_multi, release_gil)
+      .def("process_multi_async", &ThreadPool::process_multi_async,
+           py::keep_alive<0, 1>(), py::keep_alive<0, 2>(), release_gil)
+      .def("encode_orders_single_strict", &py_thread_pool_encode_orders_strict,
+           release_gil)
       .def("encode_orders_single_tolerant",
-           &py_thread_pool_encode_orders_tolerant)
-      .def("encode_inputs_multi", &py_thread_pool_encode_inputs_multi)
+           &py_thread_pool_encode_orders_tolerant, release_gil)
+      .def("encode_inputs_multi", &py_thread_pool_encode_inputs_multi,
+           release_gil)
       .def("encode_inputs_all_powers_multi",
-           &py_thread_pool_encode_inputs_all_powers_multi)
+           &py_thread_pool_encode_inputs_all_powers_multi, release_gil)
       .def("encode_inputs_state_only_multi",
-           &py_thread_pool_encode_inputs_state_only_multi)
-      .def("decode_order_idxs", &py_decode_order_idxs)
-      .def("decode_order_idxs_all_powers", &py_decode_order_idxs_all_powers);
+           &py_thread_pool_encode_inputs_state_only_multi, release_gil)
+      .def("encode_inputs_multi_async", &ThreadPool::encode_inputs_multi_async,
+           py::keep_alive<0, 1>(), py::keep_alive<0, 2>(), release_gil)
+      .def("encode_inputs_all_powers_multi_async",
+           &ThreadPool::encode_inputs_all_powers_multi_async,
+           py::keep_alive<0, 1>(), py::keep_alive<0, 2>(), release_gil)
+      .def("encode_inputs_state_only_multi_async",
+           &ThreadPool::encode_inputs_state_only_multi_async,
+           py::keep_alive<0, 1>(), py::keep_alive<0, 2>(), release_gil)
+      .def("encode_inputs_csr_multi", &ThreadPool::encode_inputs_csr_multi,
+           py::arg("games"), py::arg("input_version"), py::arg("all_powers"),
+           release_gil)
+      .def("process_and_encode_inputs_multi",
+           &ThreadPool::process_and_encode_inputs_multi, release_gil)
+      .def("process_and_encode_inputs_all_powers_multi",
+           &ThreadPool::process_and_encode_inputs_all_powers_multi, release_gil)
+      .def("process_and_encode_inputs_multi_async",
+           &ThreadPool::process_and_encode_inputs_multi_async,
+           py::keep_alive<0, 1>(), py::keep_alive<0, 2>(), release_gil)
+      .def("process_and_encode_inputs_all_powers_multi_async",
+           &ThreadPool::process_and_encode_inputs_all_powers_multi_async,
+           py::keep_alive<0, 1>(), py::keep_alive<0, 2>(), release_gil)
+      .def("decode_order_idxs", &py_decode_order_idxs, release_gil)
+      .def("decode_order_idxs_all_powers", &py_decode_order_idxs_all_powers,
+           release_gil)
+      .def("load_policy_module", &ThreadPool::load_policy_module,
+           py::arg("path"), py::arg("intra_op_threads") = 1, release_gil)
+      .def("has_policy_module", &ThreadPool::has_policy_module)
+      .def("forward_policy_multi", &ThreadPool::forward_policy_multi,
+           py::arg("games"), py::arg("input_version"), py::arg("all_powers"),
+           py::arg("temperature"), py::arg("top_p"), release_gil)
+      .def("forward_policy_and_set_orders_multi",
+           &ThreadPool::forward_policy_and_set_orders_multi, py::arg("games"),
+           py::arg("input_version"), py::arg("all_powers"),
+           py::arg("temperature"), py::arg("top_p"), release_gil)
+      .def("decode_and_set_orders", &ThreadPool::decode_and_set_orders,
+           py::arg("games"), py::arg("order_idxs"), release_gil)
+      .def("decode_and_set_orders_async",
+           &ThreadPool::decode_and_set_orders_async, py::arg("games"),
+           py::arg("order_idxs"), py::keep_alive<0, 1>(),
+           py::keep_alive<0, 2>(), release_gil)
+      .def("decode_and_set_orders_all_powers",
+           &ThreadPool::decode_and_set_orders_all_powers, py::arg("games"),
+           py::arg("order_idxs"), py::arg("x_in_adj_phase"),
+           py::arg("x_power"), release_gil)
+      .def("enable_encoding_cache", &ThreadPool::enable_encoding_cache,
+           py::arg("max_entries"), release_gil)
+      .def("get_encoding_cache_stats", &ThreadPool::get_encoding_cache_stats)
+      .def("clear_encoding_cache", &ThreadPool::clear_encoding_cache,
+           release_gil);
+
+  // class RolloutEngine
+  //
+  // run(policy) holds the GIL only while calling the policy. run(temperature,
+  // top_p) samples with the thread pool's policy module and never takes it.
+  py::class_<RolloutEngine>(m, "RolloutEngine")
+      .def(py::init<const Game &, int, std::shared_ptr<ThreadPool>, int, bool,
+                    int, const std::map<int, float> &>(),
+           py::arg("game"), py::arg("n_games"), py::arg("thread_pool"),
+           py::arg("input_version"), py::arg("all_powers"),
+           py::arg("max_rollout_length"),
+           py::arg("year_spring_prob_of_ending"), release_gil)
+      .def("get_batch", &RolloutEngine::get_batch,
+           py::return_value_policy::reference_internal)
+      .def("set_start_orders", &RolloutEngine::set_start_orders,
+           py::arg("game_idx"), py::arg("power"), py::arg("orders"))
+      .def("run",
+           py::overload_cast<const RolloutPolicy &>(&RolloutEngine::run),
+           py::arg("policy"), release_gil)
+      .def("run", py::overload_cast<float, float>(&RolloutEngine::run),
+           py::arg("temperature"), py::arg("top_p"), release_gil)
+      .def("get_prob_of_spring_ending",
+           &RolloutEngine::get_prob_of_spring_ending)
+      .def("get_spring_ending_ev", &RolloutEngine::get_spring_ending_ev)
+      .def("get_cumulative_spring_ending_prob",
+           &RolloutEngine::get_cumulative_spring_ending_prob);
 
   // encoding functions
   m.def("encode_board_state", &py_encode_board_state,
@@ -247,6 +395,12 @@ PYBIND11_MODULE(pydipcc, m) {
         py::return_value_policy::move);
   m.def("encode_board_state_pperm_matrices",
         &py_encode_board_state_pperm_matrices, py::return_value_policy::move);
+  m.def("encode_board_state_pperms", &py_encode_board_state_pperms,
+        py::arg("game"), py::arg("pperms"), py::arg("input_version"),
+        py::return_value_policy::move);
+  m.def("encode_board_state_pperm_channel_idxs",
+        &py_encode_board_state_pperm_channel_idxs, py::arg("pperms"),
+        py::arg("input_version"), py::return_value_policy::move);
   m.def("encoding_unit_ownership_idxs", &encoding_unit_ownership_idxs);
   m.def("encoding_sc_ownership_idxs", &encoding_sc_ownership_idxs);
 
@@ -29,8 +29,7 @@ namespace dipcc {
 
 // forward declares
 std::vector<std::string> get_compound_build_orders(
-    const std::unordered_map<dipcc::Loc, std::set<dipcc::Order>>
-        &all_possible_orders,
+    const PossibleOrders &all_possible_orders,
     std::vector<Loc> orderable_locs, int n_builds);
 
 class ValidOrdersEncoder {
@@ -52,11 +51,10 @@ public:
 private:
   // Methods
   int smarter_order_index(const Order &) const;
-  std::vector<int> filter_orders_in_vocab(const std::set<Order> &) const;
+  std::vector<int> filter_orders_in_vocab(const OrderSpan &) const;
   std::vector<Loc> get_sorted_actual_orderable_locs(
       const std::unordered_set<Loc> &root_locs,
-      const std::unordered_map<dipcc::Loc, std::set<dipcc::Order>>
-          &all_possible_orders) const;
+      const PossibleOrders &all_possible_orders) const;
 
   // Data
   std::unordered_map<std::string, int> order_vocabulary_to_idx_;
@@ -146,7 +144,7 @@ py::tuple ValidOrdersEncoder::encode_valid_orders(const std::string &power_s,
 } // encode_valid_orders
 
 std::vector<int> ValidOrdersEncoder::filter_orders_in_vocab(
-    const std::set<Order> &orders) const {
+    const OrderSpan &orders) const {
   std::vector<int> idxs;
   idxs.reserve(orders.size());
 
@@ -191,8 +189,7 @@ int ValidOrdersEncoder::smarter_order_index(const Order &order) const {
 
 std::vector<Loc> ValidOrdersEncoder::get_sorted_actual_orderable_locs(
     const std::unordered_set<Loc> &root_locs,
-    const std::unordered_map<dipcc::Loc, std::set<dipcc::Order>>
-        &all_possible_orders) const {
+    const PossibleOrders &all_possible_orders) const {
   std::vector<Loc> locs;
   locs.reserve(root_locs.size());
 
@@ -239,8 +236,7 @@ void combinations(int n, int c,
 }
 
 std::vector<std::string> get_compound_build_orders(
-    const std::unordered_map<dipcc::Loc, std::set<dipcc::Order>>
-        &all_possible_orders,
+    const PossibleOrders &all_possible_orders,
     std::vector<Loc> orderable_locs, int n_builds) {
 
   std::vector<std::string> r;
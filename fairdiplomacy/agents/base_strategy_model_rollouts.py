@@ -8,16 +8,14 @@ import logging
 from typing import Callable, Dict, Generic, Iterable, List, Optional, Tuple, TypeVar
 
 import logging
-import numpy as np
 import torch
 from typing import List, Tuple
 
 from conf import agents_cfgs
 from fairdiplomacy import pydipcc
-from fairdiplomacy.agents.base_search_agent import n_move_phases_later
 
 from fairdiplomacy.agents.base_strategy_model_wrapper import BaseStrategyModelWrapper
-from fairdiplomacy.game import sort_phase_key
+from fairdiplomacy.data.data_fields import DataFields
 from fairdiplomacy.models.consts import POWERS
 from fairdiplomacy.typedefs import (
     JointAction,
@@ -152,26 +150,31 @@ class BaseStrategyModelRollouts:
             with timings("clear_old_orders"):
                 game_init = pydipcc.Game(game_init)
                 game_init.clear_old_all_possible_orders()
+        max_rollout_length = (
+            override_max_rollout_length
+            if override_max_rollout_length is not None
+            else self.max_rollout_length
+        )
         with timings("clone"):
-            games = game_init.clone_n_times(len(set_orders_dicts) * self.average_n_rollouts)
+            engine = pydipcc.RolloutEngine(
+                game_init,
+                n_games=len(set_orders_dicts) * self.average_n_rollouts,
+                thread_pool=self.feature_encoder.thread_pool,
+                input_version=self.base_strategy_model.get_policy_input_version(),
+                all_powers=self.base_strategy_model.is_all_powers(),
+                max_rollout_length=max_rollout_length,
+                year_spring_prob_of_ending=self.year_spring_prob_of_ending or {},
+            )
+            batch = engine.get_batch()
+            games = batch.get_games()
         with timings("setup"):
             game_ids = [game.game_id for game in games]
 
-            # set orders if specified
-            for game, set_orders_dict in zip(
-                games, repeat(set_orders_dicts, self.average_n_rollouts)
-            ):
+            # set orders if specified. Orders of the other powers on the first
+            # phase are generated by the model.
+            for i, set_orders_dict in enumerate(repeat(set_orders_dicts, self.average_n_rollouts)):
                 for power, orders in set_orders_dict.items():
-                    game.set_orders(power, list(orders))
-
-            # for each game, a list of powers whose orders need to be generated
-            # by the model on the first phase.
-            missing_start_orders = {
-                game.game_id: frozenset(p for p in POWERS if p not in set_orders_dict)
-                for game, set_orders_dict in zip(
-                    games, repeat(set_orders_dicts, self.average_n_rollouts)
-                )
-            }
+                    engine.set_start_orders(i, power, list(orders))
 
             # Construct game_id -> player_rating dict
             if self.set_player_ratings:
@@ -190,104 +193,47 @@ class BaseStrategyModelRollouts:
             else:
                 game_rating_dict = None
 
-        max_rollout_length = (
-            override_max_rollout_length
-            if override_max_rollout_length is not None
-            else self.max_rollout_length
-        )
-        if max_rollout_length > 0:
-            rollout_end_phase_id = sort_phase_key(
-                n_move_phases_later(game_init.current_short_phase, max_rollout_length)
+        def policy(fields: Dict[str, torch.Tensor], game_idxs: List[int]) -> torch.Tensor:
+            timings.start("encoding")
+            games_to_step_rating_dict = (
+                {game_ids[i]: game_rating_dict[game_ids[i]] for i in game_idxs}
+                if game_rating_dict is not None
+                else None
             )
-            max_steps = 1000000
-        else:
-            # Really far ahead.
-            rollout_end_phase_id = sort_phase_key(
-                n_move_phases_later(game_init.current_short_phase, 10)
+            x = self.base_strategy_model.add_stuff_to_datafields(
+                DataFields(fields),
+                has_press=self.has_press,
+                agent_power=agent_power,
+                game_rating_dict=games_to_step_rating_dict,
             )
-            max_steps = 1
-
-        # Accumulates the expected value contribution of the game ending early in spring
-        # and being scored immediately (already multiplied by the probability of it happening)
-        spring_ending_ev = torch.zeros((len(games), len(POWERS), 1))
-        # Accumulates the probability of ending in spring and being scored immediately.
-        cumulative_spring_ending_prob = torch.zeros((len(games), 1, 1))
-
-        # This loop steps the games until one of the conditions is true:
-        #   - all games are done
-        #   - at least one game was stepped for max_steps steps
-        #   - all games are either completed or reach a phase such that
-        #     sort_phase_key(phase) >= rollout_end_phase_id
-        for step_id in range(max_steps):
-            ongoing_game_phases = [
-                game.current_short_phase for game in games if not game.is_game_done
-            ]
-
-            if len(ongoing_game_phases) == 0:
-                # all games are done
-                break
-
-            # step games together at the pace of the slowest game, e.g. process
-            # games with retreat phases alone before moving on to the next move phase
-            min_phase = min(ongoing_game_phases, key=sort_phase_key)
-
-            if sort_phase_key(min_phase) >= rollout_end_phase_id:
-                break
-
-            # Processing the spring movement phase of a year
-            if step_id > 0 and min_phase.startswith("S") and min_phase.endswith("M"):
-                year = int(min_phase[1:-1])
-                end_prob = self.get_prob_of_spring_ending(year)
-                if end_prob > 0.0:
-                    # Because we aren't filtering by game.is_game_done, this will also get scores
-                    # for games that stopped early due to being completed,
-                    # but this is fine since it will just be averaging in the same score again.
-                    # Shape: [num_games, num_powers, 1]
-                    scores = torch.FloatTensor([game.get_scores() for game in games]).unsqueeze(-1)
-                    spring_ending_ev += scores * (end_prob * (1.0 - cumulative_spring_ending_prob))
-                    cumulative_spring_ending_prob += end_prob * (
-                        1.0 - cumulative_spring_ending_prob
-                    )
-
-            games_to_step = [
-                game
-                for game in games
-                if not game.is_game_done and game.current_short_phase == min_phase
-            ]
-
-            if step_id > 0 or any(missing_start_orders.values()):
-                games_to_step_rating_dict = (
-                    {game.game_id: game_rating_dict[game.game_id] for game in games_to_step}
-                    if game_rating_dict is not None
-                    else None
-                )
-                batch_orders, _logprobs = self.base_strategy_model.forward_policy(
-                    games_to_step,
-                    has_press=self.has_press,
-                    agent_power=agent_power,
-                    game_rating_dict=games_to_step_rating_dict,
-                    feature_encoder=self.feature_encoder,
-                    temperature=self.temperature,
-                    top_p=self.top_p,
-                    timings=timings,
-                )
+            order_idxs, _logprobs = self.base_strategy_model.forward_policy_order_idxs_from_datafields(
+                x, temperature=self.temperature, top_p=self.top_p, timings=timings
+            )
+            timings.start("env.step")
+            return order_idxs.cpu()
 
-                with timings("env.set_orders"):
-                    assert len(games_to_step) == len(batch_orders)
-                    for game, orders_per_power in zip(games_to_step, batch_orders):
-                        for power, orders in zip(POWERS, orders_per_power):
-                            if step_id == 0 and power not in missing_start_orders[game.game_id]:
-                                continue
-                            game.set_orders(power, list(orders))
+        # Steps the games until all games are done or reach the phase
+        # max_rollout_length movement phases later, at the pace of the slowest
+        # game, and accumulates the expected value of the game ending early in
+        # spring. See RolloutEngine in dipcc.
+        timings.start("env.step")
+        engine.run(policy)
 
-            with timings("env.step"):
-                self.feature_encoder.process_multi([game for game in games_to_step])
+        # Accumulated expected value contribution of the game ending early in spring
+        # and being scored immediately (already multiplied by the probability of it happening)
+        # Shape: [num_games, num_powers, 1].
+        spring_ending_ev = engine.get_spring_ending_ev().unsqueeze(-1)
+        # Accumulated probability of ending in spring and being scored immediately.
+        # Shape: [num_games, 1, 1].
+        cumulative_spring_ending_prob = engine.get_cumulative_spring_ending_prob().view(-1, 1, 1)
 
         # Shape: [num_games, num_powers, num_value_functions].
         final_scores = torch.zeros((len(games), len(POWERS), len(all_value_functions)))
 
         # Compute SoS for done game and query the net for not-done games.
-        not_done_games = [game for game in games if not game.is_game_done]
+        # Shape: [num_games].
+        done_games_mask = batch.is_done()
+        not_done_games = [game for game, done in zip(games, done_games_mask.tolist()) if not done]
         if not_done_games:
             timings.start("encoding")
             not_done_game_rating_dict = (
@@ -312,40 +258,25 @@ class BaseStrategyModelRollouts:
                 ],
                 -1,
             )
-            not_done_games_mask = torch.BoolTensor([not game.is_game_done for game in games])
             # Extra float() to handle half().
-            final_scores[not_done_games_mask] = final_scores_per_base_strategy_model.float().cpu()
+            final_scores[~done_games_mask] = final_scores_per_base_strategy_model.float().cpu()
 
         timings.start("final_scores")
-        for i, game in enumerate(games):
-            if game.is_game_done:
-                final_scores[i] = torch.FloatTensor(game.get_scores()).unsqueeze(-1)
+        # Shape: [num_games, num_powers].
+        current_scores = batch.get_scores()
+        final_scores[done_games_mask] = current_scores[done_games_mask].unsqueeze(-1)
 
         # mix in current sum of squares ratio to encourage losing powers to try hard
         # get GameScores objects for current game state
         if self.mix_square_ratio_scoring > 0:
             # Shape: [num_games, num_powers, 1]
-            sos_scores = torch.FloatTensor([game.get_scores() for game in games]).unsqueeze(-1)
+            sos_scores = current_scores.unsqueeze(-1)
             final_scores = (1 - self.mix_square_ratio_scoring) * final_scores + (
                 self.mix_square_ratio_scoring * sos_scores
             )
 
         if self.has_year_spring_prob_of_ending:
-            # For the final game positions, they may be on different phases, check each one individually
-            final_spring_ending_ev = np.zeros((len(games), len(POWERS)))
-            final_spring_ending_prob = np.zeros((len(games),))
-            for i, game in enumerate(games):
-                game_current_phase = game.current_short_phase
-                if game_current_phase.startswith("S") and game_current_phase.endswith("M"):
-                    p = self.get_prob_of_spring_ending(game.current_year)
-                    final_spring_ending_ev[i, :] = [score * p for score in game.get_scores()]
-                    final_spring_ending_prob[i] = p
-
-            spring_ending_ev += torch.FloatTensor(final_spring_ending_ev).unsqueeze(-1)
-            cumulative_spring_ending_prob += (
-                torch.FloatTensor(final_spring_ending_prob).unsqueeze(-1).unsqueeze(-1)
-            )
-
+            # The engine has already accounted for the final game positions
             final_scores = (1.0 - cumulative_spring_ending_prob) * final_scores + spring_ending_ev
 
         if self.average_n_rollouts != 1:
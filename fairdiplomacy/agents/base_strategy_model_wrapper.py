@@ -274,25 +274,13 @@ class BaseStrategyModelWrapper:
         timings_ = DummyCtx() if timings is None else timings
         del timings
 
-        with timings_("to_half_precision"):
-            if self.half_precision:
-                x = x.to_half_precision()
-
-        assert temperature > 0
-        assert top_p > 0
-        with timings_("model"):
-            order_idxs, order_logprobs = batched_forward(
-                lambda x: self._forward_policy(
-                    x,
-                    temperature=temperature,
-                    top_p=top_p,
-                    batch_repeat_interleave=batch_repeat_interleave,
-                ),
-                x,
-                # Cannot mix batch_repeat_interleave and auto batching.
-                batch_size=self.max_batch_size if batch_repeat_interleave is None else int(1e10),
-                device=self.device,
-            )
+        order_idxs, order_logprobs = self.forward_policy_order_idxs_from_datafields(
+            x,
+            temperature=temperature,
+            top_p=top_p,
+            batch_repeat_interleave=batch_repeat_interleave,
+            timings=timings_,
+        )
 
         with timings_("model.decode"):
             if not self.is_all_powers():
@@ -319,6 +307,43 @@ class BaseStrategyModelWrapper:
 
         return (decoded, cast(torch.Tensor, order_logprobs))
 
+    def forward_policy_order_idxs_from_datafields(
+        self,
+        x: DataFields,
+        temperature: float = -1,
+        top_p: float = -1,
+        batch_repeat_interleave: Optional[int] = None,
+        timings: Optional[Union[DummyCtx, TimingCtx]] = None,
+    ) -> Tuple[torch.Tensor, torch.Tensor]:
+        """Same as forward_policy_from_datafields, but returns the sampled order idxs undecoded.
+
+        Returns: order_idxs, logprobs, where order_idxs is a [B, 7, S] tensor as
+        taken by FeatureEncoder.decode_order_idxs (or decode_order_idxs_all_powers).
+        """
+        timings_ = DummyCtx() if timings is None else timings
+        del timings
+
+        with timings_("to_half_precision"):
+            if self.half_precision:
+                x = x.to_half_precision()
+
+        assert temperature > 0
+        assert top_p > 0
+        with timings_("model"):
+            order_idxs, order_logprobs = batched_forward(
+                lambda x: self._forward_policy(
+                    x,
+                    temperature=temperature,
+                    top_p=top_p,
+                    batch_repeat_interleave=batch_repeat_interleave,
+                ),
+                x,
+                # Cannot mix batch_repeat_interleave and auto batching.
+                batch_size=self.max_batch_size if batch_repeat_interleave is None else int(1e10),
+                device=self.device,
+            )
+        return cast(torch.Tensor, order_idxs), cast(torch.Tensor, order_logprobs)
+
     def forward_values_from_datafields(
         self, x: DataFields, timings: Optional[TimingCtx] = None
     ) -> torch.Tensor:
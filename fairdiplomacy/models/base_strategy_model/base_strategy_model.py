@@ -1253,16 +1253,25 @@ def _apply_permute_powers(
 
     power_permutation_matrix = torch.tensor(power_permutation_matrix, device=device)
 
-    # Shape (batch_size, board_state_size, board_state_size)
-    batch_state_permutation_matrix = pydipcc.encode_board_state_pperm_matrices(
+    # Shape (batch_size, board_state_size). Gathering the channels at these
+    # idxs is the same as multiplying by encode_board_state_pperm_matrices,
+    # without the (batch_size, board_state_size, board_state_size) matmul.
+    batch_state_channel_idxs = pydipcc.encode_board_state_pperm_channel_idxs(
         power_permutation, input_version
     )
-    batch_state_permutation_matrix = torch.tensor(batch_state_permutation_matrix, device=device)
+    batch_state_channel_idxs = torch.tensor(batch_state_channel_idxs, device=device)
 
     # (batch_size, NUM_LOCS, board_state_size)
-    # = (batch_size, NUM_LOCS, board_state_size) * (batch_size, board_state_size, board_state_size)
-    x_board_state = torch.matmul(x_board_state, batch_state_permutation_matrix)
-    x_prev_state = torch.matmul(x_prev_state, batch_state_permutation_matrix)
+    x_board_state = torch.gather(
+        x_board_state,
+        2,
+        batch_state_channel_idxs.unsqueeze(1).expand(-1, x_board_state.size(1), -1),
+    )
+    x_prev_state = torch.gather(
+        x_prev_state,
+        2,
+        batch_state_channel_idxs.unsqueeze(1).expand(-1, x_prev_state.size(1), -1),
+    )
 
     per_power_tensors_results = []
     for per_power_tensor in per_power_tensors:
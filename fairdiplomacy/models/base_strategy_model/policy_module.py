@@ -0,0 +1,402 @@
+#
+# Copyright (c) Meta Platforms, Inc. and affiliates.
+#
+# This source code is licensed under the MIT license found in the
+# LICENSE file in the root directory of this source tree.
+#
+"""TorchScript export of a base strategy model's policy.
+
+The exported module is what pydipcc.ThreadPool.load_policy_module expects: its
+forward(fields, temperature, top_p) takes the inputs encoded by the thread
+pool's encode_inputs_multi (or encode_inputs_all_powers_multi) and returns the
+sampled [B, 7, S] order idxs. This lets ThreadPool.forward_policy_multi and
+RolloutEngine.run(temperature, top_p) sample with a trained model without
+calling back into Python.
+
+The state encoder is traced and the LSTM policy decoder's sampling loop is
+re-written below in a form TorchScript can compile, sharing the model's
+weights. Differences from forward_model_with_output_transform:
+- Only BaseStrategyModelV2 models with an LSTM policy decoder are supported.
+- Duplicate disbands are not resampled.
+- x_has_press, x_agent_power and x_player_ratings are fixed at export time,
+  the same for every game.
+- Only per-power inputs are supported, i.e. all_powers=False.
+"""
+import copy
+from typing import Dict, Optional, Tuple
+
+import torch
+import torch.nn.functional as F
+from torch import nn
+
+from fairdiplomacy import pydipcc
+from fairdiplomacy.models.base_strategy_model.base_strategy_model import (
+    BaseStrategyModelV2,
+    LSTMBaseStrategyModelDecoder,
+)
+from fairdiplomacy.models.consts import LOGIT_MASK_VAL, POWERS
+from fairdiplomacy.models.state_space import EOS_IDX
+from fairdiplomacy.typedefs import PlayerRating, Power
+from fairdiplomacy.utils.thread_pool_encoding import FeatureEncoder
+
+_NUM_POWERS = len(POWERS)
+
+
+def export_policy_module(
+    model: BaseStrategyModelV2,
+    path: str,
+    *,
+    has_press: bool,
+    agent_power: Optional[Power] = None,
+    player_rating: Optional[PlayerRating] = None,
+) -> None:
+    """Saves a TorchScript policy of model to path, for ThreadPool.load_policy_module.
+
+    The policy conditions every game on has_press, agent_power and
+    player_rating, as BaseStrategyModelWrapper.add_stuff_to_datafields does.
+    A player_rating of None is the same as not passing ratings to the model.
+    The module runs on CPU in float32, whatever the device and precision of
+    model, which is not modified.
+    """
+    policy = BaseStrategyModelPolicyModule(
+        model, has_press=has_press, agent_power=agent_power, player_rating=player_rating
+    )
+    torch.jit.save(torch.jit.script(policy), path)
+
+
+class BaseStrategyModelPolicyModule(nn.Module):
+    """Policy of a BaseStrategyModelV2 in the form of ThreadPool.load_policy_module.
+
+    See export_policy_module.
+    """
+
+    def __init__(
+        self,
+        model: BaseStrategyModelV2,
+        *,
+        has_press: bool,
+        agent_power: Optional[Power],
+        player_rating: Optional[PlayerRating],
+    ):
+        super().__init__()
+        if not isinstance(model, BaseStrategyModelV2) or not isinstance(
+            getattr(model, "policy_decoder", None), LSTMBaseStrategyModelDecoder
+        ):
+            raise ValueError(
+                "Only BaseStrategyModelV2 models with an LSTM policy decoder can be exported"
+            )
+        model = copy.deepcopy(model).cpu().float().eval()
+
+        self.has_press = 1.0 if has_press else 0.0
+        self.agent_power_idx = -1 if agent_power is None else POWERS.index(agent_power)
+        self.player_rating = 1.0 if player_rating is None else float(player_rating)
+
+        # Tracing is enough for the encoder, which has no data-dependent control
+        # flow. The batch size of the example doesn't matter.
+        example = FeatureEncoder().encode_inputs(
+            [pydipcc.Game(), pydipcc.Game()], input_version=model.get_input_version()
+        )
+        with torch.no_grad():
+            self.encoder = torch.jit.trace(
+                _StateEncoder(model), _state_encoder_inputs(example, *self._flags(example))
+            )
+        self.decoder = _PolicyDecoder(model.policy_decoder)
+
+    def _flags(
+        self, fields: Dict[str, torch.Tensor]
+    ) -> Tuple[torch.Tensor, torch.Tensor, torch.Tensor]:
+        """Returns x_has_press, x_player_ratings and x_agent_power for the batch."""
+        x_board_state = fields["x_board_state"]
+        batch_size = x_board_state.shape[0]
+        x_has_press = x_board_state.new_full([batch_size, 1], self.has_press)
+        x_player_ratings = x_board_state.new_full([batch_size, _NUM_POWERS], self.player_rating)
+        x_agent_power = x_board_state.new_zeros([batch_size, _NUM_POWERS])
+        if self.agent_power_idx >= 0:
+            x_agent_power[:, self.agent_power_idx] = 1.0
+        return x_has_press, x_player_ratings, x_agent_power
+
+    def forward(
+        self, fields: Dict[str, torch.Tensor], temperature: float, top_p: float
+    ) -> torch.Tensor:
+        x_has_press, x_player_ratings, x_agent_power = self._flags(fields)
+        encoded = self.encoder(
+            fields["x_board_state"],
+            fields["x_prev_state"],
+            fields["x_prev_orders"],
+            fields["x_season"],
+            fields["x_year_encoded"],
+            fields["x_in_adj_phase"],
+            fields["x_build_numbers"],
+            fields["x_scoring_system"],
+            x_has_press,
+            x_player_ratings,
+            x_agent_power,
+        )
+
+        # Decode each power of each game as a row, as _forward_all_powers does,
+        # skipping the rows that have nothing to order
+        x_possible_actions = fields["x_possible_actions"]
+        assert x_possible_actions.shape[1] == _NUM_POWERS, "all_powers inputs are not supported"
+        batch_size = x_possible_actions.shape[0]
+        max_seq_len = x_possible_actions.shape[2]
+        cand_idxs = x_possible_actions.reshape(-1, max_seq_len, x_possible_actions.shape[3]).long()
+        loc_idxs = fields["x_loc_idxs"].reshape(-1, fields["x_loc_idxs"].shape[2])
+        valid_mask = (cand_idxs != EOS_IDX).any(dim=-1)
+        rows = valid_mask.any(dim=-1).nonzero().squeeze(1)
+        global_order_idxs = torch.full(
+            [cand_idxs.shape[0], max_seq_len], EOS_IDX, dtype=torch.long, device=cand_idxs.device
+        )
+        if rows.numel() > 0:
+            global_order_idxs.index_copy_(
+                0,
+                rows,
+                self.decoder(
+                    encoded[rows // _NUM_POWERS],
+                    loc_idxs[rows],
+                    cand_idxs[rows],
+                    temperature,
+                    top_p,
+                ),
+            )
+        global_order_idxs = global_order_idxs.masked_fill(~valid_mask, EOS_IDX)
+        return global_order_idxs.view(batch_size, _NUM_POWERS, max_seq_len)
+
+
+class _StateEncoder(nn.Module):
+    """BaseStrategyModelV2.encode_state with positional inputs, for tracing."""
+
+    def __init__(self, model: BaseStrategyModelV2):
+        super().__init__()
+        self.model = model
+
+    def forward(
+        self,
+        x_board_state,
+        x_prev_state,
+        x_prev_orders,
+        x_season,
+        x_year_encoded,
+        x_in_adj_phase,
+        x_build_numbers,
+        x_scoring_system,
+        x_has_press,
+        x_player_ratings,
+        x_agent_power,
+    ):
+        return self.model.encode_state(
+            x_board_state=x_board_state,
+            x_prev_state=x_prev_state,
+            x_prev_orders=x_prev_orders,
+            x_season=x_season,
+            x_year_encoded=x_year_encoded,
+            x_in_adj_phase=x_in_adj_phase,
+            x_build_numbers=x_build_numbers,
+            x_has_press=x_has_press,
+            x_player_ratings=x_player_ratings,
+            x_scoring_system=x_scoring_system,
+            x_agent_power=x_agent_power,
+        )
+
+
+def _state_encoder_inputs(
+    fields: Dict[str, torch.Tensor],
+    x_has_press: torch.Tensor,
+    x_player_ratings: torch.Tensor,
+    x_agent_power: torch.Tensor,
+) -> Tuple[torch.Tensor, ...]:
+    return (
+        fields["x_board_state"],
+        fields["x_prev_state"],
+        fields["x_prev_orders"],
+        fields["x_season"],
+        fields["x_year_encoded"],
+        fields["x_in_adj_phase"],
+        fields["x_build_numbers"],
+        fields["x_scoring_system"],
+        x_has_press,
+        x_player_ratings,
+        x_agent_power,
+    )
+
+
+class _PolicyDecoder(nn.Module):
+    """Sampling loop of LSTMBaseStrategyModelDecoder.forward, compilable by TorchScript.
+
+    Shares the weights of the decoder it is built from. Only covers inference:
+    no dropout, teacher forcing or logits. Optional parts of the decoder are
+    None attributes here, so that TorchScript skips the code using them.
+    """
+
+    def __init__(self, decoder: LSTMBaseStrategyModelDecoder):
+        super().__init__()
+        if not decoder.use_simple_alignments or decoder.power_lin is not None:
+            raise ValueError("Only BaseStrategyModelV2 policy decoders can be exported")
+        self.spatial_size = decoder.spatial_size
+        self.order_emb_size = decoder.order_emb_size
+        self.lstm_size = decoder.lstm_size
+        self.lstm_layers = decoder.lstm_layers
+
+        self.order_embedding = decoder.order_embedding
+        self.cand_embedding = decoder.cand_embedding.module
+        self.lstm = decoder.lstm
+
+        featurize = decoder.featurize_output
+        if featurize:
+            self.register_buffer("order_feats", decoder.order_feats)
+        self.order_feat_lin = decoder.order_feat_lin if featurize else None
+        self.order_decoder_w = decoder.order_decoder_w if featurize else None
+        self.order_decoder_b = decoder.order_decoder_b if featurize else None
+
+        relfeat = decoder.relfeat_output
+        if relfeat:
+            self.register_buffer("order_srcs", decoder.order_srcs)
+            self.register_buffer("order_dsts", decoder.order_dsts)
+        self.order_relfeat_src_decoder_w = decoder.order_relfeat_src_decoder_w if relfeat else None
+        self.order_relfeat_dst_decoder_w = decoder.order_relfeat_dst_decoder_w if relfeat else None
+        self.order_emb_relfeat_src_decoder_w = (
+            decoder.order_emb_relfeat_src_decoder_w if relfeat else None
+        )
+        self.order_emb_relfeat_dst_decoder_w = (
+            decoder.order_emb_relfeat_dst_decoder_w if relfeat else None
+        )
+
+    def forward(
+        self,
+        enc: torch.Tensor,
+        loc_idxs: torch.Tensor,
+        all_cand_idxs: torch.Tensor,
+        temperature: float,
+        top_p: float,
+    ) -> torch.Tensor:
+        """Samples the orders of each row.
+
+        Arguments:
+        - enc: [R, spatial_size, D] encoder output
+        - loc_idxs: [R, 81]
+        - all_cand_idxs: [R, S, 469] long
+
+        Returns: [R, S] global order idxs, EOS_IDX-padded.
+        """
+        num_rows = all_cand_idxs.shape[0]
+        max_seq_len = all_cand_idxs.shape[1]
+        global_order_idxs = torch.full(
+            [num_rows, max_seq_len], EOS_IDX, dtype=torch.long, device=enc.device
+        )
+        if bool((loc_idxs == -1).all()):
+            return global_order_idxs
+
+        order_emb = enc.new_zeros([num_rows, self.order_emb_size])
+        order_enc = enc.new_zeros([num_rows, self.spatial_size, self.order_emb_size])
+        hidden = (
+            enc.new_zeros([self.lstm_layers, num_rows, self.lstm_size]),
+            enc.new_zeros([self.lstm_layers, num_rows, self.lstm_size]),
+        )
+        max_cand_per_step = (all_cand_idxs != EOS_IDX).sum(dim=2).max(dim=0).values
+
+        src_relfeat_w = enc
+        dst_relfeat_w = enc
+        if self.order_relfeat_src_decoder_w is not None:
+            src_relfeat_w = self.order_relfeat_src_decoder_w(enc)
+        if self.order_relfeat_dst_decoder_w is not None:
+            dst_relfeat_w = self.order_relfeat_dst_decoder_w(enc)
+
+        for step in range(max_seq_len):
+            cand_idxs = all_cand_idxs[:, step, : int(max_cand_per_step[step])]
+            cand_valid = cand_idxs != EOS_IDX
+            invalid_mask = ~cand_valid.any(dim=1)
+            if bool(invalid_mask.all()):
+                # No more orders to give
+                break
+
+            # -2 flags the locations of builds and of armies to be disbanded
+            alignments = ((loc_idxs == step) | (loc_idxs == -2)).to(enc.dtype)
+            if self.spatial_size != alignments.shape[1]:
+                alignments = F.pad(alignments, [0, self.spatial_size - alignments.shape[1]])
+            loc_enc = torch.matmul(alignments.unsqueeze(1), enc).squeeze(1)
+
+            lstm_input = torch.cat([loc_enc, order_emb], dim=1).unsqueeze(1)
+            out, hidden = self.lstm(lstm_input, hidden)
+            out = out.squeeze(1).unsqueeze(2)
+
+            # Same as the PaddedEmbedding of the decoder
+            cand_emb = self.cand_embedding(cand_idxs.clamp(min=0)) * cand_valid.unsqueeze(-1).to(
+                enc.dtype
+            )
+            logits = torch.matmul(cand_emb, out).squeeze(2)
+
+            order_decoder_w = self.order_decoder_w
+            order_decoder_b = self.order_decoder_b
+            if order_decoder_w is not None and order_decoder_b is not None:
+                cand_order_feats = self.order_feats[cand_idxs]
+                order_w = torch.cat(
+                    (order_decoder_w(cand_order_feats), order_decoder_b(cand_order_feats)), dim=-1
+                )
+                order_src_w = self.order_emb_relfeat_src_decoder_w
+                order_dst_w = self.order_emb_relfeat_dst_decoder_w
+                if order_src_w is not None and order_dst_w is not None:
+                    flat_order_w = order_w.view(-1, order_w.shape[-1])
+                    cand_srcs = self.order_srcs[cand_idxs]
+                    cand_dsts = self.order_dsts[cand_idxs]
+                    valid, w = _order_loc_rows(cand_srcs, src_relfeat_w)
+                    flat_order_w.index_add_(0, valid, w)
+                    valid, w = _order_loc_rows(cand_dsts, dst_relfeat_w)
+                    flat_order_w.index_add_(0, valid, w)
+                    valid, w = _order_loc_rows(cand_srcs, order_enc)
+                    flat_order_w.index_add_(0, valid, order_src_w(w))
+                    valid, w = _order_loc_rows(cand_dsts, order_enc)
+                    flat_order_w.index_add_(0, valid, order_dst_w(w))
+                # The last element of order_w is a bias
+                out_with_ones = torch.cat((out, out.new_ones([num_rows, 1, 1])), dim=1)
+                logits = logits + torch.bmm(order_w, out_with_ones).squeeze(-1)
+
+            # Rows with nothing to order sample garbage, masked out by the caller
+            cand_mask = cand_valid | invalid_mask.unsqueeze(1)
+            logits = torch.min(logits, cand_mask.float() * 1e9 + LOGIT_MASK_VAL)
+            if top_p < 0.999:
+                logits = logits.masked_fill(_top_p_mask(logits, top_p), -1e9)
+            probs = torch.softmax(logits / temperature, dim=-1)
+            local_order_idxs = torch.multinomial(probs, 1)
+            step_order_idxs = cand_idxs.gather(1, local_order_idxs).squeeze(1)
+            global_order_idxs[:, step] = step_order_idxs
+
+            order_input = step_order_idxs.masked_fill(step_order_idxs == EOS_IDX, 0)
+            order_emb = self.order_embedding(order_input)
+            order_feat_lin = self.order_feat_lin
+            if order_feat_lin is not None:
+                order_emb = order_emb + order_feat_lin(self.order_feats[order_input])
+            if self.order_emb_relfeat_src_decoder_w is not None:
+                order_enc = order_enc + order_emb.unsqueeze(1) * alignments.unsqueeze(2)
+
+        return global_order_idxs
+
+
+def _order_loc_rows(
+    cand_order_locs: torch.Tensor, enc_w: torch.Tensor
+) -> Tuple[torch.Tensor, torch.Tensor]:
+    """Gather step of LSTMBaseStrategyModelDecoder.get_order_loc_feats.
+
+    Returns the flat positions of the candidates that have a loc, and the rows
+    of enc_w at those locs.
+    """
+    num_rows = enc_w.shape[0]
+    num_locs = enc_w.shape[1]
+    flat_order_locs = cand_order_locs.reshape(-1)
+    valid = (flat_order_locs > 0).nonzero().squeeze(-1)
+    order_offsets = (
+        cand_order_locs
+        + torch.arange(num_rows, device=cand_order_locs.device).view(num_rows, 1) * num_locs
+    )
+    valid_order_offsets = order_offsets.reshape(-1)[valid]
+    return valid, enc_w.reshape(-1, enc_w.shape[2])[valid_order_offsets]
+
+
+def _top_p_mask(logits: torch.Tensor, top_p: float) -> torch.Tensor:
+    """Same as util.top_p_filtering, for a float top_p."""
+    sorted_logits, sorted_indices = torch.sort(logits, descending=True)
+    cumulative_probs = torch.cumsum(torch.softmax(sorted_logits, dim=-1), dim=-1)
+    # Keep the first token above the threshold too
+    sorted_to_remove = cumulative_probs > top_p
+    sorted_to_remove = torch.cat(
+        [torch.zeros_like(sorted_to_remove[:, :1]), sorted_to_remove[:, :-1]], dim=1
+    )
+    return sorted_to_remove.scatter(1, sorted_indices, sorted_to_remove)
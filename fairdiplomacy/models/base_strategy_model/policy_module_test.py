@@ -0,0 +1,88 @@
+#
+# Copyright (c) Meta Platforms, Inc. and affiliates.
+#
+# This source code is licensed under the MIT license found in the
+# LICENSE file in the root directory of this source tree.
+#
+import tempfile
+import unittest
+
+import torch
+
+import heyhi
+from fairdiplomacy.models.base_strategy_model.load_model import new_model
+from fairdiplomacy.models.base_strategy_model.policy_module import export_policy_module
+from fairdiplomacy.pydipcc import Game
+from fairdiplomacy.utils.thread_pool_encoding import FeatureEncoder
+
+
+CFG_LSTM = heyhi.CONF_ROOT / "c02_sup_train/for_tests/sl_202106_heavy.prototxt"
+INPUT_VERSION = 2
+# Low enough for sampling to be an argmax
+TEMPERATURE = 1e-4
+
+
+class ExportPolicyModuleTest(unittest.TestCase):
+    def setUp(self):
+        torch.manual_seed(0)
+        self.model = new_model(
+            heyhi.load_config(
+                CFG_LSTM,
+                overrides=[
+                    "use_v2_base_strategy_model=1",
+                    "use_player_ratings=1",
+                    "use_agent_power=1",
+                    "encoder.transformer.num_blocks=1",
+                ],
+            ).train
+        )
+        self.model.eval()
+        self.encoder = FeatureEncoder(num_threads=2)
+
+        # More games than the 2 the encoder is traced with, in two phases
+        self.games = [Game() for _ in range(3)]
+        self.games[2].process()
+
+        self.f = tempfile.NamedTemporaryFile("wb", suffix=".pt")
+        export_policy_module(
+            self.model, self.f.name, has_press=True, agent_power="FRANCE", player_rating=0.7
+        )
+
+    def tearDown(self):
+        self.f.close()
+
+    def _expected_order_idxs(self):
+        features = self.encoder.encode_inputs(self.games, input_version=INPUT_VERSION)
+        batch_size = len(self.games)
+        x_agent_power = torch.zeros(batch_size, 7)
+        x_agent_power[:, 2] = 1.0
+        with torch.no_grad():
+            global_order_idxs, _, _, _ = self.model(
+                **features,
+                temperature=TEMPERATURE,
+                x_has_press=torch.ones(batch_size, 1),
+                x_agent_power=x_agent_power,
+                x_player_ratings=torch.full((batch_size, 7), 0.7),
+                need_value=False,
+            )
+        return features, global_order_idxs
+
+    def test_matches_model(self):
+        features, expected = self._expected_order_idxs()
+        policy = torch.jit.load(self.f.name)
+        with torch.no_grad():
+            order_idxs = policy(features, TEMPERATURE, 1.0)
+        self.assertEqual(order_idxs.shape, (len(self.games), 7, expected.shape[2]))
+        torch.testing.assert_allclose(order_idxs, expected)
+
+    def test_forward_policy_multi(self):
+        _, expected = self._expected_order_idxs()
+        self.encoder.thread_pool.load_policy_module(self.f.name, intra_op_threads=1)
+        orders = self.encoder.thread_pool.forward_policy_multi(
+            self.games,
+            input_version=INPUT_VERSION,
+            all_powers=False,
+            temperature=TEMPERATURE,
+            top_p=1.0,
+        )
+        self.assertEqual(orders, self.encoder.decode_order_idxs(expected))
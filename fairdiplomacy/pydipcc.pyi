@@ -179,6 +179,51 @@ class Game:
     @classmethod
     def is_center(cls, loc: str) -> bool: ...
 
+class GameBatch:
+    """A batch of games queried, given orders and processed with one call per step.
+
+    Per-game queries return one row per game, in batch order.
+    """
+
+    @typing.overload
+    def __init__(self, games: typing.Sequence[Game]) -> None: ...
+    @typing.overload
+    def __init__(self, game: Game, n_repeats: int) -> None: ...
+    def __len__(self) -> int: ...
+    def __getitem__(self, i: int) -> Game: ...
+    @typing.overload
+    def get_games(self) -> typing.List[Game]: ...
+    @typing.overload
+    def get_games(self, game_idxs: typing.Sequence[int]) -> typing.List[Game]: ...
+    def is_done(self) -> torch.Tensor:
+        """Bool tensor [N]."""
+        ...
+    def phase_keys(self) -> torch.Tensor:
+        """Long tensor [N] of phase_sort_key of each game's current phase."""
+        ...
+    def phases(self) -> typing.List[Phase]: ...
+    @typing.overload
+    def get_scores(self) -> torch.Tensor:
+        """Float tensor [N, 7]."""
+        ...
+    @typing.overload
+    def get_scores(self, scoring_system: int) -> torch.Tensor: ...
+    def min_ongoing_phase(self) -> Phase:
+        """Earliest phase of any game that is not done, or "" if all are done."""
+        ...
+    def ongoing_game_idxs_at_phase(self, phase: Phase) -> typing.List[int]: ...
+    def set_orders(
+        self, game_idxs: typing.Sequence[int], orders: typing.Sequence[typing.Sequence[Action]]
+    ) -> None:
+        """Sets orders[i][p] as the orders of POWERS[p] in game game_idxs[i]."""
+        ...
+    @typing.overload
+    def process(self, game_idxs: typing.Sequence[int]) -> None: ...
+    @typing.overload
+    def process(self) -> None:
+        """Processes all games that are not done."""
+        ...
+
 class SinglePowerCFRStats:
     def __init__(
         self,
@@ -313,7 +358,16 @@ class CFRStats:
     def __setstate__(self, d: typing.Any): ...
 
 class ThreadPool:
-    def __init__(self, arg0: int, arg1: typing.Dict[str, int], arg2: int) -> None: ...
+    def __init__(
+        self,
+        n_threads: int,
+        order_vocabulary_to_idx: typing.Dict[str, int],
+        max_order_cands: int,
+        pin_memory: bool = False,
+    ) -> None:
+        """Encoded inputs are returned in recycled buffers, reused once the
+        caller drops them, and in pinned memory if pin_memory."""
+        ...
     def decode_order_idxs(
         self, order_idxs: torch.Tensor
     ) -> typing.List[typing.List[typing.List[Order]]]: ...
@@ -339,7 +393,116 @@ class ThreadPool:
     def encode_inputs_state_only_multi(
         self, arg0: typing.Sequence[Game], arg1: int
     ) -> typing.Dict[str, torch.Tensor]: ...
+    def encode_inputs_csr_multi(
+        self, games: typing.Sequence[Game], input_version: int, all_powers: bool
+    ) -> typing.Dict[str, torch.Tensor]:
+        """Same as encode_inputs_multi (or encode_inputs_all_powers_multi), but
+        x_possible_actions is replaced by x_possible_actions_values, the
+        candidates of each [B * 7 * S] row in order, and
+        x_possible_actions_offsets, their CSR row offsets."""
+        ...
     def process_multi(self, arg0: typing.Sequence[Game]) -> None: ...
+    def load_policy_module(self, path: str, intra_op_threads: int = 1) -> None:
+        """Loads a TorchScript policy for forward_policy_multi.
+
+        The module's forward takes (fields: Dict[str, Tensor], temperature: float,
+        top_p: float), with fields as returned by encode_inputs_multi (or
+        encode_inputs_all_powers_multi), and returns the sampled [B, 7, S] order
+        idxs, or a tuple starting with them. Each worker runs it with
+        intra_op_threads intra-op threads; unless torch uses OpenMP, this sets
+        the thread count of the whole process. Use
+        fairdiplomacy.models.base_strategy_model.policy_module to export a
+        trained model.
+        """
+        ...
+    def has_policy_module(self) -> bool: ...
+    def forward_policy_multi(
+        self,
+        games: typing.Sequence[Game],
+        input_version: int,
+        all_powers: bool,
+        temperature: float,
+        top_p: float,
+    ) -> typing.List[typing.List[typing.List[Order]]]:
+        """Encodes, samples and decodes orders on the workers. Returns
+        orders[i][p] for POWERS[p] in games[i]."""
+        ...
+    def forward_policy_and_set_orders_multi(
+        self,
+        games: typing.Sequence[Game],
+        input_version: int,
+        all_powers: bool,
+        temperature: float,
+        top_p: float,
+    ) -> None:
+        """Same as forward_policy_multi, but sets the orders on the games."""
+        ...
+    def decode_and_set_orders(
+        self, games: typing.Sequence[Game], order_idxs: torch.Tensor
+    ) -> None:
+        """Decodes [B, 7, S] order idxs as decode_order_idxs does and sets
+        each power's orders on games[b], with no string round trip."""
+        ...
+    def decode_and_set_orders_all_powers(
+        self,
+        games: typing.Sequence[Game],
+        order_idxs: torch.Tensor,
+        x_in_adj_phase: torch.Tensor,
+        x_power: torch.Tensor,
+    ) -> None: ...
+    def enable_encoding_cache(self, max_entries: int) -> None:
+        """Caches up to max_entries board and valid-orders encodings, keyed by
+        board hash and input version. max_entries=0 disables the cache."""
+        ...
+    def get_encoding_cache_stats(self) -> typing.Dict[str, int]:
+        """Hit/miss counts and sizes of the encoding cache, {} if disabled."""
+        ...
+    def clear_encoding_cache(self) -> None: ...
+
+class RolloutEngine:
+    """Rolls out copies of a game, querying a batched policy once per step.
+
+    Games are stepped at the pace of the slowest game until all are done or
+    reach the movement phase max_rollout_length movement phases later (or are
+    processed once if max_rollout_length is 0). The expected value of the game
+    ending at the start of each spring is accumulated along the way.
+    """
+
+    def __init__(
+        self,
+        game: Game,
+        n_games: int,
+        thread_pool: ThreadPool,
+        input_version: int,
+        all_powers: bool,
+        max_rollout_length: int,
+        year_spring_prob_of_ending: typing.Dict[int, float],
+    ) -> None: ...
+    def get_batch(self) -> GameBatch: ...
+    def set_start_orders(self, game_idx: int, power: Power, orders: Action) -> None:
+        """Sets orders for the first step. The policy is used for the other powers."""
+        ...
+    @typing.overload
+    def run(
+        self,
+        policy: typing.Callable[
+            [typing.Dict[str, torch.Tensor], typing.List[int]], torch.Tensor
+        ],
+    ) -> None:
+        """Steps the games. policy(fields, game_idxs) gets the encoded inputs of
+        the games to step and returns their [B, 7, S] sampled order idxs."""
+        ...
+    @typing.overload
+    def run(self, temperature: float, top_p: float) -> None:
+        """Steps the games, sampling with the thread pool's policy module."""
+        ...
+    def get_prob_of_spring_ending(self, year: int) -> float: ...
+    def get_spring_ending_ev(self) -> torch.Tensor:
+        """Float tensor [N, 7], already multiplied by the probability of ending."""
+        ...
+    def get_cumulative_spring_ending_prob(self) -> torch.Tensor:
+        """Float tensor [N]."""
+        ...
 
 def encode_board_state(*args, **kwargs) -> typing.Any:
     pass
@@ -355,12 +518,31 @@ def encode_board_state_pperm_matrices(
 ) -> numpy.ndarray[numpy.float32]:
     pass
 
+def encode_board_state_pperms(
+    game: Game, pperms: numpy.ndarray[numpy.int32], input_version: int
+) -> numpy.ndarray[numpy.float32]:
+    """[K, 81, W] board state of the game with its powers permuted by each of
+    the K permutations pperms [K, 7], as multiplying by
+    encode_board_state_pperm_matrices(pperms) would."""
+    ...
+
+def encode_board_state_pperm_channel_idxs(
+    pperms: numpy.ndarray[numpy.int32], input_version: int
+) -> numpy.ndarray[numpy.int64]:
+    """[B, W] channel idxs such that gathering the channels of a board state at
+    them is the same as multiplying by encode_board_state_pperm_matrices."""
+    ...
+
 def encoding_sc_ownership_idxs(arg0: int) -> typing.List[int]:
     pass
 
 def encoding_unit_ownership_idxs(arg0: int) -> typing.List[int]:
     pass
 
+def phase_sort_key(phase: Phase) -> int:
+    """Same ordering as fairdiplomacy.game.sort_phase_key, as a single int."""
+    ...
+
 def max_input_version() -> int:
     """Return the current latest input_version supported by the board/order encoder."""
     ...
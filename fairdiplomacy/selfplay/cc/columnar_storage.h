@@ -0,0 +1,138 @@
+/*
+Copyright (c) Meta Platforms, Inc. and affiliates.
+
+This source code is licensed under the MIT license found in the
+LICENSE file in the root directory of this source tree.
+*/
+
+// Fixed-capacity storage of TensorDicts that all share the same keys, and
+// per key the same dtype and [T, ...] shape. Each key is stored as a single
+// preallocated [T, capacity, ...] tensor, so that writing an element is a
+// copy into its row and gathering a batch is one index_select per key into
+// the same [T, batch, ...] layout as tensor_dict::stack(elements, 1).
+
+#pragma once
+
+#include <cassert>
+#include <mutex>
+#include <vector>
+
+#include "tensor_dict.h"
+
+namespace buffer {
+
+class ColumnarStorage {
+public:
+  explicit ColumnarStorage(int capacity) : capacity_(capacity) {}
+
+  // Copies element into row. Concurrent writes to distinct rows are safe.
+  // The first write allocates the columns after the element's layout.
+  void write(int row, const rela::TensorDict &element) {
+    assert(row >= 0 && row < capacity_);
+    std::call_once(allocated_, [&] { allocate(element); });
+    assert(element.size() == columns_.size());
+    for (const auto &name2tensor : element) {
+      auto &column = columns_.at(name2tensor.first);
+      const auto &t = name2tensor.second;
+      assert(t.dtype() == column.dtype());
+      assert(t.dim() + 1 == column.dim());
+      column.select(1, row).copy_(t);
+    }
+  }
+
+  // Returns a copy of the element in row
+  rela::TensorDict read(int row) const {
+    rela::TensorDict element;
+    for (const auto &name2tensor : columns_) {
+      element.insert(
+          {name2tensor.first, name2tensor.second.select(1, row).clone()});
+    }
+    return element;
+  }
+
+  // Returns the [T, ids.size(), ...] batch of the elements in rows ids. The
+  // batch tensors are recycled once the caller drops all references to
+  // them, so sampling at a steady batch size doesn't allocate.
+  rela::TensorDict gather(const std::vector<int> &ids) {
+    auto index = torch::empty({(int64_t)ids.size()}, torch::kLong);
+    auto index_acc = index.accessor<int64_t, 1>();
+    for (int i = 0; i < (int)ids.size(); ++i) {
+      index_acc[i] = ids[i];
+    }
+    rela::TensorDict batch = acquire_batch(ids.size());
+    for (const auto &name2tensor : columns_) {
+      torch::index_select_out(batch.at(name2tensor.first), name2tensor.second,
+                              1, index);
+    }
+    return batch;
+  }
+
+  // Number of elements and of bytes of one row over all keys. 0 until the
+  // first write.
+  int64_t row_numel() const { return row_numel_; }
+  int64_t row_bytes() const { return row_bytes_; }
+
+private:
+  void allocate(const rela::TensorDict &element) {
+    for (const auto &name2tensor : element) {
+      const auto &t = name2tensor.second;
+      assert(t.dim() >= 1 && "Columnar elements need a time dimension");
+      std::vector<int64_t> sizes(t.sizes().begin(), t.sizes().end());
+      sizes.insert(sizes.begin() + 1, capacity_);
+      columns_.insert({name2tensor.first, empty(sizes, t.scalar_type())});
+      row_numel_ += t.numel();
+      row_bytes_ += t.numel() * t.element_size();
+    }
+  }
+
+  rela::TensorDict acquire_batch(int64_t batchsize) {
+    std::lock_guard<std::mutex> lk(batches_m_);
+    for (auto &batch : batches_) {
+      int64_t size = batch.begin()->second.size(1);
+      if (size == batchsize && is_unreferenced(batch)) {
+        return batch;
+      }
+    }
+    rela::TensorDict batch;
+    for (const auto &name2tensor : columns_) {
+      const auto &column = name2tensor.second;
+      std::vector<int64_t> sizes(column.sizes().begin(), column.sizes().end());
+      sizes[1] = batchsize;
+      batch.insert({name2tensor.first, empty(sizes, column.scalar_type())});
+    }
+    if ((int)batches_.size() < kMaxBatches) {
+      batches_.push_back(batch);
+    }
+    return batch;
+  }
+
+  static torch::Tensor empty(const std::vector<int64_t> &sizes,
+                             torch::ScalarType dtype) {
+    return torch::empty(sizes, torch::TensorOptions().dtype(dtype));
+  }
+
+  // True if nothing but batches_ references the batch's tensors' storage
+  static bool is_unreferenced(const rela::TensorDict &batch) {
+    for (const auto &name2tensor : batch) {
+      if (name2tensor.second.use_count() > 1 ||
+          name2tensor.second.storage().use_count() > 1) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // Enough for the batch being trained on plus the prefetched ones
+  static constexpr int kMaxBatches = 8;
+
+  const int capacity_;
+  std::once_flag allocated_;
+  rela::TensorDict columns_;
+  int64_t row_numel_ = 0;
+  int64_t row_bytes_ = 0;
+
+  std::mutex batches_m_;
+  std::vector<rela::TensorDict> batches_;
+};
+
+} // namespace buffer
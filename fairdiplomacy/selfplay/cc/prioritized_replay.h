@@ -15,12 +15,19 @@ LICENSE file in the root directory of this source tree.
 
 #pragma once
 
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
 #include <future>
+#include <memory>
 #include <random>
 #include <string>
+#include <thread>
 #include <vector>
 
+#include "columnar_storage.h"
 #include "serialization.h"
+#include "sum_tree.h"
 #include "tensor_dict.h"
 
 using namespace rela;
@@ -28,10 +35,18 @@ using namespace rela;
 namespace buffer {
 template <class DataType> class ConcurrentQueue {
 public:
-  ConcurrentQueue(int capacity)
+  // If columns is set, element id is stored in its row first_row + id rather
+  // than as a DataType object. This requires DataType to be TensorDict.
+  ConcurrentQueue(int capacity,
+                  std::shared_ptr<ColumnarStorage> columns = nullptr,
+                  int first_row = 0)
       : capacity(capacity), total_bytes_(0), total_numel_(0), head_(0),
         tail_(0), size_(0), safe_tail_(0), safe_size_(0), sum_(0),
-        evicted_(capacity, false), elements_(capacity), weights_(capacity, 0) {}
+        evicted_(capacity, false), elements_(columns ? 0 : capacity),
+        columns_(std::move(columns)), first_row_(first_row),
+        weights_(capacity, 0), tree_(capacity) {}
+
+  bool columnar() const { return columns_ != nullptr; }
 
   int safe_size(float *sum) const {
     std::unique_lock<std::mutex> lk(m_);
@@ -69,15 +84,16 @@ public:
     int64_t bytes = 0;
     for (int i = 0; i < block_size; ++i) {
       int j = (start + i) % capacity;
-      elements_[j] = block[i];
+      if (columns_) {
+        columns_->write(first_row_ + j, block[i]);
+        numel += columns_->row_numel();
+        bytes += columns_->row_bytes();
+      } else {
+        elements_[j] = block[i];
+        add_numel_and_bytes(elements_[j], &numel, &bytes);
+      }
       weights_[j] = weight_acc[i];
       sum += weight_acc[i];
-      tensor_dict::for_each(elements_[j], [&numel](const torch::Tensor &t) {
-        numel += t.numel();
-      });
-      tensor_dict::for_each(elements_[j], [&bytes](const torch::Tensor &t) {
-        bytes += t.numel() * t.element_size();
-      });
     }
     total_numel_ += numel;
     total_bytes_ += bytes;
@@ -89,6 +105,13 @@ public:
     safe_size_ += block_size;
     sum_ += sum;
     check_size(head_, safe_tail_, safe_size_);
+    {
+      std::lock_guard<std::mutex> tree_lk(tree_m_);
+      for (int i = 0; i < block_size; ++i) {
+        int j = (start + i) % capacity;
+        tree_.set(j, weights_[j]);
+      }
+    }
 
     lk.unlock();
     cv_tail_.notify_all();
@@ -107,19 +130,26 @@ public:
     for (int i = 0; i < block_size; ++i) {
       diff -= weights_[head];
       evicted_[head] = true;
-      tensor_dict::for_each(elements_[head], [&numel](const torch::Tensor &t) {
-        numel += t.numel();
-      });
-      tensor_dict::for_each(elements_[head], [&bytes](const torch::Tensor &t) {
-        bytes += t.numel() * t.element_size();
-      });
+      if (columns_) {
+        numel += columns_->row_numel();
+        bytes += columns_->row_bytes();
+      } else {
+        add_numel_and_bytes(elements_[head], &numel, &bytes);
+      }
       head = (head + 1) % capacity;
     }
     total_numel_ -= numel;
     total_bytes_ -= bytes;
+    num_popped_ += block_size;
 
     {
       std::lock_guard<std::mutex> lk(m_);
+      {
+        std::lock_guard<std::mutex> tree_lk(tree_m_);
+        for (int id = head_; id != head; id = (id + 1) % capacity) {
+          tree_.set(id, 0);
+        }
+      }
       sum_ += diff;
       head_ = head;
       safe_size_ -= block_size;
@@ -144,54 +174,72 @@ public:
 
     std::lock_guard<std::mutex> lk_(m_);
     sum_ += diff;
+    std::lock_guard<std::mutex> tree_lk(tree_m_);
+    for (int id : ids) {
+      if (!evicted_[id]) {
+        tree_.set(id, weights_[id]);
+      }
+    }
+  }
+
+  // Total weight of the published elements
+  double total_weight() const {
+    std::lock_guard<std::mutex> lk(tree_m_);
+    return tree_.total();
+  }
+
+  // Proportional sampling of published elements: for each of the n prefix
+  // sums of the weights, writes the id of the element it falls into and its
+  // weight, in O(n * log(capacity)).
+  void find_ids(const double *prefix_sums, int n, int *ids, float *weights) {
+    std::lock_guard<std::mutex> lk(tree_m_);
+    for (int i = 0; i < n; ++i) {
+      ids[i] = tree_.find(prefix_sums[i]);
+      weights[i] = tree_.get(ids[i]);
+    }
   }
 
   // ------------------------------------------------------------- //
   // accessing elements is never locked, operate safely!
+  // In columnar mode the returned elements are copies.
 
   DataType get_element_and_mark(int idx) {
     int id = (head_ + idx) % capacity;
     evicted_[id] = false;
-    return elements_[id];
+    return element(id);
   }
 
   DataType get_element(int idx) {
     int id = (head_ + idx) % capacity;
-    return elements_[id];
+    return element(id);
   }
 
+  DataType get_element_by_id(int id) { return element(id); }
+
+  void mark(int id) { evicted_[id] = false; }
+
   float get_weight(int idx, int *id) {
     assert(id != nullptr);
     *id = (head_ + idx) % capacity;
     return weights_[*id];
   }
 
-  void save(const std::string &fpath) {
-    // making a full copy as most of the memory are in tensors, not maps.
-    std::vector<DataType> elements_copy;
-    {
-      std::lock_guard<std::mutex> lk(pop_m_);
-      int head = head_;
-      const int size = safe_size_;
-      elements_copy.resize(size);
-      for (int i = 0; i < size; ++i) {
-        elements_copy[i] = elements_[i];
-        head = (head + 1) % capacity;
-      }
-    }
-
-    FILE *stream = fopen(fpath.c_str(), "wb");
-    write(elements_copy, stream);
-    fclose(stream);
+  // Range [begin, end) of the published elements, numbered in order of
+  // addition
+  std::pair<int64_t, int64_t> element_range() const {
+    std::lock_guard<std::mutex> lk(pop_m_);
+    return {num_popped_, num_popped_ + safe_size(nullptr)};
   }
 
-  size_t load(const std::string &fpath) {
-    FILE *stream = fopen(fpath.c_str(), "rb");
-    const auto elements = read(stream);
-    fclose(stream);
-    const auto weights = torch::ones({(int)elements.size()});
-    block_append(elements, weights);
-    return elements.size();
+  // Appends copies of the elements numbered [begin, end) that are still
+  // published, oldest first, to elements. Those in range at the time of
+  // element_range are, unless they have been popped since.
+  void copy_elements(int64_t begin, int64_t end,
+                     std::vector<DataType> *elements) {
+    std::lock_guard<std::mutex> lk(pop_m_);
+    for (int64_t i = std::max(begin, num_popped_); i < end; ++i) {
+      elements->push_back(element((head_ + (i - num_popped_)) % capacity));
+    }
   }
 
   const int capacity;
@@ -199,6 +247,18 @@ public:
   std::atomic<int64_t> total_numel_;
 
 private:
+  DataType element(int id) const {
+    return columns_ ? columns_->read(first_row_ + id) : elements_[id];
+  }
+
+  static void add_numel_and_bytes(const DataType &element, int64_t *numel,
+                                  int64_t *bytes) {
+    tensor_dict::for_each(element, [=](const torch::Tensor &t) {
+      *numel += t.numel();
+      *bytes += t.numel() * t.element_size();
+    });
+  }
+
   void check_size(int head, int tail, int size) {
     if (size == 0) {
       assert(tail == head);
@@ -228,41 +288,149 @@ private:
   int safe_tail_;
   int safe_size_;
   double sum_;
+  // Number of elements ever popped, guarded by pop_m_
+  int64_t num_popped_ = 0;
   std::vector<int> evicted_;
 
+  // Exactly one of elements_ and columns_ holds the elements
   std::vector<DataType> elements_;
+  std::shared_ptr<ColumnarStorage> columns_;
+  const int first_row_;
   std::vector<float> weights_;
+
+  // Sum tree of weights_ over the published, non-popped elements, the other
+  // leaves being 0. Guarded by tree_m_, which is taken after m_ when both
+  // are held.
+  mutable std::mutex tree_m_;
+  SumTree tree_;
 };
 
 template <class DataType> class PrioritizedReplay {
 public:
+  // If columnar, all elements must have the same keys, and per key the same
+  // dtype and shape, and are stored in one preallocated tensor per key. This
+  // avoids per element allocations and stacking on sample, at the cost of
+  // allocating the full capacity upfront. Not supported with shuffle.
+  //
+  // The storage is split into num_shards independent shards of capacity /
+  // num_shards elements each, every add going to the next shard in turn, so
+  // that concurrent producers rarely wait on each other. Sampling is
+  // proportional to priority over all shards. The shard capacity is rounded
+  // up, so the buffer can hold up to num_shards - 1 elements more than
+  // capacity.
   PrioritizedReplay(int capacity, int seed, float alpha, float beta,
-                    int prefetch, bool shuffle = false)
+                    int prefetch, bool shuffle = false, bool columnar = false,
+                    int num_shards = 1)
       : alpha_(alpha) // priority exponent
         ,
         beta_(beta) // importance sampling exponent
         ,
         prefetch_(prefetch), shuffle_cross_chunks_(shuffle),
-        capacity_(capacity), storage_(int(1.25 * capacity)), num_add_(0) {
+        shard_capacity_((capacity + num_shards - 1) / num_shards),
+        // Room for at least one element above shard_capacity_, so that a
+        // full shard still takes adds until sampling pops it
+        shard_storage_capacity_(
+            std::max(shard_capacity_ + 1, int(1.25 * shard_capacity_))),
+        num_add_(0),
+        next_shard_(0) {
+    assert(!(shuffle && columnar) && "shuffle doesn't support columnar");
+    assert(num_shards >= 1);
+    if (columnar) {
+      columns_ = std::make_shared<ColumnarStorage>(num_shards *
+                                                   shard_storage_capacity_);
+    }
+    for (int i = 0; i < num_shards; ++i) {
+      shards_.push_back(std::make_unique<Shard>(
+          shard_storage_capacity_, columns_, i * shard_storage_capacity_));
+    }
     rng_.seed(seed);
   }
 
+  // Adds the pending add_batch_async batches before returning
+  ~PrioritizedReplay() {
+    if (ingestion_thread_.joinable()) {
+      {
+        std::lock_guard<std::mutex> lk(ingestion_m_);
+        stop_ingestion_ = true;
+      }
+      ingestion_cv_.notify_all();
+      ingestion_thread_.join();
+    }
+  }
+
+  // Appends the whole block with a single lock and publish step, unless it
+  // is larger than max_block_size_(), in which case it is split over
+  // successive shards
   void add_compressed(const std::vector<DataType> &sample,
                       const torch::Tensor &priority) {
     assert(priority.dim() == 1);
     assert(priority.size(0) == (int)sample.size());
     auto weights = torch::pow(priority, alpha_);
-    storage_.block_append(sample, weights);
-    num_add_ += priority.size(0);
+    const int size = sample.size();
+    const int max_block_size = max_block_size_();
+    if (size <= max_block_size) {
+      add_block_(sample, weights);
+      return;
+    }
+    for (int begin = 0; begin < size; begin += max_block_size) {
+      const int end = std::min(begin + max_block_size, size);
+      add_block_(std::vector<DataType>(sample.begin() + begin,
+                                       sample.begin() + end),
+                 weights.narrow(0, begin, end - begin));
+    }
   }
 
   void add_one(const DataType &sample, float priority) {
     add_compressed({sample}, torch::tensor({priority}));
   }
 
-  void save(const std::string &fpath) { storage_.save(fpath); }
+  // Writes a snapshot of the buffer. Elements are copied and written a
+  // chunk at a time while adds and sampling go on, so the snapshot holds the
+  // elements present when it started that weren't popped before being
+  // written. Throws std::runtime_error on IO errors.
+  void save(const std::string &fpath) {
+    const int64_t element_bytes =
+        std::max<int64_t>(total_bytes() / std::max(size(), 1), 1);
+    const int64_t chunk_size =
+        std::max<int64_t>(kSnapshotChunkBytes / element_bytes, 1);
+    SnapshotWriter writer(fpath);
+    for (auto &shard : shards_) {
+      auto [begin, end] = shard->storage.element_range();
+      for (; begin < end; begin += chunk_size) {
+        std::vector<DataType> chunk;
+        shard->storage.copy_elements(begin, std::min(begin + chunk_size, end),
+                                     &chunk);
+        writer.write(chunk);
+      }
+    }
+    writer.close();
+  }
 
-  void load(const std::string &fpath) { storage_.load(fpath); }
+  // Runs save in the background. The buffer must outlive the future, whose
+  // destructor blocks until the save is done.
+  std::future<void> save_async(const std::string &fpath) {
+    return std::async(std::launch::async, [this, fpath] { save(fpath); });
+  }
+
+  // Adds the elements of a snapshot, or of a legacy dump, with priority 1.
+  // The tensors of a snapshot are views of the memory-mapped file, read on
+  // first use, except in columnar mode, where they are copied. Throws
+  // std::runtime_error on IO errors.
+  void load(const std::string &fpath) {
+    const auto elements = readSnapshot(fpath);
+    // Spread evenly over the shards
+    const int num_shards = shards_.size();
+    for (int i = 0; i < num_shards; ++i) {
+      const int begin = elements.size() * i / num_shards;
+      const int end = elements.size() * (i + 1) / num_shards;
+      if (begin < end) {
+        shards_[i]->storage.block_append(
+            std::vector<DataType>(elements.begin() + begin,
+                                  elements.begin() + end),
+            torch::ones({end - begin}));
+      }
+    }
+  }
 
   std::tuple<std::vector<DataType>, torch::Tensor> get_all_content() {
     std::vector<DataType> samples;
@@ -274,19 +442,27 @@ public:
       return std::make_tuple(samples, weights);
     }
     int cur = 0;
-    while (cur < sample_size) {
-      DataType element = storage_.get_element(cur);
-      samples.push_back(element);
-      weight_acc[cur] = storage_.get_weight(cur, &id);
-      cur++;
+    for (auto &shard : shards_) {
+      const int shard_size = shard->storage.safe_size(nullptr);
+      for (int i = 0; i < shard_size && cur < sample_size; ++i) {
+        DataType element = shard->storage.get_element(i);
+        samples.push_back(element);
+        weight_acc[cur] = shard->storage.get_weight(i, &id);
+        cur++;
+      }
     }
 
-    return std::make_tuple(std::move(samples), weights);
+    return std::make_tuple(std::move(samples), weights.narrow(0, 0, cur));
   }
 
   std::tuple<int, std::vector<DataType>, torch::Tensor> get_new_content() {
     std::vector<DataType> samples;
-    int sample_size = num_add_ - last_query_;
+    std::vector<int> shard_sizes;
+    int sample_size = 0;
+    for (auto &shard : shards_) {
+      shard_sizes.push_back(shard->num_add - shard->last_query);
+      sample_size += shard_sizes.back();
+    }
     auto weights = torch::ones({sample_size}, torch::kFloat32);
     auto weight_acc = weights.accessor<float, 1>();
     int id = 0;
@@ -294,14 +470,19 @@ public:
       return std::make_tuple(0, samples, weights);
     }
     int cur = 0;
-    while (cur < sample_size) {
-      DataType element = storage_.get_element_and_mark(cur);
-      samples.push_back(element);
-      weight_acc[cur] = storage_.get_weight(cur, &id);
-      last_query_++;
-      cur++;
+    for (size_t i = 0; i < shards_.size(); ++i) {
+      Shard &shard = *shards_[i];
+      for (int j = 0; j < shard_sizes[i]; ++j) {
+        DataType element = shard.storage.get_element_and_mark(j);
+        samples.push_back(element);
+        weight_acc[cur] = shard.storage.get_weight(j, &id);
+        shard.last_query++;
+        cur++;
+      }
+      if (shard_sizes[i] > 0) {
+        shard.storage.block_pop(shard_sizes[i]);
+      }
     }
-    storage_.block_pop(sample_size);
 
     return std::make_tuple(sample_size, std::move(samples), weights);
   }
@@ -309,18 +490,30 @@ public:
   // assuming batch is a vector to be added to the replay buffer
   void add_batch(const std::vector<DataType> &vecs,
                  const torch::Tensor &priority) {
-    for (size_t i = 0; i < vecs.size(); i++) {
-      auto priority_accessor = priority.accessor<float, 1>();
-      add_one(vecs[i], priority_accessor[i]);
+    if (!vecs.empty()) {
+      add_compressed(vecs, priority);
     }
   }
 
   // assuming batch is a vector to be added to the replay buffer
-  // async version
+  // async version. Batches are added in order by a single ingestion thread.
+  // Blocks while kMaxPendingBatches batches are already waiting for it.
   std::future<void> add_batch_async(const std::vector<DataType> &batch,
                                     const torch::Tensor &priority) {
-    auto fut = [=] { add_batch(batch, priority); };
-    return std::async(std::launch::async, fut);
+    std::call_once(ingestion_started_, [this] {
+      ingestion_thread_ = std::thread(&PrioritizedReplay::ingest_, this);
+    });
+    std::promise<void> done;
+    std::future<void> fut = done.get_future();
+    {
+      std::unique_lock<std::mutex> lk(ingestion_m_);
+      ingestion_cv_.wait(lk, [this] {
+        return (int)pending_batches_.size() < kMaxPendingBatches;
+      });
+      pending_batches_.push_back({batch, priority, std::move(done)});
+    }
+    ingestion_cv_.notify_all();
+    return fut;
   }
 
   std::tuple<DataType, torch::Tensor> sample(int batchsize) {
@@ -363,82 +556,214 @@ public:
     assert((int)sampled_ids_.size() == priority.size(0));
 
     auto weights = torch::pow(priority, alpha_);
-    {
+    if (shards_.size() == 1) {
       std::lock_guard<std::mutex> lk(m_sampler_);
-      storage_.update(sampled_ids_, weights);
+      shards_[0]->storage.update(sampled_ids_, weights);
+    } else {
+      auto weight_acc = weights.accessor<float, 1>();
+      std::vector<std::vector<int>> shard_ids(shards_.size());
+      std::vector<std::vector<float>> shard_weights(shards_.size());
+      for (int i = 0; i < (int)sampled_ids_.size(); ++i) {
+        const int shard = sampled_ids_[i] / shard_storage_capacity_;
+        shard_ids[shard].push_back(sampled_ids_[i] % shard_storage_capacity_);
+        shard_weights[shard].push_back(weight_acc[i]);
+      }
+      std::lock_guard<std::mutex> lk(m_sampler_);
+      for (size_t i = 0; i < shards_.size(); ++i) {
+        if (!shard_ids[i].empty()) {
+          shards_[i]->storage.update(
+              shard_ids[i],
+              torch::from_blob(shard_weights[i].data(),
+                               {(int64_t)shard_weights[i].size()},
+                               torch::kFloat32));
+        }
+      }
     }
     sampled_ids_.clear();
   }
 
   void keep_priority() { sampled_ids_.clear(); }
 
-  int size() const { return storage_.safe_size(nullptr); }
+  int size() const {
+    int size = 0;
+    for (const auto &shard : shards_) {
+      size += shard->storage.safe_size(nullptr);
+    }
+    return size;
+  }
 
   int num_add() const { return num_add_; }
 
-  int64_t total_numel() const { return storage_.total_numel_; }
-  int64_t total_bytes() const { return storage_.total_bytes_; }
+  int64_t total_numel() const {
+    int64_t numel = 0;
+    for (const auto &shard : shards_) {
+      numel += shard->storage.total_numel_;
+    }
+    return numel;
+  }
+  int64_t total_bytes() const {
+    int64_t bytes = 0;
+    for (const auto &shard : shards_) {
+      bytes += shard->storage.total_bytes_;
+    }
+    return bytes;
+  }
 
 private:
   using SampleWeightIds = std::tuple<DataType, torch::Tensor, std::vector<int>>;
 
+  struct Shard {
+    Shard(int capacity, std::shared_ptr<ColumnarStorage> columns,
+          int first_row)
+        : storage(capacity, std::move(columns), first_row), num_add(0) {}
+
+    ConcurrentQueue<DataType> storage;
+    std::atomic<int> num_add;
+    int last_query = 0;
+  };
+
+  struct PendingBatch {
+    std::vector<DataType> batch;
+    torch::Tensor priority;
+    std::promise<void> done;
+  };
+
+  static constexpr int kMaxPendingBatches = 16;
+
+  // Approximate size of the chunks snapshots are written by
+  static constexpr int64_t kSnapshotChunkBytes = 64 << 20;
+
+  // Largest block that a full shard can take. Sampling only pops a shard
+  // down to shard_capacity_, so a larger block could wait for room forever.
+  int max_block_size_() const {
+    return std::max(1, shard_storage_capacity_ - shard_capacity_);
+  }
+
+  // Appends a block of at most max_block_size_() elements to the next shard
+  void add_block_(const std::vector<DataType> &block,
+                  const torch::Tensor &weights) {
+    Shard &shard = *shards_[next_shard_++ % shards_.size()];
+    shard.storage.block_append(block, weights);
+    shard.num_add += block.size();
+    num_add_ += block.size();
+  }
+
+  // Body of the ingestion thread
+  void ingest_() {
+    std::unique_lock<std::mutex> lk(ingestion_m_);
+    while (true) {
+      ingestion_cv_.wait(lk, [this] {
+        return stop_ingestion_ || !pending_batches_.empty();
+      });
+      if (pending_batches_.empty()) {
+        return;
+      }
+      PendingBatch pending = std::move(pending_batches_.front());
+      pending_batches_.pop_front();
+      lk.unlock();
+      ingestion_cv_.notify_all();
+      try {
+        add_batch(pending.batch, pending.priority);
+        pending.done.set_value();
+      } catch (...) {
+        pending.done.set_exception(std::current_exception());
+      }
+      lk.lock();
+    }
+  }
+
   SampleWeightIds sample_(int batchsize) {
     return shuffle_cross_chunks_ ? sample_shuffled_(batchsize)
                                  : sample_chunk_(batchsize);
   }
+
+  // Number of elements, including the unpublished ones
+  int storage_size_() const {
+    int size = 0;
+    for (const auto &shard : shards_) {
+      size += shard->storage.size();
+    }
+    return size;
+  }
+
+  // pop storage if full
+  void pop_full_shards_() {
+    for (auto &shard : shards_) {
+      int size = shard->storage.size();
+      if (size > shard_capacity_) {
+        shard->storage.block_pop(size - shard_capacity_);
+      }
+    }
+  }
+
   SampleWeightIds sample_chunk_(int batchsize) {
     std::unique_lock<std::mutex> lk(m_sampler_);
 
-    float sum;
-    int size = storage_.safe_size(&sum);
-    // storage_ [0, size) remains static in the subsequent section
+    // Stratified sampling over the shards laid end to end: the total weight
+    // is split into batchsize equal segments and one element is drawn from
+    // each. The prefix sums are increasing, so each shard gets a contiguous
+    // run of them.
+    const int num_shards = shards_.size();
+    std::vector<double> shard_sums(num_shards);
+    double sum = 0;
+    int last_shard = 0;
+    for (int i = 0; i < num_shards; ++i) {
+      shard_sums[i] = shards_[i]->storage.total_weight();
+      sum += shard_sums[i];
+      if (shard_sums[i] > 0) {
+        last_shard = i;
+      }
+    }
+    assert(sum > 0 && "Cannot sample from a buffer with zero total priority");
 
-    float segment = sum / batchsize;
-    std::uniform_real_distribution<float> dist(0.0, segment);
+    double segment = sum / batchsize;
+    std::uniform_real_distribution<double> dist(0.0, segment);
+    std::vector<double> prefix_sums(batchsize);
+    for (int i = 0; i < batchsize; ++i) {
+      prefix_sums[i] = dist(rng_) + i * segment;
+    }
 
-    std::vector<DataType> samples;
     auto weights = torch::zeros({batchsize}, torch::kFloat32);
-    auto weight_acc = weights.accessor<float, 1>();
+    float *weight_ptr = weights.data_ptr<float>();
     std::vector<int> ids(batchsize);
-
-    double acc_sum = 0;
-    int next_idx = 0;
-    float w = 0;
-    int id = 0;
-    for (int i = 0; i < batchsize; i++) {
-      float rand = dist(rng_) + i * segment;
-      rand = std::min(sum - (float)0.2, rand);
-
-      while (next_idx <= size) {
-        if (acc_sum > 0 && acc_sum >= rand) {
-          assert(next_idx >= 1);
-          DataType element = storage_.get_element_and_mark(next_idx - 1);
-          samples.push_back(element);
-          weight_acc[i] = w;
-          ids[i] = id;
-          break;
-        }
-
-        if (next_idx == size) {
-          std::cout << "next_idx: " << next_idx << "/" << size << std::endl;
-          std::cout << std::setprecision(10) << "acc_sum: " << acc_sum
-                    << ", sum: " << sum << ", rand: " << rand << std::endl;
-          assert(false);
-        }
-
-        w = storage_.get_weight(next_idx, &id);
-        acc_sum += w;
-        ++next_idx;
+    double shard_start = 0;
+    for (int i = 0, begin = 0; i < num_shards; ++i) {
+      // Past the last shard, e.g. due to rounding, counts as the last one
+      int end = begin;
+      while (end < batchsize &&
+             (i == last_shard ||
+              prefix_sums[end] < shard_start + shard_sums[i])) {
+        prefix_sums[end] -= shard_start;
+        ++end;
+      }
+      if (end > begin) {
+        shards_[i]->storage.find_ids(&prefix_sums[begin], end - begin,
+                                     &ids[begin], &weight_ptr[begin]);
       }
+      for (int j = begin; j < end; ++j) {
+        shards_[i]->storage.mark(ids[j]);
+        ids[j] += i * shard_storage_capacity_;
+      }
+      shard_start += shard_sums[i];
+      begin = end;
     }
-    assert((int)samples.size() == batchsize);
 
-    // pop storage if full
-    size = storage_.size();
-    if (size > capacity_) {
-      storage_.block_pop(size - capacity_);
+    // In columnar mode the batch is gathered before popping, as popped rows
+    // may be overwritten by concurrent appends
+    DataType batch;
+    std::vector<DataType> samples;
+    if (columns_) {
+      batch = columns_->gather(ids);
+    } else {
+      samples.reserve(batchsize);
+      for (int id : ids) {
+        samples.push_back(get_element_by_id_(id));
+      }
     }
 
+    int size = storage_size_();
+    pop_full_shards_();
+
     // safe to unlock, because <samples> contains copys
     lk.unlock();
 
@@ -446,33 +771,33 @@ private:
     weights = torch::pow(size * weights, -beta_);
     weights /= weights.max();
 
-    DataType batch = tensor_dict::stack(samples, 1);
+    if (!columns_) {
+      batch = tensor_dict::stack(samples, 1);
+    }
     return std::make_tuple(batch, weights, ids);
   }
 
   SampleWeightIds sample_shuffled_(int batchsize) {
     std::unique_lock<std::mutex> lk(m_sampler_);
 
-    float sum;
-    const int size = storage_.safe_size(&sum);
-    const int chunk_size = storage_.get_element(0).begin()->second.size(0);
+    std::vector<int> shard_sizes;
+    int size = 0;
+    for (auto &shard : shards_) {
+      shard_sizes.push_back(shard->storage.safe_size(nullptr));
+      size += shard_sizes.back();
+    }
+    const int chunk_size = get_element_(shard_sizes, 0).begin()->second.size(0);
 
     std::vector<DataType> samples;
     std::uniform_int_distribution<> dist_chunk(0, size - 1);
     std::uniform_int_distribution<> dist_position(0, chunk_size - 1);
     for (int i = 0; i < batchsize * chunk_size; ++i) {
-      const DataType &chunk = storage_.get_element(dist_chunk(rng_));
+      const DataType &chunk = get_element_(shard_sizes, dist_chunk(rng_));
       const int index_in_chunk = dist_position(rng_);
       samples.push_back(tensor_dict::index(chunk, index_in_chunk));
     }
 
-    {
-      // pop storage if full
-      auto real_size = storage_.size();
-      if (real_size > capacity_) {
-        storage_.block_pop(real_size - capacity_);
-      }
-    }
+    pop_full_shards_();
 
     // safe to unlock, because <samples> contains copys
     lk.unlock();
@@ -487,14 +812,32 @@ private:
     return std::make_tuple(batch, weights, ids);
   }
 
+  DataType get_element_by_id_(int id) const {
+    return shards_[id / shard_storage_capacity_]
+        ->storage.get_element_by_id(id % shard_storage_capacity_);
+  }
+
+  // Element idx of the shards laid end to end, given their sizes
+  DataType get_element_(const std::vector<int> &shard_sizes, int idx) {
+    int shard = 0;
+    while (idx >= shard_sizes[shard]) {
+      idx -= shard_sizes[shard];
+      ++shard;
+    }
+    return shards_[shard]->storage.get_element(idx);
+  }
+
   const float alpha_;
   const float beta_;
   const int prefetch_;
-  const int capacity_;
   const bool shuffle_cross_chunks_;
+  const int shard_capacity_;
+  const int shard_storage_capacity_;
 
-  ConcurrentQueue<DataType> storage_;
+  std::shared_ptr<ColumnarStorage> columns_;
+  std::vector<std::unique_ptr<Shard>> shards_;
   std::atomic<int> num_add_;
+  std::atomic<unsigned> next_shard_;
 
   // make sure that sample & update does not overlap
   std::mutex m_sampler_;
@@ -502,7 +845,14 @@ private:
   std::queue<std::future<SampleWeightIds>> futures_;
 
   std::mt19937 rng_;
-  int last_query_ = 0;
+
+  // add_batch_async
+  std::once_flag ingestion_started_;
+  std::thread ingestion_thread_;
+  std::mutex ingestion_m_;
+  std::condition_variable ingestion_cv_;
+  std::deque<PendingBatch> pending_batches_;
+  bool stop_ingestion_ = false;
 };
 
 using NestPrioritizedReplay = PrioritizedReplay<TensorDict>;
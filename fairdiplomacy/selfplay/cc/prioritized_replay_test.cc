@@ -5,6 +5,7 @@ This source code is licensed under the MIT license found in the
 LICENSE file in the root directory of this source tree.
 */
 #include <array>
+#include <atomic>
 #include <chrono>
 #include <random>
 #include <thread>
@@ -119,3 +120,297 @@ TEST(RelaTest, TestBytes) {
   replay.sample(capacity);
   ASSERT_EQ(bytes - first_size, replay.total_bytes());
 }
+
+TEST(RelaTest, TestSampleProportionalToPriority) {
+  const int capacity = 100;
+  NestPrioritizedReplay replay(capacity, 1, /*alpha=*/1.0, 0.1, 0);
+
+  const std::array<float, 4> priorities = {0.0, 1.0, 0.0, 3.0};
+  for (int i = 0; i < (int)priorities.size(); ++i) {
+    TensorDict data;
+    data["id"] = torch::full({2}, i, torch::kLong);
+    replay.add_one(data, priorities[i]);
+  }
+
+  std::array<int, 4> counts = {0, 0, 0, 0};
+  for (int k = 0; k < 1000; ++k) {
+    auto [batch, _] = replay.sample(4);
+    auto ids = batch.at("id");
+    for (int i = 0; i < 4; ++i) {
+      ++counts[ids[0][i].item<int64_t>()];
+    }
+    replay.keep_priority();
+  }
+  ASSERT_EQ(counts[0], 0);
+  ASSERT_EQ(counts[2], 0);
+  // Stratified sampling draws exactly one element from each quarter of the
+  // total priority
+  ASSERT_EQ(counts[1], 1000);
+  ASSERT_EQ(counts[3], 3000);
+
+  // Zeroing the priority of a sampled element stops it from being sampled
+  replay.sample(4);
+  replay.update_priority(torch::zeros({4}));
+  replay.add_one(
+      TensorDict{{"id", torch::full({2}, 4, torch::kLong)}}, 1.0);
+  auto [batch, _] = replay.sample(4);
+  ASSERT_EQ(batch.at("id")[0].eq(4).sum().item<int64_t>(), 4);
+}
+
+TEST(RelaTest, TestColumnarMatchesDefault) {
+  const int capacity = 8;
+  NestPrioritizedReplay replay(capacity, 1, 0.6, 0.4, 0);
+  NestPrioritizedReplay columnar(capacity, 1, 0.6, 0.4, 0, /*shuffle=*/false,
+                                 /*columnar=*/true);
+
+  for (int i = 0; i < 30; ++i) {
+    TensorDict data;
+    data["id"] = torch::full({3}, i, torch::kLong);
+    data["obs"] = torch::full({3, 2, 5}, 0.5 * i);
+    const float priority = 1 + i % 4;
+    replay.add_one(data, priority);
+    columnar.add_one(data, priority);
+    ASSERT_EQ(replay.total_bytes(), columnar.total_bytes());
+    ASSERT_EQ(replay.total_numel(), columnar.total_numel());
+
+    if (replay.size() >= 4) {
+      auto [batch, weights] = replay.sample(4);
+      auto [columnar_batch, columnar_weights] = columnar.sample(4);
+      ASSERT_TRUE(batch.at("id").equal(columnar_batch.at("id")));
+      ASSERT_TRUE(batch.at("obs").equal(columnar_batch.at("obs")));
+      ASSERT_TRUE(weights.equal(columnar_weights));
+      ASSERT_EQ(columnar_batch.at("obs").size(0), 3);
+      ASSERT_EQ(columnar_batch.at("obs").size(1), 4);
+      replay.update_priority(torch::ones({4}));
+      columnar.update_priority(torch::ones({4}));
+    }
+  }
+
+  // Batches are recycled once dropped
+  void *data = nullptr;
+  {
+    auto [batch, _] = columnar.sample(4);
+    data = batch.at("obs").data_ptr();
+    columnar.keep_priority();
+  }
+  auto [batch, _] = columnar.sample(4);
+  ASSERT_EQ(batch.at("obs").data_ptr(), data);
+}
+
+TEST(RelaTest, TestShardedReplay) {
+  const int capacity = 40;
+  const int num_shards = 4;
+  for (bool columnar : {false, true}) {
+    NestPrioritizedReplay replay(capacity, 1, 1.0, 0.4, 0, /*shuffle=*/false,
+                                 columnar, num_shards);
+
+    // Producers block on full shards until sampling pops them
+    std::vector<std::thread> producers;
+    for (int p = 0; p < 4; ++p) {
+      producers.emplace_back([&replay, p] {
+        for (int i = 0; i < 50; ++i) {
+          TensorDict data;
+          data["id"] = torch::full({2}, p * 50 + i, torch::kLong);
+          replay.add_one(data, 1.0 + i % 3);
+        }
+      });
+    }
+    int num_sampled = 0;
+    while (replay.num_add() < 200 || num_sampled < 10) {
+      if (replay.size() >= 8) {
+        auto [batch, weights] = replay.sample(8);
+        ASSERT_EQ(batch.at("id").size(1), 8);
+        ASSERT_EQ(weights.size(0), 8);
+        replay.update_priority(torch::ones({8}));
+        ++num_sampled;
+      } else {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      }
+    }
+    for (auto &producer : producers) {
+      producer.join();
+    }
+    ASSERT_EQ(replay.num_add(), 200);
+    ASSERT_LE(replay.size(), 200);
+
+    auto [content, _] = replay.get_all_content();
+    ASSERT_EQ((int)content.size(), replay.size());
+  }
+
+  // Sampling stays proportional to priority across shards. Adds go to the
+  // shards in turn, so ids 1 and 3 end up in the same shard.
+  NestPrioritizedReplay replay(capacity, 1, 1.0, 0.1, 0, /*shuffle=*/false,
+                               /*columnar=*/false, /*num_shards=*/2);
+  const std::array<float, 4> priorities = {0.0, 1.0, 0.0, 3.0};
+  for (int i = 0; i < (int)priorities.size(); ++i) {
+    replay.add_one(TensorDict{{"id", torch::full({2}, i, torch::kLong)}},
+                   priorities[i]);
+  }
+  std::array<int, 4> counts = {0, 0, 0, 0};
+  for (int k = 0; k < 1000; ++k) {
+    auto [batch, _] = replay.sample(4);
+    auto ids = batch.at("id");
+    for (int i = 0; i < 4; ++i) {
+      ++counts[ids[0][i].item<int64_t>()];
+    }
+    replay.keep_priority();
+  }
+  ASSERT_EQ(counts[0], 0);
+  ASSERT_EQ(counts[1], 1000);
+  ASSERT_EQ(counts[2], 0);
+  ASSERT_EQ(counts[3], 3000);
+}
+
+TEST(RelaTest, TestAddBatch) {
+  const int capacity = 100;
+  NestPrioritizedReplay replay(capacity, 1, 1.0, 0.4, 0);
+
+  std::vector<TensorDict> batch;
+  for (int i = 0; i < 10; ++i) {
+    batch.push_back(TensorDict{{"id", torch::full({2}, i, torch::kLong)}});
+  }
+  replay.add_batch(batch, torch::ones({10}));
+  ASSERT_EQ(replay.num_add(), 10);
+  ASSERT_EQ(replay.size(), 10);
+
+  // Async batches are added in order
+  std::vector<std::future<void>> futures;
+  for (int k = 0; k < 5; ++k) {
+    futures.push_back(replay.add_batch_async(batch, torch::ones({10})));
+  }
+  for (auto &future : futures) {
+    future.get();
+  }
+  ASSERT_EQ(replay.num_add(), 60);
+  auto [content, weights] = replay.get_all_content();
+  ASSERT_EQ((int)content.size(), 60);
+  for (int i = 0; i < 60; ++i) {
+    ASSERT_EQ(content[i].at("id")[0].item<int64_t>(), i % 10);
+  }
+
+  // Batches larger than a shard are split over the shards
+  NestPrioritizedReplay sharded(16, 1, 1.0, 0.4, 0, /*shuffle=*/false,
+                                /*columnar=*/false, /*num_shards=*/2);
+  sharded.add_batch(batch, torch::ones({10}));
+  ASSERT_EQ(sharded.size(), 10);
+}
+
+TEST(RelaTest, TestAddLargeBatchToFullBuffer) {
+  const int capacity = 1000;
+  NestPrioritizedReplay replay(capacity, 1, 1.0, 0.4, 0);
+
+  auto make_batch = [](int size) {
+    std::vector<TensorDict> batch;
+    for (int i = 0; i < size; ++i) {
+      batch.push_back(TensorDict{{"id", torch::full({2}, i, torch::kLong)}});
+    }
+    return batch;
+  };
+  replay.add_batch(make_batch(capacity), torch::ones({capacity}));
+  ASSERT_EQ(replay.size(), capacity);
+
+  // A batch larger than the room left in a full shard only goes in as
+  // sampling pops the buffer back down to capacity
+  std::atomic<bool> added(false);
+  std::thread sampler([&] {
+    while (!added) {
+      replay.sample(10);
+      replay.keep_priority();
+    }
+  });
+  replay.add_batch(make_batch(capacity / 2), torch::ones({capacity / 2}));
+  added = true;
+  sampler.join();
+  ASSERT_EQ(replay.num_add(), capacity + capacity / 2);
+}
+
+TEST(RelaTest, TestOneElementShards) {
+  // Shards of capacity 1 still have room for an add past capacity, so adds
+  // to full shards go in once sampling pops them
+  const int num_shards = 4;
+  NestPrioritizedReplay replay(num_shards, 1, 1.0, 0.4, 0, /*shuffle=*/false,
+                               /*columnar=*/false, num_shards);
+  for (int i = 0; i < num_shards; ++i) {
+    replay.add_one(TensorDict{{"id", torch::full({2}, i, torch::kLong)}}, 1.0);
+  }
+
+  std::atomic<bool> added(false);
+  std::thread sampler([&] {
+    while (!added) {
+      replay.sample(1);
+      replay.keep_priority();
+    }
+  });
+  for (int i = 0; i < 3 * num_shards; ++i) {
+    replay.add_one(TensorDict{{"id", torch::full({2}, i, torch::kLong)}}, 1.0);
+  }
+  added = true;
+  sampler.join();
+  ASSERT_EQ(replay.num_add(), 4 * num_shards);
+  ASSERT_LE(replay.size(), 2 * num_shards);
+}
+
+TEST(RelaTest, TestSaveAndLoad) {
+  const std::string path = testing::TempDir() + "replay_snapshot.bin";
+  int saved_size = 0;
+  for (bool columnar : {false, true}) {
+    const int capacity = 10;
+    NestPrioritizedReplay replay(capacity, 1, 1.0, 0.4, 0, /*shuffle=*/false,
+                                 columnar, /*num_shards=*/2);
+    // Overflow the buffer so that the oldest elements get popped
+    for (int i = 0; i < 25; ++i) {
+      TensorDict data;
+      data["id"] = torch::full({2}, i, torch::kLong);
+      data["obs"] = torch::full({2, 3}, 0.5 * i);
+      data["mask"] = torch::full({2, 4}, i % 2, torch::kInt8);
+      replay.add_one(data, 1.0);
+      if (replay.size() >= 4) {
+        replay.sample(4);
+        replay.keep_priority();
+      }
+    }
+    replay.save_async(path).get();
+    saved_size = replay.size();
+
+    NestPrioritizedReplay loaded(capacity, 1, 1.0, 0.4, 0, /*shuffle=*/false,
+                                 columnar);
+    loaded.load(path);
+    ASSERT_EQ(loaded.size(), replay.size());
+    ASSERT_EQ(loaded.num_add(), 0);
+
+    std::vector<int64_t> ids;
+    auto [content, _] = replay.get_all_content();
+    for (const auto &element : content) {
+      ids.push_back(element.at("id")[0].item<int64_t>());
+    }
+    auto [loaded_content, __] = loaded.get_all_content();
+    for (int i = 0; i < (int)loaded_content.size(); ++i) {
+      const auto &element = loaded_content[i];
+      const int64_t id = element.at("id")[0].item<int64_t>();
+      ASSERT_EQ(id, ids[i]);
+      ASSERT_TRUE(element.at("obs").equal(torch::full({2, 3}, 0.5 * id)));
+      ASSERT_TRUE(element.at("mask").equal(
+          torch::full({2, 4}, id % 2, torch::kInt8)));
+    }
+  }
+
+  // A snapshot that is never closed leaves the previous one in place
+  {
+    SnapshotWriter writer(path);
+    writer.write({TensorDict{{"id", torch::full({2}, 0, torch::kLong)}}});
+  }
+  ASSERT_NE(access((path + ".tmp").c_str(), F_OK), 0);
+  NestPrioritizedReplay previous(10, 1, 1.0, 0.4, 0);
+  previous.load(path);
+  ASSERT_EQ(previous.size(), saved_size);
+
+  // Truncated snapshots are rejected
+  std::FILE *f = std::fopen(path.c_str(), "r+b");
+  std::fseek(f, 0, SEEK_END);
+  const long size = std::ftell(f);
+  std::fclose(f);
+  ASSERT_EQ(truncate(path.c_str(), size - 1), 0);
+  NestPrioritizedReplay replay(10, 1, 1.0, 0.4, 0);
+  ASSERT_THROW(replay.load(path), std::runtime_error);
+  std::remove(path.c_str());
+}
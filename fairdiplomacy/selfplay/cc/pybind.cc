@@ -16,18 +16,30 @@ namespace py = pybind11;
 using namespace buffer;
 
 PYBIND11_MODULE(rela, m) {
+  // Handle to the work of an *_async call. Callers must keep the handle and
+  // call get() on it: a dropped save_async handle blocks in its destructor,
+  // holding the GIL, until the save is done.
   py::class_<std::future<void>>(m, "Future")
       .def(py::init<>())
-      .def("get", &std::future<void>::get);
+      .def("done",
+           [](const std::future<void> &future) {
+             return future.wait_for(std::chrono::seconds(0)) ==
+                    std::future_status::ready;
+           })
+      .def("get", &std::future<void>::get,
+           py::call_guard<py::gil_scoped_release>());
 
   py::class_<NestPrioritizedReplay, std::shared_ptr<NestPrioritizedReplay>>(
       m, "NestPrioritizedReplay")
-      .def(py::init<int, int, float, float, bool, bool>(), py::arg("capacity"),
-           py::arg("seed"), py::arg("alpha"), py::arg("beta"),
-           py::arg("prefetch"), py::arg("shuffle") = false)
+      .def(py::init<int, int, float, float, bool, bool, bool, int>(),
+           py::arg("capacity"), py::arg("seed"), py::arg("alpha"),
+           py::arg("beta"), py::arg("prefetch"), py::arg("shuffle") = false,
+           py::arg("columnar") = false, py::arg("num_shards") = 1)
       .def("load", &NestPrioritizedReplay::load)
       .def("save", &NestPrioritizedReplay::save,
            py::call_guard<py::gil_scoped_release>())
+      .def("save_async", &NestPrioritizedReplay::save_async,
+           py::call_guard<py::gil_scoped_release>())
       .def("size", &NestPrioritizedReplay::size)
       .def("num_add", &NestPrioritizedReplay::num_add)
       .def("total_bytes", &NestPrioritizedReplay::total_bytes)
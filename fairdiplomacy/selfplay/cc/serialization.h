@@ -4,8 +4,38 @@ Copyright (c) Meta Platforms, Inc. and affiliates.
 This source code is licensed under the MIT license found in the
 LICENSE file in the root directory of this source tree.
 */
+
+// Snapshots of replay buffer contents, i.e. of vectors of TensorDicts with
+// the same keys, and per key the same dtype and shape. The file layout is
+//
+//   header: "RELASNAP", uint32 version, uint32 number of keys, int64 number
+//           of elements, then per key its uint32 name size, name, int8
+//           dtype, uint8 number of dims and int64 dims
+//   chunks: int64 number of elements n, then per key in header order the
+//           raw [n, dims...] contiguous payload
+//
+// with the header, chunk headers and payloads each padded to kAlignment
+// bytes. Snapshots are written incrementally, one chunk at a time, and
+// memory-mapped on read, so that the tensors read are views of the file
+// paged in on first use.
+//
+// Files in the legacy format, a torch::save blob per element, can still be
+// read.
+
+#pragma once
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
 #include <future>
+#include <memory>
 #include <random>
+#include <stdexcept>
 #include <string>
 #include <vector>
 
@@ -15,42 +45,29 @@ namespace rela {
 
 static constexpr int kMagicNumber = 575757;
 
-int readInt(FILE *file) {
-  int tmp;
-  fread(&tmp, sizeof(int), 1, file);
-  return tmp;
-}
-
-void writeInt(int tmp, FILE *file) { fwrite(&tmp, sizeof(int), 1, file); }
-
-void write(const std::vector<TensorDict> &elements, FILE *f) {
-  assert(!elements.empty());
+static constexpr char kSnapshotMagic[8] = {'R', 'E', 'L', 'A',
+                                           'S', 'N', 'A', 'P'};
+static constexpr uint32_t kSnapshotVersion = 1;
+static constexpr size_t kAlignment = 64;
 
-  writeInt(kMagicNumber, f);
-  std::vector<std::string> header;
-  for (const auto &p : elements[0])
-    header.push_back(p.first);
+[[noreturn]] inline void throwIOError(const std::string &what,
+                                      const std::string &path) {
+  throw std::runtime_error(what + " " + path + ": " + std::strerror(errno));
+}
 
-  writeInt(header.size(), f);
-  for (size_t i = 0; i < header.size(); ++i) {
-    writeInt(header[i].size(), f);
-    fwrite(header[i].c_str(), sizeof(char), header[i].size(), f);
+inline void readBytes(void *data, size_t size, FILE *f) {
+  if (fread(data, 1, size, f) != size) {
+    throw std::runtime_error("Truncated replay buffer file");
   }
+}
 
-  writeInt(elements.size(), f);
-  for (const auto &datum : elements) {
-    std::vector<torch::Tensor> all_tensors;
-    for (const auto &name : header) {
-      all_tensors.push_back(datum.at(name));
-    }
-    std::ostringstream stream;
-    torch::save(all_tensors, stream);
-    const std::string buffer = stream.str();
-    writeInt(buffer.size(), f);
-    fwrite(buffer.c_str(), sizeof(char), buffer.size(), f);
-  }
+int readInt(FILE *file) {
+  int tmp;
+  readBytes(&tmp, sizeof(int), file);
+  return tmp;
 }
 
+// Reads elements in the legacy format
 std::vector<TensorDict> read(FILE *f) {
   std::vector<std::string> header;
   const int magic_number = readInt(f);
@@ -61,7 +78,7 @@ std::vector<TensorDict> read(FILE *f) {
   for (int i = 0; i < header_size; ++i) {
     int sz = readInt(f);
     buffer.resize(sz);
-    fread(buffer.data(), sizeof(char), sz, f);
+    readBytes(buffer.data(), sz, f);
     header.push_back(std::string(buffer.data(), sz));
   }
 
@@ -70,7 +87,7 @@ std::vector<TensorDict> read(FILE *f) {
     auto &tdict = elements[i];
     int sz = readInt(f);
     buffer.resize(sz);
-    fread(buffer.data(), sizeof(char), sz, f);
+    readBytes(buffer.data(), sz, f);
     std::vector<torch::Tensor> tensor_vec;
     torch::load(tensor_vec, static_cast<const char *>(buffer.data()), sz);
     for (size_t j = 0; j < header.size(); ++j) {
@@ -79,4 +96,278 @@ std::vector<TensorDict> read(FILE *f) {
   }
   return elements;
 }
-} // namespace rela
\ No newline at end of file
+
+// Layout of one key of the elements of a snapshot
+struct SnapshotKey {
+  std::string name;
+  torch::ScalarType dtype;
+  std::vector<int64_t> sizes;
+  size_t nbytes; // of one element
+};
+
+// Writes a snapshot chunk by chunk. The chunks go to path + ".tmp", which
+// close() renames onto path, so that an interrupted or failed write leaves
+// any previous snapshot at path intact.
+class SnapshotWriter {
+public:
+  explicit SnapshotWriter(const std::string &path)
+      : path_(path), tmp_path_(path + ".tmp") {
+    file_ = fopen(tmp_path_.c_str(), "wb");
+    if (file_ == nullptr) {
+      throwIOError("Cannot open", tmp_path_);
+    }
+  }
+
+  // Removes the temporary file unless close() succeeded
+  ~SnapshotWriter() {
+    if (file_ != nullptr) {
+      fclose(file_);
+    }
+    if (!closed_) {
+      std::remove(tmp_path_.c_str());
+    }
+  }
+
+  SnapshotWriter(const SnapshotWriter &) = delete;
+  SnapshotWriter &operator=(const SnapshotWriter &) = delete;
+
+  // Appends a chunk of elements. The layout of the first element written
+  // sets the schema, which the others must match.
+  void write(const std::vector<TensorDict> &elements) {
+    if (elements.empty()) {
+      return;
+    }
+    if (!has_header_) {
+      writeHeader(elements[0]);
+    }
+    const int64_t n = elements.size();
+    writeBytes(&n, sizeof(n));
+    pad();
+    for (const auto &key : keys_) {
+      for (const auto &element : elements) {
+        auto it = element.find(key.name);
+        if (element.size() != keys_.size() || it == element.end()) {
+          throw std::runtime_error("Snapshot elements have different keys");
+        }
+        const auto t = it->second.contiguous();
+        if (t.scalar_type() != key.dtype ||
+            std::vector<int64_t>(t.sizes().begin(), t.sizes().end()) !=
+                key.sizes) {
+          throw std::runtime_error("Snapshot elements have different " +
+                                   key.name + " dtypes or shapes");
+        }
+        writeBytes(t.data_ptr(), key.nbytes);
+      }
+      pad();
+    }
+    num_elements_ += n;
+  }
+
+  // Finalizes the header, syncs the file to disk and moves it to path
+  void close() {
+    if (!has_header_) {
+      writeHeader({});
+    }
+    if (fseek(file_, num_elements_offset_, SEEK_SET) != 0 ||
+        fwrite(&num_elements_, sizeof(num_elements_), 1, file_) != 1 ||
+        fflush(file_) != 0 || fsync(fileno(file_)) != 0) {
+      throwIOError("Cannot write", tmp_path_);
+    }
+    FILE *file = file_;
+    file_ = nullptr;
+    if (fclose(file) != 0) {
+      throwIOError("Cannot write", tmp_path_);
+    }
+    if (std::rename(tmp_path_.c_str(), path_.c_str()) != 0) {
+      throwIOError("Cannot rename " + tmp_path_ + " to", path_);
+    }
+    closed_ = true;
+  }
+
+private:
+  void writeHeader(const TensorDict &element) {
+    writeBytes(kSnapshotMagic, sizeof(kSnapshotMagic));
+    writeBytes(&kSnapshotVersion, sizeof(kSnapshotVersion));
+    const uint32_t num_keys = element.size();
+    writeBytes(&num_keys, sizeof(num_keys));
+    num_elements_offset_ = offset_;
+    const int64_t incomplete = -1;
+    writeBytes(&incomplete, sizeof(incomplete));
+    for (const auto &name2tensor : element) {
+      const auto &t = name2tensor.second;
+      SnapshotKey key{name2tensor.first, t.scalar_type(),
+                      std::vector<int64_t>(t.sizes().begin(), t.sizes().end()),
+                      size_t(t.numel() * t.element_size())};
+      const uint32_t name_size = key.name.size();
+      writeBytes(&name_size, sizeof(name_size));
+      writeBytes(key.name.data(), name_size);
+      const int8_t dtype = static_cast<int8_t>(key.dtype);
+      writeBytes(&dtype, sizeof(dtype));
+      const uint8_t dim = key.sizes.size();
+      writeBytes(&dim, sizeof(dim));
+      writeBytes(key.sizes.data(), dim * sizeof(int64_t));
+      keys_.push_back(std::move(key));
+    }
+    pad();
+    has_header_ = true;
+  }
+
+  void writeBytes(const void *data, size_t size) {
+    if (fwrite(data, 1, size, file_) != size) {
+      throwIOError("Cannot write", tmp_path_);
+    }
+    offset_ += size;
+  }
+
+  void pad() {
+    static constexpr char zeros[kAlignment] = {};
+    writeBytes(zeros, (kAlignment - offset_ % kAlignment) % kAlignment);
+  }
+
+  const std::string path_;
+  const std::string tmp_path_;
+  FILE *file_;
+  bool closed_ = false;
+  size_t offset_ = 0;
+  bool has_header_ = false;
+  std::vector<SnapshotKey> keys_;
+  size_t num_elements_offset_ = 0;
+  int64_t num_elements_ = 0;
+};
+
+// Private mapping of a whole file, unmapped on destruction
+class MappedFile {
+public:
+  explicit MappedFile(const std::string &path) {
+    const int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+      throwIOError("Cannot open", path);
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+      ::close(fd);
+      throwIOError("Cannot stat", path);
+    }
+    size_ = st.st_size;
+    if (size_ > 0) {
+      // Private writable pages, so that the tensors are writable without
+      // affecting the file
+      data_ = mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    }
+    ::close(fd);
+    if (data_ == MAP_FAILED) {
+      throwIOError("Cannot mmap", path);
+    }
+  }
+
+  ~MappedFile() {
+    if (data_ != nullptr && data_ != MAP_FAILED) {
+      munmap(data_, size_);
+    }
+  }
+
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+
+  char *data() const { return static_cast<char *>(data_); }
+  size_t size() const { return size_; }
+
+private:
+  void *data_ = nullptr;
+  size_t size_ = 0;
+};
+
+// Reads a snapshot, or a file in the legacy format. The tensors of a
+// snapshot are views of the memory-mapped file, which stays mapped until
+// they are all freed.
+inline std::vector<TensorDict> readSnapshot(const std::string &path) {
+  auto file = std::make_shared<MappedFile>(path);
+  if (file->size() >= sizeof(int) &&
+      *reinterpret_cast<const int *>(file->data()) == kMagicNumber) {
+    FILE *f = fopen(path.c_str(), "rb");
+    if (f == nullptr) {
+      throwIOError("Cannot open", path);
+    }
+    std::unique_ptr<FILE, int (*)(FILE *)> closer(f, fclose);
+    return read(f);
+  }
+
+  size_t offset = 0;
+  auto readBytes = [&](void *data, size_t size) {
+    if (offset + size > file->size()) {
+      throw std::runtime_error("Truncated replay buffer snapshot " + path);
+    }
+    memcpy(data, file->data() + offset, size);
+    offset += size;
+  };
+  auto skipPadding = [&] {
+    offset += (kAlignment - offset % kAlignment) % kAlignment;
+  };
+
+  char magic[sizeof(kSnapshotMagic)];
+  readBytes(magic, sizeof(magic));
+  uint32_t version;
+  readBytes(&version, sizeof(version));
+  if (memcmp(magic, kSnapshotMagic, sizeof(magic)) != 0 ||
+      version != kSnapshotVersion) {
+    throw std::runtime_error("Not a replay buffer snapshot: " + path);
+  }
+  uint32_t num_keys;
+  readBytes(&num_keys, sizeof(num_keys));
+  int64_t num_elements;
+  readBytes(&num_elements, sizeof(num_elements));
+  if (num_elements < 0) {
+    throw std::runtime_error("Incomplete replay buffer snapshot " + path);
+  }
+  std::vector<SnapshotKey> keys(num_keys);
+  for (auto &key : keys) {
+    uint32_t name_size;
+    readBytes(&name_size, sizeof(name_size));
+    key.name.resize(name_size);
+    readBytes(&key.name[0], name_size);
+    int8_t dtype;
+    readBytes(&dtype, sizeof(dtype));
+    key.dtype = static_cast<torch::ScalarType>(dtype);
+    uint8_t dim;
+    readBytes(&dim, sizeof(dim));
+    key.sizes.resize(dim);
+    readBytes(key.sizes.data(), dim * sizeof(int64_t));
+    int64_t numel = 1;
+    for (int64_t size : key.sizes) {
+      numel *= size;
+    }
+    key.nbytes = numel * c10::elementSize(key.dtype);
+  }
+  skipPadding();
+
+  std::vector<TensorDict> elements;
+  elements.reserve(num_elements);
+  while ((int64_t)elements.size() < num_elements) {
+    int64_t n;
+    readBytes(&n, sizeof(n));
+    skipPadding();
+    if (n <= 0 || (int64_t)elements.size() + n > num_elements) {
+      throw std::runtime_error("Corrupted replay buffer snapshot " + path);
+    }
+    const size_t first = elements.size();
+    elements.resize(first + n);
+    for (const auto &key : keys) {
+      if (offset + n * key.nbytes > file->size()) {
+        throw std::runtime_error("Truncated replay buffer snapshot " + path);
+      }
+      for (int64_t i = 0; i < n; ++i) {
+        elements[first + i][key.name] = torch::from_blob(
+            file->data() + offset, key.sizes, [file](void *) {},
+            torch::TensorOptions().dtype(key.dtype));
+        offset += key.nbytes;
+      }
+      skipPadding();
+    }
+  }
+  if (offset != file->size()) {
+    throw std::runtime_error("Corrupted replay buffer snapshot " + path);
+  }
+  return elements;
+}
+
+} // namespace rela
@@ -0,0 +1,78 @@
+/*
+Copyright (c) Meta Platforms, Inc. and affiliates.
+
+This source code is licensed under the MIT license found in the
+LICENSE file in the root directory of this source tree.
+*/
+
+// Binary sum tree over a fixed number of non-negative weights. Supports
+// setting a weight and finding the element at a given prefix sum in
+// O(log capacity), which is what proportional prioritized sampling needs.
+//
+// Not thread-safe: callers must serialize access.
+
+#pragma once
+
+#include <cassert>
+#include <vector>
+
+namespace buffer {
+
+class SumTree {
+public:
+  explicit SumTree(int capacity) : capacity_(capacity) {
+    leaf_offset_ = 1;
+    while (leaf_offset_ < capacity) {
+      leaf_offset_ *= 2;
+    }
+    nodes_.assign(2 * leaf_offset_, 0);
+  }
+
+  int capacity() const { return capacity_; }
+
+  double total() const { return nodes_[1]; }
+
+  double get(int i) const { return nodes_[leaf_offset_ + i]; }
+
+  void set(int i, double weight) {
+    assert(i >= 0 && i < capacity_);
+    assert(weight >= 0);
+    int node = leaf_offset_ + i;
+    nodes_[node] = weight;
+    // Parents are recomputed rather than updated by the difference, so that
+    // subtrees of zero weights sum to exactly zero and rounding errors don't
+    // accumulate
+    for (node /= 2; node >= 1; node /= 2) {
+      nodes_[node] = nodes_[2 * node] + nodes_[2 * node + 1];
+    }
+  }
+
+  // Returns the index i of the element such that the sum of the weights
+  // before it is <= prefix_sum < that sum plus weight i. Prefix sums past
+  // the total, e.g. due to rounding, return the last element of non-zero
+  // weight. Never returns an element of zero weight unless all are zero.
+  int find(double prefix_sum) const {
+    int node = 1;
+    while (node < leaf_offset_) {
+      int left = 2 * node;
+      bool go_left = nodes_[left + 1] <= 0 ||
+                     (prefix_sum < nodes_[left] && nodes_[left] > 0);
+      if (go_left) {
+        node = left;
+      } else {
+        prefix_sum -= nodes_[left];
+        node = left + 1;
+      }
+    }
+    return node - leaf_offset_;
+  }
+
+private:
+  int capacity_;
+  int leaf_offset_;
+  // nodes_[1] is the root, node n has children 2n and 2n + 1, and leaf i is
+  // node leaf_offset_ + i
+  std::vector<double> nodes_;
+};
+
+} // namespace buffer
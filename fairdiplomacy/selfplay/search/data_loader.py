@@ -270,6 +270,8 @@ class DataLoader:
             prefetch=self.rollout_cfg.buffer.prefetch or 3,
             capacity=self.rollout_cfg.buffer.capacity // self._ectx.ddp_world_size,
             shuffle=self.rollout_cfg.buffer.shuffle,
+            columnar=self.rollout_cfg.buffer.columnar,
+            num_shards=self.rollout_cfg.buffer.num_shards,
         )
         self._buffer = rela.NestPrioritizedReplay(**replay_params)
 
@@ -290,8 +292,8 @@ class DataLoader:
         elif self.rollout_cfg.buffer.save_at and self.rollout_cfg.buffer.save_at > 0:
             self._save_buffer_at = self.rollout_cfg.buffer.save_at
 
-        # If true, will go noop on postman buffer add calls.
-        self._skip_buffer_adds = False
+        # Handle of the buffer snapshot being written in the background, if any.
+        self._buffer_save_future = None
 
         # Timestamps where get_buffer_stats is called.
         self._first_call = time.time()
@@ -306,8 +308,6 @@ class DataLoader:
 
         def add_replay(data):
             nonlocal num_added
-            if self._skip_buffer_adds:
-                return
             if num_added < 10:
                 logging.info(
                     "adding:\n\tdata=%s\n\tbuffer sz=%s",
@@ -401,6 +401,10 @@ class DataLoader:
         logging.info("Killing Rollouter")
         if self._rollouter is not None:
             self._rollouter.terminate()
+        if getattr(self, "_buffer_save_future", None) is not None:
+            logging.info("Waiting for the buffer save to finish")
+            self._buffer_save_future.get()
+            self._buffer_save_future = None
         if getattr(self, "_sitcheck", None) is not None:
             self._sitcheck.terminate()
         if getattr(self, "_eval_player", None) is not None:
@@ -472,13 +476,14 @@ class DataLoader:
                 self._need_warmup = False
             if self._save_buffer_at and self._save_buffer_at < self._buffer.num_add():
                 save_path = pathlib.Path(f"buffer{self._ectx.training_ddp_rank}.bin").absolute()
-                logging.info("Saving buffer to %s", save_path)
-                # To avoid overflowing, set buffer to read only mode.
-                self._skip_buffer_adds = True
-                self._buffer.save(str(save_path))
-                self._skip_buffer_adds = False
-                logging.info("Done.")
+                logging.info("Saving buffer to %s in the background", save_path)
+                # Adds and sampling go on while the snapshot is written.
+                self._buffer_save_future = self._buffer.save_async(str(save_path))
                 self._save_buffer_at = None
+            if self._buffer_save_future is not None and self._buffer_save_future.done():
+                self._buffer_save_future.get()
+                self._buffer_save_future = None
+                logging.info("Done saving buffer.")
 
             batch = self.sample_raw_batch_from_buffer()
             batch = decompress_and_unflatten(batch)
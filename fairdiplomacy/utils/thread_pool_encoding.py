@@ -4,12 +4,13 @@
 # This source code is licensed under the MIT license found in the
 # LICENSE file in the root directory of this source tree.
 #
-from typing import Sequence, Optional
+from typing import Dict, Sequence, Optional
 
 import torch
 
 from fairdiplomacy import pydipcc
 from fairdiplomacy.data.data_fields import DataFields
+from fairdiplomacy.models.state_space import EOS_IDX
 from fairdiplomacy.typedefs import Action, Order
 from fairdiplomacy.utils.order_idxs import ORDER_VOCABULARY_TO_IDX, MAX_VALID_LEN
 
@@ -22,22 +23,87 @@ def get_board_state_size(input_version):
     return pydipcc.board_state_enc_width(input_version)
 
 
+def possible_actions_from_csr(
+    offsets: torch.Tensor, values: torch.Tensor, batch_size: int, max_cands: int = MAX_VALID_LEN
+) -> torch.Tensor:
+    """Inverse of the CSR layout of FeatureEncoder.encode_inputs_csr.
+
+    Returns the EOS_IDX-padded [B, 7, S, max_cands] x_possible_actions, on the
+    device of values.
+    """
+    device = values.device
+    offsets = offsets.to(device)
+    n_rows = offsets.numel() - 1
+    lengths = offsets[1:] - offsets[:-1]
+    rows = torch.repeat_interleave(torch.arange(n_rows, device=device), lengths)
+    cols = torch.arange(values.numel(), device=device) - offsets[:-1][rows]
+    dense = torch.full((n_rows, max_cands), EOS_IDX, dtype=values.dtype, device=device)
+    dense[rows, cols] = values
+    return dense.view(batch_size, 7, -1, max_cands)
+
+
+def densify_possible_actions(fields: DataFields) -> DataFields:
+    """Replaces the CSR x_possible_actions_* fields of encode_inputs_csr with
+    x_possible_actions, in place. Returns fields."""
+    fields["x_possible_actions"] = possible_actions_from_csr(
+        fields.pop("x_possible_actions_offsets"),
+        fields.pop("x_possible_actions_values"),
+        batch_size=fields["x_board_state"].shape[0],
+    )
+    return fields
+
+
+class EncodingFuture:
+    """Handle to a batch of work running in a FeatureEncoder's thread pool.
+
+    The games passed to the *_async call must not be modified until the
+    batch is done.
+    """
+
+    def __init__(self, future: pydipcc.ThreadPoolFuture):
+        self._future = future
+
+    def done(self) -> bool:
+        return self._future.done()
+
+    def result(self) -> DataFields:
+        """Blocks until the batch is done and returns the encoded fields.
+
+        The fields are empty for process_multi_async and
+        decode_and_set_orders_async. Raises the first error of the batch's
+        jobs, if any.
+        """
+        return DataFields(self._future.wait())
+
+
 class FeatureEncoder:
 
     nothread_pool_singleton: Optional[pydipcc.ThreadPool] = None
 
-    def __init__(self, *, num_threads: int = 0):
+    def __init__(
+        self, *, num_threads: int = 0, pin_memory: bool = False, encoding_cache_size: int = 0
+    ):
         """Initialize a FeatureEncoder
 
         Arguments:
           num_threads (optional int): If specified, uses a thread pool with this many threads.
+          pin_memory (optional bool): If set, encodes inputs into pinned memory. Requires
+            num_threads > 0. Asynchronous copies out of the encoded inputs must complete
+            before they are dropped, as their buffers are then reused.
+          encoding_cache_size (optional int): If set, memoizes up to this many board and
+            valid-orders encodings, keyed by board hash, so that recurring positions are
+            copied instead of re-encoded. Requires num_threads > 0.
         """
         if num_threads <= 0:
+            assert not pin_memory, "pin_memory requires num_threads > 0"
+            assert not encoding_cache_size, "encoding_cache_size requires num_threads > 0"
             self.thread_pool = self._get_nothread_pool()
         else:
             self.thread_pool = pydipcc.ThreadPool(
-                num_threads, ORDER_VOCABULARY_TO_IDX, MAX_VALID_LEN
+                num_threads, ORDER_VOCABULARY_TO_IDX, MAX_VALID_LEN, pin_memory=pin_memory
             )
+            if encoding_cache_size > 0:
+                self.thread_pool.enable_encoding_cache(encoding_cache_size)
 
     @classmethod
     def _get_nothread_pool(cls) -> pydipcc.ThreadPool:
@@ -101,6 +167,18 @@ class FeatureEncoder:
         """
         return DataFields(self.thread_pool.encode_inputs_all_powers_multi(games, input_version))
 
+    def encode_inputs_csr(
+        self, games: Sequence[pydipcc.Game], input_version: int, all_powers: bool = False
+    ) -> DataFields:
+        """Same as encode_inputs (or encode_inputs_all_powers if all_powers), but with
+        x_possible_actions in a compact CSR layout, as x_possible_actions_values and
+        x_possible_actions_offsets. Use densify_possible_actions to get back
+        x_possible_actions, e.g. once the fields are on the GPU.
+        """
+        return DataFields(
+            self.thread_pool.encode_inputs_csr_multi(games, input_version, all_powers)
+        )
+
     def decode_order_idxs(self, order_idxs):
         return self.thread_pool.decode_order_idxs(order_idxs)
 
@@ -117,5 +195,82 @@ class FeatureEncoder:
             order_idxs, x_in_adj_phase, x_power, batch_repeat_interleave
         )
 
+    def decode_and_set_orders(
+        self, games: Sequence[pydipcc.Game], order_idxs: torch.Tensor
+    ) -> None:
+        """Same as game.set_orders(power, orders) for each power's orders from
+        decode_order_idxs(order_idxs), without building any order strings.
+        """
+        self.thread_pool.decode_and_set_orders(games, order_idxs)
+
+    def decode_and_set_orders_async(
+        self, games: Sequence[pydipcc.Game], order_idxs: torch.Tensor
+    ) -> EncodingFuture:
+        """Non-blocking version of decode_and_set_orders. The orders are set
+        once the returned future is done."""
+        return EncodingFuture(self.thread_pool.decode_and_set_orders_async(games, order_idxs))
+
+    def decode_and_set_orders_all_powers(
+        self,
+        games: Sequence[pydipcc.Game],
+        order_idxs: torch.Tensor,
+        x_in_adj_phase: torch.Tensor,
+        x_power: torch.Tensor,
+    ) -> None:
+        if x_in_adj_phase.dtype == torch.half:
+            x_in_adj_phase = x_in_adj_phase.float()
+        self.thread_pool.decode_and_set_orders_all_powers(
+            games, order_idxs, x_in_adj_phase, x_power
+        )
+
     def process_multi(self, games: Sequence[pydipcc.Game]) -> None:
         self.thread_pool.process_multi(games)
+
+    def get_encoding_cache_stats(self) -> Dict[str, int]:
+        """Hit and miss counts of the encoding cache, {} if it is disabled."""
+        return self.thread_pool.get_encoding_cache_stats()
+
+    def process_and_encode_inputs(
+        self, games: Sequence[pydipcc.Game], input_version: int, all_powers: bool = False
+    ) -> DataFields:
+        """Same as process_multi followed by encode_inputs (or
+        encode_inputs_all_powers if all_powers), in one pass over the games on
+        the pool's threads.
+        """
+        if all_powers:
+            fields = self.thread_pool.process_and_encode_inputs_all_powers_multi(
+                games, input_version
+            )
+        else:
+            fields = self.thread_pool.process_and_encode_inputs_multi(games, input_version)
+        return DataFields(fields)
+
+    def process_multi_async(self, games: Sequence[pydipcc.Game]) -> EncodingFuture:
+        """Same as process_multi, but returns without waiting for the games to be processed."""
+        return EncodingFuture(self.thread_pool.process_multi_async(games))
+
+    def encode_inputs_async(
+        self, games: Sequence[pydipcc.Game], input_version: int
+    ) -> EncodingFuture:
+        """Non-blocking version of encode_inputs.
+
+        This lets the caller overlap encoding of the next batch with model
+        inference on the current one.
+        """
+        return EncodingFuture(self.thread_pool.encode_inputs_multi_async(games, input_version))
+
+    def encode_inputs_state_only_async(
+        self, games: Sequence[pydipcc.Game], input_version: int
+    ) -> EncodingFuture:
+        """Non-blocking version of encode_inputs_state_only."""
+        return EncodingFuture(
+            self.thread_pool.encode_inputs_state_only_multi_async(games, input_version)
+        )
+
+    def encode_inputs_all_powers_async(
+        self, games: Sequence[pydipcc.Game], input_version: int
+    ) -> EncodingFuture:
+        """Non-blocking version of encode_inputs_all_powers."""
+        return EncodingFuture(
+            self.thread_pool.encode_inputs_all_powers_multi_async(games, input_version)
+        )
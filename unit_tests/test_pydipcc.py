@@ -7,10 +7,14 @@
 import unittest
 import json
 import os
+import random
+import tempfile
+import typing
 
 import numpy.testing
 import torch
 from fairdiplomacy.data.build_dataset import get_valid_coastal_variant
+from fairdiplomacy.game import sort_phase_key
 from fairdiplomacy.models.base_strategy_model.base_strategy_model import Scoring
 from fairdiplomacy.utils.game_scoring import compute_game_scores_from_state
 import heyhi
@@ -18,6 +22,7 @@ from fairdiplomacy import pydipcc
 from fairdiplomacy.utils.thread_pool_encoding import (
     MAX_INPUT_VERSION,
     FeatureEncoder,
+    densify_possible_actions,
     get_board_state_size,
 )
 from fairdiplomacy.utils.order_idxs import ORDER_VOCABULARY, action_strs_to_global_idxs
@@ -217,6 +222,256 @@ class TestPydipcc(unittest.TestCase):
         self.assertEqual(games[1].game_id, "a_game_1")
 
 
+class TestProcessMulti(unittest.TestCase):
+    def test_matches_process(self):
+        """Batched stepping must give the same games as stepping one by one"""
+        rng = random.Random(0)
+        encoder = FeatureEncoder()
+        games = [pydipcc.Game() for _ in range(8)]
+        for _ in range(20):
+            for i, game in enumerate(games):
+                all_possible_orders = game.get_all_possible_orders()
+                for power, locs in game.get_orderable_locations().items():
+                    orders = []
+                    for loc in locs:
+                        # Mostly hold on some games so that many boards have
+                        # no contested locs
+                        if i % 2 == 0 and rng.random() < 0.7:
+                            orders.append(all_possible_orders[loc][0])
+                        else:
+                            orders.append(rng.choice(all_possible_orders[loc]))
+                    game.set_orders(power, orders)
+            expected = [pydipcc.Game(game) for game in games]
+            for game in expected:
+                game.process()
+            encoder.process_multi(games)
+            for game, expected_game in zip(games, expected):
+                self.assertEqual(game.to_json(), expected_game.to_json())
+
+    def test_process_and_encode(self):
+        encoder = FeatureEncoder(num_threads=2)
+        for all_powers in [False, True]:
+            games = [pydipcc.Game() for _ in range(5)]
+            for game in games:
+                game.set_orders("FRANCE", ["A PAR - BUR"])
+            expected_games = [pydipcc.Game(game) for game in games]
+            fields = encoder.process_and_encode_inputs(games, 3, all_powers=all_powers)
+            encoder.process_multi(expected_games)
+            if all_powers:
+                expected = encoder.encode_inputs_all_powers(expected_games, 3)
+            else:
+                expected = encoder.encode_inputs(expected_games, 3)
+            self.assertEqual(set(fields), set(expected))
+            for k in expected:
+                self.assertTrue(torch.equal(fields[k], expected[k]), k)
+            for game, expected_game in zip(games, expected_games):
+                self.assertEqual(game.to_json(), expected_game.to_json())
+
+    def test_async_matches_sync(self):
+        encoder = FeatureEncoder(num_threads=4)
+        games = [pydipcc.Game() for _ in range(10)]
+        future = encoder.encode_inputs_async(games, input_version=3)
+        expected = encoder.encode_inputs(games, input_version=3)
+        fields = future.result()
+        self.assertTrue(future.done())
+        self.assertEqual(set(fields), set(expected))
+        for k in expected:
+            self.assertTrue(torch.equal(fields[k], expected[k]), k)
+
+        for game in games:
+            game.set_orders("FRANCE", ["A PAR - BUR"])
+        encoder.process_multi_async(games).result()
+        for game in games:
+            self.assertEqual(game.current_short_phase, "F1901M")
+            self.assertEqual(game.get_unit_power_at("BUR"), "FRANCE")
+
+    def test_encode_reuses_dropped_buffers(self):
+        encoder = FeatureEncoder(num_threads=2)
+        games = [pydipcc.Game() for _ in range(3)]
+        fields = encoder.encode_inputs(games, input_version=3)
+        expected = {k: v.clone() for k, v in fields.items()}
+        ptr = fields["x_possible_actions"].data_ptr()
+
+        # Still held, so must not be reused
+        held = encoder.encode_inputs(games, input_version=3)
+        self.assertNotEqual(held["x_possible_actions"].data_ptr(), ptr)
+
+        # Garble the first buffers, then drop them
+        for v in fields.values():
+            v.fill_(7)
+        del fields
+        fields = encoder.encode_inputs(games, input_version=3)
+        self.assertEqual(fields["x_possible_actions"].data_ptr(), ptr)
+        for k in expected:
+            self.assertTrue(torch.equal(fields[k], expected[k]), k)
+
+
+class TestGameBatch(unittest.TestCase):
+    def test_matches_games(self):
+        rng = random.Random(0)
+        batch = pydipcc.GameBatch(pydipcc.Game(), 6)
+        games = [pydipcc.Game(game) for game in batch.get_games()]
+        self.assertEqual(len(batch), 6)
+        self.assertEqual(batch[1].game_id, games[1].game_id)
+        for _ in range(12):
+            min_phase = batch.min_ongoing_phase()
+            self.assertEqual(
+                min_phase,
+                min(
+                    (game.current_short_phase for game in games if not game.is_game_done),
+                    key=sort_phase_key,
+                ),
+            )
+            idxs = batch.ongoing_game_idxs_at_phase(min_phase)
+            orders = []
+            for i in idxs:
+                all_possible_orders = games[i].get_all_possible_orders()
+                orderable_locations = games[i].get_orderable_locations()
+                orders.append(
+                    [
+                        [rng.choice(all_possible_orders[loc]) for loc in orderable_locations[power]]
+                        for power in POWERS
+                    ]
+                )
+                for power, action in zip(POWERS, orders[-1]):
+                    games[i].set_orders(power, action)
+                games[i].process()
+            batch.set_orders(idxs, orders)
+            batch.process(idxs)
+
+            self.assertEqual(batch.phases(), [game.current_short_phase for game in games])
+            self.assertEqual(batch.is_done().tolist(), [game.is_game_done for game in games])
+            self.assertTrue(
+                torch.equal(batch.get_scores(), torch.tensor([game.get_scores() for game in games]))
+            )
+            self.assertEqual(
+                batch.phase_keys().tolist(),
+                [pydipcc.phase_sort_key(game.current_short_phase) for game in games],
+            )
+            for batch_game, game in zip(batch.get_games(), games):
+                self.assertEqual(batch_game.to_json(), game.to_json())
+
+    def test_phase_sort_key(self):
+        phases = ["S1901M", "F1901M", "F1901R", "W1901A", "S1902M", "S1902R", "COMPLETED"]
+        keys = [pydipcc.phase_sort_key(phase) for phase in phases]
+        self.assertEqual(keys, sorted(keys))
+        self.assertEqual(len(set(keys)), len(keys))
+
+
+class TestRolloutEngine(unittest.TestCase):
+    @staticmethod
+    def first_action_policy(fields, game_idxs):
+        return fields["x_possible_actions"][:, :, :, 0].long()
+
+    def test_matches_python_loop(self):
+        encoder = FeatureEncoder(num_threads=2)
+        engine = pydipcc.RolloutEngine(
+            pydipcc.Game(),
+            n_games=3,
+            thread_pool=encoder.thread_pool,
+            input_version=3,
+            all_powers=False,
+            max_rollout_length=4,
+            year_spring_prob_of_ending={1901: 0.0, 1902: 0.25},
+        )
+        for i in range(3):
+            engine.set_start_orders(i, "FRANCE", ["A PAR - BUR"])
+        engine.run(self.first_action_policy)
+
+        games = [pydipcc.Game() for _ in range(3)]
+        for game in games:
+            game.set_orders("FRANCE", ["A PAR - BUR"])
+        for step in range(100):
+            if games[0].current_short_phase == "S1903M":
+                break
+            fields = encoder.encode_inputs(games, input_version=3)
+            orders = encoder.decode_order_idxs(self.first_action_policy(fields, None))
+            for game, orders_per_power in zip(games, orders):
+                for power, action in zip(POWERS, orders_per_power):
+                    if step > 0 or power != "FRANCE":
+                        game.set_orders(power, action)
+            encoder.process_multi(games)
+
+        batch = engine.get_batch()
+        for batch_game, game in zip(batch.get_games(), games):
+            self.assertEqual(batch_game.current_short_phase, "S1903M")
+            self.assertEqual(batch_game.get_state(), game.get_state())
+
+        # Scored with probability 0.25 at the start of S1902M, and again at
+        # the final position
+        self.assertEqual(engine.get_prob_of_spring_ending(1903), 0.25)
+        self.assertTrue(
+            torch.allclose(engine.get_cumulative_spring_ending_prob(), torch.full((3,), 0.5))
+        )
+        self.assertEqual(engine.get_spring_ending_ev().shape, (3, 7))
+
+    def test_all_start_orders_set(self):
+        def fail_policy(fields, game_idxs):
+            raise RuntimeError("policy should not be called")
+
+        encoder = FeatureEncoder()
+        engine = pydipcc.RolloutEngine(
+            pydipcc.Game(),
+            n_games=2,
+            thread_pool=encoder.thread_pool,
+            input_version=3,
+            all_powers=False,
+            max_rollout_length=0,
+            year_spring_prob_of_ending={},
+        )
+        for i in range(2):
+            for power in POWERS:
+                engine.set_start_orders(i, power, [])
+        engine.run(fail_policy)
+        self.assertEqual(engine.get_batch().phases(), ["F1901M", "F1901M"])
+
+
+class FirstActionPolicyModule(torch.nn.Module):
+    def forward(
+        self, fields: typing.Dict[str, torch.Tensor], temperature: float, top_p: float
+    ) -> typing.Tuple[torch.Tensor, torch.Tensor]:
+        order_idxs = fields["x_possible_actions"][:, :, :, 0].long()
+        return order_idxs, torch.zeros(order_idxs.shape)
+
+
+class TestPolicyModule(unittest.TestCase):
+    def setUp(self):
+        self.encoder = FeatureEncoder(num_threads=2)
+        with tempfile.NamedTemporaryFile(suffix=".pt") as f:
+            torch.jit.save(torch.jit.script(FirstActionPolicyModule()), f.name)
+            self.encoder.thread_pool.load_policy_module(f.name, intra_op_threads=1)
+
+    def test_forward_policy_multi(self):
+        games = [pydipcc.Game() for _ in range(5)]
+        orders = self.encoder.thread_pool.forward_policy_multi(
+            games, input_version=3, all_powers=False, temperature=1.0, top_p=1.0
+        )
+        fields = self.encoder.encode_inputs(games, input_version=3)
+        expected = self.encoder.decode_order_idxs(
+            TestRolloutEngine.first_action_policy(fields, None)
+        )
+        self.assertEqual(orders, expected)
+
+    def test_rollout_engine(self):
+        engines = []
+        for _ in range(2):
+            engines.append(
+                pydipcc.RolloutEngine(
+                    pydipcc.Game(),
+                    n_games=3,
+                    thread_pool=self.encoder.thread_pool,
+                    input_version=3,
+                    all_powers=False,
+                    max_rollout_length=2,
+                    year_spring_prob_of_ending={},
+                )
+            )
+        engines[0].run(TestRolloutEngine.first_action_policy)
+        engines[1].run(temperature=1.0, top_p=1.0)
+        for a, b in zip(engines[0].get_batch().get_games(), engines[1].get_batch().get_games()):
+            self.assertEqual(a.get_state(), b.get_state())
+
+
 class TestEncoding(unittest.TestCase):
     def test_russia_four_builds(self):
         """Test for a bug in which coastal builds were not in russia's possible orders"""
@@ -229,6 +484,79 @@ class TestEncoding(unittest.TestCase):
             13201 in fields["x_possible_actions"][0, 5]
         ), "Order not found in Russia's possible orders"
 
+    def test_board_state_pperms_match_matrices(self):
+        with open(os.path.dirname(__file__) + "/data/test_game_russia_four_builds.json") as f:
+            adj_game = pydipcc.Game.from_json(f.read())
+        rng = numpy.random.RandomState(0)
+        pperms = numpy.stack(
+            [numpy.arange(7)] + [rng.permutation(7) for _ in range(4)]
+        ).astype(numpy.int32)
+        matrices = torch.from_numpy(pydipcc.encode_board_state_pperm_matrices(pperms, 3))
+        channel_idxs = torch.from_numpy(pydipcc.encode_board_state_pperm_channel_idxs(pperms, 3))
+        for game in [pydipcc.Game(), adj_game]:
+            board = FeatureEncoder().encode_inputs_state_only([game], input_version=3)[
+                "x_board_state"
+            ][0]
+            expected = torch.matmul(board, matrices)
+            permuted = torch.from_numpy(pydipcc.encode_board_state_pperms(game, pperms, 3))
+            self.assertTrue(torch.equal(permuted, expected))
+            self.assertTrue(torch.equal(permuted[0], board))
+            gathered = torch.gather(
+                board.expand(len(pperms), -1, -1),
+                2,
+                channel_idxs.unsqueeze(1).expand(-1, board.size(0), -1),
+            )
+            self.assertTrue(torch.equal(gathered, expected))
+
+    def test_csr_encoding_matches_dense(self):
+        with open(os.path.dirname(__file__) + "/data/test_game_russia_four_builds.json") as f:
+            adj_game = pydipcc.Game.from_json(f.read())
+        moved_game = pydipcc.Game()
+        moved_game.set_orders("FRANCE", ["A PAR - BUR"])
+        moved_game.process()
+        games = [pydipcc.Game(), adj_game, moved_game]
+        encoder = FeatureEncoder(num_threads=2)
+        for all_powers in [False, True]:
+            if all_powers:
+                expected = encoder.encode_inputs_all_powers(games, input_version=3)
+            else:
+                expected = encoder.encode_inputs(games, input_version=3)
+            fields = encoder.encode_inputs_csr(games, input_version=3, all_powers=all_powers)
+            self.assertLess(
+                fields["x_possible_actions_values"].numel(),
+                expected["x_possible_actions"].numel() / 10,
+            )
+            densify_possible_actions(fields)
+            self.assertEqual(set(fields), set(expected))
+            for k in expected:
+                self.assertTrue(torch.equal(fields[k], expected[k]), k)
+
+    def test_encoding_cache_matches_uncached(self):
+        with open(os.path.dirname(__file__) + "/data/test_game_russia_four_builds.json") as f:
+            adj_game = pydipcc.Game.from_json(f.read())
+        moved_game = pydipcc.Game()
+        moved_game.set_orders("FRANCE", ["A PAR - BUR"])
+        moved_game.process()
+        games = [pydipcc.Game(), adj_game, moved_game, pydipcc.Game()]
+        uncached = FeatureEncoder(num_threads=2)
+        cached = FeatureEncoder(num_threads=2, encoding_cache_size=100)
+        self.assertEqual(uncached.get_encoding_cache_stats(), {})
+        for all_powers in [False, True]:
+            encode = "encode_inputs_all_powers" if all_powers else "encode_inputs"
+            expected = getattr(uncached, encode)(games, input_version=3)
+            for _ in range(2):
+                stats = cached.get_encoding_cache_stats()
+                fields = getattr(cached, encode)(games, input_version=3)
+                for k in expected:
+                    self.assertTrue(torch.equal(fields[k], expected[k]), k)
+            new_stats = cached.get_encoding_cache_stats()
+            # The second pass only hits
+            self.assertEqual(new_stats["valid_orders_misses"], stats["valid_orders_misses"])
+            self.assertEqual(new_stats["valid_orders_hits"], stats["valid_orders_hits"] + 4)
+            self.assertEqual(new_stats["board_state_misses"], stats["board_state_misses"])
+            self.assertGreater(new_stats["board_state_hits"], stats["board_state_hits"])
+            self.assertEqual(new_stats["valid_orders_size"], stats["valid_orders_size"])
+
     def test_all_powers_encoding_m_phase(self):
         encoder = FeatureEncoder()
         game = pydipcc.Game()
@@ -652,6 +980,45 @@ class TestActionSorting(unittest.TestCase):
         )
         self.assertEqual(fast, ground_truth)
 
+    def test_decode_and_set_orders(self):
+        encoder = FeatureEncoder(num_threads=2)
+        games = [pydipcc.Game() for _ in range(5)]
+        expected_games = [pydipcc.Game() for _ in range(5)]
+        fields = encoder.encode_inputs(games, input_version=3)
+        order_idxs = fields["x_possible_actions"][:, :, :, 1].long()
+        encoder.decode_and_set_orders(games, order_idxs)
+        for game, orders in zip(expected_games, encoder.decode_order_idxs(order_idxs)):
+            for power, action in zip(POWERS, orders):
+                game.set_orders(power, action)
+        for game, expected_game in zip(games, expected_games):
+            self.assertEqual(game.get_orders(), expected_game.get_orders())
+
+    def test_decode_and_set_orders_raises(self):
+        encoder = FeatureEncoder(num_threads=2)
+        games = [pydipcc.Game() for _ in range(5)]
+        order_idxs = torch.full((5, 7, 17), EOS_IDX, dtype=torch.long)
+        order_idxs[3, 0, 0] = 10 ** 7
+        with self.assertRaises(Exception):
+            encoder.decode_and_set_orders(games, order_idxs)
+        future = encoder.decode_and_set_orders_async(games, order_idxs)
+        with self.assertRaises(Exception):
+            future.result()
+        self.assertTrue(future.done())
+
+    def test_decode_and_set_orders_all_powers(self):
+        encoder = FeatureEncoder()
+        game, expected_game = pydipcc.Game(), pydipcc.Game()
+        batch = encoder.encode_inputs_all_powers([game], 3)
+        encoder.decode_and_set_orders_all_powers(
+            [game], ORDERS_IDXS_ALL_POWER, batch["x_in_adj_phase"], batch["x_power"]
+        )
+        decoded = encoder.decode_order_idxs_all_powers(
+            ORDERS_IDXS_ALL_POWER, batch["x_in_adj_phase"], batch["x_power"], 1
+        )
+        for power, action in zip(POWERS, decoded[0]):
+            expected_game.set_orders(power, action)
+        self.assertEqual(game.get_orders(), expected_game.get_orders())
+
 
 def decode_order_idxs_allpower_golden(order_idx, x_in_adj_phase_batched, x_power_batched, div):
     decoded = FeatureEncoder().decode_order_idxs(order_idx)